@@ -0,0 +1,80 @@
+#include "sparse-set.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void *alloc_default(void *ud, void *ptr, size_t osize, size_t nsize) {
+    (void)ud; (void)osize;
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsize);
+}
+
+sparse_set_allocator_t sparse_set_default_allocator = { alloc_default, NULL, NULL, 0, 0, 0 };
+
+void sparse_set_allocator_init(sparse_set_allocator_t *a, sparse_set_alloc_fn fn, void *ud, uint32_t pool_max) {
+    a->fn = fn;
+    a->ud = ud;
+    a->pool = NULL;
+    a->pool_count = 0;
+    a->pool_max = pool_max;
+    a->bytes = 0;
+}
+
+void sparse_set_allocator_drain(sparse_set_allocator_t *a) {
+    while (a->pool) {
+        void *next = *(void**)a->pool;
+        a->fn(a->ud, a->pool, SPARSE_SET_PAGE_BYTES, 0);
+        a->bytes -= SPARSE_SET_PAGE_BYTES;
+        a->pool = next;
+    }
+    a->pool_count = 0;
+    a->pool_max = 0;
+}
+
+void *sparse_set_alloc(sparse_set_allocator_t *a, size_t size) {
+    return sparse_set_realloc(a, NULL, 0, size);
+}
+
+void *sparse_set_calloc(sparse_set_allocator_t *a, size_t count, size_t size) {
+    if (count > SIZE_MAX / size) return NULL;
+    void *ptr = sparse_set_realloc(a, NULL, 0, count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+// Sizes are always non-zero here: nsize == 0 would mean free to `fn`.
+void *sparse_set_realloc(sparse_set_allocator_t *a, void *ptr, size_t osize, size_t nsize) {
+    if (!ptr) osize = 0;
+    void *out = a->fn(a->ud, ptr, osize, nsize);
+    if (out) a->bytes += nsize - osize;
+    return out;
+}
+
+void sparse_set_free(sparse_set_allocator_t *a, void *ptr, size_t size) {
+    if (!ptr) return;
+    a->fn(a->ud, ptr, size, 0);
+    a->bytes -= size;
+}
+
+uint32_t *sparse_set_page_alloc(sparse_set_allocator_t *a) {
+    if (a->pool) {
+        void *page = a->pool;
+        a->pool = *(void**)page;
+        a->pool_count--;
+        return (uint32_t*)page;
+    }
+    return (uint32_t*)sparse_set_alloc(a, SPARSE_SET_PAGE_BYTES);
+}
+
+void sparse_set_page_free(sparse_set_allocator_t *a, uint32_t *page) {
+    if (!page) return;
+    if (a->pool_count < a->pool_max) {
+        *(void**)page = a->pool;
+        a->pool = page;
+        a->pool_count++;
+        return;
+    }
+    sparse_set_free(a, page, SPARSE_SET_PAGE_BYTES);
+}
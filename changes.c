@@ -0,0 +1,142 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <stdlib.h>
+
+// Change tracking keeps one sparse_set_change_t per touched entity in an
+// internal sparse set (stride = sizeof(sparse_set_change_t)), keyed by the
+// entity index. Marks fold together within one drain period:
+//
+//   added then modified        -> added
+//   added then removed         -> dropped
+//   removed then added (same)  -> modified, whole row
+//   removed then added (new)   -> added | removed (old version removed)
+//   modified then removed      -> removed
+//
+// Byte ranges of modifications are unioned per entity.
+
+bool sparse_set_track_changes(sparse_set_t *set, bool enabled) {
+    if (!enabled) {
+        if (set->changes) {
+            sparse_set_destroy(set->changes);
+            set->changes = NULL;
+        }
+        return true;
+    }
+    if (set->changes) return true;
+
+    sparse_set_t *changes = sparse_set_create_alloc(set->allocator);
+    if (!changes) return false;
+    if (!sparse_set_set_stride(changes, sizeof(sparse_set_change_t))) {
+        sparse_set_destroy(changes);
+        return false;
+    }
+    set->changes = changes;
+    return true;
+}
+
+static sparse_set_change_t *changes_find(sparse_set_t *changes, uint32_t index, uint32_t *out_pos) {
+    const uint32_t *slot = sparse_set_slot(changes, index);
+    if (!slot || *slot >= changes->size || ID_INDEX(changes->dense[*slot]) != index) return NULL;
+    *out_pos = *slot;
+    return (sparse_set_change_t*)sparse_set_get_data(changes, *slot);
+}
+
+static sparse_set_change_t *changes_add(sparse_set_t *changes, sparse_set_id_t id) {
+    uint32_t pos = sparse_set_insert(changes, id);
+    if (pos == SPARSE_SET_INVALID_POS) return NULL;
+    return (sparse_set_change_t*)sparse_set_get_data(changes, pos);
+}
+
+void sparse_set_mark_change(sparse_set_t *set, sparse_set_id_t id, uint32_t kind, uint32_t lo, uint32_t hi) {
+    sparse_set_t *changes = set->changes;
+    if (!changes) return;
+
+    uint32_t pos;
+    sparse_set_change_t *change = changes_find(changes, ID_INDEX(id), &pos);
+
+    if (kind & SPARSE_SET_CHANGE_ADDED) {
+        if (!change) {
+            if ((change = changes_add(changes, id))) {
+                change->kind = SPARSE_SET_CHANGE_ADDED;
+            }
+        } else if (changes->dense[pos] == id) {
+            // Back after a removal: the entity exists on both sides.
+            change->kind = SPARSE_SET_CHANGE_MODIFIED;
+            change->lo = 0;
+            change->hi = set->stride;
+        } else {
+            // A new version replaces a removed one; remember which.
+            if (!(change->kind & SPARSE_SET_CHANGE_REMOVED)) {
+                change->removed_version = ID_VERSION(changes->dense[pos]);
+            }
+            changes->dense[pos] = id;
+            change->kind = SPARSE_SET_CHANGE_ADDED | SPARSE_SET_CHANGE_REMOVED;
+        }
+    } else if (kind & SPARSE_SET_CHANGE_REMOVED) {
+        if (!change) {
+            if ((change = changes_add(changes, id))) {
+                change->kind = SPARSE_SET_CHANGE_REMOVED;
+                change->removed_version = ID_VERSION(id);
+            }
+        } else if (change->kind == SPARSE_SET_CHANGE_ADDED) {
+            sparse_set_remove(changes, changes->dense[pos]);
+        } else if (change->kind & SPARSE_SET_CHANGE_REMOVED) {
+            // Added | removed, now removed again: only the old one is known.
+            change->kind = SPARSE_SET_CHANGE_REMOVED;
+        } else {
+            change->kind = SPARSE_SET_CHANGE_REMOVED;
+            change->removed_version = ID_VERSION(id);
+        }
+    } else if (kind & SPARSE_SET_CHANGE_MODIFIED) {
+        if (!change) {
+            if ((change = changes_add(changes, id))) {
+                change->kind = SPARSE_SET_CHANGE_MODIFIED;
+                change->lo = lo;
+                change->hi = hi;
+            }
+        } else if (change->kind == SPARSE_SET_CHANGE_MODIFIED) {
+            if (lo < change->lo) change->lo = lo;
+            if (hi > change->hi) change->hi = hi;
+        }
+    }
+}
+
+void sparse_set_field_range(const sparse_set_t *set, const sparse_set_field_t *field, uint32_t *lo, uint32_t *hi) {
+    uint32_t offset = field->offset;
+    if (field->column != SPARSE_SET_NO_COLUMN) {
+        offset = 0;
+        for (uint32_t i = 0; i < field->column; i++) offset += set->columns[i].size;
+    }
+    *lo = offset;
+    *hi = offset + field->size;
+}
+
+void sparse_set_mark_field(sparse_set_t *set, const sparse_set_field_t *field, uint32_t first, uint32_t count) {
+    if (!set->changes) return;
+    uint32_t lo, hi;
+    sparse_set_field_range(set, field, &lo, &hi);
+    for (uint32_t pos = first; pos < first + count; pos++) {
+        sparse_set_mark_change(set, set->dense[pos], SPARSE_SET_CHANGE_MODIFIED, lo, hi);
+    }
+}
+
+uint32_t sparse_set_change_count(const sparse_set_t *set) {
+    return set->changes ? set->changes->size : 0;
+}
+
+uint32_t sparse_set_drain_changes(sparse_set_t *set, sparse_set_id_t *ids, sparse_set_change_t *out, uint32_t capacity) {
+    sparse_set_t *changes = set->changes;
+    if (!changes) return 0;
+
+    // Take from the end so each removal is a pop without swaps.
+    uint32_t count = changes->size < capacity ? changes->size : capacity;
+    uint32_t first = changes->size - count;
+    memcpy(ids, changes->dense + first, (size_t)count * sizeof(sparse_set_id_t));
+    memcpy(out, changes->data + (size_t)first * changes->stride, (size_t)count * sizeof(sparse_set_change_t));
+    if (count == changes->size) {
+        sparse_set_clear(changes);
+    } else {
+        for (uint32_t i = count; i > 0; i--) sparse_set_remove(changes, ids[i - 1]);
+    }
+    return count;
+}
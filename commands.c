@@ -0,0 +1,147 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define COMMANDS_NO_PAYLOAD SIZE_MAX
+
+bool sparse_set_commands_init(sparse_set_commands_t *cmds, sparse_set_allocator_t *allocator) {
+    cmds->allocator = allocator ? allocator : &sparse_set_default_allocator;
+    cmds->commands = (sparse_set_command_t*)sparse_set_alloc(cmds->allocator, SPARSE_SET_DEFAULT_CAPACITY * sizeof(sparse_set_command_t));
+    if (!cmds->commands) return false;
+    cmds->count = 0;
+    cmds->capacity = SPARSE_SET_DEFAULT_CAPACITY;
+    cmds->arena = NULL;
+    cmds->arena_size = 0;
+    cmds->arena_capacity = 0;
+    return true;
+}
+
+void sparse_set_commands_deinit(sparse_set_commands_t *cmds) {
+    if (cmds) {
+        sparse_set_free(cmds->allocator, cmds->commands, cmds->capacity * sizeof(sparse_set_command_t));
+        sparse_set_free(cmds->allocator, cmds->arena, cmds->arena_capacity);
+        cmds->commands = NULL;
+        cmds->arena = NULL;
+        cmds->count = 0;
+        cmds->capacity = 0;
+    }
+}
+
+void sparse_set_commands_clear(sparse_set_commands_t *cmds) {
+    cmds->count = 0;
+    cmds->arena_size = 0;
+}
+
+static sparse_set_command_t *commands_push(sparse_set_commands_t *cmds, uint32_t op, void *target,
+                                           sparse_set_id_t id, const void *payload, size_t len) {
+    if (cmds->count >= cmds->capacity) {
+        if (cmds->capacity > UINT32_MAX / 2) return NULL;
+        uint32_t new_capacity = cmds->capacity * 2;
+        sparse_set_command_t *commands = (sparse_set_command_t*)sparse_set_realloc(cmds->allocator, cmds->commands,
+            cmds->capacity * sizeof(sparse_set_command_t), new_capacity * sizeof(sparse_set_command_t));
+        if (!commands) return NULL;
+        cmds->commands = commands;
+        cmds->capacity = new_capacity;
+    }
+
+    size_t offset = COMMANDS_NO_PAYLOAD;
+    if (payload) {
+        if (cmds->arena_size + len > cmds->arena_capacity) {
+            size_t new_capacity = cmds->arena_capacity ? cmds->arena_capacity : 256;
+            while (new_capacity < cmds->arena_size + len) new_capacity *= 2;
+            uint8_t *arena = (uint8_t*)sparse_set_realloc(cmds->allocator, cmds->arena, cmds->arena_capacity, new_capacity);
+            if (!arena) return NULL;
+            cmds->arena = arena;
+            cmds->arena_capacity = new_capacity;
+        }
+        offset = cmds->arena_size;
+        memcpy(cmds->arena + offset, payload, len);
+        cmds->arena_size += len;
+    }
+
+    sparse_set_command_t *cmd = &cmds->commands[cmds->count];
+    cmd->target = target;
+    cmd->id = id;
+    cmd->op = op;
+    cmd->seq = cmds->count++;
+    cmd->payload = offset;
+    return cmd;
+}
+
+bool sparse_set_commands_insert(sparse_set_commands_t *cmds, sparse_set_t *set, sparse_set_id_t id, const void *row) {
+    return commands_push(cmds, SPARSE_SET_CMD_INSERT, set, id, row, set->stride) != NULL;
+}
+
+bool sparse_set_commands_write(sparse_set_commands_t *cmds, sparse_set_t *set, sparse_set_id_t id,
+                               const sparse_set_field_t *field, const void *value) {
+    sparse_set_command_t *cmd = commands_push(cmds, SPARSE_SET_CMD_WRITE, set, id, value, field->size);
+    if (!cmd) return false;
+    cmd->field = *field;
+    return true;
+}
+
+bool sparse_set_commands_remove(sparse_set_commands_t *cmds, sparse_set_t *set, sparse_set_id_t id) {
+    return commands_push(cmds, SPARSE_SET_CMD_REMOVE, set, id, NULL, 0) != NULL;
+}
+
+bool sparse_set_commands_destroy(sparse_set_commands_t *cmds, registry_t *reg, sparse_set_id_t id) {
+    return commands_push(cmds, SPARSE_SET_CMD_DESTROY, reg, id, NULL, 0) != NULL;
+}
+
+// Destroys last, then by target, then by sparse page; seq keeps the sort
+// stable so commands on one id run in recorded order.
+static int commands_compare(const void *pa, const void *pb) {
+    const sparse_set_command_t *a = (const sparse_set_command_t*)pa;
+    const sparse_set_command_t *b = (const sparse_set_command_t*)pb;
+    bool a_destroy = a->op == SPARSE_SET_CMD_DESTROY, b_destroy = b->op == SPARSE_SET_CMD_DESTROY;
+    if (a_destroy != b_destroy) return a_destroy ? 1 : -1;
+    if (a->target != b->target) return (uintptr_t)a->target < (uintptr_t)b->target ? -1 : 1;
+    uint32_t a_page = ID_INDEX(a->id) >> SPARSE_SET_PAGE_SHIFT, b_page = ID_INDEX(b->id) >> SPARSE_SET_PAGE_SHIFT;
+    if (a_page != b_page) return a_page < b_page ? -1 : 1;
+    return a->seq < b->seq ? -1 : (a->seq > b->seq);
+}
+
+static bool commands_apply(sparse_set_commands_t *cmds, const sparse_set_command_t *cmd) {
+    const uint8_t *payload = cmd->payload == COMMANDS_NO_PAYLOAD ? NULL : cmds->arena + cmd->payload;
+    switch (cmd->op) {
+        case SPARSE_SET_CMD_INSERT: {
+            sparse_set_t *set = (sparse_set_t*)cmd->target;
+            uint32_t pos = sparse_set_index_of(set, cmd->id);
+            bool is_new = pos == SPARSE_SET_INVALID_POS;
+            if (is_new) {
+                pos = sparse_set_insert(set, cmd->id);
+                if (pos == SPARSE_SET_INVALID_POS) return false;
+            }
+            if (payload) sparse_set_write_row(set, pos, payload);
+            return is_new || payload;
+        }
+        case SPARSE_SET_CMD_WRITE: {
+            sparse_set_t *set = (sparse_set_t*)cmd->target;
+            uint32_t pos = sparse_set_index_of(set, cmd->id);
+            if (pos == SPARSE_SET_INVALID_POS) return false;
+            memcpy(sparse_set_field_ptr(set, &cmd->field, pos), payload, cmd->field.size);
+            sparse_set_mark_field(set, &cmd->field, pos, 1);
+            return true;
+        }
+        case SPARSE_SET_CMD_REMOVE:
+            return sparse_set_remove((sparse_set_t*)cmd->target, cmd->id);
+        case SPARSE_SET_CMD_DESTROY: {
+            registry_t *reg = (registry_t*)cmd->target;
+            if (!registry_valid(reg, cmd->id)) return false;
+            registry_recycle(reg, cmd->id);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+uint32_t sparse_set_commands_flush(sparse_set_commands_t *cmds) {
+    qsort(cmds->commands, cmds->count, sizeof(sparse_set_command_t), commands_compare);
+    uint32_t applied = 0;
+    for (uint32_t i = 0; i < cmds->count; i++) {
+        if (commands_apply(cmds, &cmds->commands[i])) applied++;
+    }
+    sparse_set_commands_clear(cmds);
+    return applied;
+}
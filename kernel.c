@@ -0,0 +1,426 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <limits.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define KERNEL_SSE 1
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_AVX 1
+#define KERNEL_TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+static inline double kernel_op(int op, double x, double a, double b) {
+    switch (op) {
+        case SPARSE_SET_OP_ADD:
+            return x + a;
+        case SPARSE_SET_OP_MUL:
+            return x * a;
+        case SPARSE_SET_OP_FMA:
+            return x * a + b;
+        case SPARSE_SET_OP_MIN:
+            return x < a ? x : a;
+        case SPARSE_SET_OP_MAX:
+            return x > a ? x : a;
+        case SPARSE_SET_OP_CLAMP:
+            x = x > a ? x : a;
+            return x < b ? x : b;
+        default:
+            return x;
+    }
+}
+
+static inline double kernel_load(const uint8_t *ptr, int type) {
+    switch (type) {
+        case SPARSE_SET_TYPE_INT: {
+            int val;
+            memcpy(&val, ptr, sizeof(int));
+            return val;
+        }
+        case SPARSE_SET_TYPE_FLOAT: {
+            float val;
+            memcpy(&val, ptr, sizeof(float));
+            return val;
+        }
+        case SPARSE_SET_TYPE_DOUBLE: {
+            double val;
+            memcpy(&val, ptr, sizeof(double));
+            return val;
+        }
+        case SPARSE_SET_TYPE_BYTE:
+            return *ptr;
+        default:
+            return 0;
+    }
+}
+
+// Integer stores saturate so out-of-range results never hit undefined
+// float-to-int conversions.
+static inline void kernel_store(uint8_t *ptr, int type, double v) {
+    switch (type) {
+        case SPARSE_SET_TYPE_INT: {
+            int val;
+            if (!(v == v)) val = 0;
+            else if (v <= (double)INT_MIN) val = INT_MIN;
+            else if (v >= (double)INT_MAX) val = INT_MAX;
+            else val = (int)v;
+            memcpy(ptr, &val, sizeof(int));
+            break;
+        }
+        case SPARSE_SET_TYPE_FLOAT: {
+            float val = (float)v;
+            memcpy(ptr, &val, sizeof(float));
+            break;
+        }
+        case SPARSE_SET_TYPE_DOUBLE:
+            memcpy(ptr, &v, sizeof(double));
+            break;
+        case SPARSE_SET_TYPE_BYTE:
+            if (!(v > 0)) *ptr = 0;
+            else if (v >= 255) *ptr = 255;
+            else *ptr = (uint8_t)v;
+            break;
+    }
+}
+
+static bool kernel_type_supported(int type) {
+    return type == SPARSE_SET_TYPE_INT || type == SPARSE_SET_TYPE_FLOAT ||
+           type == SPARSE_SET_TYPE_DOUBLE || type == SPARSE_SET_TYPE_BYTE;
+}
+
+// Per-op loops over strided float/double fields, so the op switch is
+// hoisted out of the element loop.
+#define KERNEL_STRIDED_APPLY(T, base, step, n, op, a, b)                      \
+    do {                                                                      \
+        T ka = (T)(a), kb = (T)(b);                                           \
+        for (uint32_t i = 0; i < (n); i++) {                                  \
+            uint8_t *p = (base) + (size_t)i * (step);                         \
+            T x;                                                              \
+            memcpy(&x, p, sizeof(T));                                         \
+            switch (op) {                                                     \
+                case SPARSE_SET_OP_ADD: x = x + ka; break;                    \
+                case SPARSE_SET_OP_MUL: x = x * ka; break;                    \
+                case SPARSE_SET_OP_FMA: x = x * ka + kb; break;               \
+                case SPARSE_SET_OP_MIN: x = x < ka ? x : ka; break;           \
+                case SPARSE_SET_OP_MAX: x = x > ka ? x : ka; break;           \
+                case SPARSE_SET_OP_CLAMP:                                     \
+                    x = x > ka ? x : ka;                                      \
+                    x = x < kb ? x : kb;                                      \
+                    break;                                                    \
+            }                                                                 \
+            memcpy(p, &x, sizeof(T));                                         \
+        }                                                                     \
+    } while (0)
+
+#ifdef KERNEL_SSE
+// Generates a vector loop over a contiguous array; returns how many leading
+// elements were processed so the caller finishes the tail in scalar code.
+#define KERNEL_SIMD_APPLY(T, VT, W, LOAD, STORE, SET1, ADD, MUL, MIN, MAX)    \
+    VT va = SET1((T)a), vb = SET1((T)b);                                      \
+    uint32_t i = 0;                                                           \
+    switch (op) {                                                             \
+        case SPARSE_SET_OP_ADD:                                               \
+            for (; i + (W) <= n; i += (W)) STORE(x + i, ADD(LOAD(x + i), va)); \
+            break;                                                            \
+        case SPARSE_SET_OP_MUL:                                               \
+            for (; i + (W) <= n; i += (W)) STORE(x + i, MUL(LOAD(x + i), va)); \
+            break;                                                            \
+        case SPARSE_SET_OP_FMA:                                               \
+            for (; i + (W) <= n; i += (W))                                    \
+                STORE(x + i, ADD(MUL(LOAD(x + i), va), vb));                  \
+            break;                                                            \
+        case SPARSE_SET_OP_MIN:                                               \
+            for (; i + (W) <= n; i += (W)) STORE(x + i, MIN(LOAD(x + i), va)); \
+            break;                                                            \
+        case SPARSE_SET_OP_MAX:                                               \
+            for (; i + (W) <= n; i += (W)) STORE(x + i, MAX(LOAD(x + i), va)); \
+            break;                                                            \
+        case SPARSE_SET_OP_CLAMP:                                             \
+            for (; i + (W) <= n; i += (W))                                    \
+                STORE(x + i, MIN(MAX(LOAD(x + i), va), vb));                  \
+            break;                                                            \
+    }                                                                         \
+    return i
+
+#define KERNEL_SIMD_AXPY(VT, W, LOAD, STORE, SET1, ADD, MUL)                  \
+    VT vk = SET1(k);                                                          \
+    uint32_t i = 0;                                                           \
+    for (; i + (W) <= n; i += (W))                                            \
+        STORE(dst + i, ADD(LOAD(dst + i), MUL(LOAD(src + i), vk)));           \
+    return i
+
+static uint32_t kernel_apply_f32_sse(float *x, uint32_t n, int op, double a, double b) {
+    KERNEL_SIMD_APPLY(float, __m128, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps,
+                      _mm_add_ps, _mm_mul_ps, _mm_min_ps, _mm_max_ps);
+}
+
+static uint32_t kernel_apply_f64_sse(double *x, uint32_t n, int op, double a, double b) {
+    KERNEL_SIMD_APPLY(double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd,
+                      _mm_add_pd, _mm_mul_pd, _mm_min_pd, _mm_max_pd);
+}
+
+static uint32_t kernel_axpy_f32_sse(float *dst, const float *src, uint32_t n, float k) {
+    KERNEL_SIMD_AXPY(__m128, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, _mm_mul_ps);
+}
+
+static uint32_t kernel_axpy_f64_sse(double *dst, const double *src, uint32_t n, double k) {
+    KERNEL_SIMD_AXPY(__m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd);
+}
+#endif
+
+#ifdef KERNEL_AVX
+KERNEL_TARGET_AVX
+static uint32_t kernel_apply_f32_avx(float *x, uint32_t n, int op, double a, double b) {
+    KERNEL_SIMD_APPLY(float, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps,
+                      _mm256_add_ps, _mm256_mul_ps, _mm256_min_ps, _mm256_max_ps);
+}
+
+KERNEL_TARGET_AVX
+static uint32_t kernel_apply_f64_avx(double *x, uint32_t n, int op, double a, double b) {
+    KERNEL_SIMD_APPLY(double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd,
+                      _mm256_add_pd, _mm256_mul_pd, _mm256_min_pd, _mm256_max_pd);
+}
+
+KERNEL_TARGET_AVX
+static uint32_t kernel_axpy_f32_avx(float *dst, const float *src, uint32_t n, float k) {
+    KERNEL_SIMD_AXPY(__m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_mul_ps);
+}
+
+KERNEL_TARGET_AVX
+static uint32_t kernel_axpy_f64_avx(double *dst, const double *src, uint32_t n, double k) {
+    KERNEL_SIMD_AXPY(__m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_mul_pd);
+}
+
+static bool kernel_has_avx(void) {
+    static int has_avx = -1;
+    if (has_avx < 0) {
+        __builtin_cpu_init();
+        has_avx = __builtin_cpu_supports("avx") ? 1 : 0;
+    }
+    return has_avx != 0;
+}
+#endif
+
+// Vectorized prefix of a contiguous float/double array; 0 when unsupported.
+static uint32_t kernel_apply_simd(uint8_t *base, uint32_t n, int type, int op, double a, double b) {
+#ifdef KERNEL_SSE
+    if (type == SPARSE_SET_TYPE_FLOAT) {
+#ifdef KERNEL_AVX
+        if (kernel_has_avx()) return kernel_apply_f32_avx((float*)base, n, op, a, b);
+#endif
+        return kernel_apply_f32_sse((float*)base, n, op, a, b);
+    }
+    if (type == SPARSE_SET_TYPE_DOUBLE) {
+#ifdef KERNEL_AVX
+        if (kernel_has_avx()) return kernel_apply_f64_avx((double*)base, n, op, a, b);
+#endif
+        return kernel_apply_f64_sse((double*)base, n, op, a, b);
+    }
+#else
+    (void)base; (void)n; (void)type; (void)op; (void)a; (void)b;
+#endif
+    return 0;
+}
+
+static uint32_t kernel_axpy_simd(uint8_t *dst, const uint8_t *src, uint32_t n, int type, double k) {
+#ifdef KERNEL_SSE
+    if (type == SPARSE_SET_TYPE_FLOAT) {
+#ifdef KERNEL_AVX
+        if (kernel_has_avx()) return kernel_axpy_f32_avx((float*)dst, (const float*)src, n, (float)k);
+#endif
+        return kernel_axpy_f32_sse((float*)dst, (const float*)src, n, (float)k);
+    }
+    if (type == SPARSE_SET_TYPE_DOUBLE) {
+#ifdef KERNEL_AVX
+        if (kernel_has_avx()) return kernel_axpy_f64_avx((double*)dst, (const double*)src, n, k);
+#endif
+        return kernel_axpy_f64_sse((double*)dst, (const double*)src, n, k);
+    }
+#else
+    (void)dst; (void)src; (void)n; (void)type; (void)k;
+#endif
+    return 0;
+}
+
+static void kernel_apply_range(uint8_t *base, uint32_t step, uint32_t n, int type, int op, double a, double b) {
+    uint32_t done = 0;
+    if (step == sparse_set_type_size(type)) {
+        done = kernel_apply_simd(base, n, type, op, a, b);
+    }
+    base += (size_t)done * step;
+    n -= done;
+
+    switch (type) {
+        case SPARSE_SET_TYPE_FLOAT:
+            KERNEL_STRIDED_APPLY(float, base, step, n, op, a, b);
+            break;
+        case SPARSE_SET_TYPE_DOUBLE:
+            KERNEL_STRIDED_APPLY(double, base, step, n, op, a, b);
+            break;
+        default:
+            for (uint32_t i = 0; i < n; i++) {
+                uint8_t *p = base + (size_t)i * step;
+                kernel_store(p, type, kernel_op(op, kernel_load(p, type), a, b));
+            }
+            break;
+    }
+}
+
+typedef struct {
+    uint8_t *base;
+    uint32_t step;
+    int type;
+    int op;
+    double a;
+    double b;
+} kernel_apply_task_t;
+
+static void kernel_apply_task(void *ud, uint32_t begin, uint32_t end) {
+    const kernel_apply_task_t *t = (const kernel_apply_task_t*)ud;
+    kernel_apply_range(t->base + (size_t)begin * t->step, t->step, end - begin, t->type, t->op, t->a, t->b);
+}
+
+uint32_t sparse_set_field_apply(sparse_set_t *set, const sparse_set_field_t *field, int op, double a, double b) {
+    if (!kernel_type_supported(field->type) || op < SPARSE_SET_OP_ADD || op > SPARSE_SET_OP_CLAMP) {
+        return SPARSE_SET_INVALID_POS;
+    }
+    if (set->size > 0) {
+        kernel_apply_task_t task = {
+            sparse_set_field_base(set, field), sparse_set_field_step(set, field), field->type, op, a, b
+        };
+        sparse_set_parallel_for(set->size, SPARSE_SET_PARALLEL_MIN_CHUNK, kernel_apply_task, &task);
+        sparse_set_mark_field(set, field, 0, set->size);
+    }
+    return set->size;
+}
+
+// dst = dst * keep + src * k, element-wise over matching positions.
+static void kernel_combine_range(uint8_t *dst, uint32_t dst_step, int dst_type,
+                                 const uint8_t *src, uint32_t src_step, int src_type,
+                                 uint32_t n, double keep, double k) {
+    uint32_t done = 0;
+    if (keep == 1.0 && dst_type == src_type &&
+        dst_step == sparse_set_type_size(dst_type) && src_step == dst_step) {
+        done = kernel_axpy_simd(dst, src, n, dst_type, k);
+    }
+    for (uint32_t i = done; i < n; i++) {
+        uint8_t *d = dst + (size_t)i * dst_step;
+        const uint8_t *s = src + (size_t)i * src_step;
+        if (keep == 0.0 && k == 1.0 && dst_type == src_type) {
+            memmove(d, s, sparse_set_type_size(dst_type));
+            continue;
+        }
+        double v = kernel_load(s, src_type) * k;
+        if (keep != 0.0) v += kernel_load(d, dst_type) * keep;
+        kernel_store(d, dst_type, v);
+    }
+}
+
+typedef struct {
+    sparse_set_t *dst_set;
+    const sparse_set_field_t *dst;
+    const sparse_set_t *src_set;
+    const sparse_set_field_t *src;
+    uint8_t *dst_base;
+    uint32_t dst_step;
+    const uint8_t *src_base;
+    uint32_t src_step;
+    double keep;
+    double k;
+    uint32_t matched;
+} kernel_combine_task_t;
+
+// Positions [begin, end) line up in both sets.
+static void kernel_combine_aligned_task(void *ud, uint32_t begin, uint32_t end) {
+    const kernel_combine_task_t *t = (const kernel_combine_task_t*)ud;
+    kernel_combine_range(t->dst_base + (size_t)begin * t->dst_step, t->dst_step, t->dst->type,
+                         t->src_base + (size_t)begin * t->src_step, t->src_step, t->src->type,
+                         end - begin, t->keep, t->k);
+}
+
+// Walks dst positions [begin, end) and probes src. Ids are unique, so
+// chunks never write the same element.
+static void kernel_combine_dst_task(void *ud, uint32_t begin, uint32_t end) {
+    kernel_combine_task_t *t = (kernel_combine_task_t*)ud;
+    uint32_t matched = 0;
+    for (uint32_t pos = begin; pos < end; pos++) {
+        uint32_t other = sparse_set_index_of(t->src_set, t->dst_set->dense[pos]);
+        if (other == SPARSE_SET_INVALID_POS) continue;
+        kernel_combine_range(t->dst_base + (size_t)pos * t->dst_step, t->dst_step, t->dst->type,
+                             t->src_base + (size_t)other * t->src_step, t->src_step, t->src->type, 1, t->keep, t->k);
+        sparse_set_mark_field(t->dst_set, t->dst, pos, 1);
+        matched++;
+    }
+    __atomic_fetch_add(&t->matched, matched, __ATOMIC_RELAXED);
+}
+
+// Walks src positions [begin, end) and probes dst.
+static void kernel_combine_src_task(void *ud, uint32_t begin, uint32_t end) {
+    kernel_combine_task_t *t = (kernel_combine_task_t*)ud;
+    uint32_t matched = 0;
+    for (uint32_t pos = begin; pos < end; pos++) {
+        uint32_t other = sparse_set_index_of(t->dst_set, t->src_set->dense[pos]);
+        if (other == SPARSE_SET_INVALID_POS) continue;
+        kernel_combine_range(t->dst_base + (size_t)other * t->dst_step, t->dst_step, t->dst->type,
+                             t->src_base + (size_t)pos * t->src_step, t->src_step, t->src->type, 1, t->keep, t->k);
+        sparse_set_mark_field(t->dst_set, t->dst, other, 1);
+        matched++;
+    }
+    __atomic_fetch_add(&t->matched, matched, __ATOMIC_RELAXED);
+}
+
+static uint32_t kernel_combine(sparse_set_t *dst_set, const sparse_set_field_t *dst,
+                               const sparse_set_t *src_set, const sparse_set_field_t *src,
+                               double keep, double k) {
+    if (!kernel_type_supported(dst->type) || !kernel_type_supported(src->type)) {
+        return SPARSE_SET_INVALID_POS;
+    }
+
+    kernel_combine_task_t task = {
+        dst_set, dst, src_set, src,
+        sparse_set_field_base(dst_set, dst), sparse_set_field_step(dst_set, dst),
+        sparse_set_field_base(src_set, src), sparse_set_field_step(src_set, src),
+        keep, k, 0
+    };
+
+    // Same set, or the only two sets of one group (the joined ids are
+    // exactly the grouped prefix): aligned by position. With more owned
+    // sets the prefix is narrower than the join, so those go by id.
+    uint32_t aligned = SPARSE_SET_INVALID_POS;
+    if (dst_set == src_set) {
+        aligned = dst_set->size;
+    } else if (dst_set->group && dst_set->group == src_set->group && dst_set->group->set_count == 2) {
+        aligned = dst_set->group->size;
+    }
+    if (aligned != SPARSE_SET_INVALID_POS) {
+        if (aligned > 0) {
+            sparse_set_parallel_for(aligned, SPARSE_SET_PARALLEL_MIN_CHUNK, kernel_combine_aligned_task, &task);
+            sparse_set_mark_field(dst_set, dst, 0, aligned);
+        }
+        return aligned;
+    }
+
+    // Joined by id: walk the smaller set and probe the other one. Change
+    // marks are not thread-safe, so tracked sets take the serial path.
+    bool walk_dst = dst_set->size <= src_set->size;
+    uint32_t n = walk_dst ? dst_set->size : src_set->size;
+    sparse_set_task_fn fn = walk_dst ? kernel_combine_dst_task : kernel_combine_src_task;
+    if (dst_set->changes) {
+        fn(&task, 0, n);
+    } else {
+        // Probes cost more than the aligned loop, so split earlier.
+        sparse_set_parallel_for(n, SPARSE_SET_PARALLEL_MIN_CHUNK / 4, fn, &task);
+    }
+    return task.matched;
+}
+
+uint32_t sparse_set_field_axpy(sparse_set_t *dst_set, const sparse_set_field_t *dst,
+                               const sparse_set_t *src_set, const sparse_set_field_t *src, double k) {
+    return kernel_combine(dst_set, dst, src_set, src, 1.0, k);
+}
+
+uint32_t sparse_set_field_copy(sparse_set_t *dst_set, const sparse_set_field_t *dst,
+                               const sparse_set_t *src_set, const sparse_set_field_t *src) {
+    return kernel_combine(dst_set, dst, src_set, src, 0.0, 1.0);
+}
@@ -0,0 +1,149 @@
+#ifndef LUA_COMPAT_H
+#define LUA_COMPAT_H
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <errno.h>
+#include <string.h>
+
+// The binding is written against the Lua 5.4 C API. This header fills in
+// what older hosts lack, so the same source builds on 5.1 (and LuaJIT),
+// 5.2 and 5.3. Everything is redirected through macros to static
+// functions with our own prefix, which keeps it clear of hosts (LuaJIT
+// 2.1) that already ship some of the 5.2 additions. It comes in through
+// lua-sparse-set.h, so native modules using that header get it too.
+
+// Lua before 5.3 has no integer subtype: ids travel as doubles and are
+// exact only below 2^53, so registries keep versions to 21 bits there.
+#if LUA_VERSION_NUM < 503
+#define LSPARSESET_VERSION_BITS 21
+#else
+#define LSPARSESET_VERSION_BITS 32
+#endif
+
+#if LUA_VERSION_NUM < 502
+
+static inline int lsparseset_absindex(lua_State *L, int idx) {
+    return (idx > 0 || idx <= LUA_REGISTRYINDEX) ? idx : lua_gettop(L) + idx + 1;
+}
+
+static inline void lsparseset_setfuncs(lua_State *L, const luaL_Reg *l, int nup) {
+    luaL_checkstack(L, nup, "too many upvalues");
+    for (; l->name; l++) {
+        for (int i = 0; i < nup; i++) lua_pushvalue(L, -nup);
+        lua_pushcclosure(L, l->func, nup);
+        lua_setfield(L, -(nup + 2), l->name);
+    }
+    lua_pop(L, nup);
+}
+
+static inline void *lsparseset_testudata(lua_State *L, int idx, const char *tname) {
+    void *p = lua_touserdata(L, idx);
+    if (!p || !lua_getmetatable(L, idx)) return NULL;
+    luaL_getmetatable(L, tname);
+    if (!lua_rawequal(L, -1, -2)) p = NULL;
+    lua_pop(L, 2);
+    return p;
+}
+
+static inline lua_Integer lsparseset_tointegerx(lua_State *L, int idx, int *isnum) {
+    int ok = lua_isnumber(L, idx);
+    if (isnum) *isnum = ok;
+    return ok ? lua_tointeger(L, idx) : 0;
+}
+
+static inline int lsparseset_fileresult(lua_State *L, int stat, const char *fname) {
+    int en = errno;
+    if (stat) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushnil(L);
+    if (fname) lua_pushfstring(L, "%s: %s", fname, strerror(en));
+    else lua_pushstring(L, strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+
+// 5.1 buffers cannot be sized up front. Anything beyond the inline buffer
+// is staged in a userdata on top of the stack, so `sz` must be the same in
+// both calls.
+static inline char *lsparseset_buffinitsize(lua_State *L, luaL_Buffer *B, size_t sz) {
+    luaL_buffinit(L, B);
+    if (sz <= LUAL_BUFFERSIZE) return luaL_prepbuffer(B);
+    return (char *)lua_newuserdata(L, sz);
+}
+
+static inline void lsparseset_pushresultsize(luaL_Buffer *B, size_t sz) {
+    if (sz <= LUAL_BUFFERSIZE) {
+        luaL_addsize(B, sz);
+        luaL_pushresult(B);
+        return;
+    }
+    lua_pushlstring(B->L, (const char *)lua_touserdata(B->L, -1), sz);
+    lua_remove(B->L, -2);
+}
+
+#define lua_absindex lsparseset_absindex
+#define lua_rawlen(L, idx) lua_objlen(L, idx)
+#define luaL_setfuncs lsparseset_setfuncs
+#define luaL_testudata lsparseset_testudata
+#define lua_tointegerx lsparseset_tointegerx
+#define luaL_fileresult lsparseset_fileresult
+#define luaL_buffinitsize lsparseset_buffinitsize
+#define luaL_pushresultsize lsparseset_pushresultsize
+#define lsparseset_getuservalue lua_getfenv
+#define lsparseset_setuservalue lua_setfenv
+
+#else
+
+#define lsparseset_getuservalue lua_getuservalue
+#define lsparseset_setuservalue lua_setuservalue
+
+#endif
+
+#if LUA_VERSION_NUM < 504
+
+// Before 5.4 a userdata has a single uservalue (a table on 5.1/5.2), so the
+// numbered slots live in a table stored there.
+static inline void *lsparseset_newuserdatauv(lua_State *L, size_t sz, int nuv) {
+    void *p = lua_newuserdata(L, sz);
+    if (nuv > 0) {
+        lua_createtable(L, nuv, 0);
+        lsparseset_setuservalue(L, -2);
+    }
+    return p;
+}
+
+static inline int lsparseset_getiuservalue(lua_State *L, int idx, int n) {
+    lsparseset_getuservalue(L, idx);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        return LUA_TNONE;
+    }
+    lua_rawgeti(L, -1, n);
+    lua_remove(L, -2);
+    return lua_type(L, -1);
+}
+
+static inline int lsparseset_setiuservalue(lua_State *L, int idx, int n) {
+    idx = lua_absindex(L, idx);
+    lsparseset_getuservalue(L, idx);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return 0;
+    }
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, n);
+    lua_pop(L, 1);
+    return 1;
+}
+
+#define lua_newuserdatauv lsparseset_newuserdatauv
+#define lua_getiuservalue lsparseset_getiuservalue
+#define lua_setiuservalue lsparseset_setiuservalue
+
+#endif
+
+#endif
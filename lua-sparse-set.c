@@ -1,40 +1,204 @@
-#include <lua.h>
-#include <lualib.h>
-#include <lauxlib.h>
-#include <string.h>
-#include "sparse-set.h"
-
-#define REGISTRY_METATABLE "SparseRegistry"
-#define SET_METATABLE "SparseSet"
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "lua-sparse-set.h"
+
+#define QUERY_METATABLE "SparseQuery"
+#define GROUP_METATABLE "SparseGroup"
+#define COMMANDS_METATABLE "SparseCommands"
+#define ALLOCATOR_METATABLE "SparseAllocator"
+#define SHARED_METATABLE "SparseIndex"
+#define LAYOUT_METATABLE "SparseLayout"
+#define POOL_METATABLE "SparsePool"
 
-#define TYPE_INT 1
-#define TYPE_FLOAT 2
-#define TYPE_DOUBLE 3
-#define TYPE_BYTE 4
-#define TYPE_BOOL 5
+// Per-state allocator (a userdata kept in the Lua registry) wrapping the
+// state's lua_Alloc, so native buffers count against the same allocator
+// and any memory limit it enforces.
+#define ALLOCATOR_KEY "sparseset.allocator"
+#define ALLOCATOR_POOL_PAGES 256
+
+// Per-state hold on the process-wide worker pool (a bool userdata in the
+// Lua registry). Its __gc runs at lua_close, before the module can be
+// unloaded, and stops the workers once no other state holds the pool.
+#define POOL_KEY "sparseset.pool"
+
+// Set uservalue slots: Lua values (stride 0), field name -> handle (schema),
+// the shared index the set is attached to.
+#define SET_UV_VALUES 1
+#define SET_UV_FIELDS 2
+#define SET_UV_SHARED 3
+#define SET_UV_COUNT 3
+
+// Most fields set:each() pushes per element.
+#define EACH_MAX_FIELDS 16
+
+// Most fields in one layout (as many as a schema set can have).
+#define LAYOUT_MAX_FIELDS SPARSE_SET_MAX_COLUMNS
+
+#define TYPE_INT SPARSE_SET_TYPE_INT
+#define TYPE_FLOAT SPARSE_SET_TYPE_FLOAT
+#define TYPE_DOUBLE SPARSE_SET_TYPE_DOUBLE
+#define TYPE_BYTE SPARSE_SET_TYPE_BYTE
+#define TYPE_BOOL SPARSE_SET_TYPE_BOOL
+
+static void push_record(lua_State *L, const sparse_set_t *set, uint32_t pos) {
+    if (set->data) {
+        lua_pushlstring(L, (const char *)set->data + (size_t)pos * set->stride, set->stride);
+        return;
+    }
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, set->stride);
+    sparse_set_read_row(set, pos, out);
+    luaL_pushresultsize(&b, set->stride);
+}
 
-static size_t field_type_size(int type) {
+static void push_field(lua_State *L, const uint8_t *ptr, int type) {
     switch (type) {
-        case TYPE_INT:
-            return sizeof(int);
-        case TYPE_FLOAT:
-            return sizeof(float);
-        case TYPE_DOUBLE:
-            return sizeof(double);
+        case TYPE_INT: {
+            int val;
+            memcpy(&val, ptr, sizeof(int));
+            lua_pushinteger(L, val);
+            break;
+        }
+        case TYPE_FLOAT: {
+            float val;
+            memcpy(&val, ptr, sizeof(float));
+            lua_pushnumber(L, val);
+            break;
+        }
+        case TYPE_DOUBLE: {
+            double val;
+            memcpy(&val, ptr, sizeof(double));
+            lua_pushnumber(L, val);
+            break;
+        }
         case TYPE_BYTE:
+            lua_pushinteger(L, *ptr);
+            break;
         case TYPE_BOOL:
-            return sizeof(uint8_t);
+            lua_pushboolean(L, *ptr != 0);
+            break;
         default:
-            return 0;
+            lua_pushnil(L);
+            break;
+    }
+}
+
+static void write_field(lua_State *L, uint8_t *ptr, int type, int arg) {
+    switch (type) {
+        case TYPE_INT: {
+            int val = (int)luaL_checkinteger(L, arg);
+            memcpy(ptr, &val, sizeof(int));
+            break;
+        }
+        case TYPE_FLOAT: {
+            float val = (float)luaL_checknumber(L, arg);
+            memcpy(ptr, &val, sizeof(float));
+            break;
+        }
+        case TYPE_DOUBLE: {
+            double val = (double)luaL_checknumber(L, arg);
+            memcpy(ptr, &val, sizeof(double));
+            break;
+        }
+        case TYPE_BYTE:
+            *ptr = (uint8_t)luaL_checkinteger(L, arg);
+            break;
+        case TYPE_BOOL:
+            *ptr = lua_toboolean(L, arg) ? 1 : 0;
+            break;
+    }
+}
+
+// Resolves a field argument starting at `arg`: `offset, type` for stride
+// sets, a field name or handle for schema sets. Returns the index of the
+// first argument after the field.
+static int check_field(lua_State *L, int set_idx, sparse_set_t *set, int arg, sparse_set_field_t *field, const char *fname) {
+    if (set->stride == 0) {
+        return luaL_error(L, "%s requires set created with stride > 0", fname);
+    }
+
+    if (set->columns) {
+        lua_Integer handle;
+        if (lua_type(L, arg) == LUA_TSTRING) {
+            int isnum;
+            lua_getiuservalue(L, set_idx, SET_UV_FIELDS);
+            lua_pushvalue(L, arg);
+            lua_rawget(L, -2);
+            handle = lua_tointegerx(L, -1, &isnum);
+            lua_pop(L, 2);
+            if (!isnum) {
+                return luaL_error(L, "Unknown field '%s'", lua_tostring(L, arg));
+            }
+        } else {
+            handle = luaL_checkinteger(L, arg);
+        }
+        if (handle < 1 || !sparse_set_field_column(set, (uint32_t)(handle - 1), field)) {
+            return luaL_error(L, "Unknown field handle %d", (int)handle);
+        }
+        return arg + 1;
+    }
+
+    int offset = luaL_checkinteger(L, arg);
+    int type = luaL_checkinteger(L, arg + 1);
+    if (sparse_set_type_size(type) == 0) {
+        return luaL_error(L, "Unknown type %d", type);
+    }
+    if (offset < 0 || !sparse_set_field_at(set, (uint32_t)offset, type, field)) {
+        return luaL_error(L, "Offset out of bounds");
     }
+    return arg + 2;
+}
+
+static sparse_set_allocator_t *get_allocator(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, ALLOCATOR_KEY);
+    sparse_set_allocator_t *allocator = (sparse_set_allocator_t *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return allocator;
+}
+
+// Runs at lua_close at the latest. Objects finalized after it still free
+// through the allocator; with the pool drained, pages go straight back.
+static int l_allocator_gc(lua_State *L) {
+    sparse_set_allocator_drain((sparse_set_allocator_t *)lua_touserdata(L, 1));
+    return 0;
+}
+
+static void open_allocator(lua_State *L) {
+    if (get_allocator(L)) return;
+    void *ud;
+    lua_Alloc fn = lua_getallocf(L, &ud);
+    sparse_set_allocator_t *allocator = (sparse_set_allocator_t *)lua_newuserdatauv(L, sizeof(sparse_set_allocator_t), 0);
+    sparse_set_allocator_init(allocator, fn, ud, ALLOCATOR_POOL_PAGES);
+    luaL_newmetatable(L, ALLOCATOR_METATABLE);
+    lua_pushcfunction(L, l_allocator_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, ALLOCATOR_KEY);
+}
+
+// Returns bytes held by sets, registries and command buffers of this
+// state, and the number of pooled free pages (included in the bytes).
+static int l_memory(lua_State *L) {
+    sparse_set_allocator_t *allocator = get_allocator(L);
+    lua_pushinteger(L, (lua_Integer)allocator->bytes);
+    lua_pushinteger(L, allocator->pool_count);
+    return 2;
 }
 
 static int l_reg_create(lua_State *L) {
     if (lua_gettop(L) != 0) {
         return luaL_error(L, "new_registry() does not accept arguments");
     }
-    registry_t *reg = (registry_t *)lua_newuserdatauv(L, sizeof(registry_t), 0);
-    if (!registry_init(reg)) return luaL_error(L, "Failed to create registry");
+    registry_t *reg = (registry_t *)lua_newuserdatauv(L, sizeof(registry_t), 1);
+    if (!registry_init_alloc(reg, get_allocator(L))) return luaL_error(L, "Failed to create registry");
+    registry_set_version_bits(reg, LSPARSESET_VERSION_BITS);
 
     luaL_getmetatable(L, REGISTRY_METATABLE);
     lua_setmetatable(L, -2);
@@ -53,12 +217,6 @@ static int l_reg_create_id(lua_State *L) {
     return 1;
 }
 
-static int l_reg_destroy_id(lua_State *L) {
-    registry_t *reg = get_reg(L);
-    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
-    registry_recycle(reg, id);
-    return 0;
-}
 
 static int l_reg_valid(lua_State *L) {
     registry_t *reg = get_reg(L);
@@ -67,43 +225,240 @@ static int l_reg_valid(lua_State *L) {
     return 1;
 }
 
+// Fills the table on top of the stack with the counters; the per-call ones
+// only exist when built with SPARSE_SET_STATS.
+static void push_counters(lua_State *L, const sparse_set_counters_t *c) {
+    lua_pushinteger(L, c->grows);
+    lua_setfield(L, -2, "grows");
+    lua_pushinteger(L, c->shrinks);
+    lua_setfield(L, -2, "shrinks");
+    lua_pushinteger(L, c->rehashes);
+    lua_setfield(L, -2, "rehashes");
+    lua_pushinteger(L, c->page_allocs);
+    lua_setfield(L, -2, "page_allocs");
+#ifdef SPARSE_SET_STATS
+    lua_pushinteger(L, (lua_Integer)c->inserts);
+    lua_setfield(L, -2, "inserts");
+    lua_pushinteger(L, (lua_Integer)c->removes);
+    lua_setfield(L, -2, "removes");
+    lua_pushinteger(L, (lua_Integer)c->lookups);
+    lua_setfield(L, -2, "lookups");
+    lua_pushinteger(L, (lua_Integer)c->misses);
+    lua_setfield(L, -2, "misses");
+#endif
+}
+
+static int l_reg_stats(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    registry_stats_t stats;
+    registry_stats(reg, &stats);
+    lua_createtable(L, 0, 14);
+    lua_pushinteger(L, stats.live);
+    lua_setfield(L, -2, "live");
+    lua_pushinteger(L, stats.next_index);
+    lua_setfield(L, -2, "next_index");
+    lua_pushinteger(L, stats.recycled);
+    lua_setfield(L, -2, "recycled");
+    lua_pushinteger(L, stats.recycle_capacity);
+    lua_setfield(L, -2, "recycle_capacity");
+    lua_pushinteger(L, stats.pages);
+    lua_setfield(L, -2, "pages");
+    lua_pushinteger(L, (lua_Integer)stats.bytes);
+    lua_setfield(L, -2, "bytes");
+    push_counters(L, &stats.counters);
+    return 1;
+}
+
+static int l_reg_shrink_to_fit(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    registry_shrink_to_fit(reg);
+    return 0;
+}
+
+static int l_reg_auto_shrink(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    registry_set_auto_shrink(reg, lua_toboolean(L, 2));
+    return 0;
+}
+
 static int l_reg_gc(lua_State *L) {
     registry_t *reg = get_reg(L);
     registry_deinit(reg);
     return 0;
 }
 
+static uint32_t check_capacity(lua_State *L, int idx, const char *what) {
+    lua_Integer n = luaL_checkinteger(L, idx);
+    if (n < 0 || (uint64_t)n > SPARSE_SET_MAX_DENSE) {
+        return (uint32_t)luaL_error(L, "%s must be in 0..%u", what, SPARSE_SET_MAX_DENSE);
+    }
+    return (uint32_t)n;
+}
+
+// Reads `capacity` and `reserve` from the argument at idx: a number is the
+// capacity, a table may carry both fields.
+static void check_capacity_opts(lua_State *L, int idx, uint32_t *capacity, uint32_t *reserve) {
+    *capacity = 0;
+    *reserve = 0;
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        *capacity = check_capacity(L, idx, "capacity");
+        return;
+    }
+    if (!lua_istable(L, idx)) return;
+    lua_getfield(L, idx, "capacity");
+    if (!lua_isnil(L, -1)) *capacity = check_capacity(L, -1, "capacity");
+    lua_getfield(L, idx, "reserve");
+    if (!lua_isnil(L, -1)) *reserve = check_capacity(L, -1, "reserve");
+    lua_pop(L, 2);
+    if (*reserve && *capacity > *reserve) {
+        luaL_error(L, "capacity exceeds reserve");
+    }
+}
+
+// Applies check_capacity_opts results to a freshly created set.
+static void setup_capacity(lua_State *L, sparse_set_t *set, uint32_t capacity, uint32_t reserve) {
+    if (reserve) {
+        if (reserve < set->dense_capacity) reserve = set->dense_capacity;
+        if (!sparse_set_reserve_address_space(set, reserve)) {
+            luaL_error(L, "Failed to reserve address space");
+        }
+    }
+    if (capacity && !sparse_set_reserve(set, capacity)) {
+        luaL_error(L, "Failed to reserve capacity");
+    }
+}
+
+// The Lua value table of a stride 0 set, presized to `capacity` slots.
+static void new_value_table(lua_State *L, uint32_t capacity) {
+    lua_createtable(L, capacity > INT_MAX ? INT_MAX : (int)capacity, 0);
+}
+
+// new_set([stride[, capacity | opts]]); opts.capacity preallocates,
+// opts.reserve reserves address space for that many entries (reserve.c),
+// opts.file backs dense/data with a mapped file, opts.adaptive starts the
+// set on the small-set hash index.
 static int l_set_create(lua_State *L) {
     int nargs = lua_gettop(L);
-    if (nargs > 1) {
-        return luaL_error(L, "new_set([stride]) accepts at most one argument");
+    if (nargs > 2) {
+        return luaL_error(L, "new_set([stride[, capacity | opts]]) accepts at most two arguments");
     }
 
     int stride = 0;
-    if (nargs == 1) {
+    if (nargs >= 1) {
         stride = luaL_checkinteger(L, 1);
         if (stride < 0) {
             return luaL_error(L, "stride must be >= 0");
         }
     }
-
-    sparse_set_t *set = (sparse_set_t *)lua_newuserdatauv(L, sizeof(sparse_set_t), 1);
-    if (!sparse_set_init(set)) return luaL_error(L, "Failed to create set");
-
-    if (stride > 0) {
-        if (!sparse_set_set_stride(set, stride)) {
-            return luaL_error(L, "Failed to set stride");
-        }
-    }
-    
-    lua_newtable(L);
-    lua_setiuservalue(L, -2, 1);
-
-    luaL_getmetatable(L, SET_METATABLE);
-    lua_setmetatable(L, -2);
-    return 1;
-}
-
+
+    const char *file = NULL;
+    bool adaptive = false;
+    uint32_t capacity = 0, reserve = 0;
+    if (nargs == 2 && !lua_isnil(L, 2)) {
+        if (lua_type(L, 2) != LUA_TNUMBER) luaL_checktype(L, 2, LUA_TTABLE);
+        check_capacity_opts(L, 2, &capacity, &reserve);
+    }
+    if (nargs == 2 && lua_istable(L, 2)) {
+        lua_getfield(L, 2, "adaptive");
+        adaptive = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "file");  // left on the stack to keep `file` alive
+        file = lua_tostring(L, -1);
+        if (file && stride == 0) {
+            return luaL_error(L, "file-backed sets require stride > 0");
+        }
+        if (file && reserve) {
+            return luaL_error(L, "file-backed sets cannot reserve address space");
+        }
+    }
+
+    sparse_set_t *set = (sparse_set_t *)lua_newuserdatauv(L, sizeof(sparse_set_t), SET_UV_COUNT);
+    if (!sparse_set_init_alloc(set, get_allocator(L))) return luaL_error(L, "Failed to create set");
+
+    new_value_table(L, stride == 0 ? capacity : 0);
+    lua_setiuservalue(L, -2, 1);
+
+    // Metatable first so __gc releases the set if setup below fails.
+    luaL_getmetatable(L, SET_METATABLE);
+    lua_setmetatable(L, -2);
+
+    if (file) {
+        if (!sparse_set_map_file(set, file, (uint32_t)stride)) {
+            return luaL_error(L, "Failed to map file '%s'", file);
+        }
+    } else if (stride > 0) {
+        if (!sparse_set_set_stride(set, stride)) {
+            return luaL_error(L, "Failed to set stride");
+        }
+    }
+    setup_capacity(L, set, capacity, reserve);
+    if (adaptive && !sparse_set_set_adaptive(set, true)) {
+        return luaL_error(L, "Failed to set up adaptive index");
+    }
+    return 1;
+}
+
+// new_schema_set(fields[, capacity | opts]); opts as for new_set (capacity
+// and reserve).
+static int l_schema_set_create(lua_State *L) {
+    int types[SPARSE_SET_MAX_COLUMNS];
+    luaL_checktype(L, 1, LUA_TTABLE);
+    uint32_t capacity, reserve;
+    if (!lua_isnoneornil(L, 2) && lua_type(L, 2) != LUA_TNUMBER) luaL_checktype(L, 2, LUA_TTABLE);
+    check_capacity_opts(L, 2, &capacity, &reserve);
+    lua_settop(L, 1);
+    int count = (int)lua_rawlen(L, 1);
+    if (count == 0 || count > SPARSE_SET_MAX_COLUMNS) {
+        return luaL_error(L, "schema must declare 1..%d fields", SPARSE_SET_MAX_COLUMNS);
+    }
+
+    lua_createtable(L, 0, count);
+    int names_idx = lua_gettop(L);
+    for (int i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        if (!lua_istable(L, -1)) {
+            return luaL_error(L, "schema[%d] must be { name, type }", i + 1);
+        }
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            return luaL_error(L, "schema[%d] name must be a string", i + 1);
+        }
+        types[i] = (int)lua_tointeger(L, -1);
+        if (sparse_set_type_size(types[i]) == 0) {
+            return luaL_error(L, "schema[%d] has unknown type", i + 1);
+        }
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, -1);
+        lua_rawget(L, names_idx);
+        if (!lua_isnil(L, -1)) {
+            return luaL_error(L, "duplicate field '%s'", lua_tostring(L, -2));
+        }
+        lua_pop(L, 1);
+        lua_pushinteger(L, i + 1);
+        lua_rawset(L, names_idx);
+        lua_pop(L, 1);
+    }
+
+    sparse_set_t *set = (sparse_set_t *)lua_newuserdatauv(L, sizeof(sparse_set_t), SET_UV_COUNT);
+    if (!sparse_set_init_alloc(set, get_allocator(L))) return luaL_error(L, "Failed to create set");
+    if (!sparse_set_set_schema(set, types, (uint32_t)count)) {
+        sparse_set_deinit(set);
+        return luaL_error(L, "Failed to create schema columns");
+    }
+
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, SET_UV_VALUES);
+    lua_pushvalue(L, names_idx);
+    lua_setiuservalue(L, -2, SET_UV_FIELDS);
+
+    luaL_getmetatable(L, SET_METATABLE);
+    lua_setmetatable(L, -2);
+    setup_capacity(L, set, capacity, reserve);
+    return 1;
+}
+
 static int l_set_insert(lua_State *L) {
     sparse_set_t *set = get_set(L);
     sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
@@ -126,72 +481,59 @@ static int l_set_insert(lua_State *L) {
             size_t len;
             const char *data = luaL_checklstring(L, 3, &len);
             if (len != set->stride) {
-                return luaL_error(L, "Data size mismatch, expected %d got %d", set->stride, (int)len);
-            }
-            void *ptr = sparse_set_get_data(set, pos);
-            if (ptr) {
-                memcpy(ptr, data, len);
-            }
+                return luaL_error(L, "Data size mismatch, expected %d got %d", set->stride, (int)len);
+            }
+            sparse_set_write_row(set, pos, data);
         }
-    } else {
-        lua_getiuservalue(L, 1, 1);
-        lua_pushvalue(L, 3);
-        lua_rawseti(L, -2, pos + 1);
-        lua_pop(L, 1);
-    }
-
+    } else {
+        lua_getiuservalue(L, 1, 1);
+        lua_pushvalue(L, 3);
+        lua_rawseti(L, -2, pos + 1);
+        lua_pop(L, 1);
+        if (!is_new) sparse_set_mark_change(set, id, SPARSE_SET_CHANGE_MODIFIED, 0, 0);
+    }
+
     lua_pushboolean(L, is_new);
     return 1;
 }
 
-static int l_set_remove(lua_State *L) {
-    sparse_set_t *set = get_set(L);
-    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
-    
-    if (!sparse_set_contains(set, id)) {
-        lua_pushboolean(L, false);
-        return 1;
-    }
-
-    uint32_t index = ID_INDEX(id);
-    uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-    uint32_t offset = index & SPARSE_SET_PAGE_MASK;
-    uint32_t pos = set->sparse[page_idx][offset];
-    uint32_t last_pos = set->size - 1;
-
-    if (pos != last_pos) {
-        lua_getiuservalue(L, 1, 1);
-        lua_rawgeti(L, -1, last_pos + 1);
-        lua_rawseti(L, -2, pos + 1);
-        lua_pop(L, 1);
-    }
-    
-    lua_getiuservalue(L, 1, 1);
-    lua_pushnil(L);
-    lua_rawseti(L, -2, last_pos + 1);
-    lua_pop(L, 1);
-
-    sparse_set_remove(set, id);
-    lua_pushboolean(L, true);
-    return 1;
-}
+// Removes id and mirrors the swap-with-last in the Lua value table at
+// values_idx (an absolute stack index).
+static bool set_remove_value(lua_State *L, sparse_set_t *set, sparse_set_id_t id, int values_idx) {
+    uint32_t pos = sparse_set_index_of(set, id);
+    if (pos == SPARSE_SET_INVALID_POS) return false;
+
+    if (set->stride == 0) {
+        uint32_t last_pos = set->size - 1;
+        if (pos != last_pos) {
+            lua_rawgeti(L, values_idx, last_pos + 1);
+            lua_rawseti(L, values_idx, pos + 1);
+        }
+        lua_pushnil(L);
+        lua_rawseti(L, values_idx, last_pos + 1);
+    }
+
+    sparse_set_remove(set, id);
+    return true;
+}
+
+static int l_set_remove(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
+
+    lua_getiuservalue(L, 1, 1);
+    lua_pushboolean(L, set_remove_value(L, set, id, lua_gettop(L)));
+    return 1;
+}
 
 static int l_set_get(lua_State *L) {
     sparse_set_t *set = get_set(L);
     sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
     
-    uint32_t index = ID_INDEX(id);
-    if (sparse_set_contains(set, id)) {
-        uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-        uint32_t offset = index & SPARSE_SET_PAGE_MASK;
-        uint32_t pos = set->sparse[page_idx][offset];
-        if (set->stride > 0) {
-            void *ptr = sparse_set_get_data(set, pos);
-            if (ptr) {
-                lua_pushlstring(L, (const char *)ptr, set->stride);
-            } else {
-                lua_pushnil(L);
-            }
+    uint32_t pos = sparse_set_index_of(set, id);
+    if (pos != SPARSE_SET_INVALID_POS) {
+        if (set->stride > 0) {
+            push_record(L, set, pos);
         } else {
             lua_getiuservalue(L, 1, 1);
             lua_rawgeti(L, -1, pos + 1);
@@ -209,36 +551,387 @@ static int l_set_contains(lua_State *L) {
     return 1;
 }
 
+// Accepts a Lua array of ids or a string of packed native 64-bit ids
+// (string.pack("j", ...)). May push a scratch userdata onto the stack.
+static const sparse_set_id_t *check_id_list(lua_State *L, int arg, uint32_t *count) {
+    if (lua_type(L, arg) == LUA_TSTRING) {
+        size_t len;
+        const char *s = lua_tolstring(L, arg, &len);
+        if (len % sizeof(sparse_set_id_t) != 0) {
+            luaL_argerror(L, arg, "packed id buffer length must be a multiple of 8");
+        }
+        *count = (uint32_t)(len / sizeof(sparse_set_id_t));
+        if ((uintptr_t)s % sizeof(sparse_set_id_t) == 0) {
+            return (const sparse_set_id_t *)s;
+        }
+        sparse_set_id_t *ids = (sparse_set_id_t *)lua_newuserdatauv(L, len + 1, 0);
+        memcpy(ids, s, len);
+        return ids;
+    }
+
+    luaL_checktype(L, arg, LUA_TTABLE);
+    uint32_t n = (uint32_t)lua_rawlen(L, arg);
+    sparse_set_id_t *ids = (sparse_set_id_t *)lua_newuserdatauv(L, (size_t)n * sizeof(sparse_set_id_t) + 1, 0);
+    for (uint32_t i = 0; i < n; i++) {
+        int isnum;
+        lua_rawgeti(L, arg, i + 1);
+        ids[i] = (sparse_set_id_t)lua_tointegerx(L, -1, &isnum);
+        if (!isnum) {
+            luaL_error(L, "ids[%d] is not an integer", (int)(i + 1));
+        }
+        lua_pop(L, 1);
+    }
+    *count = n;
+    return ids;
+}
+
+static uint32_t *new_pos_buffer(lua_State *L, uint32_t count) {
+    return (uint32_t *)lua_newuserdatauv(L, (size_t)count * sizeof(uint32_t) + 1, 0);
+}
+
+static int l_set_insert_many(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    uint32_t count;
+    const sparse_set_id_t *ids = check_id_list(L, 2, &count);
+
+    const char *blob = NULL;
+    bool has_values = !lua_isnoneornil(L, 3);
+    if (set->stride > 0) {
+        if (has_values) {
+            size_t len;
+            blob = luaL_checklstring(L, 3, &len);
+            if (len != (size_t)count * set->stride) {
+                return luaL_error(L, "Data size mismatch, expected %d got %d", (int)(count * set->stride), (int)len);
+            }
+        }
+    } else if (has_values) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+
+    uint32_t *pos = new_pos_buffer(L, count);
+    uint32_t added = sparse_set_insert_many(set, ids, count, pos);
+    if (added == SPARSE_SET_INVALID_POS) {
+        lua_pushnil(L);
+        lua_pushstring(L, "oom");
+        return 2;
+    }
+
+    if (set->stride > 0) {
+        if (blob) {
+            for (uint32_t i = 0; i < count; i++) {
+                sparse_set_write_row(set, pos[i], blob + (size_t)i * set->stride);
+            }
+        }
+    } else {
+        lua_getiuservalue(L, 1, 1);
+        int values_idx = lua_gettop(L);
+        for (uint32_t i = 0; i < count; i++) {
+            if (has_values) {
+                lua_rawgeti(L, 3, i + 1);
+            } else {
+                lua_pushnil(L);
+            }
+            lua_rawseti(L, values_idx, pos[i] + 1);
+            sparse_set_mark_change(set, ids[i], SPARSE_SET_CHANGE_MODIFIED, 0, 0);
+        }
+    }
+
+    lua_pushinteger(L, added);
+    return 1;
+}
+
+static int l_set_remove_many(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    uint32_t count;
+    const sparse_set_id_t *ids = check_id_list(L, 2, &count);
+
+    uint32_t removed = 0;
+    if (set->stride > 0) {
+        removed = sparse_set_remove_many(set, ids, count);
+    } else {
+        lua_getiuservalue(L, 1, 1);
+        int values_idx = lua_gettop(L);
+        for (uint32_t i = 0; i < count; i++) {
+            if (set_remove_value(L, set, ids[i], values_idx)) removed++;
+        }
+    }
+    lua_pushinteger(L, removed);
+    return 1;
+}
+
+// The registry's uservalue is a weak-keyed table of attached sets
+// (set -> true), created by the first attach. Pushes it, or returns false
+// and pushes nothing when no set was ever attached.
+static bool push_attached(lua_State *L, int reg_idx) {
+    if (lua_getiuservalue(L, reg_idx, 1) == LUA_TTABLE) return true;
+    lua_pop(L, 1);
+    return false;
+}
+
+// Removes ids from every set attached to the registry at reg_idx.
+static void registry_remove_attached(lua_State *L, int reg_idx, const sparse_set_id_t *ids, uint32_t count) {
+    if (count == 0 || !push_attached(L, reg_idx)) return;
+    int attached_idx = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, attached_idx)) {
+        lua_pop(L, 1);
+        sparse_set_t *set = (sparse_set_t *)lua_touserdata(L, -1);
+        if (set->stride > 0) {
+            sparse_set_remove_many(set, ids, count);
+        } else {
+            lua_getiuservalue(L, -1, SET_UV_VALUES);
+            int values_idx = lua_gettop(L);
+            for (uint32_t i = 0; i < count; i++) {
+                set_remove_value(L, set, ids[i], values_idx);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+static int l_reg_attach(lua_State *L) {
+    int top = lua_gettop(L);
+    for (int i = 2; i <= top; i++) lsparseset_checkset(L, i);
+    if (!push_attached(L, 1)) {
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, 1, 1);
+    }
+    for (int i = 2; i <= top; i++) {
+        lua_pushvalue(L, i);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
+    }
+    return 0;
+}
+
+static int l_reg_detach(lua_State *L) {
+    lsparseset_checkset(L, 2);
+    if (push_attached(L, 1)) {
+        lua_pushvalue(L, 2);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+    }
+    return 0;
+}
+
+static int l_reg_destroy_id(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
+    if (!registry_valid(reg, id)) return 0;
+    registry_recycle(reg, id);
+    registry_remove_attached(L, 1, &id, 1);
+    return 0;
+}
+
+static int l_reg_destroy_many(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    uint32_t count;
+    const sparse_set_id_t *ids = check_id_list(L, 2, &count);
+    sparse_set_id_t *destroyed = (sparse_set_id_t *)lua_newuserdatauv(L, (size_t)count * sizeof(sparse_set_id_t) + 1, 0);
+    uint32_t n = registry_recycle_many(reg, ids, count, destroyed);
+    registry_remove_attached(L, 1, destroyed, n);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+// Returns the new ids as one string of packed native ids, ready for
+// insert_many; fails without creating anything partially visible to Lua.
+static int l_reg_create_many(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    if (n < 0 || n > (lua_Integer)SPARSE_SET_MAX_DENSE) {
+        return luaL_error(L, "count out of range");
+    }
+    luaL_Buffer b;
+    sparse_set_id_t *ids = (sparse_set_id_t *)luaL_buffinitsize(L, &b, (size_t)n * sizeof(sparse_set_id_t));
+    uint32_t created = registry_create_many(reg, ids, (uint32_t)n);
+    if (created < (uint32_t)n) {
+        registry_recycle_many(reg, ids, created, NULL);
+        lua_pushnil(L);
+        lua_pushstring(L, "oom");
+        return 2;
+    }
+    luaL_pushresultsize(&b, (size_t)n * sizeof(sparse_set_id_t));
+    return 1;
+}
+
+static int l_set_contains_many(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    uint32_t count;
+    const sparse_set_id_t *ids = check_id_list(L, 2, &count);
+    uint32_t *pos = new_pos_buffer(L, count);
+    sparse_set_index_of_many(set, ids, count, pos);
+
+    lua_createtable(L, (int)count, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        lua_pushboolean(L, pos[i] != SPARSE_SET_INVALID_POS);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+// Second result is the number of missing ids: a zeroed record of a stride
+// set cannot be told apart from a stored one otherwise.
+static int l_set_get_many(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    uint32_t count;
+    const sparse_set_id_t *ids = check_id_list(L, 2, &count);
+    uint32_t *pos = new_pos_buffer(L, count);
+    uint32_t missing = count - sparse_set_index_of_many(set, ids, count, pos);
+
+    if (set->stride > 0) {
+        luaL_Buffer b;
+        size_t total = (size_t)count * set->stride;
+        char *out = luaL_buffinitsize(L, &b, total);
+        for (uint32_t i = 0; i < count; i++) {
+            char *dst = out + (size_t)i * set->stride;
+            if (pos[i] != SPARSE_SET_INVALID_POS) {
+                sparse_set_read_row(set, pos[i], dst);
+            } else {
+                memset(dst, 0, set->stride);
+            }
+        }
+        luaL_pushresultsize(&b, total);
+        lua_pushinteger(L, missing);
+        return 2;
+    }
+
+    lua_getiuservalue(L, 1, 1);
+    int values_idx = lua_gettop(L);
+    lua_createtable(L, (int)count, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        if (pos[i] == SPARSE_SET_INVALID_POS) continue;
+        lua_rawgeti(L, values_idx, pos[i] + 1);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushinteger(L, missing);
+    return 2;
+}
+
 static int l_set_size(lua_State *L) {
     sparse_set_t *set = get_set(L);
     lua_pushinteger(L, sparse_set_size(set));
     return 1;
 }
 
-static int l_set_gc(lua_State *L) {
-    sparse_set_t *set = get_set(L);
-    sparse_set_deinit(set);
-    return 0;
-}
-
-static int _iter_optimized(lua_State *L) {
-    sparse_set_t *set = (sparse_set_t *)lua_touserdata(L, 1);
-    int pos = lua_tointeger(L, 2);
-    if (pos >= (int)sparse_set_size(set)) return 0;
-    
-    sparse_set_id_t id = sparse_set_get_id(set, pos);
+// Returns dense capacity and number of allocated sparse pages.
+static int l_set_capacity(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    lua_pushinteger(L, sparse_set_capacity(set));
+    lua_pushinteger(L, sparse_set_page_count(set));
+    lua_pushinteger(L, set->hash_capacity);
+    return 3;
+}
+
+// Bytes of one slot in a table's array part (a TValue on 64-bit builds).
+#define LUA_SLOT_BYTES 16
+
+static int l_set_stats(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_stats_t stats;
+    sparse_set_stats(set, &stats);
+    lua_createtable(L, 0, 18);
+    lua_pushinteger(L, stats.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, stats.capacity);
+    lua_setfield(L, -2, "capacity");
+    lua_pushinteger(L, stats.pages);
+    lua_setfield(L, -2, "pages");
+    lua_pushinteger(L, stats.live_pages);
+    lua_setfield(L, -2, "live_pages");
+    lua_pushinteger(L, stats.hash_capacity);
+    lua_setfield(L, -2, "hash_capacity");
+    lua_pushinteger(L, (lua_Integer)stats.dense_bytes);
+    lua_setfield(L, -2, "dense_bytes");
+    lua_pushinteger(L, (lua_Integer)stats.data_bytes);
+    lua_setfield(L, -2, "data_bytes");
+    lua_pushinteger(L, (lua_Integer)stats.index_bytes);
+    lua_setfield(L, -2, "index_bytes");
+    lua_pushinteger(L, stats.reserved);
+    lua_setfield(L, -2, "reserved");
+
+    // The value table's array part holds one slot per position; it grows
+    // in powers of two and is not shrunk on removal, so this is an estimate
+    // that leaves out the values themselves.
+    size_t slots = 0;
+    if (set->stride == 0) {
+        lua_getiuservalue(L, 1, SET_UV_VALUES);
+        size_t len = (size_t)lua_rawlen(L, -1);
+        lua_pop(L, 1);
+        if (len > 0) {
+            slots = 1;
+            while (slots < len) slots *= 2;
+        }
+    }
+    lua_pushinteger(L, (lua_Integer)(slots * LUA_SLOT_BYTES));
+    lua_setfield(L, -2, "value_bytes");
+    push_counters(L, &stats.counters);
+    return 1;
+}
+
+static int l_set_reserve(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    uint32_t capacity = check_capacity(L, 2, "capacity");
+    if (!sparse_set_reserve(set, capacity)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "oom");
+        return 2;
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int l_set_shrink_to_fit(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_shrink_to_fit(set);
+    return 0;
+}
+
+static int l_set_auto_shrink(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_set_auto_shrink(set, lua_toboolean(L, 2));
+    return 0;
+}
+
+static int l_set_adaptive(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    if (!sparse_set_set_adaptive(set, lua_toboolean(L, 2))) {
+        return luaL_error(L, "Failed to switch sparse index");
+    }
+    return 0;
+}
+
+static int l_set_sync(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    lua_pushboolean(L, sparse_set_sync(set));
+    return 1;
+}
+
+static int l_set_gc(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_deinit(set);
+    return 0;
+}
+
+static int _iter_optimized(lua_State *L) {
+    sparse_set_t *set = (sparse_set_t *)lua_touserdata(L, 1);
+    int pos = lua_tointeger(L, 2);
+    if (pos >= (int)sparse_set_size(set)) return 0;
+    
+    sparse_set_id_t id = sparse_set_get_id(set, pos);
     lua_pushinteger(L, pos + 1);
     lua_pushinteger(L, id);
     
-    if (set->stride > 0) {
-        void *ptr = sparse_set_get_data(set, pos);
-        if (ptr) {
-            lua_pushlstring(L, (const char *)ptr, set->stride);
-        } else {
-            lua_pushnil(L);
-        }
-    } else {
-        lua_rawgeti(L, lua_upvalueindex(1), pos + 1);
+    if (set->stride > 0) {
+        push_record(L, set, pos);
+    } else {
+        lua_rawgeti(L, lua_upvalueindex(1), pos + 1);
     }
     return 3;
 }
@@ -273,9 +966,12 @@ static int l_set_swap(lua_State *L) {
     uint32_t a = (uint32_t)(a_lua - 1);
     uint32_t b = (uint32_t)(b_lua - 1);
     
-    if (a >= set->size || b >= set->size) {
-        return luaL_error(L, "Index out of bounds");
-    }
+    if (a >= set->size || b >= set->size) {
+        return luaL_error(L, "Index out of bounds");
+    }
+    if (set->group && (a < set->group->size || b < set->group->size)) {
+        return luaL_error(L, "Position is owned by a group");
+    }
     
     if (a != b) {
         sparse_set_swap_at(set, a, b);
@@ -302,13 +998,8 @@ static int l_set_at(lua_State *L) {
     
     lua_pushinteger(L, id);
     
-    if (set->stride > 0) {
-        void *ptr = sparse_set_get_data(set, index - 1);
-        if (ptr) {
-            lua_pushlstring(L, (const char *)ptr, set->stride);
-        } else {
-            lua_pushnil(L);
-        }
+    if (set->stride > 0) {
+        push_record(L, set, (uint32_t)(index - 1));
     } else {
         lua_getiuservalue(L, 1, 1);
         lua_rawgeti(L, -1, index);
@@ -320,140 +1011,1186 @@ static int l_set_at(lua_State *L) {
 static int l_set_get_field(lua_State *L) {
     sparse_set_t *set = get_set(L);
     sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
-    int offset = luaL_checkinteger(L, 3);
-    int type = luaL_checkinteger(L, 4);
+    sparse_set_field_t field;
+    check_field(L, 1, set, 3, &field, "get_field");
 
-    if (set->stride == 0) {
-        return luaL_error(L, "get_field requires set created with stride > 0");
+    uint32_t pos = sparse_set_index_of(set, id);
+    if (pos == SPARSE_SET_INVALID_POS) {
+        lua_pushnil(L);
+        return 1;
     }
+    push_field(L, sparse_set_field_ptr(set, &field, pos), field.type);
+    return 1;
+}
 
-    size_t type_size = field_type_size(type);
-    if (type_size == 0) {
-        return luaL_error(L, "Unknown type %d", type);
+static int l_set_set_field(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
+    sparse_set_field_t field;
+    int value_arg = check_field(L, 1, set, 3, &field, "set_field");
+
+    uint32_t pos = sparse_set_index_of(set, id);
+    if (pos == SPARSE_SET_INVALID_POS) {
+        lua_pushboolean(L, false);
+        return 1;
     }
-    
-    uint32_t index = sparse_set_index_of(set, id);
-    if (index == SPARSE_SET_INVALID_POS) {
+    write_field(L, sparse_set_field_ptr(set, &field, pos), field.type, value_arg);
+    sparse_set_mark_field(set, &field, pos, 1);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// Accessor closures: upvalue 1 is the set, upvalue 2 a userdata holding
+// the field resolved when the accessor was made, so a call is one lookup
+// plus the load/store.
+static int accessor_get(lua_State *L) {
+    sparse_set_t *set = (sparse_set_t *)lua_touserdata(L, lua_upvalueindex(1));
+    const sparse_set_field_t *field = (const sparse_set_field_t *)lua_touserdata(L, lua_upvalueindex(2));
+    uint32_t pos = sparse_set_index_of(set, (sparse_set_id_t)luaL_checkinteger(L, 1));
+    if (pos == SPARSE_SET_INVALID_POS) {
         lua_pushnil(L);
         return 1;
     }
-    
-    void *base = sparse_set_get_data(set, index);
-    if (!base) {
+    push_field(L, sparse_set_field_ptr(set, field, pos), field->type);
+    return 1;
+}
+
+static int accessor_set(lua_State *L) {
+    sparse_set_t *set = (sparse_set_t *)lua_touserdata(L, lua_upvalueindex(1));
+    const sparse_set_field_t *field = (const sparse_set_field_t *)lua_touserdata(L, lua_upvalueindex(2));
+    uint32_t pos = sparse_set_index_of(set, (sparse_set_id_t)luaL_checkinteger(L, 1));
+    if (pos == SPARSE_SET_INVALID_POS) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    write_field(L, sparse_set_field_ptr(set, field, pos), field->type, 2);
+    if (set->changes) sparse_set_mark_field(set, field, pos, 1);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// set:accessor(offset, type) / set:accessor(field) -> get(id), set(id, value)
+static int l_set_accessor(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_field_t field;
+    check_field(L, 1, set, 2, &field, "accessor");
+
+    lua_pushvalue(L, 1);
+    sparse_set_field_t *resolved = (sparse_set_field_t *)lua_newuserdatauv(L, sizeof(sparse_set_field_t), 0);
+    *resolved = field;
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_pushcclosure(L, accessor_get, 2);
+    lua_insert(L, -3);
+    lua_pushcclosure(L, accessor_set, 2);
+    return 2;
+}
+
+// Allocation-free iteration over stride sets: positions instead of record
+// strings, then field reads/writes by position with no id lookup.
+static int iter_pos_next(lua_State *L) {
+    sparse_set_t *set = (sparse_set_t *)lua_touserdata(L, lua_upvalueindex(1));
+    lua_Integer pos = lua_tointeger(L, 2);
+    if (pos >= (lua_Integer)set->size) return 0;
+    lua_pushinteger(L, pos + 1);
+    lua_pushinteger(L, (lua_Integer)set->dense[pos]);
+    return 2;
+}
+
+static int l_set_iter_pos(lua_State *L) {
+    lsparseset_checkset(L, 1);
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, iter_pos_next, 1);
+    lua_pushnil(L);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+static int l_set_get_field_at(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    lua_Integer index = luaL_checkinteger(L, 2);
+    sparse_set_field_t field;
+    check_field(L, 1, set, 3, &field, "get_field_at");
+
+    if (index < 1 || index > (lua_Integer)set->size) {
         lua_pushnil(L);
         return 1;
     }
-    
-    if (offset < 0 || (size_t)offset + type_size > set->stride) {
-        return luaL_error(L, "Offset out of bounds");
+    push_field(L, sparse_set_field_ptr(set, &field, (uint32_t)(index - 1)), field.type);
+    return 1;
+}
+
+static int l_set_set_field_at(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    lua_Integer index = luaL_checkinteger(L, 2);
+    sparse_set_field_t field;
+    int value_arg = check_field(L, 1, set, 3, &field, "set_field_at");
+
+    if (index < 1 || index > (lua_Integer)set->size) {
+        lua_pushboolean(L, false);
+        return 1;
     }
-    
-    uint8_t *ptr = (uint8_t*)base + offset;
-    
-    switch (type) {
-        case TYPE_INT: {
-            int val;
-            memcpy(&val, ptr, sizeof(int));
-            lua_pushinteger(L, val);
-            break;
-        }
-        case TYPE_FLOAT: {
-            float val;
-            memcpy(&val, ptr, sizeof(float));
-            lua_pushnumber(L, val);
-            break;
-        }
-        case TYPE_DOUBLE: {
-            double val;
-            memcpy(&val, ptr, sizeof(double));
-            lua_pushnumber(L, val);
-            break;
-        }
-        case TYPE_BYTE: {
-            uint8_t val = *ptr;
-            lua_pushinteger(L, val);
-            break;
+    uint32_t pos = (uint32_t)(index - 1);
+    write_field(L, sparse_set_field_ptr(set, &field, pos), field.type, value_arg);
+    sparse_set_mark_field(set, &field, pos, 1);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// set:each(fn, field...) calls fn(id, value...) for every element with
+// the requested fields pushed as plain values (value sets pass the stored
+// value), so nothing is allocated per element. The walk runs last to
+// first: fn may remove the element it was given, whose slot is then
+// filled from the already visited tail.
+static int l_set_each(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    sparse_set_field_t fields[EACH_MAX_FIELDS];
+    int count = 0;
+    int top = lua_gettop(L);
+    for (int arg = 3; arg <= top; count++) {
+        if (count == EACH_MAX_FIELDS) {
+            return luaL_error(L, "each takes at most %d fields", EACH_MAX_FIELDS);
         }
-        case TYPE_BOOL: {
-            uint8_t val = *ptr;
-            lua_pushboolean(L, val != 0);
-            break;
+        arg = check_field(L, 1, set, arg, &fields[count], "each");
+    }
+    int values_idx = 0;
+    if (set->stride == 0) {
+        lua_getiuservalue(L, 1, SET_UV_VALUES);
+        values_idx = lua_gettop(L);
+    }
+    luaL_checkstack(L, count + 2, NULL);
+
+    uint32_t pos = set->size;
+    while (pos > 0) {
+        pos--;
+        if (pos >= set->size) continue;
+        lua_pushvalue(L, 2);
+        lua_pushinteger(L, (lua_Integer)set->dense[pos]);
+        int nargs = 1;
+        if (values_idx) {
+            lua_rawgeti(L, values_idx, pos + 1);
+            nargs++;
         }
-        default:
-            return luaL_error(L, "Unknown type %d", type);
+        for (int i = 0; i < count; i++) {
+            push_field(L, sparse_set_field_ptr(set, &fields[i], pos), fields[i].type);
+        }
+        lua_call(L, nargs + count, 0);
     }
-    return 1;
-}
-
-static int l_set_set_field(lua_State *L) {
-    sparse_set_t *set = get_set(L);
-    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
-    int offset = luaL_checkinteger(L, 3);
-    int type = luaL_checkinteger(L, 4);
+    return 0;
+}
 
-    if (set->stride == 0) {
-        return luaL_error(L, "set_field requires set created with stride > 0");
+// Fields resolved once by set:layout() and moved together by get_fields /
+// set_fields. `stride` and `column_count` record the shape of the set it
+// was made for; it applies to any set of the same shape.
+typedef struct {
+    uint32_t stride;
+    uint32_t column_count;
+    uint32_t count;
+    sparse_set_field_t fields[];
+} layout_t;
+
+// string.pack-style format for stride records: i / i4 int, f float,
+// d / n double, B byte, x one padding byte, spaces ignored. Like
+// string.pack's default there is no alignment padding.
+static int parse_layout_format(lua_State *L, const char *fmt, sparse_set_t *set, sparse_set_field_t *fields) {
+    int count = 0;
+    uint32_t offset = 0;
+    for (const char *p = fmt; *p; p++) {
+        int type;
+        switch (*p) {
+            case ' ': continue;
+            case 'x': offset++; continue;
+            case 'i':
+                if (p[1] == '4') p++;
+                type = TYPE_INT;
+                break;
+            case 'f': type = TYPE_FLOAT; break;
+            case 'd': case 'n': type = TYPE_DOUBLE; break;
+            case 'B': type = TYPE_BYTE; break;
+            default:
+                return luaL_error(L, "invalid format option '%c'", *p);
+        }
+        if (count == LAYOUT_MAX_FIELDS) {
+            return luaL_error(L, "layout takes at most %d fields", LAYOUT_MAX_FIELDS);
+        }
+        if (!sparse_set_field_at(set, offset, type, &fields[count])) {
+            return luaL_error(L, "format exceeds stride %d", (int)set->stride);
+        }
+        offset += fields[count++].size;
     }
+    return count;
+}
 
-    size_t type_size = field_type_size(type);
-    if (type_size == 0) {
-        return luaL_error(L, "Unknown type %d", type);
+// set:layout(format) / set:layout(offset, type, ...) / set:layout(field, ...)
+static int l_set_layout(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_field_t fields[LAYOUT_MAX_FIELDS];
+    int count = 0;
+    if (!set->columns && lua_gettop(L) == 2 && lua_type(L, 2) == LUA_TSTRING) {
+        if (set->stride == 0) return luaL_error(L, "layout requires set created with stride > 0");
+        count = parse_layout_format(L, lua_tostring(L, 2), set, fields);
+    } else {
+        int top = lua_gettop(L);
+        for (int arg = 2; arg <= top; count++) {
+            if (count == LAYOUT_MAX_FIELDS) {
+                return luaL_error(L, "layout takes at most %d fields", LAYOUT_MAX_FIELDS);
+            }
+            arg = check_field(L, 1, set, arg, &fields[count], "layout");
+        }
     }
+    if (count == 0) return luaL_error(L, "layout needs at least one field");
 
-    uint32_t index = sparse_set_index_of(set, id);
-    if (index == SPARSE_SET_INVALID_POS) {
-        lua_pushboolean(L, false);
+    layout_t *layout = (layout_t *)lua_newuserdatauv(L, sizeof(layout_t) + (size_t)count * sizeof(sparse_set_field_t), 0);
+    layout->stride = set->stride;
+    layout->column_count = set->column_count;
+    layout->count = (uint32_t)count;
+    memcpy(layout->fields, fields, (size_t)count * sizeof(sparse_set_field_t));
+    luaL_getmetatable(L, LAYOUT_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static const layout_t *check_layout(lua_State *L, const sparse_set_t *set, int arg) {
+    const layout_t *layout = (const layout_t *)luaL_checkudata(L, arg, LAYOUT_METATABLE);
+    bool fits = layout->stride == set->stride && layout->column_count == set->column_count;
+    for (uint32_t i = 0; fits && i < layout->count && set->columns; i++) {
+        const sparse_set_field_t *f = &layout->fields[i];
+        fits = set->columns[f->column].type == f->type;
+    }
+    if (!fits) luaL_argerror(L, arg, "layout was made for a set of another shape");
+    luaL_checkstack(L, (int)layout->count, NULL);
+    return layout;
+}
+
+static int push_fields(lua_State *L, const sparse_set_t *set, const layout_t *layout, uint32_t pos) {
+    if (pos == SPARSE_SET_INVALID_POS) {
+        lua_pushnil(L);
         return 1;
     }
-    
-    void *base = sparse_set_get_data(set, index);
-    if (!base) {
+    for (uint32_t i = 0; i < layout->count; i++) {
+        push_field(L, sparse_set_field_ptr(set, &layout->fields[i], pos), layout->fields[i].type);
+    }
+    return (int)layout->count;
+}
+
+static int write_fields(lua_State *L, sparse_set_t *set, const layout_t *layout, uint32_t pos, int arg) {
+    if (pos == SPARSE_SET_INVALID_POS) {
         lua_pushboolean(L, false);
         return 1;
     }
-    
-    if (offset < 0 || (size_t)offset + type_size > set->stride) {
-        return luaL_error(L, "Offset out of bounds");
-    }
-    
-    uint8_t *ptr = (uint8_t*)base + offset;
-    
-    switch (type) {
-        case TYPE_INT: {
-            int val = (int)luaL_checkinteger(L, 5);
-            memcpy(ptr, &val, sizeof(int));
-            break;
-        }
-        case TYPE_FLOAT: {
-            float val = (float)luaL_checknumber(L, 5);
-            memcpy(ptr, &val, sizeof(float));
-            break;
-        }
-        case TYPE_DOUBLE: {
-            double val = (double)luaL_checknumber(L, 5);
-            memcpy(ptr, &val, sizeof(double));
-            break;
-        }
-        case TYPE_BYTE: {
-            int val = luaL_checkinteger(L, 5);
-            *ptr = (uint8_t)val;
-            break;
-        }
-        case TYPE_BOOL: {
-            *ptr = lua_toboolean(L, 5) ? 1 : 0;
-            break;
+    // Check every value before writing any, so a bad argument leaves the
+    // row untouched.
+    for (uint32_t i = 0; i < layout->count; i++) {
+        switch (layout->fields[i].type) {
+            case TYPE_INT:
+            case TYPE_BYTE:
+                luaL_checkinteger(L, arg + (int)i);
+                break;
+            case TYPE_FLOAT:
+            case TYPE_DOUBLE:
+                luaL_checknumber(L, arg + (int)i);
+                break;
         }
-        default:
-            return luaL_error(L, "Unknown type %d", type);
+    }
+    for (uint32_t i = 0; i < layout->count; i++) {
+        const sparse_set_field_t *f = &layout->fields[i];
+        write_field(L, sparse_set_field_ptr(set, f, pos), f->type, arg + (int)i);
+        sparse_set_mark_field(set, f, pos, 1);
     }
     lua_pushboolean(L, true);
     return 1;
 }
+
+static uint32_t check_index(lua_State *L, const sparse_set_t *set, int arg) {
+    lua_Integer index = luaL_checkinteger(L, arg);
+    if (index < 1 || index > (lua_Integer)set->size) return SPARSE_SET_INVALID_POS;
+    return (uint32_t)(index - 1);
+}
+
+static int l_set_get_fields(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
+    const layout_t *layout = check_layout(L, set, 3);
+    return push_fields(L, set, layout, sparse_set_index_of(set, id));
+}
+
+static int l_set_set_fields(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
+    const layout_t *layout = check_layout(L, set, 3);
+    return write_fields(L, set, layout, sparse_set_index_of(set, id), 4);
+}
+
+static int l_set_get_fields_at(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    uint32_t pos = check_index(L, set, 2);
+    const layout_t *layout = check_layout(L, set, 3);
+    return push_fields(L, set, layout, pos);
+}
+
+static int l_set_set_fields_at(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    uint32_t pos = check_index(L, set, 2);
+    const layout_t *layout = check_layout(L, set, 3);
+    return write_fields(L, set, layout, pos, 4);
+}
+
+static int l_layout_size(lua_State *L) {
+    const layout_t *layout = (const layout_t *)luaL_checkudata(L, 1, LAYOUT_METATABLE);
+    lua_pushinteger(L, layout->count);
+    return 1;
+}
+
+static int set_field_apply(lua_State *L, int op, const char *fname) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_field_t field;
+    int arg = check_field(L, 1, set, 2, &field, fname);
+    double a = luaL_checknumber(L, arg);
+    double b = 0;
+    if (op == SPARSE_SET_OP_FMA || op == SPARSE_SET_OP_CLAMP) {
+        b = luaL_checknumber(L, arg + 1);
+    }
+
+    uint32_t count = sparse_set_field_apply(set, &field, op, a, b);
+    if (count == SPARSE_SET_INVALID_POS) {
+        return luaL_error(L, "%s does not support bool fields", fname);
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+static int l_set_field_add(lua_State *L) {
+    return set_field_apply(L, SPARSE_SET_OP_ADD, "field_add");
+}
+
+static int l_set_field_mul(lua_State *L) {
+    return set_field_apply(L, SPARSE_SET_OP_MUL, "field_mul");
+}
+
+static int l_set_field_fma(lua_State *L) {
+    return set_field_apply(L, SPARSE_SET_OP_FMA, "field_fma");
+}
+
+static int l_set_field_min(lua_State *L) {
+    return set_field_apply(L, SPARSE_SET_OP_MIN, "field_min");
+}
+
+static int l_set_field_max(lua_State *L) {
+    return set_field_apply(L, SPARSE_SET_OP_MAX, "field_max");
+}
+
+static int l_set_field_clamp(lua_State *L) {
+    return set_field_apply(L, SPARSE_SET_OP_CLAMP, "field_clamp");
+}
+
+// set:field_axpy(dst_field, src_set, src_field, k) / set:field_copy(dst_field, src_set, src_field)
+static int set_field_combine(lua_State *L, bool copy, const char *fname) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_field_t dst, src;
+    int src_idx = check_field(L, 1, set, 2, &dst, fname);
+    sparse_set_t *src_set = (sparse_set_t *)luaL_checkudata(L, src_idx, SET_METATABLE);
+    int arg = check_field(L, src_idx, src_set, src_idx + 1, &src, fname);
+
+    uint32_t count;
+    if (copy) {
+        count = sparse_set_field_copy(set, &dst, src_set, &src);
+    } else {
+        count = sparse_set_field_axpy(set, &dst, src_set, &src, luaL_checknumber(L, arg));
+    }
+    if (count == SPARSE_SET_INVALID_POS) {
+        return luaL_error(L, "%s does not support bool fields", fname);
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+static int l_set_field_axpy(lua_State *L) {
+    return set_field_combine(L, false, "field_axpy");
+}
+
+static int l_set_field_copy(lua_State *L) {
+    return set_field_combine(L, true, "field_copy");
+}
+
+static int l_set_field(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    const char *name = luaL_checkstring(L, 2);
+    if (!set->columns) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_getiuservalue(L, 1, SET_UV_FIELDS);
+    lua_getfield(L, -1, name);
+    return 1;
+}
+
 
+static void push_value_at(lua_State *L, sparse_set_t *set, uint32_t pos, int values_idx) {
+    if (set->stride > 0) {
+        push_record(L, set, pos);
+    } else {
+        lua_rawgeti(L, values_idx, pos + 1);
+    }
+}
+
+// Reorders the Lua value table at values_idx in place so it follows a
+// permutation already applied to the set.
+static void permute_values(lua_State *L, const uint32_t *order, uint32_t count, int values_idx) {
+    lua_createtable(L, (int)count, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        lua_rawgeti(L, values_idx, order[i] + 1);
+        lua_rawseti(L, -2, i + 1);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        lua_rawseti(L, values_idx, i + 1);
+    }
+    lua_pop(L, 1);
+}
+
+static int finish_sort(lua_State *L, sparse_set_t *set, bool ok, const uint32_t *order) {
+    if (!ok) {
+        lua_pushnil(L);
+        lua_pushstring(L, "oom");
+        return 2;
+    }
+    if (set->stride == 0 && set->size > 1) {
+        lua_getiuservalue(L, 1, SET_UV_VALUES);
+        permute_values(L, order, set->size, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+typedef struct {
+    lua_State *L;
+    int cmp_idx;
+    int values_idx;
+    uint32_t size;
+    const sparse_set_group_t *group;
+    uint32_t split;
+} sort_cmp_t;
+
+static bool sort_lua_less(void *ud, const sparse_set_t *set, uint32_t a, uint32_t b) {
+    sort_cmp_t *cmp = (sort_cmp_t *)ud;
+    lua_State *L = cmp->L;
+    lua_pushvalue(L, cmp->cmp_idx);
+    lua_pushinteger(L, set->dense[a]);
+    lua_pushinteger(L, set->dense[b]);
+    push_value_at(L, (sparse_set_t *)set, a, cmp->values_idx);
+    push_value_at(L, (sparse_set_t *)set, b, cmp->values_idx);
+    lua_call(L, 4, 1);
+    // Positions and buffers were sized before the sort, so a comparator
+    // that changed the set (or its group) cannot be allowed to go on.
+    if (set->size != cmp->size || set->group != cmp->group ||
+        (set->group && set->group->size != cmp->split)) {
+        luaL_error(L, "set modified during sort");
+    }
+    bool less = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return less;
+}
+
+// set:sort([cmp]): by entity index, or by cmp(id_a, id_b, value_a, value_b)
+// returning true when a goes first.
+static int l_set_sort(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    bool by_id = lua_isnoneornil(L, 2);
+    if (!by_id) luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    uint32_t *order = new_pos_buffer(L, set->size);
+    if (by_id) {
+        return finish_sort(L, set, sparse_set_sort_by_id(set, order), order);
+    }
+
+    // The comparator may raise: the order is computed in GC-owned buffers
+    // and nothing is touched until it completes.
+    uint32_t *scratch = new_pos_buffer(L, set->size);
+    lua_getiuservalue(L, 1, SET_UV_VALUES);
+    sort_cmp_t cmp = { L, 2, lua_gettop(L), set->size, set->group, set->group ? set->group->size : 0 };
+    sparse_set_sort_order(set, sort_lua_less, &cmp, order, scratch);
+    return finish_sort(L, set, sparse_set_permute(set, order), order);
+}
+
+static int l_set_sort_by_field(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    sparse_set_field_t field;
+    int next = check_field(L, 1, set, 2, &field, "sort_by_field");
+    bool descending = lua_toboolean(L, next);
+    uint32_t *order = new_pos_buffer(L, set->size);
+    return finish_sort(L, set, sparse_set_sort_by_field(set, &field, descending, order), order);
+}
+
+static int l_set_sort_like(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    const sparse_set_t *other = lsparseset_checkset(L, 2);
+    uint32_t *order = new_pos_buffer(L, set->size);
+    return finish_sort(L, set, sparse_set_sort_like(set, other, order), order);
+}
+
+static int check_set_list(lua_State *L, int arg, const sparse_set_t **out, const char *what) {
+    if (lua_isnoneornil(L, arg)) return 0;
+    luaL_checktype(L, arg, LUA_TTABLE);
+    int n = (int)lua_rawlen(L, arg);
+    if (n > SPARSE_SET_QUERY_MAX_SETS) {
+        return luaL_error(L, "too many %s sets (max %d)", what, SPARSE_SET_QUERY_MAX_SETS);
+    }
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, arg, i + 1);
+        const sparse_set_t *set = (const sparse_set_t *)luaL_testudata(L, -1, SET_METATABLE);
+        if (!set) {
+            return luaL_error(L, "%s[%d] is not a set", what, i + 1);
+        }
+        out[i] = set;
+        lua_pop(L, 1);
+    }
+    return n;
+}
+
+static int l_query_create(lua_State *L) {
+    const sparse_set_t *include[SPARSE_SET_QUERY_MAX_SETS];
+    const sparse_set_t *exclude[SPARSE_SET_QUERY_MAX_SETS];
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int include_count = check_set_list(L, 1, include, "include");
+    int exclude_count = check_set_list(L, 2, exclude, "exclude");
+    if (include_count == 0) {
+        return luaL_error(L, "new_query requires at least one included set");
+    }
+
+    sparse_set_query_t *query = (sparse_set_query_t *)lua_newuserdatauv(L, sizeof(sparse_set_query_t), 1);
+    if (!sparse_set_query_init(query, include, include_count, exclude, exclude_count)) {
+        return luaL_error(L, "Failed to create query");
+    }
+
+    // Keep the sets alive as long as the query, included sets first.
+    lua_createtable(L, include_count + exclude_count, 0);
+    for (int i = 0; i < include_count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        lua_rawseti(L, -2, i + 1);
+    }
+    for (int i = 0; i < exclude_count; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        lua_rawseti(L, -2, include_count + i + 1);
+    }
+    lua_setiuservalue(L, -2, 1);
+
+    luaL_getmetatable(L, QUERY_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int _query_iter(lua_State *L) {
+    sparse_set_query_t *query = (sparse_set_query_t *)lua_touserdata(L, lua_upvalueindex(1));
+    sparse_set_query_iter_t iter = {
+        .query = query,
+        .driver = (uint32_t)lua_tointeger(L, lua_upvalueindex(2)),
+        .current_pos = (uint32_t)lua_tointeger(L, lua_upvalueindex(3))
+    };
+    uint32_t pos[SPARSE_SET_QUERY_MAX_SETS];
+    sparse_set_id_t id;
+
+    if (!sparse_set_query_iter_next(&iter, &id, pos)) return 0;
+    lua_pushinteger(L, iter.current_pos);
+    lua_replace(L, lua_upvalueindex(3));
+
+    lua_pushinteger(L, id);
+    for (uint32_t i = 0; i < query->include_count; i++) {
+        push_value_at(L, (sparse_set_t *)query->include[i], pos[i], lua_upvalueindex(4 + i));
+    }
+    return 1 + query->include_count;
+}
+
+static int l_query_iter(lua_State *L) {
+    sparse_set_query_t *query = (sparse_set_query_t *)luaL_checkudata(L, 1, QUERY_METATABLE);
+    sparse_set_query_iter_t iter = sparse_set_query_iter(query);
+    luaL_checkstack(L, 4 + query->include_count, "too many sets in query");
+
+    // Upvalues: query, driver, cursor, then each included set's value table.
+    lua_settop(L, 1);
+    lua_pushinteger(L, iter.driver);
+    lua_pushinteger(L, 0);
+    lua_getiuservalue(L, 1, 1);
+    for (uint32_t i = 0; i < query->include_count; i++) {
+        lua_rawgeti(L, 4, i + 1);
+        lua_getiuservalue(L, -1, 1);
+        lua_remove(L, -2);
+    }
+    lua_remove(L, 4);
+    lua_pushcclosure(L, _query_iter, 3 + query->include_count);
+    return 1;
+}
+
+static int l_query_count(lua_State *L) {
+    sparse_set_query_t *query = (sparse_set_query_t *)luaL_checkudata(L, 1, QUERY_METATABLE);
+    lua_pushinteger(L, sparse_set_query_count(query));
+    return 1;
+}
+
+static int l_group_create(lua_State *L) {
+    sparse_set_t *sets[SPARSE_SET_GROUP_MAX_SETS];
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int n = (int)lua_rawlen(L, 1);
+    if (n < 2 || n > SPARSE_SET_GROUP_MAX_SETS) {
+        return luaL_error(L, "new_group requires 2 to %d sets", SPARSE_SET_GROUP_MAX_SETS);
+    }
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        sparse_set_t *set = (sparse_set_t *)luaL_testudata(L, -1, SET_METATABLE);
+        if (!set) {
+            return luaL_error(L, "sets[%d] is not a set", i + 1);
+        }
+        // Lua values are mirrored by position in a table the core cannot
+        // reorder, so only binary sets can be grouped.
+        if (set->stride == 0) {
+            return luaL_error(L, "sets[%d] requires set created with stride > 0", i + 1);
+        }
+        if (set->group) {
+            return luaL_error(L, "sets[%d] is already owned by a group", i + 1);
+        }
+        sets[i] = set;
+        lua_pop(L, 1);
+    }
+
+    sparse_set_group_t *group = (sparse_set_group_t *)lua_newuserdatauv(L, sizeof(sparse_set_group_t), 1);
+    if (!sparse_set_group_init(group, sets, (uint32_t)n)) {
+        return luaL_error(L, "Failed to create group");
+    }
+
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setiuservalue(L, -2, 1);
+
+    luaL_getmetatable(L, GROUP_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int l_group_size(lua_State *L) {
+    sparse_set_group_t *group = (sparse_set_group_t *)luaL_checkudata(L, 1, GROUP_METATABLE);
+    lua_pushinteger(L, sparse_set_group_size(group));
+    return 1;
+}
+
+static int l_group_contains(lua_State *L) {
+    sparse_set_group_t *group = (sparse_set_group_t *)luaL_checkudata(L, 1, GROUP_METATABLE);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
+    lua_pushboolean(L, sparse_set_group_contains(group, id));
+    return 1;
+}
+
+static int _group_iter(lua_State *L) {
+    sparse_set_group_t *group = (sparse_set_group_t *)lua_touserdata(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    if (i < 0 || (uint64_t)i >= group->size || group->set_count == 0) return 0;
+    lua_pushinteger(L, i + 1);
+    lua_pushinteger(L, group->sets[0]->dense[i]);
+    return 2;
+}
+
+// Yields index, id; the index is the same position in every owned set.
+static int l_group_iter(lua_State *L) {
+    luaL_checkudata(L, 1, GROUP_METATABLE);
+    lua_pushcfunction(L, _group_iter);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+static int l_group_gc(lua_State *L) {
+    sparse_set_group_t *group = (sparse_set_group_t *)lua_touserdata(L, 1);
+    sparse_set_group_deinit(group);
+    return 0;
+}
+
+static sparse_set_shared_t *check_shared(lua_State *L) {
+    return (sparse_set_shared_t *)luaL_checkudata(L, 1, SHARED_METATABLE);
+}
+
+static int l_shared_create(lua_State *L) {
+    sparse_set_shared_t *shared = (sparse_set_shared_t *)lua_newuserdatauv(L, sizeof(sparse_set_shared_t), 0);
+    sparse_set_shared_init(shared, get_allocator(L));
+    luaL_getmetatable(L, SHARED_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// Each attached set keeps the index alive through its uservalue; the index
+// only holds plain pointers back, cleared when a set is detached or freed.
+static int l_shared_attach(lua_State *L) {
+    sparse_set_shared_t *shared = check_shared(L);
+    int n = lua_gettop(L);
+    for (int i = 2; i <= n; i++) {
+        sparse_set_t *set = (sparse_set_t *)luaL_checkudata(L, i, SET_METATABLE);
+        if (set->shared == shared) continue;
+        if (set->shared) {
+            return luaL_error(L, "set #%d already uses another shared index", i - 1);
+        }
+        if (!sparse_set_shared_attach(shared, set)) {
+            if (shared->used == ~0ull) {
+                return luaL_error(L, "shared index holds at most %d sets", SPARSE_SET_SHARED_MAX_SETS);
+            }
+            return luaL_error(L, "Failed to attach set #%d", i - 1);
+        }
+        lua_pushvalue(L, 1);
+        lua_setiuservalue(L, i, SET_UV_SHARED);
+    }
+    return 0;
+}
+
+static int l_shared_detach(lua_State *L) {
+    sparse_set_shared_t *shared = check_shared(L);
+    int n = lua_gettop(L);
+    for (int i = 2; i <= n; i++) {
+        sparse_set_t *set = (sparse_set_t *)luaL_checkudata(L, i, SET_METATABLE);
+        if (set->shared != shared) continue;
+        if (!sparse_set_shared_detach(set)) {
+            return luaL_error(L, "Failed to rebuild index of set #%d", i - 1);
+        }
+        lua_pushnil(L);
+        lua_setiuservalue(L, i, SET_UV_SHARED);
+    }
+    return 0;
+}
+
+// index:contains(id, set, ...) -> true if every listed set holds id.
+static int l_shared_contains(lua_State *L) {
+    sparse_set_shared_t *shared = check_shared(L);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 2);
+    int n = lua_gettop(L);
+    uint64_t mask = 0;
+    for (int i = 3; i <= n; i++) {
+        sparse_set_t *set = (sparse_set_t *)luaL_checkudata(L, i, SET_METATABLE);
+        if (set->shared != shared) {
+            return luaL_error(L, "set #%d is not attached to this index", i - 2);
+        }
+        mask |= 1ull << set->shared_bit;
+    }
+    lua_pushboolean(L, mask != 0 && sparse_set_shared_contains(shared, id, mask));
+    return 1;
+}
+
+static int l_shared_count(lua_State *L) {
+    sparse_set_shared_t *shared = check_shared(L);
+    lua_pushinteger(L, SPARSE_SET_POPCOUNT64(shared->used));
+    return 1;
+}
+
+static int l_shared_pages(lua_State *L) {
+    sparse_set_shared_t *shared = check_shared(L);
+    lua_pushinteger(L, shared->page_count);
+    return 1;
+}
+
+static int l_shared_shrink_to_fit(lua_State *L) {
+    sparse_set_shared_shrink_to_fit(check_shared(L));
+    return 0;
+}
+
+static int l_shared_gc(lua_State *L) {
+    sparse_set_shared_t *shared = (sparse_set_shared_t *)lua_touserdata(L, 1);
+    sparse_set_shared_deinit(shared);
+    return 0;
+}
+
+static sparse_set_commands_t *check_commands(lua_State *L) {
+    return (sparse_set_commands_t *)luaL_checkudata(L, 1, COMMANDS_METATABLE);
+}
+
+// The buffer's uservalue keeps every target referenced by a pending command
+// alive until the next flush or clear.
+static void commands_keep(lua_State *L, int target_idx) {
+    lua_getiuservalue(L, 1, 1);
+    lua_pushvalue(L, target_idx);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+static void commands_release(lua_State *L) {
+    lua_newtable(L);
+    lua_setiuservalue(L, 1, 1);
+}
+
+// Removals and field writes on Lua value sets would have to mirror the
+// value table, which the core cannot do, so only binary sets are accepted.
+static sparse_set_t *check_command_set(lua_State *L, int arg) {
+    sparse_set_t *set = lsparseset_checkset(L, arg);
+    if (set->stride == 0) {
+        luaL_error(L, "command buffer requires set created with stride > 0");
+    }
+    return set;
+}
+
+static int commands_result(lua_State *L, bool ok) {
+    if (!ok) {
+        lua_pushnil(L);
+        lua_pushstring(L, "oom");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int l_pool_gc(lua_State *L) {
+    bool *held = (bool *)lua_touserdata(L, 1);
+    if (*held) sparse_set_parallel_release();
+    *held = false;
+    return 0;
+}
+
+// Takes or drops this state's hold on the pool. The hold is only taken
+// once the finalizer that drops it is in place.
+static void hold_pool(lua_State *L, bool hold) {
+    lua_getfield(L, LUA_REGISTRYINDEX, POOL_KEY);
+    bool *held = (bool *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!held) {
+        if (!hold) return;
+        held = (bool *)lua_newuserdatauv(L, sizeof(bool), 0);
+        *held = false;
+        if (luaL_newmetatable(L, POOL_METATABLE)) {
+            lua_pushcfunction(L, l_pool_gc);
+            lua_setfield(L, -2, "__gc");
+        }
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, POOL_KEY);
+    }
+    if (hold && !*held) sparse_set_parallel_retain();
+    if (!hold && *held) sparse_set_parallel_release();
+    *held = hold;
+}
+
+static int l_set_threads(lua_State *L) {
+    lua_Integer threads = luaL_checkinteger(L, 1);
+    if (threads < 1 || threads > SPARSE_SET_PARALLEL_MAX_THREADS) {
+        return luaL_error(L, "threads must be in 1..%d", SPARSE_SET_PARALLEL_MAX_THREADS);
+    }
+    hold_pool(L, threads > 1);
+    if (!sparse_set_parallel_set_threads((uint32_t)threads)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "failed to start worker threads");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int l_get_threads(lua_State *L) {
+    lua_pushinteger(L, sparse_set_parallel_threads());
+    return 1;
+}
+
+static int l_commands_create(lua_State *L) {
+    sparse_set_commands_t *cmds = (sparse_set_commands_t *)lua_newuserdatauv(L, sizeof(sparse_set_commands_t), 1);
+    if (!sparse_set_commands_init(cmds, get_allocator(L))) return luaL_error(L, "Failed to create command buffer");
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, 1);
+    luaL_getmetatable(L, COMMANDS_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int l_commands_insert(lua_State *L) {
+    sparse_set_commands_t *cmds = check_commands(L);
+    sparse_set_t *set = check_command_set(L, 2);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 3);
+    const char *row = NULL;
+    if (!lua_isnoneornil(L, 4)) {
+        size_t len;
+        row = luaL_checklstring(L, 4, &len);
+        if (len != set->stride) {
+            return luaL_error(L, "Data size mismatch, expected %d got %d", set->stride, (int)len);
+        }
+    }
+    commands_keep(L, 2);
+    return commands_result(L, sparse_set_commands_insert(cmds, set, id, row));
+}
+
+static int l_commands_remove(lua_State *L) {
+    sparse_set_commands_t *cmds = check_commands(L);
+    sparse_set_t *set = check_command_set(L, 2);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 3);
+    commands_keep(L, 2);
+    return commands_result(L, sparse_set_commands_remove(cmds, set, id));
+}
+
+static int l_commands_set_field(lua_State *L) {
+    sparse_set_commands_t *cmds = check_commands(L);
+    sparse_set_t *set = lsparseset_checkset(L, 2);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 3);
+    sparse_set_field_t field;
+    int value_arg = check_field(L, 2, set, 4, &field, "set_field");
+    uint8_t value[8];
+    write_field(L, value, field.type, value_arg);
+    commands_keep(L, 2);
+    return commands_result(L, sparse_set_commands_write(cmds, set, id, &field, value));
+}
+
+static int l_commands_destroy(lua_State *L) {
+    sparse_set_commands_t *cmds = check_commands(L);
+    registry_t *reg = lsparseset_checkregistry(L, 2);
+    sparse_set_id_t id = (sparse_set_id_t)luaL_checkinteger(L, 3);
+    commands_keep(L, 2);
+    return commands_result(L, sparse_set_commands_destroy(cmds, reg, id));
+}
+
+// Destroys also remove the id from the registry's attached sets, after the
+// core has applied every command (which is when destroys run anyway).
+static int l_commands_flush(lua_State *L) {
+    sparse_set_commands_t *cmds = check_commands(L);
+    uint32_t destroy_count = 0;
+    for (uint32_t i = 0; i < cmds->count; i++) {
+        if (cmds->commands[i].op == SPARSE_SET_CMD_DESTROY) destroy_count++;
+    }
+    sparse_set_command_t *destroys = NULL;
+    if (destroy_count > 0) {
+        destroys = (sparse_set_command_t *)lua_newuserdatauv(L, destroy_count * sizeof(sparse_set_command_t), 0);
+        destroy_count = 0;
+        for (uint32_t i = 0; i < cmds->count; i++) {
+            if (cmds->commands[i].op == SPARSE_SET_CMD_DESTROY) destroys[destroy_count++] = cmds->commands[i];
+        }
+    }
+
+    uint32_t applied = sparse_set_commands_flush(cmds);
+
+    if (destroy_count > 0) {
+        sparse_set_id_t *ids = (sparse_set_id_t *)lua_newuserdatauv(L, destroy_count * sizeof(sparse_set_id_t), 0);
+        lua_getiuservalue(L, 1, 1);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            lua_pop(L, 1);
+            registry_t *reg = lsparseset_toregistry(L, -1);
+            if (!reg) continue;
+            uint32_t n = 0;
+            for (uint32_t i = 0; i < destroy_count; i++) {
+                if (destroys[i].target == reg) ids[n++] = destroys[i].id;
+            }
+            registry_remove_attached(L, lua_gettop(L), ids, n);
+        }
+    }
+    commands_release(L);
+    lua_pushinteger(L, applied);
+    return 1;
+}
+
+static int l_commands_size(lua_State *L) {
+    sparse_set_commands_t *cmds = check_commands(L);
+    lua_pushinteger(L, cmds->count);
+    return 1;
+}
+
+static int l_commands_clear(lua_State *L) {
+    sparse_set_commands_t *cmds = check_commands(L);
+    sparse_set_commands_clear(cmds);
+    commands_release(L);
+    return 0;
+}
+
+static int l_commands_gc(lua_State *L) {
+    sparse_set_commands_t *cmds = (sparse_set_commands_t *)lua_touserdata(L, 1);
+    sparse_set_commands_deinit(cmds);
+    return 0;
+}
+
+// Snapshots are produced into a GC-owned buffer, then returned as a string
+// or written to the file named at path_idx (when given).
+static int push_snapshot(lua_State *L, int path_idx, const char *buf, size_t size) {
+    if (lua_isnoneornil(L, path_idx)) {
+        lua_pushlstring(L, buf, size);
+        return 1;
+    }
+    const char *path = luaL_checkstring(L, path_idx);
+    FILE *f = fopen(path, "wb");
+    if (!f) return luaL_fileresult(L, 0, path);
+    bool ok = fwrite(buf, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+    if (!ok) return luaL_fileresult(L, 0, path);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Reads a whole file into a GC-owned buffer left on the stack. Returns NULL
+// with errno set on failure. The buffer is allocated before the file is
+// opened, so a memory error cannot leak the FILE*.
+static const char *read_snapshot_file(lua_State *L, const char *path, size_t *len) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+    if (st.st_size < 0 || (uint64_t)st.st_size >= SIZE_MAX) {
+        errno = EFBIG;
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    char *buf = (char *)lua_newuserdatauv(L, size + 1, 0);
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    errno = 0;
+    size_t got = fread(buf, 1, size, f);
+    int err = errno;
+    fclose(f);
+    if (got != size) {
+        errno = err ? err : EIO;
+        return NULL;
+    }
+    *len = got;
+    return buf;
+}
+
+static int finish_restore(lua_State *L, bool ok) {
+    if (!ok) {
+        lua_pushnil(L);
+        lua_pushstring(L, "invalid snapshot");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static sparse_set_t *check_snapshot_set(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    // Lua values cannot be serialized; only binary sets have snapshots.
+    if (set->stride == 0) {
+        luaL_error(L, "snapshot requires set created with stride > 0");
+    }
+    return set;
+}
+
+static int l_set_snapshot(lua_State *L) {
+    sparse_set_t *set = check_snapshot_set(L);
+    lua_settop(L, 2);
+    size_t size = sparse_set_snapshot_size(set);
+    char *buf = (char *)lua_newuserdatauv(L, size, 0);
+    sparse_set_snapshot_write(set, buf, size);
+    return push_snapshot(L, 2, buf, size);
+}
+
+static int l_set_restore(lua_State *L) {
+    sparse_set_t *set = check_snapshot_set(L);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    return finish_restore(L, sparse_set_snapshot_read(set, data, len));
+}
+
+static int l_set_restore_file(lua_State *L) {
+    sparse_set_t *set = check_snapshot_set(L);
+    const char *path = luaL_checkstring(L, 2);
+    size_t len;
+    const char *data = read_snapshot_file(L, path, &len);
+    if (!data) return luaL_fileresult(L, 0, path);
+    return finish_restore(L, sparse_set_snapshot_read(set, data, len));
+}
+
+static int l_reg_snapshot(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    lua_settop(L, 2);
+    size_t size = registry_snapshot_size(reg);
+    char *buf = (char *)lua_newuserdatauv(L, size, 0);
+    registry_snapshot_write(reg, buf, size);
+    return push_snapshot(L, 2, buf, size);
+}
+
+static int l_reg_restore(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    return finish_restore(L, registry_snapshot_read(reg, data, len));
+}
+
+static int l_reg_restore_file(lua_State *L) {
+    registry_t *reg = get_reg(L);
+    const char *path = luaL_checkstring(L, 2);
+    size_t len;
+    const char *data = read_snapshot_file(L, path, &len);
+    if (!data) return luaL_fileresult(L, 0, path);
+    return finish_restore(L, registry_snapshot_read(reg, data, len));
+}
+
+static int l_set_track_changes(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    bool enabled = lua_isnone(L, 2) || lua_toboolean(L, 2);
+    if (!sparse_set_track_changes(set, enabled)) {
+        return luaL_error(L, "oom");
+    }
+    return 0;
+}
+
+static int l_set_change_count(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    lua_pushinteger(L, sparse_set_change_count(set));
+    return 1;
+}
+
+// Pushes ids as a Lua array, or as one string of packed native ids.
+static void push_id_list(lua_State *L, const sparse_set_id_t *ids, uint32_t count, bool packed) {
+    if (packed) {
+        lua_pushlstring(L, (const char *)ids, (size_t)count * sizeof(sparse_set_id_t));
+        return;
+    }
+    lua_createtable(L, (int)count, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        lua_pushinteger(L, (lua_Integer)ids[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+// Returns added, modified, removed id lists plus a flat {lo1, hi1, lo2, ...}
+// array of the modified byte ranges. An index recycled since the last drain
+// shows up in both added (new id) and removed (old id).
+static int l_set_drain_changes(lua_State *L) {
+    sparse_set_t *set = get_set(L);
+    bool packed = lua_toboolean(L, 2);
+    uint32_t count = sparse_set_change_count(set);
+
+    sparse_set_change_t *changes = (sparse_set_change_t *)lua_newuserdatauv(L, (size_t)count * sizeof(sparse_set_change_t) + 1, 0);
+    sparse_set_id_t *ids = (sparse_set_id_t *)lua_newuserdatauv(L, (size_t)count * 4 * sizeof(sparse_set_id_t) + 1, 0);
+    sparse_set_id_t *added = ids + count;
+    sparse_set_id_t *modified = added + count;
+    sparse_set_id_t *removed = modified + count;
+    uint32_t n_added = 0, n_modified = 0, n_removed = 0;
+
+    count = sparse_set_drain_changes(set, ids, changes, count);
+    lua_createtable(L, 0, 0);
+    int ranges_idx = lua_gettop(L);
+    for (uint32_t i = 0; i < count; i++) {
+        const sparse_set_change_t *change = &changes[i];
+        if (change->kind & SPARSE_SET_CHANGE_ADDED) added[n_added++] = ids[i];
+        if (change->kind & SPARSE_SET_CHANGE_REMOVED) {
+            removed[n_removed++] = ID_MAKE(ID_INDEX(ids[i]), change->removed_version);
+        }
+        if (change->kind & SPARSE_SET_CHANGE_MODIFIED) {
+            modified[n_modified++] = ids[i];
+            lua_pushinteger(L, change->lo);
+            lua_rawseti(L, ranges_idx, (lua_Integer)n_modified * 2 - 1);
+            lua_pushinteger(L, change->hi);
+            lua_rawseti(L, ranges_idx, (lua_Integer)n_modified * 2);
+        }
+    }
+
+    push_id_list(L, added, n_added, packed);
+    push_id_list(L, modified, n_modified, packed);
+    push_id_list(L, removed, n_removed, packed);
+    lua_pushvalue(L, ranges_idx);
+    return 4;
+}
+
 static const struct luaL_Reg reg_methods[] = {
     {"create", l_reg_create_id},
-    {"destroy", l_reg_destroy_id},
-    {"valid", l_reg_valid},
+    {"destroy", l_reg_destroy_id},
+    {"destroy_many", l_reg_destroy_many},
+    {"create_many", l_reg_create_many},
+    {"attach", l_reg_attach},
+    {"detach", l_reg_detach},
+    {"valid", l_reg_valid},
+    {"stats", l_reg_stats},
+    {"shrink_to_fit", l_reg_shrink_to_fit},
+    {"auto_shrink", l_reg_auto_shrink},
+    {"snapshot", l_reg_snapshot},
+    {"restore", l_reg_restore},
+    {"restore_file", l_reg_restore_file},
     {NULL, NULL}
 };
 
@@ -462,17 +2199,215 @@ static const struct luaL_Reg set_methods[] = {
     {"index_of", l_set_index_of},
     {"swap", l_set_swap},
     {"insert", l_set_insert},
-    {"remove", l_set_remove},
+    {"remove", l_set_remove},
+    {"insert_many", l_set_insert_many},
+    {"remove_many", l_set_remove_many},
+    {"contains_many", l_set_contains_many},
+    {"get_many", l_set_get_many},
     {"contains", l_set_contains},
     {"get", l_set_get},
-    {"size", l_set_size},
+    {"size", l_set_size},
+    {"capacity", l_set_capacity},
+    {"reserve", l_set_reserve},
+    {"stats", l_set_stats},
+    {"shrink_to_fit", l_set_shrink_to_fit},
+    {"auto_shrink", l_set_auto_shrink},
+    {"adaptive", l_set_adaptive},
+    {"sync", l_set_sync},
     {"iter", l_set_iter},
+    {"iter_pos", l_set_iter_pos},
+    {"each", l_set_each},
     {"get_field", l_set_get_field},
-    {"set_field", l_set_set_field},
-    {NULL, NULL}
-};
-
-int luaopen_sparseset(lua_State *L) {
+    {"set_field", l_set_set_field},
+    {"get_field_at", l_set_get_field_at},
+    {"set_field_at", l_set_set_field_at},
+    {"layout", l_set_layout},
+    {"get_fields", l_set_get_fields},
+    {"set_fields", l_set_set_fields},
+    {"get_fields_at", l_set_get_fields_at},
+    {"set_fields_at", l_set_set_fields_at},
+    {"accessor", l_set_accessor},
+    {"field", l_set_field},
+    {"field_add", l_set_field_add},
+    {"field_mul", l_set_field_mul},
+    {"field_fma", l_set_field_fma},
+    {"field_min", l_set_field_min},
+    {"field_max", l_set_field_max},
+    {"field_clamp", l_set_field_clamp},
+    {"field_axpy", l_set_field_axpy},
+    {"field_copy", l_set_field_copy},
+    {"sort", l_set_sort},
+    {"sort_by_field", l_set_sort_by_field},
+    {"sort_like", l_set_sort_like},
+    {"snapshot", l_set_snapshot},
+    {"restore", l_set_restore},
+    {"restore_file", l_set_restore_file},
+    {"track_changes", l_set_track_changes},
+    {"change_count", l_set_change_count},
+    {"drain_changes", l_set_drain_changes},
+    {NULL, NULL}
+};
+
+static uint32_t capi_insert(sparse_set_t *set, sparse_set_id_t id) {
+    if (set->stride == 0) return SPARSE_SET_INVALID_POS;
+    uint32_t pos = sparse_set_index_of(set, id);
+    if (pos != SPARSE_SET_INVALID_POS) return pos;
+    return sparse_set_insert(set, id);
+}
+
+static bool capi_remove(sparse_set_t *set, sparse_set_id_t id) {
+    if (set->stride == 0) return false;
+    return sparse_set_remove(set, id);
+}
+
+static const sparse_set_capi_t capi = {
+    .version = SPARSE_SET_API_VERSION,
+    .contains = sparse_set_contains,
+    .index_of = sparse_set_index_of,
+    .size = sparse_set_size,
+    .get_id = sparse_set_get_id,
+    .get_data = sparse_set_get_data,
+    .get_column = sparse_set_get_column,
+    .dense = sparse_set_dense,
+    .data = sparse_set_data,
+    .column_data = sparse_set_column_data,
+    .iter = sparse_set_iter,
+    .iter_next = sparse_set_iter_next,
+    .insert = capi_insert,
+    .remove = capi_remove,
+    .registry_create_id = registry_create_id,
+    .registry_recycle = registry_recycle,
+    .registry_valid = registry_valid,
+};
+
+static const struct luaL_Reg query_methods[] = {
+    {"iter", l_query_iter},
+    {"count", l_query_count},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg group_methods[] = {
+    {"size", l_group_size},
+    {"contains", l_group_contains},
+    {"iter", l_group_iter},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg layout_methods[] = {
+    {"size", l_layout_size},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg shared_methods[] = {
+    {"attach", l_shared_attach},
+    {"detach", l_shared_detach},
+    {"contains", l_shared_contains},
+    {"count", l_shared_count},
+    {"pages", l_shared_pages},
+    {"shrink_to_fit", l_shared_shrink_to_fit},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg commands_methods[] = {
+    {"insert", l_commands_insert},
+    {"remove", l_commands_remove},
+    {"set_field", l_commands_set_field},
+    {"destroy", l_commands_destroy},
+    {"flush", l_commands_flush},
+    {"size", l_commands_size},
+    {"clear", l_commands_clear},
+    {NULL, NULL}
+};
+
+// LuaJIT only: sparseset.ffi casts a set userdata to a cdata view of its
+// storage, so JIT-compiled loops read and write records with no C call.
+// The chunk gets the module table, the set metatable and the offset of
+// `dense` in sparse_set_t; the view declares the fields from there on,
+// which follow each other in the same order as in sparse-set.h.
+static const char ffi_chunk[] =
+    "local M, set_mt, head, types = ...\n"
+    "local ffi = require('ffi')\n"
+    "if not pcall(ffi.typeof, 'sparseset_set_t') then\n"
+    "  ffi.cdef(string.format([[\n"
+    "    typedef struct { uint8_t *data; uint32_t size; int type; } sparseset_column_t;\n"
+    "    typedef struct {\n"
+    "      uint8_t head[%d];\n"
+    "      uint64_t *dense;\n"
+    "      uint32_t size;\n"
+    "      uint32_t capacity;\n"
+    "      uint32_t stride;\n"
+    "      uint8_t *data;\n"
+    "      sparseset_column_t *columns;\n"
+    "      uint32_t column_count;\n"
+    "    } sparseset_set_t;]], head))\n"
+    "end\n"
+    "local view_t = ffi.typeof('sparseset_set_t *')\n"
+    "local function view(set)\n"
+    "  if getmetatable(set) ~= set_mt then error('bad argument #1 (SparseSet expected)', 3) end\n"
+    "  return ffi.cast(view_t, set)\n"
+    "end\n"
+    "local function typed(ptr, ct, size)\n"
+    "  local t = ffi.typeof(ct)\n"
+    "  if ffi.sizeof(t) ~= size then error('ctype size does not match the record size', 3) end\n"
+    "  return ffi.cast(ffi.typeof('$ *', t), ptr)\n"
+    "end\n"
+    "M.ffi = {\n"
+    "  view = function(set)\n"
+    "    local v = view(set)\n"
+    "    return v\n"
+    "  end,\n"
+    "  dense = function(set)\n"
+    "    local v = view(set)\n"
+    "    return v.dense, v.size\n"
+    "  end,\n"
+    "  data = function(set, ct)\n"
+    "    local v = view(set)\n"
+    "    if v.data == nil then error('set has no row data', 2) end\n"
+    "    return typed(v.data, ct, v.stride), v.size\n"
+    "  end,\n"
+    "  column = function(set, field, ct)\n"
+    "    local v = view(set)\n"
+    "    if type(field) == 'string' then field = set:field(field) end\n"
+    "    if type(field) ~= 'number' or field < 1 or field > v.column_count then\n"
+    "      error('unknown field', 2)\n"
+    "    end\n"
+    "    local c = v.columns[field - 1]\n"
+    "    return typed(c.data, ct or types[c.type], c.size), v.size\n"
+    "  end,\n"
+    "}\n";
+
+static void open_ffi(lua_State *L) {
+    lua_getglobal(L, "jit");
+    bool jit = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (!jit) return;
+    if (luaL_loadbuffer(L, ffi_chunk, sizeof(ffi_chunk) - 1, "=sparseset.ffi") != 0) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pushvalue(L, -2);
+    luaL_getmetatable(L, SET_METATABLE);
+    lua_pushinteger(L, (lua_Integer)offsetof(sparse_set_t, dense));
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, "int");
+    lua_rawseti(L, -2, TYPE_INT);
+    lua_pushstring(L, "float");
+    lua_rawseti(L, -2, TYPE_FLOAT);
+    lua_pushstring(L, "double");
+    lua_rawseti(L, -2, TYPE_DOUBLE);
+    lua_pushstring(L, "uint8_t");
+    lua_rawseti(L, -2, TYPE_BYTE);
+    lua_pushstring(L, "uint8_t");
+    lua_rawseti(L, -2, TYPE_BOOL);
+    // Without a working FFI the module simply has no `ffi` field.
+    if (lua_pcall(L, 4, 0, 0) != 0) lua_pop(L, 1);
+}
+
+int luaopen_sparseset(lua_State *L) {
+    lua_pushlightuserdata(L, (void *)&capi);
+    lua_setfield(L, LUA_REGISTRYINDEX, SPARSE_SET_CAPI_KEY);
+    open_allocator(L);
+
     luaL_newmetatable(L, REGISTRY_METATABLE);
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
@@ -486,14 +2421,66 @@ int luaopen_sparseset(lua_State *L) {
     lua_setfield(L, -2, "__index");
     lua_pushcfunction(L, l_set_gc);
     lua_setfield(L, -2, "__gc");
-    luaL_setfuncs(L, set_methods, 0);
-    lua_pop(L, 1);
+    luaL_setfuncs(L, set_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, QUERY_METATABLE);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, query_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, GROUP_METATABLE);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_group_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_setfuncs(L, group_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LAYOUT_METATABLE);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, layout_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, SHARED_METATABLE);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_shared_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_setfuncs(L, shared_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, COMMANDS_METATABLE);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_commands_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_setfuncs(L, commands_methods, 0);
+    lua_pop(L, 1);
 
     lua_newtable(L);
     lua_pushcfunction(L, l_reg_create);
     lua_setfield(L, -2, "new_registry");
     lua_pushcfunction(L, l_set_create);
     lua_setfield(L, -2, "new_set");
+    lua_pushcfunction(L, l_schema_set_create);
+    lua_setfield(L, -2, "new_schema_set");
+    lua_pushcfunction(L, l_query_create);
+    lua_setfield(L, -2, "new_query");
+    lua_pushcfunction(L, l_group_create);
+    lua_setfield(L, -2, "new_group");
+    lua_pushcfunction(L, l_commands_create);
+    lua_setfield(L, -2, "new_commands");
+    lua_pushcfunction(L, l_shared_create);
+    lua_setfield(L, -2, "new_index");
+    lua_pushcfunction(L, l_set_threads);
+    lua_setfield(L, -2, "set_threads");
+    lua_pushcfunction(L, l_get_threads);
+    lua_setfield(L, -2, "threads");
+    lua_pushcfunction(L, l_memory);
+    lua_setfield(L, -2, "memory");
     lua_pushinteger(L, TYPE_INT);
     lua_setfield(L, -2, "TYPE_INT");
     lua_pushinteger(L, TYPE_FLOAT);
@@ -504,8 +2491,12 @@ int luaopen_sparseset(lua_State *L) {
     lua_setfield(L, -2, "TYPE_BYTE");
     lua_pushinteger(L, TYPE_BOOL);
     lua_setfield(L, -2, "TYPE_BOOL");
-    
-
-    
+#ifdef SPARSE_SET_STATS
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
+#endif
+    lua_setfield(L, -2, "STATS");
+    open_ffi(L);
     return 1;
 }
@@ -0,0 +1,87 @@
+#ifndef LUA_SPARSE_SET_H
+#define LUA_SPARSE_SET_H
+
+#include <lua.h>
+#include <lauxlib.h>
+#include "sparse-set.h"
+#include "lua-compat.h"
+
+#define REGISTRY_METATABLE "SparseRegistry"
+#define SET_METATABLE "SparseSet"
+
+// Registry field holding a lightuserdata to the sparse_set_capi_t table.
+// It is set by luaopen_sparseset, so require("sparseset") first.
+#define SPARSE_SET_CAPI_KEY "sparseset.capi"
+
+// Function table for other native modules. Modules loaded by require()
+// cannot link against each other's symbols, so they reach the core through
+// these pointers. Fields are only ever appended; check `version`.
+//
+// Structural changes (insert/remove) are refused on Lua value sets
+// (stride == 0) because their values live in a Lua table the C side
+// cannot keep in sync.
+typedef struct {
+    uint32_t version;
+
+    bool (*contains)(const sparse_set_t *set, sparse_set_id_t id);
+    uint32_t (*index_of)(const sparse_set_t *set, sparse_set_id_t id);
+    uint32_t (*size)(const sparse_set_t *set);
+    sparse_set_id_t (*get_id)(const sparse_set_t *set, uint32_t pos);
+    void* (*get_data)(const sparse_set_t *set, uint32_t pos);
+    void* (*get_column)(const sparse_set_t *set, uint32_t column, uint32_t pos);
+
+    const sparse_set_id_t* (*dense)(const sparse_set_t *set);
+    void* (*data)(const sparse_set_t *set);
+    void* (*column_data)(const sparse_set_t *set, uint32_t column);
+
+    sparse_set_iter_t (*iter)(const sparse_set_t *set);
+    bool (*iter_next)(sparse_set_iter_t *iter, sparse_set_id_t *out_id);
+
+    uint32_t (*insert)(sparse_set_t *set, sparse_set_id_t id);
+    bool (*remove)(sparse_set_t *set, sparse_set_id_t id);
+
+    sparse_set_id_t (*registry_create_id)(registry_t *reg);
+    void (*registry_recycle)(registry_t *reg, sparse_set_id_t id);
+    bool (*registry_valid)(const registry_t *reg, sparse_set_id_t id);
+} sparse_set_capi_t;
+
+static inline sparse_set_t*
+get_set(lua_State *L){
+    return (sparse_set_t*)lua_touserdata(L, 1);
+}
+
+static inline registry_t*
+get_reg(lua_State *L){
+    return (registry_t*)lua_touserdata(L, 1);
+}
+
+// Type-checked access to set/registry userdata for native consumers.
+static inline sparse_set_t* lsparseset_toset(lua_State *L, int idx) {
+    return (sparse_set_t*)luaL_testudata(L, idx, SET_METATABLE);
+}
+
+static inline sparse_set_t* lsparseset_checkset(lua_State *L, int idx) {
+    return (sparse_set_t*)luaL_checkudata(L, idx, SET_METATABLE);
+}
+
+static inline registry_t* lsparseset_toregistry(lua_State *L, int idx) {
+    return (registry_t*)luaL_testudata(L, idx, REGISTRY_METATABLE);
+}
+
+static inline registry_t* lsparseset_checkregistry(lua_State *L, int idx) {
+    return (registry_t*)luaL_checkudata(L, idx, REGISTRY_METATABLE);
+}
+
+// Returns the core function table, or NULL when the module is not loaded
+// or was built with an older API version than `min_version`.
+static inline const sparse_set_capi_t* lsparseset_getcapi(lua_State *L, uint32_t min_version) {
+    lua_getfield(L, LUA_REGISTRYINDEX, SPARSE_SET_CAPI_KEY);
+    const sparse_set_capi_t *capi = (const sparse_set_capi_t*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!capi || capi->version < min_version) return NULL;
+    return capi;
+}
+
+int luaopen_sparseset(lua_State *L);
+
+#endif
@@ -0,0 +1,215 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File layout: a 64 byte header, the AoS data region (capacity * stride,
+// padded to 8 bytes), then the dense ids (capacity entries). Growing only
+// moves the dense ids (8 bytes per entity); the data region never moves
+// inside the file. The set's size is written to the header as it changes,
+// so reopening just maps the file and rebuilds the sparse index from dense.
+
+#define MAPPED_MAGIC 0x50414d53u
+#define MAPPED_VERSION 1
+#define MAPPED_BOM 0x01020304u
+#define MAPPED_HEADER_SIZE 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t bom;
+    uint32_t stride;
+    uint32_t size;
+    uint32_t capacity;
+} mapped_header_t;
+
+struct sparse_set_mapping {
+    int fd;
+    uint8_t *base;
+    size_t length;
+};
+
+static size_t mapped_dense_offset(uint32_t stride, uint32_t capacity) {
+    size_t data_bytes = (size_t)capacity * stride;
+    return MAPPED_HEADER_SIZE + ((data_bytes + 7) & ~(size_t)7);
+}
+
+static size_t mapped_length(uint32_t stride, uint32_t capacity) {
+    return mapped_dense_offset(stride, capacity) + (size_t)capacity * sizeof(sparse_set_id_t);
+}
+
+#if !defined(_WIN32)
+
+static void mapped_bind(sparse_set_t *set) {
+    struct sparse_set_mapping *m = set->mapping;
+    mapped_header_t *header = (mapped_header_t*)m->base;
+    set->data = m->base + MAPPED_HEADER_SIZE;
+    set->dense = (sparse_set_id_t*)(m->base + mapped_dense_offset(header->stride, header->capacity));
+    set->dense_capacity = header->capacity;
+}
+
+static bool mapped_truncate(int fd, size_t length) {
+    return ftruncate(fd, (off_t)length) == 0;
+}
+
+static uint8_t *mapped_map(int fd, size_t length) {
+    void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return base == MAP_FAILED ? NULL : (uint8_t*)base;
+}
+
+bool sparse_set_map_file(sparse_set_t *set, const char *path, uint32_t stride) {
+    if (stride == 0 || set->size > 0 || set->data || set->columns || set->mapping || set->vm) return false;
+
+    struct sparse_set_mapping *m = (struct sparse_set_mapping*)sparse_set_alloc(set->allocator, sizeof(*m));
+    if (!m) return false;
+    m->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (m->fd < 0) {
+        sparse_set_free(set->allocator, m, sizeof(*m));
+        return false;
+    }
+
+    struct stat st;
+    mapped_header_t header;
+    if (fstat(m->fd, &st) != 0) goto fail;
+
+    if (st.st_size == 0) {
+        header.magic = MAPPED_MAGIC;
+        header.version = MAPPED_VERSION;
+        header.bom = MAPPED_BOM;
+        header.stride = stride;
+        header.size = 0;
+        header.capacity = set->dense_capacity;
+        m->length = mapped_length(stride, header.capacity);
+        if (!mapped_truncate(m->fd, m->length)) goto fail;
+        if (!(m->base = mapped_map(m->fd, m->length))) goto fail;
+        memcpy(m->base, &header, sizeof(header));
+    } else {
+        if (pread(m->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) goto fail;
+        if (header.magic != MAPPED_MAGIC || header.version != MAPPED_VERSION ||
+            header.bom != MAPPED_BOM || header.stride != stride ||
+            header.capacity == 0 || header.capacity > SPARSE_SET_MAX_DENSE ||
+            header.size > header.capacity) {
+            goto fail;
+        }
+        m->length = mapped_length(stride, header.capacity);
+        if ((uint64_t)st.st_size < m->length) goto fail;
+        if (!(m->base = mapped_map(m->fd, m->length))) goto fail;
+    }
+
+    // Swap the heap arrays for the mapping, then index the stored ids.
+    sparse_set_id_t *old_dense = set->dense;
+    uint32_t old_capacity = set->dense_capacity;
+    set->mapping = m;
+    set->stride = stride;
+    mapped_bind(set);
+    set->size = header.size;
+    if (!sparse_set_rebuild_index(set)) {
+        set->mapping = NULL;
+        set->stride = 0;
+        set->data = NULL;
+        set->dense = old_dense;
+        set->dense_capacity = old_capacity;
+        set->size = 0;
+        sparse_set_clear(set);
+        munmap(m->base, m->length);
+        goto fail;
+    }
+    sparse_set_free(set->allocator, old_dense, (size_t)old_capacity * sizeof(sparse_set_id_t));
+    set->mapped_size = &((mapped_header_t*)m->base)->size;
+    return true;
+
+fail:
+    close(m->fd);
+    sparse_set_free(set->allocator, m, sizeof(*m));
+    return false;
+}
+
+bool sparse_set_mapping_resize(sparse_set_t *set, uint32_t new_capacity) {
+    struct sparse_set_mapping *m = set->mapping;
+    mapped_header_t *header = (mapped_header_t*)m->base;
+    uint32_t stride = header->stride;
+    size_t old_dense = mapped_dense_offset(stride, header->capacity);
+    size_t new_dense = mapped_dense_offset(stride, new_capacity);
+    size_t new_length = mapped_length(stride, new_capacity);
+    size_t ids_bytes = (size_t)set->size * sizeof(sparse_set_id_t);
+
+    if (new_capacity < header->capacity) {
+        // Compact first: the old mapping stays valid for the new layout, so
+        // a failed remap still leaves a consistent (just larger) mapping.
+        memmove(m->base + new_dense, m->base + old_dense, ids_bytes);
+        header->capacity = new_capacity;
+        uint8_t *base = mapped_map(m->fd, new_length);
+        if (base) {
+            munmap(m->base, m->length);
+            m->base = base;
+            m->length = new_length;
+            // Keeping a longer file is harmless if this fails.
+            (void)mapped_truncate(m->fd, new_length);
+        }
+        mapped_bind(set);
+        set->mapped_size = &((mapped_header_t*)m->base)->size;
+        return true;
+    }
+
+    if (!mapped_truncate(m->fd, new_length)) return false;
+    uint8_t *base = mapped_map(m->fd, new_length);
+    if (!base) {
+        (void)mapped_truncate(m->fd, m->length);
+        return false;
+    }
+    munmap(m->base, m->length);
+    m->base = base;
+    m->length = new_length;
+    memmove(base + new_dense, base + old_dense, ids_bytes);
+    ((mapped_header_t*)base)->capacity = new_capacity;
+    mapped_bind(set);
+    set->mapped_size = &((mapped_header_t*)base)->size;
+    return true;
+}
+
+bool sparse_set_sync(sparse_set_t *set) {
+    if (!set->mapping) return true;
+    return msync(set->mapping->base, set->mapping->length, MS_SYNC) == 0;
+}
+
+void sparse_set_unmap(sparse_set_t *set) {
+    struct sparse_set_mapping *m = set->mapping;
+    if (!m) return;
+    ((mapped_header_t*)m->base)->size = set->size;
+    munmap(m->base, m->length);
+    close(m->fd);
+    sparse_set_free(set->allocator, m, sizeof(*m));
+    set->mapping = NULL;
+    set->mapped_size = NULL;
+    set->dense = NULL;
+    set->data = NULL;
+}
+
+#else
+
+bool sparse_set_map_file(sparse_set_t *set, const char *path, uint32_t stride) {
+    (void)set; (void)path; (void)stride;
+    return false;
+}
+
+bool sparse_set_mapping_resize(sparse_set_t *set, uint32_t new_capacity) {
+    (void)set; (void)new_capacity;
+    return false;
+}
+
+bool sparse_set_sync(sparse_set_t *set) {
+    (void)set;
+    return true;
+}
+
+void sparse_set_unmap(sparse_set_t *set) {
+    (void)set;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include "sparse-set.h"
+#include <stdlib.h>
+
+// A process-wide worker pool for native kernels. parallel_for hands out
+// chunks of [0, count) through an atomic cursor; the calling thread works
+// too, so `threads` counts it and the pool holds threads - 1 workers.
+// Callers are serialized by run_lock, which also guards reconfiguration.
+// Every worker acknowledges every job before the caller returns, so job
+// fields are never rewritten under a worker still reading them.
+
+#if !defined(_WIN32)
+#include <pthread.h>
+
+typedef struct {
+    pthread_mutex_t run_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_t *workers;
+    uint32_t worker_count;
+    uint32_t generation;
+    uint32_t pending;
+    uint32_t users;
+    bool stop;
+
+    sparse_set_task_fn fn;
+    void *ud;
+    uint32_t count;
+    uint32_t chunk;
+    uint64_t next;
+} parallel_pool_t;
+
+static parallel_pool_t pool = {
+    .run_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void parallel_run_chunks(void) {
+    for (;;) {
+        uint64_t begin = __atomic_fetch_add(&pool.next, (uint64_t)pool.chunk, __ATOMIC_RELAXED);
+        if (begin >= pool.count) break;
+        uint64_t end = begin + pool.chunk < pool.count ? begin + pool.chunk : pool.count;
+        pool.fn(pool.ud, (uint32_t)begin, (uint32_t)end);
+    }
+}
+
+// `arg` is the generation current when the worker was created: run_lock
+// is held until every worker exists, so later generations are all jobs this
+// worker has to take part in, even if it starts running after them.
+static void *parallel_worker(void *arg) {
+    uint32_t seen = (uint32_t)(uintptr_t)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen && !pool.stop) {
+            pthread_cond_wait(&pool.work_cond, &pool.lock);
+        }
+        if (pool.stop) break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        parallel_run_chunks();
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) pthread_cond_signal(&pool.done_cond);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void parallel_stop_workers(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (uint32_t i = 0; i < pool.worker_count; i++) {
+        pthread_join(pool.workers[i], NULL);
+    }
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.worker_count = 0;
+    pool.stop = false;
+}
+
+bool sparse_set_parallel_set_threads(uint32_t threads) {
+    if (threads == 0 || threads > SPARSE_SET_PARALLEL_MAX_THREADS) return false;
+
+    pthread_mutex_lock(&pool.run_lock);
+    bool ok = true;
+    if (threads - 1 != pool.worker_count) {
+        parallel_stop_workers();
+        if (threads > 1) {
+            pool.workers = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+            ok = pool.workers != NULL;
+            for (uint32_t i = 0; ok && i < threads - 1; i++) {
+                if (pthread_create(&pool.workers[i], NULL, parallel_worker, (void*)(uintptr_t)pool.generation) != 0) {
+                    ok = false;
+                    break;
+                }
+                pool.worker_count++;
+            }
+            if (!ok) parallel_stop_workers();
+        }
+    }
+    pthread_mutex_unlock(&pool.run_lock);
+    return ok;
+}
+
+void sparse_set_parallel_retain(void) {
+    pthread_mutex_lock(&pool.run_lock);
+    pool.users++;
+    pthread_mutex_unlock(&pool.run_lock);
+}
+
+void sparse_set_parallel_release(void) {
+    pthread_mutex_lock(&pool.run_lock);
+    if (pool.users > 0 && --pool.users == 0) parallel_stop_workers();
+    pthread_mutex_unlock(&pool.run_lock);
+}
+
+uint32_t sparse_set_parallel_threads(void) {
+    pthread_mutex_lock(&pool.run_lock);
+    uint32_t threads = pool.worker_count + 1;
+    pthread_mutex_unlock(&pool.run_lock);
+    return threads;
+}
+
+void sparse_set_parallel_for(uint32_t count, uint32_t min_chunk, sparse_set_task_fn fn, void *ud) {
+    if (count == 0) return;
+    if (min_chunk == 0) min_chunk = 1;
+
+    pthread_mutex_lock(&pool.run_lock);
+    uint32_t threads = pool.worker_count + 1;
+    if (threads == 1 || count < 2 * (uint64_t)min_chunk) {
+        pthread_mutex_unlock(&pool.run_lock);
+        fn(ud, 0, count);
+        return;
+    }
+
+    // A few chunks per thread evens out uneven work (e.g. join misses).
+    uint32_t chunk = (uint32_t)(((uint64_t)count + threads * 4 - 1) / (threads * 4));
+    if (chunk < min_chunk) chunk = min_chunk;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.ud = ud;
+    pool.count = count;
+    pool.chunk = chunk;
+    pool.next = 0;
+    pool.pending = pool.worker_count;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    parallel_run_chunks();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0) pthread_cond_wait(&pool.done_cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.run_lock);
+}
+
+#else
+
+bool sparse_set_parallel_set_threads(uint32_t threads) {
+    return threads == 1;
+}
+
+uint32_t sparse_set_parallel_threads(void) {
+    return 1;
+}
+
+void sparse_set_parallel_retain(void) {
+}
+
+void sparse_set_parallel_release(void) {
+}
+
+void sparse_set_parallel_for(uint32_t count, uint32_t min_chunk, sparse_set_task_fn fn, void *ud) {
+    (void)min_chunk;
+    if (count > 0) fn(ud, 0, count);
+}
+
+#endif
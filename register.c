@@ -3,12 +3,17 @@
 #include <string.h>
 
 bool registry_init(registry_t *reg) {
-    reg->generations = (uint32_t**)calloc(SPARSE_SET_DEFAULT_CAPACITY, sizeof(uint32_t*));
-    reg->recycle = (uint32_t*)malloc(SPARSE_SET_DEFAULT_CAPACITY * sizeof(uint32_t));
+    return registry_init_alloc(reg, &sparse_set_default_allocator);
+}
+
+bool registry_init_alloc(registry_t *reg, sparse_set_allocator_t *allocator) {
+    reg->allocator = allocator;
+    reg->generations = (uint32_t**)sparse_set_calloc(allocator, SPARSE_SET_DEFAULT_CAPACITY, sizeof(uint32_t*));
+    reg->recycle = (uint32_t*)sparse_set_alloc(allocator, SPARSE_SET_DEFAULT_CAPACITY * sizeof(uint32_t));
     
     if (!reg->generations || !reg->recycle) {
-        if (reg->generations) free(reg->generations);
-        if (reg->recycle) free(reg->recycle);
+        sparse_set_free(allocator, reg->generations, SPARSE_SET_DEFAULT_CAPACITY * sizeof(uint32_t*));
+        sparse_set_free(allocator, reg->recycle, SPARSE_SET_DEFAULT_CAPACITY * sizeof(uint32_t));
         return false;
     }
 
@@ -16,18 +21,22 @@ bool registry_init(registry_t *reg) {
     reg->recycle_capacity = SPARSE_SET_DEFAULT_CAPACITY;
     reg->recycle_count = 0;
     reg->next_index = 0;
+    reg->version_mask = UINT32_MAX;
+    reg->auto_shrink = false;
+    memset(&reg->counters, 0, sizeof(reg->counters));
     return true;
 }
 
 void registry_deinit(registry_t *reg) {
     if (reg) {
+        sparse_set_allocator_t *a = reg->allocator;
         if (reg->generations) {
             for (uint32_t i = 0; i < reg->generations_capacity; i++) {
-                if (reg->generations[i]) free(reg->generations[i]);
+                sparse_set_page_free(a, reg->generations[i]);
             }
-            free(reg->generations);
+            sparse_set_free(a, reg->generations, reg->generations_capacity * sizeof(uint32_t*));
         }
-        if (reg->recycle) free(reg->recycle);
+        sparse_set_free(a, reg->recycle, reg->recycle_capacity * sizeof(uint32_t));
         reg->generations = NULL;
         reg->recycle = NULL;
     }
@@ -38,26 +47,32 @@ static bool registry_ensure_gen_page(registry_t *reg, uint32_t page_idx) {
         uint32_t new_capacity = reg->generations_capacity;
         while (new_capacity <= page_idx) new_capacity *= 2;
         
-        uint32_t **new_gens = (uint32_t**)realloc(reg->generations, new_capacity * sizeof(uint32_t*));
+        uint32_t **new_gens = (uint32_t**)sparse_set_realloc(reg->allocator, reg->generations,
+            reg->generations_capacity * sizeof(uint32_t*), new_capacity * sizeof(uint32_t*));
         if (!new_gens) return false;
         
         memset(new_gens + reg->generations_capacity, 0, (new_capacity - reg->generations_capacity) * sizeof(uint32_t*));
         reg->generations = new_gens;
         reg->generations_capacity = new_capacity;
+        reg->counters.grows++;
     }
 
     if (!reg->generations[page_idx]) {
-        reg->generations[page_idx] = (uint32_t*)calloc(SPARSE_SET_PAGE_SIZE, sizeof(uint32_t));
-        if (!reg->generations[page_idx]) return false;
+        uint32_t *page = sparse_set_page_alloc(reg->allocator);
+        if (!page) return false;
+        memset(page, 0, SPARSE_SET_PAGE_SIZE * sizeof(uint32_t));
+        reg->generations[page_idx] = page;
+        reg->counters.page_allocs++;
     }
     return true;
 }
 
 registry_t* registry_create() {
-    registry_t *reg = (registry_t*)malloc(sizeof(registry_t));
+    sparse_set_allocator_t *allocator = &sparse_set_default_allocator;
+    registry_t *reg = (registry_t*)sparse_set_alloc(allocator, sizeof(registry_t));
     if (!reg) return NULL;
-    if (!registry_init(reg)) {
-        free(reg);
+    if (!registry_init_alloc(reg, allocator)) {
+        sparse_set_free(allocator, reg, sizeof(registry_t));
         return NULL;
     }
     return reg;
@@ -65,11 +80,37 @@ registry_t* registry_create() {
 
 void registry_destroy(registry_t *reg) {
     if (reg) {
+        sparse_set_allocator_t *allocator = reg->allocator;
         registry_deinit(reg);
-        free(reg);
+        sparse_set_free(allocator, reg, sizeof(registry_t));
     }
 }
 
+static void registry_resize_recycle(registry_t *reg, uint32_t new_cap) {
+    if (new_cap < SPARSE_SET_DEFAULT_CAPACITY) new_cap = SPARSE_SET_DEFAULT_CAPACITY;
+    if (new_cap < reg->recycle_count || new_cap == reg->recycle_capacity) return;
+    uint32_t *new_rec = (uint32_t*)sparse_set_realloc(reg->allocator, reg->recycle,
+        reg->recycle_capacity * sizeof(uint32_t), new_cap * sizeof(uint32_t));
+    if (!new_rec) return;
+    if (new_cap < reg->recycle_capacity) reg->counters.shrinks++;
+    else reg->counters.grows++;
+    reg->recycle = new_rec;
+    reg->recycle_capacity = new_cap;
+}
+
+void registry_shrink_to_fit(registry_t *reg) {
+    registry_resize_recycle(reg, reg->recycle_count);
+}
+
+void registry_set_auto_shrink(registry_t *reg, bool enabled) {
+    reg->auto_shrink = enabled;
+}
+
+void registry_set_version_bits(registry_t *reg, uint32_t bits) {
+    if (bits == 0) bits = 1;
+    reg->version_mask = bits >= 32 ? UINT32_MAX : (1u << bits) - 1;
+}
+
 sparse_set_id_t registry_create_id(registry_t *reg) {
     uint32_t index;
     uint32_t version;
@@ -78,41 +119,113 @@ sparse_set_id_t registry_create_id(registry_t *reg) {
         index = reg->recycle[--reg->recycle_count];
         uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
         version = reg->generations[page_idx][index & SPARSE_SET_PAGE_MASK];
+        if (reg->auto_shrink && reg->recycle_capacity > SPARSE_SET_DEFAULT_CAPACITY &&
+            reg->recycle_count <= reg->recycle_capacity / 4) {
+            registry_resize_recycle(reg, reg->recycle_capacity / 2);
+        }
     } else {
-        index = reg->next_index++;
+        // Index UINT32_MAX is kept free so no live id can alias ID_NULL.
+        if (reg->next_index == UINT32_MAX) return ID_NULL;
+        index = reg->next_index;
         uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
         if (!registry_ensure_gen_page(reg, page_idx)) {
             return ID_NULL;
         }
+        reg->next_index++;
         version = 0;
     }
     
+    SPARSE_SET_COUNT(reg, inserts, 1);
     return ID_MAKE(index, version);
 }
 
+static bool registry_alive(const registry_t *reg, sparse_set_id_t id) {
+    uint32_t index = ID_INDEX(id);
+    uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
+    
+    if (page_idx >= reg->generations_capacity || !reg->generations[page_idx]) return false;
+    return reg->generations[page_idx][index & SPARSE_SET_PAGE_MASK] == ID_VERSION(id);
+}
+
 void registry_recycle(registry_t *reg, sparse_set_id_t id) {
-    if (!registry_valid(reg, id)) return;
+    if (!registry_alive(reg, id)) return;
     
     uint32_t index = ID_INDEX(id);
     uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-    reg->generations[page_idx][index & SPARSE_SET_PAGE_MASK]++;
+    uint32_t *version = &reg->generations[page_idx][index & SPARSE_SET_PAGE_MASK];
+    *version = (*version + 1) & reg->version_mask;
     
     if (reg->recycle_count >= reg->recycle_capacity) {
         uint32_t new_cap = reg->recycle_capacity * 2;
-        uint32_t *new_rec = (uint32_t*)realloc(reg->recycle, new_cap * sizeof(uint32_t));
+        uint32_t *new_rec = (uint32_t*)sparse_set_realloc(reg->allocator, reg->recycle,
+            reg->recycle_capacity * sizeof(uint32_t), new_cap * sizeof(uint32_t));
         if (!new_rec) return;
         reg->recycle = new_rec;
         reg->recycle_capacity = new_cap;
+        reg->counters.grows++;
     }
     
     reg->recycle[reg->recycle_count++] = index;
+    SPARSE_SET_COUNT(reg, removes, 1);
+}
+
+uint32_t registry_create_many(registry_t *reg, sparse_set_id_t *out, uint32_t count) {
+    uint32_t created = 0;
+    while (created < count && reg->recycle_count > 0) {
+        uint32_t index = reg->recycle[--reg->recycle_count];
+        uint32_t version = reg->generations[index >> SPARSE_SET_PAGE_SHIFT][index & SPARSE_SET_PAGE_MASK];
+        out[created++] = ID_MAKE(index, version);
+    }
+    if (reg->auto_shrink && reg->recycle_capacity > SPARSE_SET_DEFAULT_CAPACITY &&
+        reg->recycle_count <= reg->recycle_capacity / 4) {
+        registry_resize_recycle(reg, reg->recycle_count * 2);
+    }
+
+    // Fresh indices: one page check per page instead of per id.
+    while (created < count && reg->next_index < UINT32_MAX) {
+        uint32_t index = reg->next_index;
+        if (!registry_ensure_gen_page(reg, index >> SPARSE_SET_PAGE_SHIFT)) break;
+        uint32_t run = SPARSE_SET_PAGE_SIZE - (index & SPARSE_SET_PAGE_MASK);
+        if (run > count - created) run = count - created;
+        if (run > UINT32_MAX - index) run = UINT32_MAX - index;
+        for (uint32_t i = 0; i < run; i++) {
+            out[created++] = ID_MAKE(index + i, 0);
+        }
+        reg->next_index = index + run;
+    }
+    SPARSE_SET_COUNT(reg, inserts, created);
+    return created;
+}
+
+uint32_t registry_recycle_many(registry_t *reg, const sparse_set_id_t *ids, uint32_t count, sparse_set_id_t *out_destroyed) {
+    uint32_t destroyed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!registry_alive(reg, ids[i])) continue;
+        registry_recycle(reg, ids[i]);
+        if (out_destroyed) out_destroyed[destroyed] = ids[i];
+        destroyed++;
+    }
+    return destroyed;
 }
 
 bool registry_valid(const registry_t *reg, sparse_set_id_t id) {
-    uint32_t index = ID_INDEX(id);
-    uint32_t version = ID_VERSION(id);
-    uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-    
-    if (page_idx >= reg->generations_capacity || !reg->generations[page_idx]) return false;
-    return reg->generations[page_idx][index & SPARSE_SET_PAGE_MASK] == version;
+    SPARSE_SET_COUNT(reg, lookups, 1);
+    if (registry_alive(reg, id)) return true;
+    SPARSE_SET_COUNT(reg, misses, 1);
+    return false;
+}
+
+void registry_stats(const registry_t *reg, registry_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->live = reg->next_index - reg->recycle_count;
+    out->next_index = reg->next_index;
+    out->recycled = reg->recycle_count;
+    out->recycle_capacity = reg->recycle_capacity;
+    for (uint32_t i = 0; i < reg->generations_capacity; i++) {
+        if (reg->generations[i]) out->pages++;
+    }
+    out->bytes = (size_t)reg->generations_capacity * sizeof(uint32_t*) +
+                 (size_t)out->pages * SPARSE_SET_PAGE_BYTES +
+                 (size_t)reg->recycle_capacity * sizeof(uint32_t);
+    out->counters = reg->counters;
 }
@@ -0,0 +1,165 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Reserved storage: dense, the AoS data and every schema column each get
+// their own PROT_NONE range sized for max_capacity entries. Growing only
+// makes more of a range readable and writable (fresh anonymous pages read
+// as zero), so records never move and the base pointers handed out by
+// sparse_set_dense / sparse_set_data stay valid until the set is freed.
+// Shrinking maps fresh PROT_NONE pages over the tail, which returns the
+// memory without giving up the address range.
+
+// Regions are dense, then data (if any), then each column in order.
+typedef struct {
+    uint8_t *base;
+    size_t elem;
+    size_t length;      // reserved bytes
+    size_t committed;   // readable/writable prefix
+} vm_region_t;
+
+struct sparse_set_vm {
+    uint32_t max_capacity;
+    uint32_t region_count;
+    vm_region_t regions[];
+};
+
+#if !defined(_WIN32)
+
+static size_t vm_round(size_t bytes) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) & ~(page - 1);
+}
+
+static bool vm_commit(vm_region_t *r, uint32_t capacity) {
+    size_t want = vm_round((size_t)capacity * r->elem);
+    if (want > r->committed) {
+        if (mprotect(r->base + r->committed, want - r->committed, PROT_READ | PROT_WRITE) != 0) return false;
+    } else if (want < r->committed) {
+        void *tail = mmap(r->base + want, r->committed - want, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        // Keeping the pages committed is harmless if this fails.
+        if (tail == MAP_FAILED) return true;
+    }
+    r->committed = want;
+    return true;
+}
+
+bool sparse_set_reserve_address_space(sparse_set_t *set, uint32_t max_capacity) {
+    if (set->size > 0 || set->vm || set->mapping) return false;
+    if (max_capacity < set->dense_capacity || max_capacity > SPARSE_SET_MAX_DENSE) return false;
+
+    uint32_t count = 1 + (set->data ? 1 : 0) + set->column_count;
+    size_t vm_bytes = sizeof(struct sparse_set_vm) + count * sizeof(vm_region_t);
+    struct sparse_set_vm *vm = (struct sparse_set_vm*)sparse_set_alloc(set->allocator, vm_bytes);
+    if (!vm) return false;
+    vm->max_capacity = max_capacity;
+    vm->region_count = count;
+
+    uint32_t n = 0;
+    vm->regions[n++].elem = sizeof(sparse_set_id_t);
+    if (set->data) vm->regions[n++].elem = set->stride;
+    for (uint32_t i = 0; i < set->column_count; i++) vm->regions[n++].elem = set->columns[i].size;
+
+    // Map every range before touching the set so a failure changes nothing.
+    uint32_t ready = 0;
+    for (; ready < count; ready++) {
+        vm_region_t *r = &vm->regions[ready];
+        r->length = vm_round((size_t)max_capacity * r->elem);
+        r->committed = 0;
+        void *base = mmap(NULL, r->length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) break;
+        r->base = (uint8_t*)base;
+        if (!vm_commit(r, set->dense_capacity)) {
+            munmap(base, r->length);
+            break;
+        }
+    }
+    if (ready < count) {
+        for (uint32_t i = 0; i < ready; i++) munmap(vm->regions[i].base, vm->regions[i].length);
+        sparse_set_free(set->allocator, vm, vm_bytes);
+        return false;
+    }
+
+    // The set is empty, so the heap arrays hold nothing worth copying.
+    sparse_set_allocator_t *a = set->allocator;
+    size_t capacity = set->dense_capacity;
+    n = 0;
+    sparse_set_free(a, set->dense, capacity * sizeof(sparse_set_id_t));
+    set->dense = (sparse_set_id_t*)vm->regions[n++].base;
+    if (set->data) {
+        sparse_set_free(a, set->data, capacity * set->stride);
+        set->data = vm->regions[n++].base;
+    }
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        sparse_set_free(a, set->columns[i].data, capacity * set->columns[i].size);
+        set->columns[i].data = vm->regions[n++].base;
+    }
+    set->vm = vm;
+    return true;
+}
+
+bool sparse_set_vm_resize(sparse_set_t *set, uint32_t new_capacity) {
+    struct sparse_set_vm *vm = set->vm;
+    if (new_capacity > vm->max_capacity) {
+        // Growth stops at the reservation; the last step may be partial.
+        if (set->dense_capacity >= vm->max_capacity) return false;
+        new_capacity = vm->max_capacity;
+    }
+
+    uint32_t done = 0;
+    for (; done < vm->region_count; done++) {
+        if (!vm_commit(&vm->regions[done], new_capacity)) break;
+    }
+    if (done < vm->region_count) {
+        for (uint32_t i = 0; i < done; i++) vm_commit(&vm->regions[i], set->dense_capacity);
+        return false;
+    }
+    set->dense_capacity = new_capacity;
+    return true;
+}
+
+void sparse_set_vm_release(sparse_set_t *set) {
+    struct sparse_set_vm *vm = set->vm;
+    if (!vm) return;
+    for (uint32_t i = 0; i < vm->region_count; i++) {
+        munmap(vm->regions[i].base, vm->regions[i].length);
+    }
+    set->dense = NULL;
+    set->data = NULL;
+    for (uint32_t i = 0; i < set->column_count; i++) set->columns[i].data = NULL;
+    sparse_set_free(set->allocator, vm, sizeof(struct sparse_set_vm) + vm->region_count * sizeof(vm_region_t));
+    set->vm = NULL;
+}
+
+uint32_t sparse_set_reserved_capacity(const sparse_set_t *set) {
+    return set->vm ? set->vm->max_capacity : 0;
+}
+
+#else
+
+bool sparse_set_reserve_address_space(sparse_set_t *set, uint32_t max_capacity) {
+    (void)set; (void)max_capacity;
+    return false;
+}
+
+bool sparse_set_vm_resize(sparse_set_t *set, uint32_t new_capacity) {
+    (void)set; (void)new_capacity;
+    return false;
+}
+
+void sparse_set_vm_release(sparse_set_t *set) {
+    (void)set;
+}
+
+uint32_t sparse_set_reserved_capacity(const sparse_set_t *set) {
+    (void)set;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,296 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <stdlib.h>
+
+// Heap blocks hold their capacity in entry 0 and up to capacity - 1
+// positions after it. Capacities are powers of two from 4, so a slot with
+// n > SPARSE_SET_SHARED_INLINE members spills to the smallest class with
+// room for n; blocks halve once a quarter full and go back inline at
+// SPARSE_SET_SHARED_INLINE members.
+
+static uint32_t shared_block_capacity(uint32_t count) {
+    uint32_t capacity = 4;
+    while (capacity - 1 < count) capacity *= 2;
+    return capacity;
+}
+
+static sparse_set_shared_page_t** shared_page_entry(sparse_set_shared_t *shared, uint32_t page_idx, bool create) {
+    if (page_idx < SPARSE_SET_FLAT_PAGES) {
+        if (page_idx >= shared->page_capacity) {
+            if (!create) return NULL;
+            uint32_t new_capacity = shared->page_capacity ? shared->page_capacity : 16;
+            while (new_capacity <= page_idx) new_capacity *= 2;
+            if (new_capacity > SPARSE_SET_FLAT_PAGES) new_capacity = SPARSE_SET_FLAT_PAGES;
+
+            sparse_set_shared_page_t **pages = (sparse_set_shared_page_t**)sparse_set_realloc(shared->allocator, shared->pages,
+                shared->page_capacity * sizeof(sparse_set_shared_page_t*), new_capacity * sizeof(sparse_set_shared_page_t*));
+            if (!pages) return NULL;
+
+            memset(pages + shared->page_capacity, 0, (new_capacity - shared->page_capacity) * sizeof(sparse_set_shared_page_t*));
+            shared->pages = pages;
+            shared->page_capacity = new_capacity;
+        }
+        return &shared->pages[page_idx];
+    }
+
+    if (!shared->blocks) {
+        if (!create) return NULL;
+        shared->blocks = (sparse_set_shared_page_t***)sparse_set_calloc(shared->allocator, SPARSE_SET_BLOCK_COUNT, sizeof(sparse_set_shared_page_t**));
+        if (!shared->blocks) return NULL;
+    }
+    sparse_set_shared_page_t ***block = &shared->blocks[page_idx >> SPARSE_SET_BLOCK_SHIFT];
+    if (!*block) {
+        if (!create) return NULL;
+        *block = (sparse_set_shared_page_t**)sparse_set_calloc(shared->allocator, SPARSE_SET_BLOCK_SIZE, sizeof(sparse_set_shared_page_t*));
+        if (!*block) return NULL;
+    }
+    return &(*block)[page_idx & SPARSE_SET_BLOCK_MASK];
+}
+
+static void shared_free_page(sparse_set_shared_t *shared, sparse_set_shared_page_t *page) {
+    if (!page) return;
+    for (uint32_t i = 0; i < SPARSE_SET_PAGE_SIZE && page->live > 0; i++) {
+        sparse_set_shared_slot_t *slot = &page->slots[i];
+        if (SPARSE_SET_POPCOUNT64(slot->mask) > SPARSE_SET_SHARED_INLINE) {
+            sparse_set_free(shared->allocator, slot->pos.heap, slot->pos.heap[0] * sizeof(uint32_t));
+        }
+        if (slot->mask) page->live--;
+    }
+    sparse_set_free(shared->allocator, page, sizeof(sparse_set_shared_page_t));
+    shared->page_count--;
+}
+
+bool sparse_set_shared_init(sparse_set_shared_t *shared, sparse_set_allocator_t *allocator) {
+    memset(shared, 0, sizeof(*shared));
+    shared->allocator = allocator;
+    return true;
+}
+
+static void shared_unregister(sparse_set_t *set) {
+    sparse_set_shared_t *shared = set->shared;
+    shared->sets[set->shared_bit] = NULL;
+    shared->used &= ~(1ull << set->shared_bit);
+    shared->epoch++;
+    set->shared = NULL;
+    set->shared_bit = 0;
+}
+
+static void shared_free_storage(sparse_set_shared_t *shared) {
+    for (uint32_t i = 0; i < shared->page_capacity; i++) {
+        shared_free_page(shared, shared->pages[i]);
+    }
+    sparse_set_free(shared->allocator, shared->pages, shared->page_capacity * sizeof(sparse_set_shared_page_t*));
+    if (shared->blocks) {
+        for (uint32_t i = 0; i < SPARSE_SET_BLOCK_COUNT; i++) {
+            sparse_set_shared_page_t **block = shared->blocks[i];
+            if (!block) continue;
+            for (uint32_t j = 0; j < SPARSE_SET_BLOCK_SIZE; j++) {
+                shared_free_page(shared, block[j]);
+            }
+            sparse_set_free(shared->allocator, block, SPARSE_SET_BLOCK_SIZE * sizeof(sparse_set_shared_page_t*));
+        }
+        sparse_set_free(shared->allocator, shared->blocks, SPARSE_SET_BLOCK_COUNT * sizeof(sparse_set_shared_page_t**));
+    }
+    shared->pages = NULL;
+    shared->page_capacity = 0;
+    shared->blocks = NULL;
+}
+
+void sparse_set_shared_deinit(sparse_set_shared_t *shared) {
+    // A set whose private index cannot be built while the shared pages are
+    // still allocated retries once they are freed; they are several times
+    // the size of the private pages it needs.
+    uint64_t pending = 0;
+    for (uint32_t bit = 0; bit < SPARSE_SET_SHARED_MAX_SETS; bit++) {
+        sparse_set_t *set = shared->sets[bit];
+        if (set && !sparse_set_shared_detach(set)) pending |= 1ull << bit;
+    }
+    shared_free_storage(shared);
+
+    for (; pending; pending &= pending - 1) {
+        sparse_set_t *set = shared->sets[SPARSE_SET_POPCOUNT64((pending & -pending) - 1)];
+        shared_unregister(set);
+        if (sparse_set_rebuild_index(set)) {
+            if (set->adaptive) sparse_set_set_adaptive(set, true);
+            continue;
+        }
+        // Out of memory even then: the set has no index to keep its
+        // members in.
+        sparse_set_release_index(set);
+        set->size = 0;
+        if (set->group) set->group->size = 0;
+    }
+}
+
+uint32_t* sparse_set_shared_add(sparse_set_shared_t *shared, uint32_t bit, uint32_t index) {
+    sparse_set_shared_page_t **entry = shared_page_entry(shared, index >> SPARSE_SET_PAGE_SHIFT, true);
+    if (!entry) return NULL;
+    if (!*entry) {
+        *entry = (sparse_set_shared_page_t*)sparse_set_calloc(shared->allocator, 1, sizeof(sparse_set_shared_page_t));
+        if (!*entry) return NULL;
+        shared->page_count++;
+    }
+    sparse_set_shared_page_t *page = *entry;
+    sparse_set_shared_slot_t *slot = &page->slots[index & SPARSE_SET_PAGE_MASK];
+
+    uint32_t count = SPARSE_SET_POPCOUNT64(slot->mask);
+    uint32_t rank = sparse_set_shared_rank(slot->mask, bit);
+    uint32_t *pos;
+    if (count + 1 <= SPARSE_SET_SHARED_INLINE) {
+        pos = slot->pos.inline_pos;
+    } else if (count <= SPARSE_SET_SHARED_INLINE) {
+        uint32_t capacity = shared_block_capacity(count + 1);
+        uint32_t *heap = (uint32_t*)sparse_set_alloc(shared->allocator, capacity * sizeof(uint32_t));
+        if (!heap) return NULL;
+        heap[0] = capacity;
+        memcpy(heap + 1, slot->pos.inline_pos, count * sizeof(uint32_t));
+        slot->pos.heap = heap;
+        pos = heap + 1;
+    } else {
+        uint32_t *heap = slot->pos.heap;
+        if (count + 1 > heap[0] - 1) {
+            uint32_t capacity = shared_block_capacity(count + 1);
+            heap = (uint32_t*)sparse_set_realloc(shared->allocator, heap,
+                heap[0] * sizeof(uint32_t), capacity * sizeof(uint32_t));
+            if (!heap) return NULL;
+            heap[0] = capacity;
+            slot->pos.heap = heap;
+        }
+        pos = heap + 1;
+    }
+
+    memmove(pos + rank + 1, pos + rank, (count - rank) * sizeof(uint32_t));
+    pos[rank] = SPARSE_SET_INVALID_POS;
+    if (!slot->mask) page->live++;
+    slot->mask |= 1ull << bit;
+    return pos + rank;
+}
+
+void sparse_set_shared_drop(sparse_set_shared_t *shared, uint32_t bit, uint32_t index) {
+    sparse_set_shared_page_t *page = sparse_set_shared_page(shared, index >> SPARSE_SET_PAGE_SHIFT);
+    if (!page) return;
+    sparse_set_shared_slot_t *slot = &page->slots[index & SPARSE_SET_PAGE_MASK];
+    if (!((slot->mask >> bit) & 1)) return;
+
+    uint32_t count = SPARSE_SET_POPCOUNT64(slot->mask);
+    uint32_t rank = sparse_set_shared_rank(slot->mask, bit);
+    uint32_t *pos = sparse_set_shared_positions(slot);
+    memmove(pos + rank, pos + rank + 1, (count - rank - 1) * sizeof(uint32_t));
+    slot->mask &= ~(1ull << bit);
+    if (!slot->mask) page->live--;
+
+    if (count > SPARSE_SET_SHARED_INLINE) {
+        uint32_t *heap = slot->pos.heap;
+        if (count - 1 <= SPARSE_SET_SHARED_INLINE) {
+            memcpy(slot->pos.inline_pos, heap + 1, (count - 1) * sizeof(uint32_t));
+            sparse_set_free(shared->allocator, heap, heap[0] * sizeof(uint32_t));
+        } else if (count - 1 < heap[0] / 4) {
+            // A failed shrink keeps the larger block, which is still valid.
+            uint32_t capacity = heap[0] / 2;
+            uint32_t old_capacity = heap[0];
+            heap[0] = capacity;
+            uint32_t *smaller = (uint32_t*)sparse_set_realloc(shared->allocator, heap,
+                old_capacity * sizeof(uint32_t), capacity * sizeof(uint32_t));
+            if (smaller) slot->pos.heap = smaller;
+            else heap[0] = old_capacity;
+        }
+    }
+}
+
+static void shared_register(sparse_set_shared_t *shared, sparse_set_t *set, uint32_t bit) {
+    shared->sets[bit] = set;
+    shared->used |= 1ull << bit;
+    shared->epoch++;
+    set->shared = shared;
+    set->shared_bit = bit;
+}
+
+bool sparse_set_shared_attach(sparse_set_shared_t *shared, sparse_set_t *set) {
+    if (set->shared || shared->used == ~0ull) return false;
+    uint32_t bit = 0;
+    while ((shared->used >> bit) & 1) bit++;
+
+    for (uint32_t pos = 0; pos < set->size; pos++) {
+        uint32_t *slot = sparse_set_shared_add(shared, bit, ID_INDEX(set->dense[pos]));
+        if (!slot) {
+            for (uint32_t i = 0; i < pos; i++) {
+                sparse_set_shared_drop(shared, bit, ID_INDEX(set->dense[i]));
+            }
+            return false;
+        }
+        *slot = pos;
+    }
+
+    sparse_set_release_index(set);
+    shared_register(shared, set, bit);
+    return true;
+}
+
+void sparse_set_shared_leave(sparse_set_t *set) {
+    if (!set->shared) return;
+    for (uint32_t pos = 0; pos < set->size; pos++) {
+        sparse_set_shared_drop(set->shared, set->shared_bit, ID_INDEX(set->dense[pos]));
+    }
+    shared_unregister(set);
+}
+
+bool sparse_set_shared_detach(sparse_set_t *set) {
+    sparse_set_shared_t *shared = set->shared;
+    if (!shared) return true;
+
+    uint32_t bit = set->shared_bit;
+    set->shared = NULL;
+    if (!sparse_set_rebuild_index(set)) {
+        sparse_set_release_index(set);
+        set->shared = shared;
+        return false;
+    }
+    for (uint32_t pos = 0; pos < set->size; pos++) {
+        sparse_set_shared_drop(shared, bit, ID_INDEX(set->dense[pos]));
+    }
+    set->shared = shared;
+    shared_unregister(set);
+    if (set->adaptive) sparse_set_set_adaptive(set, true);
+    return true;
+}
+
+bool sparse_set_shared_contains(const sparse_set_shared_t *shared, sparse_set_id_t id, uint64_t mask) {
+    sparse_set_shared_slot_t *slot = sparse_set_shared_entry(shared, ID_INDEX(id));
+    if (!slot || (slot->mask & mask) != mask) return false;
+
+    const uint32_t *positions = sparse_set_shared_positions(slot);
+    for (uint64_t rest = mask; rest; rest &= rest - 1) {
+        uint32_t bit = SPARSE_SET_POPCOUNT64((rest & -rest) - 1);
+        const sparse_set_t *set = shared->sets[bit];
+        if (!set || set->dense[positions[sparse_set_shared_rank(slot->mask, bit)]] != id) return false;
+    }
+    return true;
+}
+
+void sparse_set_shared_shrink_to_fit(sparse_set_shared_t *shared) {
+    for (uint32_t i = 0; i < shared->page_capacity; i++) {
+        if (shared->pages[i] && shared->pages[i]->live == 0) {
+            shared_free_page(shared, shared->pages[i]);
+            shared->pages[i] = NULL;
+        }
+    }
+    if (!shared->blocks) return;
+    for (uint32_t i = 0; i < SPARSE_SET_BLOCK_COUNT; i++) {
+        sparse_set_shared_page_t **block = shared->blocks[i];
+        if (!block) continue;
+        bool any_page = false;
+        for (uint32_t j = 0; j < SPARSE_SET_BLOCK_SIZE; j++) {
+            if (!block[j]) continue;
+            if (block[j]->live == 0) {
+                shared_free_page(shared, block[j]);
+                block[j] = NULL;
+            } else {
+                any_page = true;
+            }
+        }
+        if (!any_page) {
+            sparse_set_free(shared->allocator, block, SPARSE_SET_BLOCK_SIZE * sizeof(sparse_set_shared_page_t*));
+            shared->blocks[i] = NULL;
+        }
+    }
+}
@@ -0,0 +1,257 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <stdlib.h>
+
+// Snapshot layout (native byte order, all fields packed):
+//
+//   set:      u32 magic 'SSET', u32 version, u32 byte order mark,
+//             u32 size, u32 stride, u32 column_count, u32 types[column_count],
+//             u64 ids[size], then rows: size * stride bytes for AoS data, or
+//             each column's size * column bytes in turn.
+//   registry: u32 magic 'SREG', u32 version, u32 byte order mark,
+//             u32 next_index, u32 recycle_count,
+//             u32 generations[next_index], u32 recycle[recycle_count].
+//
+// The byte order mark rejects snapshots taken on a machine of the other
+// endianness instead of silently misreading them.
+
+#define SNAPSHOT_MAGIC_SET 0x54455353u
+#define SNAPSHOT_MAGIC_REGISTRY 0x47455253u
+#define SNAPSHOT_BOM 0x01020304u
+#define SNAPSHOT_HEADER_SIZE (3 * sizeof(uint32_t))
+
+typedef struct {
+    const uint8_t *ptr;
+    size_t left;
+} snapshot_reader_t;
+
+static uint8_t *snapshot_put(uint8_t *out, const void *src, size_t len) {
+    memcpy(out, src, len);
+    return out + len;
+}
+
+static uint8_t *snapshot_put_u32(uint8_t *out, uint32_t value) {
+    return snapshot_put(out, &value, sizeof(value));
+}
+
+static const uint8_t *snapshot_take(snapshot_reader_t *r, size_t len) {
+    if (r->left < len) return NULL;
+    const uint8_t *p = r->ptr;
+    r->ptr += len;
+    r->left -= len;
+    return p;
+}
+
+static bool snapshot_take_u32(snapshot_reader_t *r, uint32_t *value) {
+    const uint8_t *p = snapshot_take(r, sizeof(*value));
+    if (!p) return false;
+    memcpy(value, p, sizeof(*value));
+    return true;
+}
+
+static bool snapshot_check_header(snapshot_reader_t *r, uint32_t magic) {
+    uint32_t got_magic, version, bom;
+    return snapshot_take_u32(r, &got_magic) && got_magic == magic &&
+           snapshot_take_u32(r, &version) && version == SPARSE_SET_SNAPSHOT_VERSION &&
+           snapshot_take_u32(r, &bom) && bom == SNAPSHOT_BOM;
+}
+
+static size_t snapshot_row_bytes(const sparse_set_t *set) {
+    return set->data || set->columns ? set->stride : 0;
+}
+
+size_t sparse_set_snapshot_size(const sparse_set_t *set) {
+    return SNAPSHOT_HEADER_SIZE + 3 * sizeof(uint32_t) +
+           (size_t)set->column_count * sizeof(uint32_t) +
+           (size_t)set->size * (sizeof(sparse_set_id_t) + snapshot_row_bytes(set));
+}
+
+size_t sparse_set_snapshot_write(const sparse_set_t *set, void *out, size_t capacity) {
+    size_t total = sparse_set_snapshot_size(set);
+    if (capacity < total) return 0;
+
+    uint8_t *p = (uint8_t*)out;
+    p = snapshot_put_u32(p, SNAPSHOT_MAGIC_SET);
+    p = snapshot_put_u32(p, SPARSE_SET_SNAPSHOT_VERSION);
+    p = snapshot_put_u32(p, SNAPSHOT_BOM);
+    p = snapshot_put_u32(p, set->size);
+    p = snapshot_put_u32(p, set->data || set->columns ? set->stride : 0);
+    p = snapshot_put_u32(p, set->column_count);
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        p = snapshot_put_u32(p, (uint32_t)set->columns[i].type);
+    }
+    p = snapshot_put(p, set->dense, (size_t)set->size * sizeof(sparse_set_id_t));
+    if (set->data) {
+        p = snapshot_put(p, set->data, (size_t)set->size * set->stride);
+    }
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        const sparse_set_column_t *column = &set->columns[i];
+        p = snapshot_put(p, column->data, (size_t)set->size * column->size);
+    }
+    return total;
+}
+
+static int snapshot_compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// True when no two ids share an entity index (a set holds one version per
+// index); false on a repeat or allocation failure.
+static bool snapshot_ids_unique(sparse_set_allocator_t *a, const sparse_set_id_t *ids, uint32_t size) {
+    if (size < 2) return true;
+    uint32_t *index = (uint32_t*)sparse_set_alloc(a, (size_t)size * sizeof(uint32_t));
+    if (!index) return false;
+    for (uint32_t i = 0; i < size; i++) index[i] = ID_INDEX(ids[i]);
+    qsort(index, size, sizeof(uint32_t), snapshot_compare_u32);
+    bool unique = true;
+    for (uint32_t i = 1; i < size && unique; i++) unique = index[i] != index[i - 1];
+    sparse_set_free(a, index, (size_t)size * sizeof(uint32_t));
+    return unique;
+}
+
+bool sparse_set_snapshot_read(sparse_set_t *set, const void *in, size_t len) {
+    if (set->group) return false;
+
+    snapshot_reader_t r = { (const uint8_t*)in, len };
+    uint32_t size, stride, column_count;
+    if (!snapshot_check_header(&r, SNAPSHOT_MAGIC_SET) ||
+        !snapshot_take_u32(&r, &size) ||
+        !snapshot_take_u32(&r, &stride) ||
+        !snapshot_take_u32(&r, &column_count)) {
+        return false;
+    }
+
+    // The layout must match the target set exactly.
+    if (stride != snapshot_row_bytes(set) || column_count != set->column_count) return false;
+    for (uint32_t i = 0; i < column_count; i++) {
+        uint32_t type;
+        if (!snapshot_take_u32(&r, &type) || (int)type != set->columns[i].type) return false;
+    }
+    if (size > SPARSE_SET_MAX_DENSE) return false;
+
+    const uint8_t *ids = snapshot_take(&r, (size_t)size * sizeof(sparse_set_id_t));
+    const uint8_t *rows = snapshot_take(&r, (size_t)size * stride);
+    if (!ids || !rows || r.left != 0) return false;
+
+    // insert_many does the bulk reserve and rebuilds the sparse index in one
+    // pass; ids must be unique so positions come out as 0..size-1.
+    size_t id_bytes = (size_t)(size ? size : 1) * sizeof(sparse_set_id_t);
+    sparse_set_id_t *id_buf = (sparse_set_id_t*)sparse_set_alloc(set->allocator, id_bytes);
+    if (!id_buf) return false;
+    memcpy(id_buf, ids, (size_t)size * sizeof(sparse_set_id_t));
+
+    // Everything that can be checked is checked before the set is cleared,
+    // so a rejected snapshot leaves it untouched.
+    if (!snapshot_ids_unique(set->allocator, id_buf, size) || !sparse_set_reserve(set, size)) {
+        sparse_set_free(set->allocator, id_buf, id_bytes);
+        return false;
+    }
+
+    sparse_set_clear(set);
+    uint32_t added = size ? sparse_set_insert_many(set, id_buf, size, NULL) : 0;
+    sparse_set_free(set->allocator, id_buf, id_bytes);
+    if (added == SPARSE_SET_INVALID_POS || set->size != size) {
+        sparse_set_clear(set);
+        return false;
+    }
+
+    if (set->data) {
+        memcpy(set->data, rows, (size_t)size * stride);
+    }
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        sparse_set_column_t *column = &set->columns[i];
+        memcpy(column->data, rows, (size_t)size * column->size);
+        rows += (size_t)size * column->size;
+    }
+    return true;
+}
+
+size_t registry_snapshot_size(const registry_t *reg) {
+    return SNAPSHOT_HEADER_SIZE + 2 * sizeof(uint32_t) +
+           ((size_t)reg->next_index + reg->recycle_count) * sizeof(uint32_t);
+}
+
+size_t registry_snapshot_write(const registry_t *reg, void *out, size_t capacity) {
+    size_t total = registry_snapshot_size(reg);
+    if (capacity < total) return 0;
+
+    uint8_t *p = (uint8_t*)out;
+    p = snapshot_put_u32(p, SNAPSHOT_MAGIC_REGISTRY);
+    p = snapshot_put_u32(p, SPARSE_SET_SNAPSHOT_VERSION);
+    p = snapshot_put_u32(p, SNAPSHOT_BOM);
+    p = snapshot_put_u32(p, reg->next_index);
+    p = snapshot_put_u32(p, reg->recycle_count);
+    for (uint32_t index = 0; index < reg->next_index; index += SPARSE_SET_PAGE_SIZE) {
+        uint32_t count = reg->next_index - index;
+        if (count > SPARSE_SET_PAGE_SIZE) count = SPARSE_SET_PAGE_SIZE;
+        p = snapshot_put(p, reg->generations[index >> SPARSE_SET_PAGE_SHIFT], count * sizeof(uint32_t));
+    }
+    p = snapshot_put(p, reg->recycle, (size_t)reg->recycle_count * sizeof(uint32_t));
+    return total;
+}
+
+bool registry_snapshot_read(registry_t *reg, const void *in, size_t len) {
+    snapshot_reader_t r = { (const uint8_t*)in, len };
+    uint32_t next_index, recycle_count;
+    if (!snapshot_check_header(&r, SNAPSHOT_MAGIC_REGISTRY) ||
+        !snapshot_take_u32(&r, &next_index) ||
+        !snapshot_take_u32(&r, &recycle_count) ||
+        next_index == UINT32_MAX || recycle_count > next_index) {
+        return false;
+    }
+    const uint8_t *gens = snapshot_take(&r, (size_t)next_index * sizeof(uint32_t));
+    const uint8_t *recycle = snapshot_take(&r, (size_t)recycle_count * sizeof(uint32_t));
+    if (!gens || !recycle || r.left != 0) return false;
+
+    // Build into a fresh registry and swap it in only once complete.
+    registry_t fresh;
+    uint32_t pages = (uint32_t)(((uint64_t)next_index + SPARSE_SET_PAGE_SIZE - 1) >> SPARSE_SET_PAGE_SHIFT);
+    fresh.generations_capacity = SPARSE_SET_DEFAULT_CAPACITY;
+    while (fresh.generations_capacity < pages) fresh.generations_capacity *= 2;
+    fresh.recycle_capacity = recycle_count > SPARSE_SET_DEFAULT_CAPACITY ? recycle_count : SPARSE_SET_DEFAULT_CAPACITY;
+    fresh.recycle_count = recycle_count;
+    fresh.next_index = next_index;
+    fresh.version_mask = reg->version_mask;
+    fresh.auto_shrink = reg->auto_shrink;
+    fresh.allocator = reg->allocator;
+    fresh.counters = reg->counters;
+    fresh.generations = (uint32_t**)sparse_set_calloc(fresh.allocator, fresh.generations_capacity, sizeof(uint32_t*));
+    fresh.recycle = (uint32_t*)sparse_set_alloc(fresh.allocator, fresh.recycle_capacity * sizeof(uint32_t));
+    if (!fresh.generations || !fresh.recycle) goto fail;
+
+    for (uint32_t page = 0; page < pages; page++) {
+        uint32_t *gen_page = sparse_set_page_alloc(fresh.allocator);
+        if (!gen_page) goto fail;
+        memset(gen_page, 0, SPARSE_SET_PAGE_SIZE * sizeof(uint32_t));
+        fresh.generations[page] = gen_page;
+        uint32_t first = page << SPARSE_SET_PAGE_SHIFT;
+        uint32_t count = next_index - first;
+        if (count > SPARSE_SET_PAGE_SIZE) count = SPARSE_SET_PAGE_SIZE;
+        memcpy(gen_page, gens + (size_t)first * sizeof(uint32_t), count * sizeof(uint32_t));
+    }
+
+    // Each free index may appear once; a repeat would hand the same id out
+    // twice.
+    memcpy(fresh.recycle, recycle, (size_t)recycle_count * sizeof(uint32_t));
+    size_t seen_size = (size_t)next_index / 8 + 1;
+    uint8_t *seen = (uint8_t*)sparse_set_calloc(fresh.allocator, seen_size, 1);
+    if (!seen) goto fail;
+    for (uint32_t i = 0; i < recycle_count; i++) {
+        uint32_t index = fresh.recycle[i];
+        if (index >= next_index || (seen[index >> 3] & (1u << (index & 7)))) {
+            sparse_set_free(fresh.allocator, seen, seen_size);
+            goto fail;
+        }
+        seen[index >> 3] |= (uint8_t)(1u << (index & 7));
+    }
+    sparse_set_free(fresh.allocator, seen, seen_size);
+
+    registry_deinit(reg);
+    *reg = fresh;
+    return true;
+
+fail:
+    registry_deinit(&fresh);
+    return false;
+}
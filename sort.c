@@ -0,0 +1,251 @@
+#include "sparse-set.h"
+#include <string.h>
+#include <stdlib.h>
+
+// Sorting computes a permutation first (order[i] = old position moved to
+// position i) and applies it in one pass, so a failing key/comparator never
+// leaves the set half sorted. Owned sets are sorted within two independent
+// ranges, the grouped prefix and the tail, and the prefix permutation is
+// replayed on every other set of the group to keep them aligned.
+
+static uint32_t sort_split(const sparse_set_t *set) {
+    return set->group ? set->group->size : 0;
+}
+
+// Stable LSD radix sort of order[lo, hi) by keys[lo, hi) (key_bytes wide).
+// Passes whose byte is the same for every key are skipped.
+static void sort_radix_range(uint64_t *keys, uint32_t *order, uint64_t *tmp_keys, uint32_t *tmp_order,
+                             uint32_t lo, uint32_t hi, uint32_t key_bytes) {
+    uint32_t n = hi - lo;
+    if (n < 2) return;
+
+    uint64_t *src_k = keys + lo, *dst_k = tmp_keys + lo;
+    uint32_t *src_o = order + lo, *dst_o = tmp_order + lo;
+
+    for (uint32_t byte = 0; byte < key_bytes; byte++) {
+        uint32_t shift = byte * 8;
+        uint32_t count[256] = {0};
+        for (uint32_t i = 0; i < n; i++) count[(src_k[i] >> shift) & 0xFF]++;
+        if (count[(src_k[0] >> shift) & 0xFF] == n) continue;
+
+        uint32_t sum = 0;
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t dst = count[(src_k[i] >> shift) & 0xFF]++;
+            dst_k[dst] = src_k[i];
+            dst_o[dst] = src_o[i];
+        }
+
+        uint64_t *swap_k = src_k; src_k = dst_k; dst_k = swap_k;
+        uint32_t *swap_o = src_o; src_o = dst_o; dst_o = swap_o;
+    }
+
+    if (src_o != order + lo) {
+        memcpy(order + lo, src_o, n * sizeof(uint32_t));
+    }
+}
+
+// Sorts order[] by keys[] within the group split and applies it.
+static bool sort_by_keys(sparse_set_t *set, uint64_t *keys, uint32_t key_bytes, uint32_t *order_out) {
+    uint32_t n = set->size;
+    if (n < 2) {
+        if (order_out && n == 1) order_out[0] = 0;
+        return true;
+    }
+
+    sparse_set_allocator_t *a = set->allocator;
+    uint32_t *order = order_out ? order_out : (uint32_t*)sparse_set_alloc(a, n * sizeof(uint32_t));
+    uint64_t *tmp_keys = (uint64_t*)sparse_set_alloc(a, n * sizeof(uint64_t));
+    uint32_t *tmp_order = (uint32_t*)sparse_set_alloc(a, n * sizeof(uint32_t));
+    bool ok = order && tmp_keys && tmp_order;
+
+    if (ok) {
+        for (uint32_t i = 0; i < n; i++) order[i] = i;
+        uint32_t split = sort_split(set);
+        sort_radix_range(keys, order, tmp_keys, tmp_order, 0, split, key_bytes);
+        sort_radix_range(keys, order, tmp_keys, tmp_order, split, n, key_bytes);
+        ok = sparse_set_permute(set, order);
+    }
+
+    sparse_set_free(a, tmp_keys, n * sizeof(uint64_t));
+    sparse_set_free(a, tmp_order, n * sizeof(uint32_t));
+    if (!order_out) sparse_set_free(a, order, n * sizeof(uint32_t));
+    return ok;
+}
+
+static uint64_t *sort_keys_alloc(const sparse_set_t *set) {
+    return (uint64_t*)sparse_set_alloc(set->allocator, (size_t)(set->size ? set->size : 1) * sizeof(uint64_t));
+}
+
+static void sort_keys_free(const sparse_set_t *set, uint64_t *keys) {
+    sparse_set_free(set->allocator, keys, (size_t)(set->size ? set->size : 1) * sizeof(uint64_t));
+}
+
+static uint64_t sort_field_key(const uint8_t *ptr, int type) {
+    switch (type) {
+        case SPARSE_SET_TYPE_INT: {
+            uint32_t bits;
+            memcpy(&bits, ptr, sizeof(bits));
+            return bits ^ 0x80000000u;
+        }
+        case SPARSE_SET_TYPE_FLOAT: {
+            uint32_t bits;
+            memcpy(&bits, ptr, sizeof(bits));
+            return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+        }
+        case SPARSE_SET_TYPE_DOUBLE: {
+            uint64_t bits;
+            memcpy(&bits, ptr, sizeof(bits));
+            return (bits & 0x8000000000000000ull) ? ~bits : (bits | 0x8000000000000000ull);
+        }
+        default:
+            return *ptr;
+    }
+}
+
+bool sparse_set_sort_by_id(sparse_set_t *set, uint32_t *order_out) {
+    uint64_t *keys = sort_keys_alloc(set);
+    if (!keys) return false;
+    for (uint32_t i = 0; i < set->size; i++) keys[i] = ID_INDEX(set->dense[i]);
+    bool ok = sort_by_keys(set, keys, 4, order_out);
+    sort_keys_free(set, keys);
+    return ok;
+}
+
+bool sparse_set_sort_by_field(sparse_set_t *set, const sparse_set_field_t *field, bool descending, uint32_t *order_out) {
+    uint32_t width = sparse_set_type_size(field->type);
+    if (width == 0) return false;
+    uint64_t mask = width == 8 ? ~0ull : ((1ull << (width * 8)) - 1);
+
+    uint64_t *keys = sort_keys_alloc(set);
+    if (!keys) return false;
+    for (uint32_t i = 0; i < set->size; i++) {
+        uint64_t key = sort_field_key(sparse_set_field_ptr(set, field, i), field->type);
+        keys[i] = descending ? (~key & mask) : key;
+    }
+    bool ok = sort_by_keys(set, keys, width, order_out);
+    sort_keys_free(set, keys);
+    return ok;
+}
+
+bool sparse_set_sort_like(sparse_set_t *set, const sparse_set_t *other, uint32_t *order_out) {
+    uint64_t *keys = sort_keys_alloc(set);
+    if (!keys) return false;
+    // Ids missing from `other` get key other->size and keep their order.
+    for (uint32_t i = 0; i < set->size; i++) {
+        uint32_t pos = sparse_set_index_of(other, set->dense[i]);
+        keys[i] = pos == SPARSE_SET_INVALID_POS ? other->size : pos;
+    }
+    bool ok = sort_by_keys(set, keys, 4, order_out);
+    sort_keys_free(set, keys);
+    return ok;
+}
+
+static void sort_merge_range(const sparse_set_t *set, sparse_set_less_fn less, void *ud,
+                             uint32_t *order, uint32_t *scratch, uint32_t lo, uint32_t hi) {
+    // Bottom-up merge sort ping-ponging between order and scratch.
+    uint32_t *src = order, *dst = scratch;
+    for (uint32_t width = 1; width < hi - lo; width *= 2) {
+        for (uint32_t start = lo; start < hi; start += 2 * width) {
+            uint32_t mid = start + width < hi ? start + width : hi;
+            uint32_t end = mid + width < hi ? mid + width : hi;
+            uint32_t i = start, j = mid, k = start;
+            while (i < mid && j < end) {
+                dst[k++] = less(ud, set, src[j], src[i]) ? src[j++] : src[i++];
+            }
+            while (i < mid) dst[k++] = src[i++];
+            while (j < end) dst[k++] = src[j++];
+        }
+        uint32_t *swap = src; src = dst; dst = swap;
+    }
+    if (src != order) memcpy(order + lo, src + lo, (hi - lo) * sizeof(uint32_t));
+}
+
+void sparse_set_sort_order(const sparse_set_t *set, sparse_set_less_fn less, void *ud,
+                           uint32_t *order, uint32_t *scratch) {
+    // Bounds are taken once: the buffers hold the size at entry, whatever
+    // `less` does to the set.
+    uint32_t n = set->size;
+    uint32_t split = sort_split(set);
+    for (uint32_t i = 0; i < n; i++) order[i] = i;
+    sort_merge_range(set, less, ud, order, scratch, 0, split);
+    sort_merge_range(set, less, ud, order, scratch, split, n);
+}
+
+static size_t sort_row_bytes(const sparse_set_t *set) {
+    size_t row_bytes = set->data ? set->stride : 0;
+    for (uint32_t c = 0; c < set->column_count; c++) {
+        if (set->columns[c].size > row_bytes) row_bytes = set->columns[c].size;
+    }
+    return row_bytes < sizeof(sparse_set_id_t) ? sizeof(sparse_set_id_t) : row_bytes;
+}
+
+// Applies order to positions [0, n) of one set; tmp holds n rows of
+// sort_row_bytes(set).
+static void sort_apply(sparse_set_t *set, const uint32_t *order, uint32_t n, uint8_t *tmp) {
+    sparse_set_id_t *ids = (sparse_set_id_t*)tmp;
+    for (uint32_t i = 0; i < n; i++) ids[i] = set->dense[order[i]];
+    memcpy(set->dense, ids, (size_t)n * sizeof(sparse_set_id_t));
+
+    if (set->data) {
+        for (uint32_t i = 0; i < n; i++) {
+            memcpy(tmp + (size_t)i * set->stride, set->data + (size_t)order[i] * set->stride, set->stride);
+        }
+        memcpy(set->data, tmp, (size_t)n * set->stride);
+    }
+    for (uint32_t c = 0; c < set->column_count; c++) {
+        sparse_set_column_t *column = &set->columns[c];
+        for (uint32_t i = 0; i < n; i++) {
+            memcpy(tmp + (size_t)i * column->size, column->data + (size_t)order[i] * column->size, column->size);
+        }
+        memcpy(column->data, tmp, (size_t)n * column->size);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        *sparse_set_slot(set, ID_INDEX(set->dense[i])) = i;
+    }
+}
+
+bool sparse_set_permute(sparse_set_t *set, const uint32_t *order) {
+    // A repeated position would duplicate an id in dense, so check that
+    // order really is a permutation.
+    uint32_t split = sort_split(set);
+    size_t seen_size = (size_t)set->size / 8 + 1;
+    uint8_t *seen = (uint8_t*)sparse_set_calloc(set->allocator, seen_size, 1);
+    if (!seen) return false;
+    bool valid = true;
+    for (uint32_t i = 0; i < set->size && valid; i++) {
+        uint32_t p = order[i];
+        valid = p < set->size && (i < split) == (p < split) && !(seen[p >> 3] & (1u << (p & 7)));
+        if (valid) seen[p >> 3] |= (uint8_t)(1u << (p & 7));
+    }
+    sparse_set_free(set->allocator, seen, seen_size);
+    if (!valid) return false;
+
+    // One scratch buffer sized for every set touched, so nothing can fail
+    // once the first set has been reordered.
+    size_t bytes = (size_t)set->size * sort_row_bytes(set);
+    if (set->group && split > 0) {
+        for (uint32_t s = 0; s < set->group->set_count; s++) {
+            size_t owned_bytes = (size_t)split * sort_row_bytes(set->group->sets[s]);
+            if (owned_bytes > bytes) bytes = owned_bytes;
+        }
+    }
+    if (bytes == 0) bytes = 1;
+    uint8_t *tmp = (uint8_t*)sparse_set_alloc(set->allocator, bytes);
+    if (!tmp) return false;
+
+    sort_apply(set, order, set->size, tmp);
+    if (set->group && split > 0) {
+        for (uint32_t s = 0; s < set->group->set_count; s++) {
+            sparse_set_t *owned = set->group->sets[s];
+            if (owned != set) sort_apply(owned, order, split, tmp);
+        }
+    }
+    sparse_set_free(set->allocator, tmp, bytes);
+    return true;
+}
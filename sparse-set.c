@@ -4,88 +4,439 @@
 #include <stdlib.h>
 
 bool sparse_set_init(sparse_set_t *set) {
-    set->sparse = (uint32_t**)calloc(SPARSE_SET_DEFAULT_CAPACITY, sizeof(uint32_t*));
-    set->dense = (sparse_set_id_t*)malloc(SPARSE_SET_DEFAULT_CAPACITY * sizeof(sparse_set_id_t));
+    return sparse_set_init_alloc(set, &sparse_set_default_allocator);
+}
+
+bool sparse_set_init_alloc(sparse_set_t *set, sparse_set_allocator_t *allocator) {
+    set->allocator = allocator;
+    set->sparse = (uint32_t**)sparse_set_calloc(allocator, SPARSE_SET_DEFAULT_CAPACITY, sizeof(uint32_t*));
+    set->dense = (sparse_set_id_t*)sparse_set_alloc(allocator, SPARSE_SET_DEFAULT_CAPACITY * sizeof(sparse_set_id_t));
     
     if (!set->sparse || !set->dense) {
-        if (set->sparse) free(set->sparse);
-        if (set->dense) free(set->dense);
+        sparse_set_free(allocator, set->sparse, SPARSE_SET_DEFAULT_CAPACITY * sizeof(uint32_t*));
+        sparse_set_free(allocator, set->dense, SPARSE_SET_DEFAULT_CAPACITY * sizeof(sparse_set_id_t));
         return false;
     }
 
     set->size = 0;
     set->dense_capacity = SPARSE_SET_DEFAULT_CAPACITY;
     set->sparse_capacity = SPARSE_SET_DEFAULT_CAPACITY;
+    set->sparse_blocks = NULL;
+    set->group = NULL;
+    set->mapping = NULL;
+    set->vm = NULL;
+    set->mapped_size = NULL;
+    set->spare_page = NULL;
+    set->page_count = 0;
+    set->auto_shrink = false;
+    set->changes = NULL;
+    set->shared = NULL;
+    set->shared_bit = 0;
+    set->hash = NULL;
+    set->hash_capacity = 0;
+    set->adaptive = false;
     set->stride = 0;
     set->data = NULL;
+    set->columns = NULL;
+    set->column_count = 0;
+    memset(&set->counters, 0, sizeof(set->counters));
     return true;
 }
 
 void sparse_set_deinit(sparse_set_t *set) {
     if (set) {
+        if (set->group) sparse_set_group_deinit(set->group);
+        if (set->shared) sparse_set_shared_leave(set);
+        if (set->mapping) sparse_set_unmap(set);
+        if (set->vm) sparse_set_vm_release(set);
+        sparse_set_allocator_t *a = set->allocator;
+        if (set->changes) sparse_set_destroy(set->changes);
         if (set->sparse) {
             for (uint32_t i = 0; i < set->sparse_capacity; i++) {
-                if (set->sparse[i]) free(set->sparse[i]);
+                sparse_set_page_free(a, set->sparse[i]);
+            }
+            sparse_set_free(a, set->sparse, set->sparse_capacity * sizeof(uint32_t*));
+        }
+        if (set->sparse_blocks) {
+            for (uint32_t i = 0; i < SPARSE_SET_BLOCK_COUNT; i++) {
+                uint32_t **block = set->sparse_blocks[i];
+                if (!block) continue;
+                for (uint32_t j = 0; j < SPARSE_SET_BLOCK_SIZE; j++) {
+                    sparse_set_page_free(a, block[j]);
+                }
+                sparse_set_free(a, block, SPARSE_SET_BLOCK_SIZE * sizeof(uint32_t*));
+            }
+            sparse_set_free(a, set->sparse_blocks, SPARSE_SET_BLOCK_COUNT * sizeof(uint32_t**));
+        }
+        sparse_set_page_free(a, set->spare_page);
+        sparse_set_free(a, set->hash, (size_t)set->hash_capacity * 2 * sizeof(uint32_t));
+        sparse_set_free(a, set->dense, (size_t)set->dense_capacity * sizeof(sparse_set_id_t));
+        sparse_set_free(a, set->data, (size_t)set->dense_capacity * set->stride);
+        if (set->columns) {
+            for (uint32_t i = 0; i < set->column_count; i++) {
+                sparse_set_free(a, set->columns[i].data, (size_t)set->dense_capacity * set->columns[i].size);
             }
-            free(set->sparse);
+            sparse_set_free(a, set->columns, set->column_count * sizeof(sparse_set_column_t));
         }
-        if (set->dense) free(set->dense);
-        if (set->data) free(set->data);
+        set->changes = NULL;
+        set->hash = NULL;
+        set->hash_capacity = 0;
         set->sparse = NULL;
+        set->sparse_blocks = NULL;
+        set->spare_page = NULL;
+        set->page_count = 0;
         set->dense = NULL;
         set->data = NULL;
+        set->columns = NULL;
+        set->column_count = 0;
         set->stride = 0;
     }
 }
 
-static bool sparse_set_grow_dense(sparse_set_t *set) {
-    uint32_t new_capacity = set->dense_capacity * 2;
-    sparse_set_id_t *new_dense = (sparse_set_id_t*)realloc(set->dense, new_capacity * sizeof(sparse_set_id_t));
-    if (!new_dense) return false;
-    set->dense = new_dense;
-    
-    if (set->stride > 0) {
-        uint8_t *new_data = (uint8_t*)realloc(set->data, new_capacity * set->stride);
-        if (!new_data) {
-            return false;
+// Moves dense, data and every column to blocks of new_capacity. Every new
+// block is allocated before any old one is released, so either all arrays
+// move or none does and dense_capacity always matches the size of each
+// block (the allocator is told that size on the next resize or free). A
+// failed shrink keeps the old, larger blocks, so shrinking always succeeds.
+static bool sparse_set_realloc_dense(sparse_set_t *set, uint32_t new_capacity) {
+    bool shrink = new_capacity < set->dense_capacity;
+
+    sparse_set_allocator_t *a = set->allocator;
+    size_t old_capacity = set->dense_capacity;
+    size_t keep = shrink ? new_capacity : old_capacity;
+
+    sparse_set_id_t *new_dense = (sparse_set_id_t*)sparse_set_alloc(a, (size_t)new_capacity * sizeof(sparse_set_id_t));
+    uint8_t *new_data = set->data ? (uint8_t*)sparse_set_alloc(a, (size_t)new_capacity * set->stride) : NULL;
+    uint8_t *new_columns[SPARSE_SET_MAX_COLUMNS];
+    bool ok = new_dense && (new_data || !set->data);
+    uint32_t made = 0;
+    while (ok && made < set->column_count) {
+        new_columns[made] = (uint8_t*)sparse_set_alloc(a, (size_t)new_capacity * set->columns[made].size);
+        ok = new_columns[made] != NULL;
+        if (ok) made++;
+    }
+    if (!ok) {
+        sparse_set_free(a, new_dense, (size_t)new_capacity * sizeof(sparse_set_id_t));
+        sparse_set_free(a, new_data, (size_t)new_capacity * set->stride);
+        for (uint32_t i = 0; i < made; i++) {
+            sparse_set_free(a, new_columns[i], (size_t)new_capacity * set->columns[i].size);
         }
+        return shrink;
+    }
+
+    if (keep) memcpy(new_dense, set->dense, keep * sizeof(sparse_set_id_t));
+    sparse_set_free(a, set->dense, old_capacity * sizeof(sparse_set_id_t));
+    set->dense = new_dense;
+    if (set->data) {
+        if (keep) memcpy(new_data, set->data, keep * set->stride);
+        sparse_set_free(a, set->data, old_capacity * set->stride);
         set->data = new_data;
     }
-    
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        sparse_set_column_t *column = &set->columns[i];
+        if (keep) memcpy(new_columns[i], column->data, keep * column->size);
+        sparse_set_free(a, column->data, old_capacity * column->size);
+        column->data = new_columns[i];
+    }
+
     set->dense_capacity = new_capacity;
     return true;
 }
 
-static bool sparse_set_ensure_page(sparse_set_t *set, uint32_t page_idx) {
-    if (page_idx >= set->sparse_capacity) {
-        uint32_t new_capacity = set->sparse_capacity;
-        while (new_capacity <= page_idx) new_capacity *= 2;
-        if (new_capacity > (SPARSE_SET_MAX_SIZE >> SPARSE_SET_PAGE_SHIFT) + 1) {
-            new_capacity = (SPARSE_SET_MAX_SIZE >> SPARSE_SET_PAGE_SHIFT) + 1;
+static bool sparse_set_resize_dense(sparse_set_t *set, uint32_t new_capacity) {
+    uint32_t old_capacity = set->dense_capacity;
+    bool ok = set->mapping ? sparse_set_mapping_resize(set, new_capacity)
+            : set->vm ? sparse_set_vm_resize(set, new_capacity)
+            : sparse_set_realloc_dense(set, new_capacity);
+    if (set->dense_capacity > old_capacity) set->counters.grows++;
+    else if (set->dense_capacity < old_capacity) set->counters.shrinks++;
+    return ok;
+}
+
+static bool sparse_set_grow_dense(sparse_set_t *set) {
+    if (set->dense_capacity >= SPARSE_SET_MAX_DENSE) return false;
+    uint32_t new_capacity = set->dense_capacity > SPARSE_SET_MAX_DENSE / 2
+        ? SPARSE_SET_MAX_DENSE : set->dense_capacity * 2;
+    return sparse_set_resize_dense(set, new_capacity);
+}
+
+static void sparse_set_swap_bytes(uint8_t *ptr_a, uint8_t *ptr_b, uint32_t size) {
+    uint8_t buffer[64];
+    uint32_t remaining = size;
+    uint32_t offset = 0;
+
+    while (remaining > 0) {
+        uint32_t chunk_size = (remaining > sizeof(buffer)) ? sizeof(buffer) : remaining;
+
+        memcpy(buffer, ptr_a + offset, chunk_size);
+        memcpy(ptr_a + offset, ptr_b + offset, chunk_size);
+        memcpy(ptr_b + offset, buffer, chunk_size);
+
+        remaining -= chunk_size;
+        offset += chunk_size;
+    }
+}
+
+static void sparse_set_zero_row(sparse_set_t *set, uint32_t pos) {
+    if (set->data) {
+        memset(set->data + (size_t)pos * set->stride, 0, set->stride);
+    }
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        sparse_set_column_t *column = &set->columns[i];
+        memset(column->data + (size_t)pos * column->size, 0, column->size);
+    }
+}
+
+static void sparse_set_move_row(sparse_set_t *set, uint32_t dst, uint32_t src) {
+    if (set->data) {
+        memcpy(set->data + (size_t)dst * set->stride, set->data + (size_t)src * set->stride, set->stride);
+    }
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        sparse_set_column_t *column = &set->columns[i];
+        memcpy(column->data + (size_t)dst * column->size, column->data + (size_t)src * column->size, column->size);
+    }
+}
+
+static void sparse_set_swap_rows(sparse_set_t *set, uint32_t a, uint32_t b) {
+    if (set->data) {
+        sparse_set_swap_bytes(set->data + (size_t)a * set->stride, set->data + (size_t)b * set->stride, set->stride);
+    }
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        sparse_set_column_t *column = &set->columns[i];
+        sparse_set_swap_bytes(column->data + (size_t)a * column->size, column->data + (size_t)b * column->size, column->size);
+    }
+}
+
+// Returns the directory entry that owns page_idx. With `create`, the flat
+// array is grown or tier blocks allocated as needed; without it, NULL is
+// returned when the entry does not exist yet.
+static uint32_t** sparse_set_page_entry(sparse_set_t *set, uint32_t page_idx, bool create) {
+    if (page_idx < SPARSE_SET_FLAT_PAGES) {
+        if (page_idx >= set->sparse_capacity) {
+            if (!create) return NULL;
+            uint32_t new_capacity = set->sparse_capacity;
+            while (new_capacity <= page_idx) new_capacity *= 2;
+            if (new_capacity > SPARSE_SET_FLAT_PAGES) new_capacity = SPARSE_SET_FLAT_PAGES;
+
+            uint32_t **new_sparse = (uint32_t**)sparse_set_realloc(set->allocator, set->sparse,
+                set->sparse_capacity * sizeof(uint32_t*), new_capacity * sizeof(uint32_t*));
+            if (!new_sparse) return NULL;
+
+            memset(new_sparse + set->sparse_capacity, 0, (new_capacity - set->sparse_capacity) * sizeof(uint32_t*));
+            set->sparse = new_sparse;
+            set->sparse_capacity = new_capacity;
+        }
+        return &set->sparse[page_idx];
+    }
+
+    if (!set->sparse_blocks) {
+        if (!create) return NULL;
+        set->sparse_blocks = (uint32_t***)sparse_set_calloc(set->allocator, SPARSE_SET_BLOCK_COUNT, sizeof(uint32_t**));
+        if (!set->sparse_blocks) return NULL;
+    }
+    uint32_t ***block = &set->sparse_blocks[page_idx >> SPARSE_SET_BLOCK_SHIFT];
+    if (!*block) {
+        if (!create) return NULL;
+        *block = (uint32_t**)sparse_set_calloc(set->allocator, SPARSE_SET_BLOCK_SIZE, sizeof(uint32_t*));
+        if (!*block) return NULL;
+    }
+    return &(*block)[page_idx & SPARSE_SET_BLOCK_MASK];
+}
+
+static void sparse_set_reset_page(uint32_t *page) {
+    memset(page, 0xFF, SPARSE_SET_PAGE_SIZE * sizeof(uint32_t));
+    page[SPARSE_SET_PAGE_LIVE] = 0;
+}
+
+static uint32_t* sparse_set_ensure_page(sparse_set_t *set, uint32_t page_idx) {
+    uint32_t **entry = sparse_set_page_entry(set, page_idx, true);
+    if (!entry) return NULL;
+
+    if (!*entry) {
+        if (set->spare_page) {
+            // Released pages are already all-invalid with a zero live count
+            *entry = set->spare_page;
+            set->spare_page = NULL;
+        } else {
+            *entry = sparse_set_page_alloc(set->allocator);
+            if (!*entry) return NULL;
+            sparse_set_reset_page(*entry);
+            set->counters.page_allocs++;
         }
-        if (page_idx >= new_capacity) return false;
+        set->page_count++;
+    }
+    return *entry;
+}
+
+static void sparse_set_release_page(sparse_set_t *set, uint32_t page_idx) {
+    uint32_t **entry = sparse_set_page_entry(set, page_idx, false);
+    if (!entry || !*entry) return;
+
+    if (set->spare_page) sparse_set_page_free(set->allocator, *entry);
+    else set->spare_page = *entry;
+    *entry = NULL;
+    set->page_count--;
+}
+
+static bool sparse_set_reserve_dense(sparse_set_t *set, uint64_t capacity) {
+    if (capacity >= SPARSE_SET_INVALID_POS) return false;
+    while (set->dense_capacity < capacity) {
+        if (!sparse_set_grow_dense(set)) return false;
+    }
+    return true;
+}
+
+static uint32_t sparse_set_hash_capacity_for(uint64_t count) {
+    uint32_t capacity = SPARSE_SET_HASH_MIN_CAPACITY;
+    while (capacity < count * 2 && capacity <= SPARSE_SET_HASH_MAX_CAPACITY) capacity *= 2;
+    return capacity;
+}
+
+static int sparse_set_compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
 
-        uint32_t **new_sparse = (uint32_t**)realloc(set->sparse, new_capacity * sizeof(uint32_t*));
-        if (!new_sparse) return false;
-        
-        memset(new_sparse + set->sparse_capacity, 0, (new_capacity - set->sparse_capacity) * sizeof(uint32_t*));
-        set->sparse = new_sparse;
-        set->sparse_capacity = new_capacity;
+// Number of sparse pages the set's ids would occupy (at least 1). Only
+// called with at most SPARSE_SET_HASH_MAX_CAPACITY / 2 ids.
+static uint32_t sparse_set_pages_needed(const sparse_set_t *set) {
+    if (set->size == 0) return 1;
+    uint32_t *pages = (uint32_t*)sparse_set_alloc(set->allocator, set->size * sizeof(uint32_t));
+    if (!pages) return 1;
+    for (uint32_t i = 0; i < set->size; i++) pages[i] = ID_INDEX(set->dense[i]) >> SPARSE_SET_PAGE_SHIFT;
+    qsort(pages, set->size, sizeof(uint32_t), sparse_set_compare_u32);
+    uint32_t distinct = 1;
+    for (uint32_t i = 1; i < set->size; i++) distinct += pages[i] != pages[i - 1];
+    sparse_set_free(set->allocator, pages, set->size * sizeof(uint32_t));
+    return distinct;
+}
+
+// Hash capacity for `count` ids if a table that size is smaller than the
+// pages the current ids need, else 0.
+static uint32_t sparse_set_hash_fit(const sparse_set_t *set, uint64_t count) {
+    uint32_t capacity = sparse_set_hash_capacity_for(count);
+    if (capacity > SPARSE_SET_HASH_MAX_CAPACITY) return 0;
+    uint64_t hash_bytes = (uint64_t)capacity * 2 * sizeof(uint32_t);
+    return hash_bytes < (uint64_t)sparse_set_pages_needed(set) * SPARSE_SET_PAGE_BYTES ? capacity : 0;
+}
+
+// Replaces whatever index the set has with a hash of `capacity` pairs built
+// from dense. Fails on allocation failure or duplicate indices.
+static bool sparse_set_hash_build(sparse_set_t *set, uint32_t capacity) {
+    size_t bytes = (size_t)capacity * 2 * sizeof(uint32_t);
+    uint32_t *hash = (uint32_t*)sparse_set_alloc(set->allocator, bytes);
+    if (!hash) return false;
+    memset(hash, 0xFF, bytes);
+
+    uint32_t mask = capacity - 1;
+    for (uint32_t pos = 0; pos < set->size; pos++) {
+        uint32_t index = ID_INDEX(set->dense[pos]);
+        uint32_t i = sparse_set_hash_home(index, mask);
+        for (; hash[2 * i + 1] != SPARSE_SET_INVALID_POS; i = (i + 1) & mask) {
+            if (hash[2 * i] == index) {
+                sparse_set_free(set->allocator, hash, bytes);
+                return false;
+            }
+        }
+        hash[2 * i] = index;
+        hash[2 * i + 1] = pos;
     }
 
-    if (!set->sparse[page_idx]) {
-        set->sparse[page_idx] = (uint32_t*)malloc(SPARSE_SET_PAGE_SIZE * sizeof(uint32_t));
-        if (!set->sparse[page_idx]) return false;
-        memset(set->sparse[page_idx], 0xFF, SPARSE_SET_PAGE_SIZE * sizeof(uint32_t));
+    sparse_set_release_index(set);
+    set->hash = hash;
+    set->hash_capacity = capacity;
+    set->counters.rehashes++;
+    return true;
+}
+
+static bool sparse_set_hash_to_pages(sparse_set_t *set) {
+    uint32_t *hash = set->hash;
+    uint32_t capacity = set->hash_capacity;
+    set->hash = NULL;
+    set->hash_capacity = 0;
+    if (!sparse_set_rebuild_index(set)) {
+        sparse_set_release_index(set);
+        set->hash = hash;
+        set->hash_capacity = capacity;
+        return false;
     }
+    sparse_set_free(set->allocator, hash, (size_t)capacity * 2 * sizeof(uint32_t));
     return true;
 }
 
+// Makes room for `count` ids, growing the hash while it still beats pages
+// and moving the set to pages once it does not.
+static bool sparse_set_hash_reserve(sparse_set_t *set, uint64_t count) {
+    if (count * 2 <= set->hash_capacity) return true;
+    uint32_t capacity = sparse_set_hash_fit(set, count);
+    if (capacity) return sparse_set_hash_build(set, capacity);
+    return sparse_set_hash_to_pages(set);
+}
+
+// The table must have room; the caller stores the position.
+static uint32_t* sparse_set_hash_add(sparse_set_t *set, uint32_t index) {
+    uint32_t mask = set->hash_capacity - 1;
+    uint32_t i = sparse_set_hash_home(index, mask);
+    while (set->hash[2 * i + 1] != SPARSE_SET_INVALID_POS) i = (i + 1) & mask;
+    set->hash[2 * i] = index;
+    return &set->hash[2 * i + 1];
+}
+
+// Backward-shift deletion: later pairs of the probe run move up into the
+// hole, so lookups never need tombstones.
+static void sparse_set_hash_remove(sparse_set_t *set, uint32_t index) {
+    uint32_t *pos = sparse_set_hash_find(set, index);
+    if (!pos) return;
+    uint32_t mask = set->hash_capacity - 1;
+    uint32_t hole = (uint32_t)(pos - 1 - set->hash) / 2;
+    for (uint32_t i = (hole + 1) & mask; set->hash[2 * i + 1] != SPARSE_SET_INVALID_POS; i = (i + 1) & mask) {
+        uint32_t home = sparse_set_hash_home(set->hash[2 * i], mask);
+        // The pair may fill the hole unless its home lies in (hole, i].
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            set->hash[2 * hole] = set->hash[2 * i];
+            set->hash[2 * hole + 1] = set->hash[2 * i + 1];
+            hole = i;
+        }
+    }
+    set->hash[2 * hole + 1] = SPARSE_SET_INVALID_POS;
+}
+
+bool sparse_set_set_adaptive(sparse_set_t *set, bool enabled) {
+    set->adaptive = enabled;
+    if (set->shared) return true;
+    if (!enabled) return !set->hash || sparse_set_hash_to_pages(set);
+    if (set->hash) return true;
+    uint32_t capacity = sparse_set_hash_fit(set, set->size);
+    return !capacity || sparse_set_hash_build(set, capacity);
+}
+
+// Claims the slot of an index the set does not hold yet where slots only
+// exist for members (shared index, hash). The hash may move to pages on
+// the way; a paged slot comes back with its page's live count bumped.
+static uint32_t* sparse_set_claim_slot(sparse_set_t *set, uint32_t index) {
+    if (set->shared) return sparse_set_shared_add(set->shared, set->shared_bit, index);
+    if (set->hash && !sparse_set_hash_reserve(set, (uint64_t)set->size + 1)) return NULL;
+    if (set->hash) return sparse_set_hash_add(set, index);
+    uint32_t *page = sparse_set_ensure_page(set, index >> SPARSE_SET_PAGE_SHIFT);
+    if (!page) return NULL;
+    page[SPARSE_SET_PAGE_LIVE]++;
+    return &page[index & SPARSE_SET_PAGE_MASK];
+}
+
+static void sparse_set_drop_slot(sparse_set_t *set, uint32_t index) {
+    if (set->shared) sparse_set_shared_drop(set->shared, set->shared_bit, index);
+    else sparse_set_hash_remove(set, index);
+}
+
 sparse_set_t* sparse_set_create() {
-    sparse_set_t *set = (sparse_set_t*)malloc(sizeof(sparse_set_t));
+    return sparse_set_create_alloc(&sparse_set_default_allocator);
+}
+
+sparse_set_t* sparse_set_create_alloc(sparse_set_allocator_t *allocator) {
+    sparse_set_t *set = (sparse_set_t*)sparse_set_alloc(allocator, sizeof(sparse_set_t));
     if (!set) return NULL;
-    if (!sparse_set_init(set)) {
-        free(set);
+    if (!sparse_set_init_alloc(set, allocator)) {
+        sparse_set_free(allocator, set, sizeof(sparse_set_t));
         return NULL;
     }
     return set;
@@ -93,34 +444,70 @@ sparse_set_t* sparse_set_create() {
 
 void sparse_set_destroy(sparse_set_t *set) {
     if (set) {
+        sparse_set_allocator_t *allocator = set->allocator;
         sparse_set_deinit(set);
-        free(set);
+        sparse_set_free(allocator, set, sizeof(sparse_set_t));
     }
 }
 
 bool sparse_set_contains(const sparse_set_t *set, sparse_set_id_t id) {
-    uint32_t index = ID_INDEX(id);
-    uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-    if (page_idx >= set->sparse_capacity || !set->sparse[page_idx]) return false;
-    
-    uint32_t pos = set->sparse[page_idx][index & SPARSE_SET_PAGE_MASK];
-    return pos < set->size && set->dense[pos] == id;
+    SPARSE_SET_COUNT(set, lookups, 1);
+    const uint32_t *slot = sparse_set_slot(set, ID_INDEX(id));
+    uint32_t pos = slot ? *slot : SPARSE_SET_INVALID_POS;
+    if (pos < set->size && set->dense[pos] == id) return true;
+    SPARSE_SET_COUNT(set, misses, 1);
+    return false;
+}
+
+// Mapped sets persist their size in the file header.
+static inline void sparse_set_store_size(sparse_set_t *set) {
+    if (set->mapped_size) *set->mapped_size = set->size;
+}
+
+static uint32_t sparse_set_group_enter(sparse_set_group_t *group, sparse_set_id_t id, uint32_t pos);
+static void sparse_set_group_leave(sparse_set_group_t *group, sparse_set_id_t id);
+
+// Slot of `index` for an insert: paged sets get their page allocated
+// (returned in *out_page); shared and hash sets get NULL when the index is
+// not theirs yet, and claim it with sparse_set_claim_slot once dense has
+// room.
+static uint32_t* sparse_set_insert_slot(sparse_set_t *set, uint32_t index, uint32_t **out_page, bool *oom) {
+    *out_page = NULL;
+    *oom = false;
+    if (set->shared || set->hash) return sparse_set_slot(set, index);
+    uint32_t *page = sparse_set_ensure_page(set, index >> SPARSE_SET_PAGE_SHIFT);
+    if (!page) {
+        *oom = true;
+        return NULL;
+    }
+    *out_page = page;
+    return &page[index & SPARSE_SET_PAGE_MASK];
 }
 
 uint32_t sparse_set_insert(sparse_set_t *set, sparse_set_id_t id) {
     uint32_t index = ID_INDEX(id);
-    uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-    
-    if (!sparse_set_ensure_page(set, page_idx)) {
+    uint32_t *page;
+    bool oom;
+    uint32_t *slot = sparse_set_insert_slot(set, index, &page, &oom);
+    if (oom) {
         return SPARSE_SET_INVALID_POS;
     }
     
-    uint32_t *page = set->sparse[page_idx];
-    uint32_t offset = index & SPARSE_SET_PAGE_MASK;
-    uint32_t pos = page[offset];
+    uint32_t pos = slot ? *slot : SPARSE_SET_INVALID_POS;
     
     if (pos < set->size && ID_INDEX(set->dense[pos]) == index) {
         if (set->dense[pos] == id) return SPARSE_SET_INVALID_POS;
+        if (set->changes) {
+            sparse_set_mark_change(set, set->dense[pos], SPARSE_SET_CHANGE_REMOVED, 0, 0);
+            sparse_set_mark_change(set, id, SPARSE_SET_CHANGE_ADDED, 0, 0);
+        }
+        if (set->group) {
+            // A new version is a different entity as far as the group goes
+            sparse_set_group_leave(set->group, set->dense[pos]);
+            pos = *slot;
+            set->dense[pos] = id;
+            return sparse_set_group_enter(set->group, id, pos);
+        }
         set->dense[pos] = id;
         return pos;
     }
@@ -128,60 +515,290 @@ uint32_t sparse_set_insert(sparse_set_t *set, sparse_set_id_t id) {
     if (set->size >= set->dense_capacity) {
         if (!sparse_set_grow_dense(set)) return SPARSE_SET_INVALID_POS;
     }
+    if (!slot) {
+        slot = sparse_set_claim_slot(set, index);
+        if (!slot) return SPARSE_SET_INVALID_POS;
+    }
 
     uint32_t new_pos = set->size;
     set->dense[new_pos] = id;
     
-    if (set->stride > 0) {
-        memset(set->data + new_pos * set->stride, 0, set->stride);
-    }
+    sparse_set_zero_row(set, new_pos);
     
-    page[offset] = new_pos;
+    *slot = new_pos;
+    if (page) page[SPARSE_SET_PAGE_LIVE]++;
     set->size++;
+    sparse_set_store_size(set);
+    SPARSE_SET_COUNT(set, inserts, 1);
+    if (set->changes) sparse_set_mark_change(set, id, SPARSE_SET_CHANGE_ADDED, 0, 0);
+    if (set->group) return sparse_set_group_enter(set->group, id, new_pos);
     return new_pos;
 }
 
 bool sparse_set_remove(sparse_set_t *set, sparse_set_id_t id) {
-    if (!sparse_set_contains(set, id)) return false;
-    
     uint32_t index = ID_INDEX(id);
     uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-    uint32_t offset = index & SPARSE_SET_PAGE_MASK;
+    uint32_t *page = set->shared || set->hash ? NULL : sparse_set_page(set, page_idx);
+    uint32_t *slot = page ? &page[index & SPARSE_SET_PAGE_MASK] : sparse_set_slot(set, index);
+    if (!slot) return false;
     
-    uint32_t pos = set->sparse[page_idx][offset];
+    uint32_t pos = *slot;
+    if (pos >= set->size || set->dense[pos] != id) return false;
+
+    if (set->changes) sparse_set_mark_change(set, id, SPARSE_SET_CHANGE_REMOVED, 0, 0);
+    if (set->group) {
+        sparse_set_group_leave(set->group, id);
+        pos = *slot;
+    }
+
     uint32_t last_pos = set->size - 1;
     sparse_set_id_t last_id = set->dense[last_pos];
-    uint32_t last_index = ID_INDEX(last_id);
 
     set->dense[pos] = last_id;
-
-    uint32_t last_page_idx = last_index >> SPARSE_SET_PAGE_SHIFT;
-    uint32_t last_offset = last_index & SPARSE_SET_PAGE_MASK;
-    set->sparse[last_page_idx][last_offset] = pos;
-    
-    if (set->stride > 0) {
-        memcpy(set->data + pos * set->stride, set->data + last_pos * set->stride, set->stride);
-    }
+    *sparse_set_slot(set, ID_INDEX(last_id)) = pos;
     
-    set->sparse[page_idx][offset] = SPARSE_SET_INVALID_POS;
+    sparse_set_move_row(set, pos, last_pos);
     
     set->size--;
+    sparse_set_store_size(set);
+    SPARSE_SET_COUNT(set, removes, 1);
+
+    if (!page) {
+        sparse_set_drop_slot(set, index);
+        if (set->hash && set->auto_shrink && set->hash_capacity > SPARSE_SET_HASH_MIN_CAPACITY &&
+            set->size * 8 <= set->hash_capacity) {
+            sparse_set_hash_build(set, set->hash_capacity / 2);
+        }
+    } else {
+        *slot = SPARSE_SET_INVALID_POS;
+        if (--page[SPARSE_SET_PAGE_LIVE] == 0 && set->auto_shrink) {
+            sparse_set_release_page(set, page_idx);
+        }
+    }
+    // Halve at a quarter full so a size oscillating around a power of two
+    // does not realloc on every insert/remove.
+    if (set->auto_shrink && set->dense_capacity > SPARSE_SET_DEFAULT_CAPACITY &&
+        set->size <= set->dense_capacity / 4) {
+        uint32_t new_capacity = set->dense_capacity / 2;
+        if (new_capacity < SPARSE_SET_DEFAULT_CAPACITY) new_capacity = SPARSE_SET_DEFAULT_CAPACITY;
+        sparse_set_resize_dense(set, new_capacity);
+    }
     return true;
 }
 
 void sparse_set_clear(sparse_set_t *set) {
+    if (set->changes) {
+        for (uint32_t pos = 0; pos < set->size; pos++) {
+            sparse_set_mark_change(set, set->dense[pos], SPARSE_SET_CHANGE_REMOVED, 0, 0);
+        }
+    }
+    if (set->shared) {
+        for (uint32_t pos = 0; pos < set->size; pos++) {
+            sparse_set_shared_drop(set->shared, set->shared_bit, ID_INDEX(set->dense[pos]));
+        }
+    }
+    if (set->hash) {
+        memset(set->hash, 0xFF, (size_t)set->hash_capacity * 2 * sizeof(uint32_t));
+    }
     for (uint32_t i = 0; i < set->sparse_capacity; i++) {
-        if (set->sparse[i]) {
-            memset(set->sparse[i], 0xFF, SPARSE_SET_PAGE_SIZE * sizeof(uint32_t));
+        if (set->sparse[i]) sparse_set_reset_page(set->sparse[i]);
+    }
+    if (set->sparse_blocks) {
+        for (uint32_t i = 0; i < SPARSE_SET_BLOCK_COUNT; i++) {
+            uint32_t **block = set->sparse_blocks[i];
+            if (!block) continue;
+            for (uint32_t j = 0; j < SPARSE_SET_BLOCK_SIZE; j++) {
+                if (block[j]) sparse_set_reset_page(block[j]);
+            }
         }
     }
+    SPARSE_SET_COUNT(set, removes, set->size);
     set->size = 0;
+    sparse_set_store_size(set);
+    if (set->group) set->group->size = 0;
+    if (set->auto_shrink) sparse_set_shrink_to_fit(set);
+}
+
+void sparse_set_shrink_to_fit(sparse_set_t *set) {
+    if (set->spare_page) {
+        sparse_set_page_free(set->allocator, set->spare_page);
+        set->spare_page = NULL;
+    }
+
+    for (uint32_t i = 0; i < set->sparse_capacity; i++) {
+        if (set->sparse[i] && set->sparse[i][SPARSE_SET_PAGE_LIVE] == 0) {
+            sparse_set_page_free(set->allocator, set->sparse[i]);
+            set->sparse[i] = NULL;
+            set->page_count--;
+        }
+    }
+    if (set->sparse_blocks) {
+        bool any_block = false;
+        for (uint32_t i = 0; i < SPARSE_SET_BLOCK_COUNT; i++) {
+            uint32_t **block = set->sparse_blocks[i];
+            if (!block) continue;
+            bool any_page = false;
+            for (uint32_t j = 0; j < SPARSE_SET_BLOCK_SIZE; j++) {
+                if (!block[j]) continue;
+                if (block[j][SPARSE_SET_PAGE_LIVE] == 0) {
+                    sparse_set_page_free(set->allocator, block[j]);
+                    block[j] = NULL;
+                    set->page_count--;
+                } else {
+                    any_page = true;
+                }
+            }
+            if (any_page) {
+                any_block = true;
+            } else {
+                sparse_set_free(set->allocator, block, SPARSE_SET_BLOCK_SIZE * sizeof(uint32_t*));
+                set->sparse_blocks[i] = NULL;
+            }
+        }
+        if (!any_block) {
+            sparse_set_free(set->allocator, set->sparse_blocks, SPARSE_SET_BLOCK_COUNT * sizeof(uint32_t**));
+            set->sparse_blocks = NULL;
+        }
+    }
+
+    uint32_t capacity = set->size > SPARSE_SET_DEFAULT_CAPACITY ? set->size : SPARSE_SET_DEFAULT_CAPACITY;
+    if (capacity < set->dense_capacity) sparse_set_resize_dense(set, capacity);
+
+    if (set->adaptive && !set->shared) {
+        uint32_t hash_capacity = sparse_set_hash_fit(set, set->size);
+        if (hash_capacity && (!set->hash || hash_capacity < set->hash_capacity)) {
+            sparse_set_hash_build(set, hash_capacity);
+        }
+    }
+}
+
+void sparse_set_set_auto_shrink(sparse_set_t *set, bool enabled) {
+    set->auto_shrink = enabled;
+}
+
+void sparse_set_release_index(sparse_set_t *set) {
+    sparse_set_allocator_t *a = set->allocator;
+    for (uint32_t i = 0; i < set->sparse_capacity; i++) {
+        sparse_set_page_free(a, set->sparse[i]);
+        set->sparse[i] = NULL;
+    }
+    if (set->sparse_blocks) {
+        for (uint32_t i = 0; i < SPARSE_SET_BLOCK_COUNT; i++) {
+            uint32_t **block = set->sparse_blocks[i];
+            if (!block) continue;
+            for (uint32_t j = 0; j < SPARSE_SET_BLOCK_SIZE; j++) {
+                sparse_set_page_free(a, block[j]);
+            }
+            sparse_set_free(a, block, SPARSE_SET_BLOCK_SIZE * sizeof(uint32_t*));
+        }
+        sparse_set_free(a, set->sparse_blocks, SPARSE_SET_BLOCK_COUNT * sizeof(uint32_t**));
+        set->sparse_blocks = NULL;
+    }
+    sparse_set_page_free(a, set->spare_page);
+    set->spare_page = NULL;
+    set->page_count = 0;
+    sparse_set_free(a, set->hash, (size_t)set->hash_capacity * 2 * sizeof(uint32_t));
+    set->hash = NULL;
+    set->hash_capacity = 0;
+}
+
+bool sparse_set_rebuild_index(sparse_set_t *set) {
+    if (set->shared) {
+        for (uint32_t pos = 0; pos < set->size; pos++) {
+            uint32_t index = ID_INDEX(set->dense[pos]);
+            uint32_t *slot = sparse_set_slot(set, index);
+            if (!slot) slot = sparse_set_shared_add(set->shared, set->shared_bit, index);
+            else if (*slot < pos) slot = NULL;
+            if (!slot) {
+                // Leave no trace of this set's ids in the shared slots.
+                for (uint32_t i = 0; i < pos; i++) {
+                    sparse_set_shared_drop(set->shared, set->shared_bit, ID_INDEX(set->dense[i]));
+                }
+                return false;
+            }
+            *slot = pos;
+        }
+        return true;
+    }
+    if (set->hash) {
+        uint32_t capacity = sparse_set_hash_capacity_for(set->size);
+        if (capacity <= SPARSE_SET_HASH_MAX_CAPACITY) return sparse_set_hash_build(set, capacity);
+        sparse_set_release_index(set);
+    }
+    for (uint32_t pos = 0; pos < set->size; pos++) {
+        uint32_t index = ID_INDEX(set->dense[pos]);
+        uint32_t *page = sparse_set_ensure_page(set, index >> SPARSE_SET_PAGE_SHIFT);
+        if (!page) return false;
+        uint32_t *slot = &page[index & SPARSE_SET_PAGE_MASK];
+        if (*slot < pos && ID_INDEX(set->dense[*slot]) == index) return false;
+        *slot = pos;
+        page[SPARSE_SET_PAGE_LIVE]++;
+    }
+    return true;
+}
+
+uint32_t sparse_set_capacity(const sparse_set_t *set) {
+    return set->dense_capacity;
+}
+
+uint32_t sparse_set_page_count(const sparse_set_t *set) {
+    return set->page_count;
+}
+
+bool sparse_set_reserve(sparse_set_t *set, uint32_t capacity) {
+    if (capacity <= set->dense_capacity) return true;
+    if (capacity > SPARSE_SET_MAX_DENSE) return false;
+    if (set->vm && capacity > sparse_set_reserved_capacity(set)) return false;
+    return sparse_set_resize_dense(set, capacity);
+}
+
+void sparse_set_stats(const sparse_set_t *set, sparse_set_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->size = set->size;
+    out->capacity = set->dense_capacity;
+    out->pages = set->page_count + (set->spare_page ? 1 : 0);
+    out->hash_capacity = set->hash_capacity;
+    out->dense_bytes = (size_t)set->dense_capacity * sizeof(sparse_set_id_t);
+    out->data_bytes = set->data || set->columns ? (size_t)set->dense_capacity * set->stride : 0;
+    out->index_bytes = (size_t)set->sparse_capacity * sizeof(uint32_t*) +
+                       (size_t)out->pages * SPARSE_SET_PAGE_BYTES +
+                       (size_t)set->hash_capacity * 2 * sizeof(uint32_t);
+    out->reserved = sparse_set_reserved_capacity(set);
+    out->counters = set->counters;
+
+    for (uint32_t i = 0; i < set->sparse_capacity; i++) {
+        if (set->sparse[i] && set->sparse[i][SPARSE_SET_PAGE_LIVE] > 0) out->live_pages++;
+    }
+    if (set->sparse_blocks) {
+        out->index_bytes += SPARSE_SET_BLOCK_COUNT * sizeof(uint32_t**);
+        for (uint32_t i = 0; i < SPARSE_SET_BLOCK_COUNT; i++) {
+            uint32_t **block = set->sparse_blocks[i];
+            if (!block) continue;
+            out->index_bytes += SPARSE_SET_BLOCK_SIZE * sizeof(uint32_t*);
+            for (uint32_t j = 0; j < SPARSE_SET_BLOCK_SIZE; j++) {
+                if (block[j] && block[j][SPARSE_SET_PAGE_LIVE] > 0) out->live_pages++;
+            }
+        }
+    }
 }
 
 uint32_t sparse_set_size(const sparse_set_t *set) {
     return set->size;
 }
 
+const sparse_set_id_t* sparse_set_dense(const sparse_set_t *set) {
+    return set->dense;
+}
+
+void* sparse_set_data(const sparse_set_t *set) {
+    return set->data;
+}
+
+void* sparse_set_column_data(const sparse_set_t *set, uint32_t column) {
+    if (column >= set->column_count) return NULL;
+    return set->columns[column].data;
+}
+
 sparse_set_id_t sparse_set_get_id(const sparse_set_t *set, uint32_t pos) {
     if (pos < set->size) {
         return set->dense[pos];
@@ -190,60 +807,41 @@ sparse_set_id_t sparse_set_get_id(const sparse_set_t *set, uint32_t pos) {
 }
 
 uint32_t sparse_set_index_of(const sparse_set_t *set, sparse_set_id_t id) {
-    uint32_t index = ID_INDEX(id);
-    uint32_t page_idx = index >> SPARSE_SET_PAGE_SHIFT;
-    
-    if (page_idx >= set->sparse_capacity || !set->sparse[page_idx]) {
-        return SPARSE_SET_INVALID_POS;
-    }
-    
-    uint32_t pos = set->sparse[page_idx][index & SPARSE_SET_PAGE_MASK];
-    if (pos < set->size && set->dense[pos] == id) {
-        return pos;
+    SPARSE_SET_COUNT(set, lookups, 1);
+    const uint32_t *slot = sparse_set_slot(set, ID_INDEX(id));
+    if (slot) {
+        uint32_t pos = *slot;
+        if (pos < set->size && set->dense[pos] == id) {
+            return pos;
+        }
     }
+    SPARSE_SET_COUNT(set, misses, 1);
     return SPARSE_SET_INVALID_POS;
 }
 
-void sparse_set_swap_at(sparse_set_t *set, uint32_t a, uint32_t b) {
-    if (a == b || a >= set->size || b >= set->size) {
-        return;
-    }
-    
+static void sparse_set_swap_positions(sparse_set_t *set, uint32_t a, uint32_t b) {
+    if (a == b) return;
+
     sparse_set_id_t id_a = set->dense[a];
     sparse_set_id_t id_b = set->dense[b];
     
     set->dense[a] = id_b;
     set->dense[b] = id_a;
     
-    uint32_t idx_a = ID_INDEX(id_a);
-    uint32_t page_a = idx_a >> SPARSE_SET_PAGE_SHIFT;
-    uint32_t off_a = idx_a & SPARSE_SET_PAGE_MASK;
-    
-    uint32_t idx_b = ID_INDEX(id_b);
-    uint32_t page_b = idx_b >> SPARSE_SET_PAGE_SHIFT;
-    uint32_t off_b = idx_b & SPARSE_SET_PAGE_MASK;
-    
-    set->sparse[page_a][off_a] = b;
-    set->sparse[page_b][off_b] = a; 
+    *sparse_set_slot(set, ID_INDEX(id_a)) = b;
+    *sparse_set_slot(set, ID_INDEX(id_b)) = a;
     
-    if (set->stride > 0) {
-        uint8_t *ptr_a = set->data + a * set->stride;
-        uint8_t *ptr_b = set->data + b * set->stride;
-        uint8_t buffer[64];
-        uint32_t remaining = set->stride;
-        uint32_t offset = 0;
-        
-        while (remaining > 0) {
-            uint32_t chunk_size = (remaining > sizeof(buffer)) ? sizeof(buffer) : remaining;
-            
-            memcpy(buffer, ptr_a + offset, chunk_size);
-            memcpy(ptr_a + offset, ptr_b + offset, chunk_size);
-            memcpy(ptr_b + offset, buffer, chunk_size);
-            
-            remaining -= chunk_size;
-            offset += chunk_size;
-        }
-    } 
+    sparse_set_swap_rows(set, a, b);
+}
+
+void sparse_set_swap_at(sparse_set_t *set, uint32_t a, uint32_t b) {
+    if (a == b || a >= set->size || b >= set->size) {
+        return;
+    }
+    if (set->group && (a < set->group->size || b < set->group->size)) {
+        return;
+    }
+    sparse_set_swap_positions(set, a, b);
 }
 
 sparse_set_iter_t sparse_set_iter(const sparse_set_t *set) {
@@ -263,11 +861,11 @@ bool sparse_set_iter_next(sparse_set_iter_t *iter, sparse_set_id_t *out_id) {
 }
 
 bool sparse_set_set_stride(sparse_set_t *set, uint32_t stride) {
-    if (set->size > 0 || set->data) return false; // Can only set stride when empty/init
+    if (set->size > 0 || set->data || set->columns || set->vm) return false; // Can only set stride when empty/init
     if (stride == 0) return true;
     
     set->stride = stride;
-    set->data = (uint8_t*)calloc(set->dense_capacity, stride);
+    set->data = (uint8_t*)sparse_set_calloc(set->allocator, set->dense_capacity, stride);
     return set->data != NULL;
 }
 
@@ -275,3 +873,413 @@ void* sparse_set_get_data(const sparse_set_t *set, uint32_t pos) {
     if (pos >= set->size || !set->data) return NULL;
     return set->data + pos * set->stride;
 }
+
+bool sparse_set_set_schema(sparse_set_t *set, const int *types, uint32_t count) {
+    if (set->size > 0 || set->data || set->columns || set->vm) return false;
+    if (count == 0 || count > SPARSE_SET_MAX_COLUMNS) return false;
+
+    sparse_set_column_t *columns = (sparse_set_column_t*)sparse_set_calloc(set->allocator, count, sizeof(sparse_set_column_t));
+    if (!columns) return false;
+
+    uint32_t row_size = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t size = sparse_set_type_size(types[i]);
+        if (size == 0) goto fail;
+        columns[i].size = (uint32_t)size;
+        columns[i].type = types[i];
+        columns[i].data = (uint8_t*)sparse_set_calloc(set->allocator, set->dense_capacity, size);
+        if (!columns[i].data) goto fail;
+        row_size += (uint32_t)size;
+    }
+
+    set->columns = columns;
+    set->column_count = count;
+    set->stride = row_size;
+    return true;
+
+fail:
+    for (uint32_t i = 0; i < count; i++) {
+        sparse_set_free(set->allocator, columns[i].data, (size_t)set->dense_capacity * columns[i].size);
+    }
+    sparse_set_free(set->allocator, columns, count * sizeof(sparse_set_column_t));
+    return false;
+}
+
+void* sparse_set_get_column(const sparse_set_t *set, uint32_t column, uint32_t pos) {
+    if (pos >= set->size || column >= set->column_count) return NULL;
+    return set->columns[column].data + (size_t)pos * set->columns[column].size;
+}
+
+void sparse_set_read_row(const sparse_set_t *set, uint32_t pos, void *out) {
+    if (set->data) {
+        memcpy(out, set->data + (size_t)pos * set->stride, set->stride);
+        return;
+    }
+    uint8_t *dst = (uint8_t*)out;
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        const sparse_set_column_t *column = &set->columns[i];
+        memcpy(dst, column->data + (size_t)pos * column->size, column->size);
+        dst += column->size;
+    }
+}
+
+void sparse_set_write_row(sparse_set_t *set, uint32_t pos, const void *in) {
+    if (set->changes) sparse_set_mark_change(set, set->dense[pos], SPARSE_SET_CHANGE_MODIFIED, 0, set->stride);
+    if (set->data) {
+        memcpy(set->data + (size_t)pos * set->stride, in, set->stride);
+        return;
+    }
+    const uint8_t *src = (const uint8_t*)in;
+    for (uint32_t i = 0; i < set->column_count; i++) {
+        sparse_set_column_t *column = &set->columns[i];
+        memcpy(column->data + (size_t)pos * column->size, src, column->size);
+        src += column->size;
+    }
+}
+
+bool sparse_set_field_at(const sparse_set_t *set, uint32_t offset, int type, sparse_set_field_t *out) {
+    size_t size = sparse_set_type_size(type);
+    if (!set->data || size == 0 || (size_t)offset + size > set->stride) return false;
+    out->column = SPARSE_SET_NO_COLUMN;
+    out->offset = offset;
+    out->size = (uint32_t)size;
+    out->type = type;
+    return true;
+}
+
+bool sparse_set_field_column(const sparse_set_t *set, uint32_t column, sparse_set_field_t *out) {
+    if (column >= set->column_count) return false;
+    out->column = column;
+    out->offset = 0;
+    out->size = set->columns[column].size;
+    out->type = set->columns[column].type;
+    return true;
+}
+
+bool sparse_set_query_init(sparse_set_query_t *query,
+                           const sparse_set_t *const *include, uint32_t include_count,
+                           const sparse_set_t *const *exclude, uint32_t exclude_count) {
+    if (include_count == 0 || include_count > SPARSE_SET_QUERY_MAX_SETS ||
+        exclude_count > SPARSE_SET_QUERY_MAX_SETS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < include_count; i++) {
+        if (!include[i]) return false;
+        query->include[i] = include[i];
+    }
+    for (uint32_t i = 0; i < exclude_count; i++) {
+        if (!exclude[i]) return false;
+        query->exclude[i] = exclude[i];
+    }
+    query->include_count = include_count;
+    query->exclude_count = exclude_count;
+
+    query->shared = include[0]->shared;
+    query->shared_epoch = query->shared ? query->shared->epoch : 0;
+    query->include_mask = 0;
+    query->exclude_mask = 0;
+    for (uint32_t i = 0; i < include_count && query->shared; i++) {
+        if (include[i]->shared != query->shared) query->shared = NULL;
+        else query->include_mask |= 1ull << include[i]->shared_bit;
+    }
+    for (uint32_t i = 0; i < exclude_count && query->shared; i++) {
+        if (exclude[i]->shared != query->shared) query->shared = NULL;
+        else query->exclude_mask |= 1ull << exclude[i]->shared_bit;
+    }
+    return true;
+}
+
+// Every queried set is on query->shared: one slot read rejects most ids,
+// and positions come from the same slot.
+static bool sparse_set_query_match_shared(const sparse_set_query_t *query, sparse_set_id_t id, uint32_t *out_pos) {
+    sparse_set_shared_slot_t *slot = sparse_set_shared_entry(query->shared, ID_INDEX(id));
+    if (!slot || (slot->mask & query->include_mask) != query->include_mask) return false;
+
+    const uint32_t *positions = sparse_set_shared_positions(slot);
+    for (uint32_t i = 0; i < query->include_count; i++) {
+        const sparse_set_t *set = query->include[i];
+        uint32_t pos = positions[sparse_set_shared_rank(slot->mask, set->shared_bit)];
+        if (set->dense[pos] != id) return false;
+        if (out_pos) out_pos[i] = pos;
+    }
+    if (slot->mask & query->exclude_mask) {
+        for (uint32_t i = 0; i < query->exclude_count; i++) {
+            const sparse_set_t *set = query->exclude[i];
+            if (!((slot->mask >> set->shared_bit) & 1)) continue;
+            if (set->dense[positions[sparse_set_shared_rank(slot->mask, set->shared_bit)]] == id) return false;
+        }
+    }
+    return true;
+}
+
+uint32_t sparse_set_query_driver(const sparse_set_query_t *query) {
+    uint32_t driver = 0;
+    for (uint32_t i = 1; i < query->include_count; i++) {
+        if (query->include[i]->size < query->include[driver]->size) {
+            driver = i;
+        }
+    }
+    return driver;
+}
+
+bool sparse_set_query_match(const sparse_set_query_t *query, sparse_set_id_t id, uint32_t *out_pos) {
+    // include[0] still being on the index proves the index is alive; the
+    // epoch proves no queried set has moved since init.
+    if (query->shared && query->include[0]->shared == query->shared &&
+        query->shared->epoch == query->shared_epoch) {
+        return sparse_set_query_match_shared(query, id, out_pos);
+    }
+    for (uint32_t i = 0; i < query->include_count; i++) {
+        uint32_t pos = sparse_set_index_of(query->include[i], id);
+        if (pos == SPARSE_SET_INVALID_POS) return false;
+        if (out_pos) out_pos[i] = pos;
+    }
+    for (uint32_t i = 0; i < query->exclude_count; i++) {
+        if (sparse_set_contains(query->exclude[i], id)) return false;
+    }
+    return true;
+}
+
+sparse_set_query_iter_t sparse_set_query_iter(const sparse_set_query_t *query) {
+    sparse_set_query_iter_t iter = {
+        .query = query,
+        .driver = sparse_set_query_driver(query),
+        .current_pos = 0
+    };
+    return iter;
+}
+
+bool sparse_set_query_iter_next(sparse_set_query_iter_t *iter, sparse_set_id_t *out_id, uint32_t *out_pos) {
+    if (!iter || !iter->query) return false;
+
+    const sparse_set_t *driver = iter->query->include[iter->driver];
+    while (iter->current_pos < driver->size) {
+        sparse_set_id_t id = driver->dense[iter->current_pos++];
+        if (sparse_set_query_match(iter->query, id, out_pos)) {
+            if (out_id) *out_id = id;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    const sparse_set_query_t *query;
+    const sparse_set_t *driver;
+    uint32_t count;
+} sparse_set_query_count_task_t;
+
+static void sparse_set_query_count_task(void *ud, uint32_t begin, uint32_t end) {
+    sparse_set_query_count_task_t *t = (sparse_set_query_count_task_t*)ud;
+    uint32_t count = 0;
+    for (uint32_t pos = begin; pos < end; pos++) {
+        if (sparse_set_query_match(t->query, t->driver->dense[pos], NULL)) count++;
+    }
+    __atomic_fetch_add(&t->count, count, __ATOMIC_RELAXED);
+}
+
+uint32_t sparse_set_query_count(const sparse_set_query_t *query) {
+    sparse_set_query_count_task_t task = {
+        query, query->include[sparse_set_query_driver(query)], 0
+    };
+    sparse_set_parallel_for(task.driver->size, SPARSE_SET_PARALLEL_MIN_CHUNK / 4, sparse_set_query_count_task, &task);
+    return task.count;
+}
+
+#define SPARSE_SET_PREFETCH_DISTANCE 8
+
+// Paged sets resolve the slot with two loads, so it is worth fetching
+// ahead. A hash slot would need the full probe, so only its home bucket is
+// fetched; a shared index is left to the lookup itself.
+static inline void sparse_set_prefetch_slot(const sparse_set_t *set, sparse_set_id_t id) {
+    if (set->hash) {
+        SPARSE_SET_PREFETCH(&set->hash[2 * sparse_set_hash_home(ID_INDEX(id), set->hash_capacity - 1)]);
+        return;
+    }
+    if (set->shared) return;
+    const uint32_t *slot = sparse_set_slot(set, ID_INDEX(id));
+    if (slot) {
+        SPARSE_SET_PREFETCH(slot);
+    }
+}
+
+uint32_t sparse_set_insert_many(sparse_set_t *set, const sparse_set_id_t *ids, uint32_t count, uint32_t *out_pos) {
+    if (!sparse_set_reserve_dense(set, (uint64_t)set->size + count)) {
+        return SPARSE_SET_INVALID_POS;
+    }
+
+    if (set->hash && !sparse_set_hash_reserve(set, (uint64_t)set->size + count)) {
+        return SPARSE_SET_INVALID_POS;
+    }
+
+    // Allocate every touched page up front; runs of ids on the same page
+    // only pay for the first check. Shared and hash slots are claimed per
+    // id below.
+    uint32_t last_page = SPARSE_SET_INVALID_POS;
+    for (uint32_t i = 0; i < count && !set->shared && !set->hash; i++) {
+        uint32_t page_idx = ID_INDEX(ids[i]) >> SPARSE_SET_PAGE_SHIFT;
+        if (page_idx == last_page) continue;
+        if (!sparse_set_ensure_page(set, page_idx)) return SPARSE_SET_INVALID_POS;
+        last_page = page_idx;
+    }
+
+    uint32_t added = 0;
+    uint32_t size_before = set->size;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i + SPARSE_SET_PREFETCH_DISTANCE < count) {
+            sparse_set_prefetch_slot(set, ids[i + SPARSE_SET_PREFETCH_DISTANCE]);
+        }
+
+        sparse_set_id_t id = ids[i];
+        uint32_t index = ID_INDEX(id);
+        uint32_t *page = set->shared || set->hash ? NULL : sparse_set_page(set, index >> SPARSE_SET_PAGE_SHIFT);
+        uint32_t *slot = page ? &page[index & SPARSE_SET_PAGE_MASK] : sparse_set_slot(set, index);
+        uint32_t pos = slot ? *slot : SPARSE_SET_INVALID_POS;
+
+        if (pos < set->size && ID_INDEX(set->dense[pos]) == index) {
+            if (set->dense[pos] != id) {
+                if (set->changes) {
+                    sparse_set_mark_change(set, set->dense[pos], SPARSE_SET_CHANGE_REMOVED, 0, 0);
+                    sparse_set_mark_change(set, id, SPARSE_SET_CHANGE_ADDED, 0, 0);
+                }
+                if (set->group) {
+                    // Same as the single insert: the old version leaves first
+                    sparse_set_group_leave(set->group, set->dense[pos]);
+                    pos = *slot;
+                }
+                set->dense[pos] = id;
+                added++;
+            }
+        } else {
+            if (!slot) {
+                slot = sparse_set_claim_slot(set, index);
+                if (!slot) {
+                    // Ids added so far stay; the batch reports oom.
+                    added = SPARSE_SET_INVALID_POS;
+                    break;
+                }
+            }
+            pos = set->size++;
+            set->dense[pos] = id;
+            sparse_set_zero_row(set, pos);
+            *slot = pos;
+            if (page) page[SPARSE_SET_PAGE_LIVE]++;
+            if (set->changes) sparse_set_mark_change(set, id, SPARSE_SET_CHANGE_ADDED, 0, 0);
+            added++;
+        }
+        if (out_pos) out_pos[i] = pos;
+    }
+
+    sparse_set_store_size(set);
+    SPARSE_SET_COUNT(set, inserts, set->size - size_before);
+    (void)size_before;
+
+    // Group entry swaps rows around, which can move ids inserted earlier in
+    // this batch, so positions are only final after every id has entered.
+    if (set->group) {
+        for (uint32_t i = 0; i < count; i++) {
+            sparse_set_group_enter(set->group, ids[i], sparse_set_index_of(set, ids[i]));
+        }
+        if (out_pos) {
+            for (uint32_t i = 0; i < count; i++) out_pos[i] = sparse_set_index_of(set, ids[i]);
+        }
+    }
+    return added;
+}
+
+uint32_t sparse_set_remove_many(sparse_set_t *set, const sparse_set_id_t *ids, uint32_t count) {
+    uint32_t removed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i + SPARSE_SET_PREFETCH_DISTANCE < count) {
+            sparse_set_prefetch_slot(set, ids[i + SPARSE_SET_PREFETCH_DISTANCE]);
+        }
+        if (sparse_set_remove(set, ids[i])) removed++;
+    }
+    return removed;
+}
+
+uint32_t sparse_set_index_of_many(const sparse_set_t *set, const sparse_set_id_t *ids, uint32_t count, uint32_t *out_pos) {
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i + SPARSE_SET_PREFETCH_DISTANCE < count) {
+            sparse_set_prefetch_slot(set, ids[i + SPARSE_SET_PREFETCH_DISTANCE]);
+        }
+        uint32_t pos = sparse_set_index_of(set, ids[i]);
+        if (pos != SPARSE_SET_INVALID_POS) found++;
+        out_pos[i] = pos;
+    }
+    return found;
+}
+
+// Moves `id` into the grouped prefix of every owned set if all of them
+// contain it. `pos` is the id's position in the calling set; returns its
+// (possibly new) position there.
+static uint32_t sparse_set_group_enter(sparse_set_group_t *group, sparse_set_id_t id, uint32_t pos) {
+    if (pos < group->size) return pos;
+
+    uint32_t positions[SPARSE_SET_GROUP_MAX_SETS];
+    for (uint32_t i = 0; i < group->set_count; i++) {
+        positions[i] = sparse_set_index_of(group->sets[i], id);
+        if (positions[i] == SPARSE_SET_INVALID_POS) return pos;
+    }
+
+    uint32_t target = group->size++;
+    for (uint32_t i = 0; i < group->set_count; i++) {
+        sparse_set_swap_positions(group->sets[i], positions[i], target);
+    }
+    return target;
+}
+
+// Moves `id` out of the grouped prefix (to just past its end) in every
+// owned set; a no-op if the id is not grouped.
+static void sparse_set_group_leave(sparse_set_group_t *group, sparse_set_id_t id) {
+    uint32_t pos = sparse_set_index_of(group->sets[0], id);
+    if (pos == SPARSE_SET_INVALID_POS || pos >= group->size) return;
+
+    uint32_t last = --group->size;
+    for (uint32_t i = 0; i < group->set_count; i++) {
+        sparse_set_t *owned = group->sets[i];
+        sparse_set_swap_positions(owned, sparse_set_index_of(owned, id), last);
+    }
+}
+
+bool sparse_set_group_init(sparse_set_group_t *group, sparse_set_t *const *sets, uint32_t count) {
+    if (count < 2 || count > SPARSE_SET_GROUP_MAX_SETS) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!sets[i] || sets[i]->group) return false;
+        for (uint32_t j = 0; j < i; j++) {
+            if (sets[j] == sets[i]) return false;
+        }
+    }
+
+    uint32_t smallest = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        group->sets[i] = sets[i];
+        sets[i]->group = group;
+        if (sets[i]->size < sets[smallest]->size) smallest = i;
+    }
+    group->set_count = count;
+    group->size = 0;
+
+    // Entering only ever swaps with the prefix end, which is at or before
+    // the cursor, so a single forward walk sees every id once.
+    sparse_set_t *driver = sets[smallest];
+    for (uint32_t pos = 0; pos < driver->size; pos++) {
+        sparse_set_group_enter(group, driver->dense[pos], pos);
+    }
+    return true;
+}
+
+void sparse_set_group_deinit(sparse_set_group_t *group) {
+    for (uint32_t i = 0; i < group->set_count; i++) {
+        if (group->sets[i]->group == group) group->sets[i]->group = NULL;
+    }
+    group->set_count = 0;
+    group->size = 0;
+}
+
+bool sparse_set_group_contains(const sparse_set_group_t *group, sparse_set_id_t id) {
+    if (group->set_count == 0) return false;
+    uint32_t pos = sparse_set_index_of(group->sets[0], id);
+    return pos != SPARSE_SET_INVALID_POS && pos < group->size;
+}
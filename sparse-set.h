@@ -4,8 +4,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <lua.h>
-#include <lauxlib.h>
+
+// Core sparse set / registry API. Independent of Lua: native modules can
+// include this header and operate on sets in place. Lua-side access to the
+// same objects goes through lua-sparse-set.h.
+#define SPARSE_SET_API_VERSION 1
 
 typedef uint64_t sparse_set_id_t;
 
@@ -14,46 +17,288 @@ typedef uint64_t sparse_set_id_t;
 #define ID_VERSION(id) ((uint32_t)((id >> 32) & 0xFFFFFFFF))
 #define ID_MAKE(index, version) (((uint64_t)(version) << 32) | (index))
 
+#define SPARSE_SET_INVALID_POS UINT32_MAX
+
 #define SPARSE_SET_PAGE_SIZE 4096
 #define SPARSE_SET_PAGE_MASK (SPARSE_SET_PAGE_SIZE - 1)
 #define SPARSE_SET_PAGE_SHIFT 12
 
+// Sparse directory. Pages below SPARSE_SET_FLAT_PAGES hang off the flat
+// `sparse` array, grown on demand. Higher pages, up to the full 32-bit
+// index space, go through a lazily allocated two-level table of
+// SPARSE_SET_BLOCK_SIZE page pointers per block, so a few far-away ids only
+// cost one block and one page.
+#define SPARSE_SET_FLAT_PAGES 256
+#define SPARSE_SET_BLOCK_SHIFT 10
+#define SPARSE_SET_BLOCK_SIZE (1u << SPARSE_SET_BLOCK_SHIFT)
+#define SPARSE_SET_BLOCK_MASK (SPARSE_SET_BLOCK_SIZE - 1)
+#define SPARSE_SET_BLOCK_COUNT (1u << (32 - SPARSE_SET_PAGE_SHIFT - SPARSE_SET_BLOCK_SHIFT))
+
+// Each sparse page carries one extra slot after its SPARSE_SET_PAGE_SIZE
+// entries holding the number of live ids on it, so empty pages can be found
+// and released without scanning.
+#define SPARSE_SET_PAGE_LIVE SPARSE_SET_PAGE_SIZE
+
+// Bytes of one sparse or generation page block (generation pages use the
+// same size so both come from one pool).
+#define SPARSE_SET_PAGE_BYTES ((SPARSE_SET_PAGE_SIZE + 1) * sizeof(uint32_t))
+
+// Allocator used for every buffer of a set/registry (alloc.c). `fn` has the
+// lua_Alloc contract: nsize == 0 frees and returns NULL, otherwise it
+// (re)allocates `ptr` from `osize` to `nsize` bytes. Page blocks are cached
+// on a free list of up to `pool_max` entries. An allocator must outlive
+// every object using it and is not thread-safe; `bytes` counts live bytes
+// handed out, including pooled pages.
+typedef void *(*sparse_set_alloc_fn)(void *ud, void *ptr, size_t osize, size_t nsize);
+
+typedef struct sparse_set_allocator {
+    sparse_set_alloc_fn fn;
+    void *ud;
+    void *pool;
+    uint32_t pool_count;
+    uint32_t pool_max;
+    size_t bytes;
+} sparse_set_allocator_t;
+
+// malloc/realloc/free, no pool. Used by the plain init/create functions.
+extern sparse_set_allocator_t sparse_set_default_allocator;
+
+void sparse_set_allocator_init(sparse_set_allocator_t *a, sparse_set_alloc_fn fn, void *ud, uint32_t pool_max);
+// Frees pooled pages and stops pooling; later page frees go straight to fn.
+void sparse_set_allocator_drain(sparse_set_allocator_t *a);
+void *sparse_set_alloc(sparse_set_allocator_t *a, size_t size);
+void *sparse_set_calloc(sparse_set_allocator_t *a, size_t count, size_t size);
+void *sparse_set_realloc(sparse_set_allocator_t *a, void *ptr, size_t osize, size_t nsize);
+void sparse_set_free(sparse_set_allocator_t *a, void *ptr, size_t size);
+// SPARSE_SET_PAGE_BYTES blocks, uninitialized.
+uint32_t *sparse_set_page_alloc(sparse_set_allocator_t *a);
+void sparse_set_page_free(sparse_set_allocator_t *a, uint32_t *page);
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SPARSE_SET_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define SPARSE_SET_PREFETCH(addr) ((void)(addr))
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SPARSE_SET_POPCOUNT64(x) ((uint32_t)__builtin_popcountll(x))
+#else
+static inline uint32_t sparse_set_popcount64(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (uint32_t)((x * 0x0101010101010101ull) >> 56);
+}
+#define SPARSE_SET_POPCOUNT64(x) sparse_set_popcount64(x)
+#endif
+
+// Activity counters of a set or registry. The growth counts are always
+// kept; the per-call counts only when built with SPARSE_SET_STATS (make
+// STATS=1) and stay 0 otherwise. The fields exist either way so the struct
+// layout does not depend on the switch. For a registry, inserts/removes
+// count created/destroyed ids and lookups are registry_valid calls.
 typedef struct {
+    uint32_t grows;         // dense (registry: recycle list, directory) growths
+    uint32_t shrinks;       // dense (registry: recycle list) shrinks
+    uint32_t rehashes;      // adaptive hash rebuilds
+    uint32_t page_allocs;   // pages taken from the allocator
+    uint64_t inserts;
+    uint64_t removes;
+    uint64_t lookups;       // contains / index_of
+    uint64_t misses;        // lookups that found nothing
+} sparse_set_counters_t;
+
+// Lookups also run on pool threads (parallel queries and kernels), so the
+// per-call counts are bumped atomically.
+#ifdef SPARSE_SET_STATS
+#define SPARSE_SET_COUNT(obj, field, n) \
+    ((void)__atomic_fetch_add(&((sparse_set_counters_t*)&(obj)->counters)->field, (uint64_t)(n), __ATOMIC_RELAXED))
+#else
+#define SPARSE_SET_COUNT(obj, field, n) ((void)0)
+#endif
+
+typedef struct {
+    sparse_set_allocator_t *allocator;
     uint32_t **generations;
     uint32_t generations_capacity;
     uint32_t *recycle;
     uint32_t recycle_count;
     uint32_t recycle_capacity;
     uint32_t next_index;
+    uint32_t version_mask;  // versions wrap to 0 past this
+    bool auto_shrink;
+    sparse_set_counters_t counters;
 } registry_t;
 
+#define SPARSE_SET_TYPE_INT 1
+#define SPARSE_SET_TYPE_FLOAT 2
+#define SPARSE_SET_TYPE_DOUBLE 3
+#define SPARSE_SET_TYPE_BYTE 4
+#define SPARSE_SET_TYPE_BOOL 5
+
+static inline size_t sparse_set_type_size(int type) {
+    switch (type) {
+        case SPARSE_SET_TYPE_INT:
+            return sizeof(int);
+        case SPARSE_SET_TYPE_FLOAT:
+            return sizeof(float);
+        case SPARSE_SET_TYPE_DOUBLE:
+            return sizeof(double);
+        case SPARSE_SET_TYPE_BYTE:
+        case SPARSE_SET_TYPE_BOOL:
+            return sizeof(uint8_t);
+        default:
+            return 0;
+    }
+}
+
+// Shared sparse index (shared.c). Sets attached to one index give up their
+// private sparse pages and keep their positions in a single entity-indexed
+// table: each slot holds a membership mask (bit b = the set attached as b
+// contains that index) and the members' positions in bit order. Up to
+// SPARSE_SET_SHARED_INLINE positions live in the slot itself; more spill to
+// a heap block whose first entry is its capacity. Testing membership in any
+// combination of attached sets is one mask read. Versions are still checked
+// against each set's dense array.
+#define SPARSE_SET_SHARED_MAX_SETS 64
+#define SPARSE_SET_SHARED_INLINE 2
+
+typedef struct {
+    uint64_t mask;
+    union {
+        uint32_t inline_pos[SPARSE_SET_SHARED_INLINE];
+        uint32_t *heap;
+    } pos;
+} sparse_set_shared_slot_t;
+
 typedef struct {
+    uint32_t live;   // slots with a non-zero mask
+    sparse_set_shared_slot_t slots[SPARSE_SET_PAGE_SIZE];
+} sparse_set_shared_page_t;
+
+typedef struct sparse_set_shared {
+    sparse_set_allocator_t *allocator;
+    sparse_set_shared_page_t **pages;     // flat part, as for sparse_set_t
+    uint32_t page_capacity;
+    sparse_set_shared_page_t ***blocks;   // pages >= SPARSE_SET_FLAT_PAGES
+    uint32_t page_count;
+    uint32_t epoch;                       // bumped on every attach/detach
+    uint64_t used;                        // bits held by attached sets
+    struct sparse_set *sets[SPARSE_SET_SHARED_MAX_SETS];
+} sparse_set_shared_t;
+
+static inline sparse_set_shared_page_t* sparse_set_shared_page(const sparse_set_shared_t *shared, uint32_t page_idx) {
+    if (page_idx < shared->page_capacity) return shared->pages[page_idx];
+    if (page_idx < SPARSE_SET_FLAT_PAGES || !shared->blocks) return NULL;
+    sparse_set_shared_page_t **block = shared->blocks[page_idx >> SPARSE_SET_BLOCK_SHIFT];
+    return block ? block[page_idx & SPARSE_SET_BLOCK_MASK] : NULL;
+}
+
+static inline sparse_set_shared_slot_t* sparse_set_shared_entry(const sparse_set_shared_t *shared, uint32_t index) {
+    sparse_set_shared_page_t *page = sparse_set_shared_page(shared, index >> SPARSE_SET_PAGE_SHIFT);
+    return page ? &page->slots[index & SPARSE_SET_PAGE_MASK] : NULL;
+}
+
+static inline uint32_t* sparse_set_shared_positions(sparse_set_shared_slot_t *slot) {
+    return SPARSE_SET_POPCOUNT64(slot->mask) <= SPARSE_SET_SHARED_INLINE ? slot->pos.inline_pos : slot->pos.heap + 1;
+}
+
+// Position of `bit`'s entry among the slot's positions.
+static inline uint32_t sparse_set_shared_rank(uint64_t mask, uint32_t bit) {
+    return SPARSE_SET_POPCOUNT64(mask & ((1ull << bit) - 1));
+}
+
+// One field of a schema set, stored contiguously and indexed by dense position.
+typedef struct {
+    uint8_t *data;
+    uint32_t size;
+    int type;
+} sparse_set_column_t;
+
+typedef struct sparse_set {
+    sparse_set_allocator_t *allocator;
     uint32_t **sparse;
     uint32_t sparse_capacity;
+    uint32_t ***sparse_blocks;
+    struct sparse_set_group *group;   // owning group, or NULL
+    struct sparse_set_mapping *mapping;   // file-backed dense/data, or NULL
+    struct sparse_set_vm *vm;         // reserved address space (reserve.c), or NULL
+    uint32_t *mapped_size;            // size field in the mapped file header
+    uint32_t *spare_page;   // last released page, reused before malloc
+    uint32_t page_count;
+    bool auto_shrink;
+    struct sparse_set *changes;       // change tracker (see changes.c), or NULL
+    sparse_set_shared_t *shared;      // shared sparse index, or NULL
+    uint32_t shared_bit;              // this set's bit in shared slots
+    uint32_t *hash;                   // adaptive mode: (index, pos) pairs, or NULL
+    uint32_t hash_capacity;           // pairs, a power of two
+    bool adaptive;
     sparse_set_id_t *dense;
     uint32_t size;
     uint32_t dense_capacity;
+    // Record size in bytes. For schema sets this is the packed row size
+    // (sum of column sizes) and data stays NULL.
     uint32_t stride;
     uint8_t *data;
+    sparse_set_column_t *columns;
+    uint32_t column_count;
+    sparse_set_counters_t counters;
 } sparse_set_t;
 
-static inline sparse_set_t* 
-get_set(lua_State *L){
-    return (sparse_set_t*)lua_touserdata(L, 1);
+// Adaptive mode keeps a small set's index in an open-addressing table of
+// (index, position) pairs, linear probing at most half full, instead of
+// 16 KB pages. A pair whose position is SPARSE_SET_INVALID_POS is empty.
+// The table is rebuilt from dense when it grows and is swapped for pages
+// once it would take SPARSE_SET_HASH_MAX_CAPACITY pairs or as many bytes
+// as the pages the set's ids touch.
+#define SPARSE_SET_HASH_MIN_CAPACITY 16
+#define SPARSE_SET_HASH_MAX_CAPACITY 8192
+
+static inline uint32_t sparse_set_hash_home(uint32_t index, uint32_t mask) {
+    return (uint32_t)((index * 0x9E3779B97F4A7C15ull) >> 40) & mask;
 }
 
-static inline registry_t*
-get_reg(lua_State *L){
-    return (registry_t*)lua_touserdata(L, 1);
+static inline uint32_t* sparse_set_hash_find(const sparse_set_t *set, uint32_t index) {
+    uint32_t mask = set->hash_capacity - 1;
+    for (uint32_t i = sparse_set_hash_home(index, mask); ; i = (i + 1) & mask) {
+        uint32_t *pair = set->hash + 2 * i;
+        if (pair[1] == SPARSE_SET_INVALID_POS) return NULL;
+        if (pair[0] == index) return pair + 1;
+    }
+}
+
+static inline uint32_t* sparse_set_page(const sparse_set_t *set, uint32_t page_idx) {
+    if (page_idx < set->sparse_capacity) return set->sparse[page_idx];
+    if (page_idx < SPARSE_SET_FLAT_PAGES || !set->sparse_blocks) return NULL;
+    uint32_t **block = set->sparse_blocks[page_idx >> SPARSE_SET_BLOCK_SHIFT];
+    return block ? block[page_idx & SPARSE_SET_BLOCK_MASK] : NULL;
+}
+
+// Sparse slot holding the dense position of `index`, or NULL if its page
+// was never allocated (or, for a shared index or adaptive hash, if the set
+// does not hold the index). Slots of those two move when membership
+// changes, so the pointer is only good until the next insert/remove.
+static inline uint32_t* sparse_set_slot(const sparse_set_t *set, uint32_t index) {
+    if (set->shared) {
+        sparse_set_shared_slot_t *entry = sparse_set_shared_entry(set->shared, index);
+        if (!entry || !((entry->mask >> set->shared_bit) & 1)) return NULL;
+        return sparse_set_shared_positions(entry) + sparse_set_shared_rank(entry->mask, set->shared_bit);
+    }
+    if (set->hash) return sparse_set_hash_find(set, index);
+    uint32_t *page = sparse_set_page(set, index >> SPARSE_SET_PAGE_SHIFT);
+    return page ? page + (index & SPARSE_SET_PAGE_MASK) : NULL;
 }
 
 #define SPARSE_SET_DEFAULT_CAPACITY 64
-#define SPARSE_SET_MAX_SIZE 0xFFFFF
+// Largest dense capacity; UINT32_MAX is reserved for SPARSE_SET_INVALID_POS.
+#define SPARSE_SET_MAX_DENSE 0xFFFFFFFEu
 
 bool sparse_set_init(sparse_set_t *set);
+bool sparse_set_init_alloc(sparse_set_t *set, sparse_set_allocator_t *allocator);
 void sparse_set_deinit(sparse_set_t *set);
 
 bool registry_init(registry_t *reg);
+bool registry_init_alloc(registry_t *reg, sparse_set_allocator_t *allocator);
 void registry_deinit(registry_t *reg);
 
 registry_t* registry_create();
@@ -61,18 +306,154 @@ void registry_destroy(registry_t *reg);
 sparse_set_id_t registry_create_id(registry_t *reg);
 void registry_recycle(registry_t *reg, sparse_set_id_t id);
 bool registry_valid(const registry_t *reg, sparse_set_id_t id);
+// Creates up to `count` ids into `out`, recycled indices first (same order
+// as repeated create_id); returns how many were created (fewer on OOM or
+// index exhaustion).
+uint32_t registry_create_many(registry_t *reg, sparse_set_id_t *out, uint32_t count);
+// Recycles every valid id; returns how many were. The ids actually
+// recycled are written to `out_destroyed` when it is not NULL.
+uint32_t registry_recycle_many(registry_t *reg, const sparse_set_id_t *ids, uint32_t count, sparse_set_id_t *out_destroyed);
+// Generation pages are never released (they keep versions of dead ids);
+// only the recycle list is trimmed.
+void registry_shrink_to_fit(registry_t *reg);
+void registry_set_auto_shrink(registry_t *reg, bool enabled);
+// Limits versions to `bits` (1..32, default 32) so ids fit hosts that carry
+// them as doubles: with 21 bits every id is below 2^53. A narrower version
+// wraps sooner, so a stale id can match again after 2^bits reuses of its
+// index. Set it before creating ids.
+void registry_set_version_bits(registry_t *reg, uint32_t bits);
+
+typedef struct {
+    uint32_t live;              // ids currently valid
+    uint32_t next_index;        // indices ever handed out
+    uint32_t recycled;          // recycle list depth
+    uint32_t recycle_capacity;
+    uint32_t pages;             // generation pages
+    size_t bytes;
+    sparse_set_counters_t counters;
+} registry_stats_t;
+
+void registry_stats(const registry_t *reg, registry_stats_t *out);
 
 sparse_set_t* sparse_set_create();
+sparse_set_t* sparse_set_create_alloc(sparse_set_allocator_t *allocator);
 void sparse_set_destroy(sparse_set_t *set);
 
-#define SPARSE_SET_INVALID_POS UINT32_MAX
-
 bool sparse_set_contains(const sparse_set_t *set, sparse_set_id_t id);
 uint32_t sparse_set_insert(sparse_set_t *set, sparse_set_id_t id);
 bool sparse_set_remove(sparse_set_t *set, sparse_set_id_t id);
 void sparse_set_clear(sparse_set_t *set);
 
+// Releases empty sparse pages and trims dense/data/columns to the current
+// size (never below SPARSE_SET_DEFAULT_CAPACITY).
+void sparse_set_shrink_to_fit(sparse_set_t *set);
+// With auto shrink on, a page is released as soon as it empties (one spare
+// is kept to absorb churn), dense storage halves once it falls to a quarter
+// full, and clear() shrinks to fit.
+void sparse_set_set_auto_shrink(sparse_set_t *set, bool enabled);
+// Adaptive index (see SPARSE_SET_HASH_MIN_CAPACITY). Enabling switches a
+// set small or sparse enough to the hash right away; shrink_to_fit can
+// switch back to it after the set has shrunk. Disabling moves to pages.
+// Has no effect on a set attached to a shared index. Returns false on
+// allocation failure, leaving the representation unchanged.
+bool sparse_set_set_adaptive(sparse_set_t *set, bool enabled);
+uint32_t sparse_set_capacity(const sparse_set_t *set);
+uint32_t sparse_set_page_count(const sparse_set_t *set);
+// Grows dense, data and every column to at least `capacity` entries in one
+// step instead of doubling up to it. Never shrinks; false on allocation
+// failure (or beyond a reserved set's limit), leaving the set unchanged.
+bool sparse_set_reserve(sparse_set_t *set, uint32_t capacity);
+
+// Memory snapshot of a set. `pages` counts sparse pages held (the spare
+// included), `live_pages` those with at least one id; byte counts are
+// what the set holds from its allocator (for a mapped set, dense and data
+// are the mapped regions). A set on a shared index reports no pages.
+typedef struct {
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t pages;
+    uint32_t live_pages;
+    uint32_t hash_capacity;
+    size_t dense_bytes;
+    size_t data_bytes;      // AoS data or all schema columns
+    size_t index_bytes;     // pages, page directory and hash
+    uint32_t reserved;      // sparse_set_reserved_capacity
+    sparse_set_counters_t counters;
+} sparse_set_stats_t;
+
+void sparse_set_stats(const sparse_set_t *set, sparse_set_stats_t *out);
+
+// Rebuilds the sparse index from dense[0, size), e.g. after dense was filled
+// from storage. Fails on duplicate indices or allocation failure.
+bool sparse_set_rebuild_index(sparse_set_t *set);
+
+// Frees the private sparse pages; used when the set moves to a shared index.
+void sparse_set_release_index(sparse_set_t *set);
+
+bool sparse_set_shared_init(sparse_set_shared_t *shared, sparse_set_allocator_t *allocator);
+// Detaches every attached set (see sparse_set_shared_detach) and frees the
+// index. A set whose private index cannot be built retries after the shared
+// pages are freed, and is only cleared if that fails as well.
+void sparse_set_shared_deinit(sparse_set_shared_t *shared);
+// Moves `set` (possibly non-empty) onto the shared index. Fails if the set
+// is already on one, the index has SPARSE_SET_SHARED_MAX_SETS sets, or on
+// allocation failure, leaving the set unchanged.
+bool sparse_set_shared_attach(sparse_set_shared_t *shared, sparse_set_t *set);
+// Rebuilds a private index for the set and leaves the shared one. Returns
+// false, still attached, on allocation failure.
+bool sparse_set_shared_detach(sparse_set_t *set);
+// Used by sparse-set.c: claims `bit` for `index` and returns its position
+// entry (set to SPARSE_SET_INVALID_POS), or NULL on allocation failure; and
+// drops `bit` from `index`. leave() drops every id of the set without
+// rebuilding anything, for deinit.
+uint32_t* sparse_set_shared_add(sparse_set_shared_t *shared, uint32_t bit, uint32_t index);
+void sparse_set_shared_drop(sparse_set_shared_t *shared, uint32_t bit, uint32_t index);
+void sparse_set_shared_leave(sparse_set_t *set);
+// True if every attached set in `mask` (bits as in set->shared_bit)
+// contains exactly `id`.
+bool sparse_set_shared_contains(const sparse_set_shared_t *shared, sparse_set_id_t id, uint64_t mask);
+// Releases pages no set has an index on.
+void sparse_set_shared_shrink_to_fit(sparse_set_shared_t *shared);
+
+// File-backed storage (POSIX only; see mapped.c). Backs dense and the AoS
+// data of an empty set with a shared mapping of `path`, created if missing.
+// An existing file must have been written with the same stride and is
+// reopened in place. Growth extends the file and remaps it.
+bool sparse_set_map_file(sparse_set_t *set, const char *path, uint32_t stride);
+// msync()s a mapped set; a no-op for other sets.
+bool sparse_set_sync(sparse_set_t *set);
+// Used by sparse-set.c for capacity changes and deinit of mapped sets.
+bool sparse_set_mapping_resize(sparse_set_t *set, uint32_t new_capacity);
+void sparse_set_unmap(sparse_set_t *set);
+
+// Reserved storage (POSIX only; see reserve.c). Reserves address space for
+// `max_capacity` entries of dense, data and every column of an empty set
+// and commits pages as it grows, so growth never copies records and the
+// dense/data/column pointers stay put for the life of the set. Call after
+// the stride or schema is set; not for file-backed sets. Growth past
+// max_capacity fails like an allocation failure. Memory committed this
+// way bypasses the set's allocator.
+bool sparse_set_reserve_address_space(sparse_set_t *set, uint32_t max_capacity);
+// Entries reserved by sparse_set_reserve_address_space, or 0.
+uint32_t sparse_set_reserved_capacity(const sparse_set_t *set);
+// Used by sparse-set.c for capacity changes and deinit of reserved sets.
+bool sparse_set_vm_resize(sparse_set_t *set, uint32_t new_capacity);
+void sparse_set_vm_release(sparse_set_t *set);
+
+// Batch variants. insert_many returns the number of newly added ids (or
+// SPARSE_SET_INVALID_POS on oom); out_pos receives each id's position and
+// may be NULL. index_of_many returns the number of ids found.
+uint32_t sparse_set_insert_many(sparse_set_t *set, const sparse_set_id_t *ids, uint32_t count, uint32_t *out_pos);
+uint32_t sparse_set_remove_many(sparse_set_t *set, const sparse_set_id_t *ids, uint32_t count);
+uint32_t sparse_set_index_of_many(const sparse_set_t *set, const sparse_set_id_t *ids, uint32_t count, uint32_t *out_pos);
+
 uint32_t sparse_set_size(const sparse_set_t *set);
+// Zero-copy spans: dense ids, stride records (NULL unless stride mode) and
+// schema columns. All are indexed by position in [0, size) and stay valid
+// until the next structural change.
+const sparse_set_id_t* sparse_set_dense(const sparse_set_t *set);
+void* sparse_set_data(const sparse_set_t *set);
+void* sparse_set_column_data(const sparse_set_t *set, uint32_t column);
 sparse_set_id_t sparse_set_get_id(const sparse_set_t *set, uint32_t pos);
 uint32_t sparse_set_index_of(const sparse_set_t *set, sparse_set_id_t id);
 void sparse_set_swap_at(sparse_set_t *set, uint32_t a, uint32_t b);
@@ -80,6 +461,61 @@ void sparse_set_swap_at(sparse_set_t *set, uint32_t a, uint32_t b);
 bool sparse_set_set_stride(sparse_set_t *set, uint32_t stride);
 void* sparse_set_get_data(const sparse_set_t *set, uint32_t pos);
 
+#define SPARSE_SET_MAX_COLUMNS 64
+#define SPARSE_SET_NO_COLUMN UINT32_MAX
+
+// Switches an empty set to column (SoA) storage, one column per type code.
+bool sparse_set_set_schema(sparse_set_t *set, const int *types, uint32_t count);
+void* sparse_set_get_column(const sparse_set_t *set, uint32_t column, uint32_t pos);
+
+// Gather/scatter one packed record of `stride` bytes, whatever the layout.
+void sparse_set_read_row(const sparse_set_t *set, uint32_t pos, void *out);
+void sparse_set_write_row(sparse_set_t *set, uint32_t pos, const void *in);
+
+// A typed field resolved once: either `offset` inside stride records
+// (column == SPARSE_SET_NO_COLUMN) or a whole schema column.
+typedef struct {
+    uint32_t column;
+    uint32_t offset;
+    uint32_t size;
+    int type;
+} sparse_set_field_t;
+
+bool sparse_set_field_at(const sparse_set_t *set, uint32_t offset, int type, sparse_set_field_t *out);
+bool sparse_set_field_column(const sparse_set_t *set, uint32_t column, sparse_set_field_t *out);
+
+static inline uint8_t* sparse_set_field_base(const sparse_set_t *set, const sparse_set_field_t *field) {
+    if (field->column != SPARSE_SET_NO_COLUMN) return set->columns[field->column].data;
+    return set->data + field->offset;
+}
+
+// Distance in bytes between the same field of consecutive positions.
+static inline uint32_t sparse_set_field_step(const sparse_set_t *set, const sparse_set_field_t *field) {
+    if (field->column != SPARSE_SET_NO_COLUMN) return set->columns[field->column].size;
+    return set->stride;
+}
+
+static inline uint8_t* sparse_set_field_ptr(const sparse_set_t *set, const sparse_set_field_t *field, uint32_t pos) {
+    return sparse_set_field_base(set, field) + (size_t)pos * sparse_set_field_step(set, field);
+}
+
+// Bulk field kernels (kernel.c). Supported types: INT, FLOAT, DOUBLE, BYTE;
+// integer results saturate. Contiguous float/double fields are vectorized.
+#define SPARSE_SET_OP_ADD 1     // x = x + a
+#define SPARSE_SET_OP_MUL 2     // x = x * a
+#define SPARSE_SET_OP_FMA 3     // x = x * a + b
+#define SPARSE_SET_OP_MIN 4     // x = min(x, a)
+#define SPARSE_SET_OP_MAX 5     // x = max(x, a)
+#define SPARSE_SET_OP_CLAMP 6   // x = min(max(x, a), b)
+
+// Each returns the number of elements touched, or SPARSE_SET_INVALID_POS for
+// unsupported types/ops. Across two sets the fields are joined by id.
+uint32_t sparse_set_field_apply(sparse_set_t *set, const sparse_set_field_t *field, int op, double a, double b);
+uint32_t sparse_set_field_axpy(sparse_set_t *dst_set, const sparse_set_field_t *dst,
+                               const sparse_set_t *src_set, const sparse_set_field_t *src, double k);
+uint32_t sparse_set_field_copy(sparse_set_t *dst_set, const sparse_set_field_t *dst,
+                               const sparse_set_t *src_set, const sparse_set_field_t *src);
+
 typedef struct {
     const sparse_set_t *set;
     uint32_t current_pos;
@@ -88,4 +524,196 @@ typedef struct {
 sparse_set_iter_t sparse_set_iter(const sparse_set_t *set);
 bool sparse_set_iter_next(sparse_set_iter_t *iter, sparse_set_id_t *out_id);
 
+#define SPARSE_SET_QUERY_MAX_SETS 16
+
+typedef struct {
+    const sparse_set_t *include[SPARSE_SET_QUERY_MAX_SETS];
+    const sparse_set_t *exclude[SPARSE_SET_QUERY_MAX_SETS];
+    uint32_t include_count;
+    uint32_t exclude_count;
+    // Set when every queried set is on this shared index: matching then
+    // reads one slot instead of one sparse page per set. Ignored once the
+    // index's epoch moves on.
+    const sparse_set_shared_t *shared;
+    uint32_t shared_epoch;
+    uint64_t include_mask;
+    uint64_t exclude_mask;
+} sparse_set_query_t;
+
+typedef struct {
+    const sparse_set_query_t *query;
+    uint32_t driver;
+    uint32_t current_pos;
+} sparse_set_query_iter_t;
+
+bool sparse_set_query_init(sparse_set_query_t *query,
+                           const sparse_set_t *const *include, uint32_t include_count,
+                           const sparse_set_t *const *exclude, uint32_t exclude_count);
+// Index into query->include of the smallest set, which drives iteration.
+uint32_t sparse_set_query_driver(const sparse_set_query_t *query);
+// Checks one id against every include/exclude set, filling out_pos[i] with
+// the id's position in include[i] (out_pos may be NULL).
+bool sparse_set_query_match(const sparse_set_query_t *query, sparse_set_id_t id, uint32_t *out_pos);
+sparse_set_query_iter_t sparse_set_query_iter(const sparse_set_query_t *query);
+bool sparse_set_query_iter_next(sparse_set_query_iter_t *iter, sparse_set_id_t *out_id, uint32_t *out_pos);
+// Number of matching entities; large driver sets are scanned in parallel.
+uint32_t sparse_set_query_count(const sparse_set_query_t *query);
+
+// Owning group: ids present in every owned set occupy positions
+// [0, size) of each set, in the same order, so iterating the group walks
+// the sets' dense/data arrays in parallel without lookups. The order is
+// maintained by insert/remove on the owned sets; swap_at refuses to touch
+// grouped positions. A set belongs to at most one group, and deinit of an
+// owned set disbands its group.
+#define SPARSE_SET_GROUP_MAX_SETS 16
+
+typedef struct sparse_set_group {
+    sparse_set_t *sets[SPARSE_SET_GROUP_MAX_SETS];
+    uint32_t set_count;
+    uint32_t size;
+} sparse_set_group_t;
+
+// Fails if count is not in [2, SPARSE_SET_GROUP_MAX_SETS], a set repeats,
+// or a set is already owned by another group.
+bool sparse_set_group_init(sparse_set_group_t *group, sparse_set_t *const *sets, uint32_t count);
+void sparse_set_group_deinit(sparse_set_group_t *group);
+bool sparse_set_group_contains(const sparse_set_group_t *group, sparse_set_id_t id);
+
+static inline uint32_t sparse_set_group_size(const sparse_set_group_t *group) {
+    return group->size;
+}
+
+// Sorting. Every sort is stable and fills the optional order_out (size
+// entries) with the applied permutation: order_out[i] is the old position
+// now at i. Grouped sets sort their grouped prefix and their tail
+// separately; the prefix permutation is applied to every owned set.
+// All return false on allocation failure, leaving the set unchanged.
+bool sparse_set_sort_by_id(sparse_set_t *set, uint32_t *order_out);
+// Radix sort on a typed field.
+bool sparse_set_sort_by_field(sparse_set_t *set, const sparse_set_field_t *field, bool descending, uint32_t *order_out);
+// Ids also in `other` come first, in other's order; the rest keep their
+// relative order after them.
+bool sparse_set_sort_like(sparse_set_t *set, const sparse_set_t *other, uint32_t *order_out);
+
+typedef bool (*sparse_set_less_fn)(void *ud, const sparse_set_t *set, uint32_t a, uint32_t b);
+// Stable merge sort of positions into `order` using caller buffers of size
+// entries each; the set is not modified, so `less` may longjmp. `less` must
+// not change the set's size or group either: the caller checks that and
+// bails out. Apply the result with sparse_set_permute.
+void sparse_set_sort_order(const sparse_set_t *set, sparse_set_less_fn less, void *ud,
+                           uint32_t *order, uint32_t *scratch);
+// Reorders positions so that i holds what was at order[i]. order must be a
+// permutation of [0, size) that keeps grouped positions inside the prefix.
+bool sparse_set_permute(sparse_set_t *set, const uint32_t *order);
+
+// Binary snapshots (see snapshot.c for the layout). *_write returns the
+// number of bytes written, or 0 if `capacity` is below *_snapshot_size.
+// Reading a set replaces its contents and requires the same stride/schema
+// as when it was written (and no owning group); reading a registry replaces
+// it wholesale. Both return false on malformed input (including repeated
+// ids) or allocation failure and then leave the target untouched; only a set
+// whose sparse index cannot be allocated while reloading is left empty.
+#define SPARSE_SET_SNAPSHOT_VERSION 1
+
+size_t sparse_set_snapshot_size(const sparse_set_t *set);
+size_t sparse_set_snapshot_write(const sparse_set_t *set, void *out, size_t capacity);
+bool sparse_set_snapshot_read(sparse_set_t *set, const void *in, size_t len);
+size_t registry_snapshot_size(const registry_t *reg);
+size_t registry_snapshot_write(const registry_t *reg, void *out, size_t capacity);
+bool registry_snapshot_read(registry_t *reg, const void *in, size_t len);
+
+// Change tracking (changes.c). While enabled, insert/remove/clear, row
+// writes and the field kernels record one entry per touched entity until it
+// is drained. Marks are folded: an entity added and then removed before a
+// drain is dropped, a removal followed by re-adding the same id becomes a
+// whole-row modification, and modifications union their byte ranges
+// [lo, hi) within the packed row. `removed_version` is the version of the id
+// that went away when kind has SPARSE_SET_CHANGE_REMOVED (an index recycled
+// in between reports ADDED | REMOVED with the new id).
+#define SPARSE_SET_CHANGE_ADDED 1
+#define SPARSE_SET_CHANGE_MODIFIED 2
+#define SPARSE_SET_CHANGE_REMOVED 4
+
+typedef struct {
+    uint32_t kind;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t removed_version;
+} sparse_set_change_t;
+
+// Enabling allocates the tracker; disabling discards pending changes.
+bool sparse_set_track_changes(sparse_set_t *set, bool enabled);
+void sparse_set_mark_change(sparse_set_t *set, sparse_set_id_t id, uint32_t kind, uint32_t lo, uint32_t hi);
+// Marks `field` modified for positions [first, first + count).
+void sparse_set_mark_field(sparse_set_t *set, const sparse_set_field_t *field, uint32_t first, uint32_t count);
+// Byte range of `field` inside a packed row.
+void sparse_set_field_range(const sparse_set_t *set, const sparse_set_field_t *field, uint32_t *lo, uint32_t *hi);
+uint32_t sparse_set_change_count(const sparse_set_t *set);
+// Moves up to `capacity` pending changes out; returns how many were written.
+uint32_t sparse_set_drain_changes(sparse_set_t *set, sparse_set_id_t *ids, sparse_set_change_t *out, uint32_t capacity);
+
+// Worker pool for native kernels (parallel.c). The pool is process-wide
+// and starts with one thread (the caller): nothing runs in parallel until
+// set_threads(n > 1). parallel_for splits [0, count) into chunks of at
+// least `min_chunk` and blocks until every chunk is done; concurrent
+// callers take turns. Tasks must not call parallel_for themselves.
+#define SPARSE_SET_PARALLEL_MAX_THREADS 256
+#define SPARSE_SET_PARALLEL_MIN_CHUNK 16384
+
+typedef void (*sparse_set_task_fn)(void *ud, uint32_t begin, uint32_t end);
+
+bool sparse_set_parallel_set_threads(uint32_t threads);
+uint32_t sparse_set_parallel_threads(void);
+// Users of the pool (one per Lua state that started workers). The workers
+// are stopped when the last user releases, before the code they run can be
+// unloaded.
+void sparse_set_parallel_retain(void);
+void sparse_set_parallel_release(void);
+void sparse_set_parallel_for(uint32_t count, uint32_t min_chunk, sparse_set_task_fn fn, void *ud);
+
+// Deferred structural changes (commands.c). Commands are recorded while
+// sets are being iterated and applied in one batch by flush, grouped by
+// target and sparse page for locality. Commands for the same id keep their
+// recorded order; registry destroys run after every set command. Row and
+// field payloads are copied at record time.
+#define SPARSE_SET_CMD_INSERT 1
+#define SPARSE_SET_CMD_WRITE 2
+#define SPARSE_SET_CMD_REMOVE 3
+#define SPARSE_SET_CMD_DESTROY 4
+
+typedef struct {
+    void *target;               // sparse_set_t*, or registry_t* for DESTROY
+    sparse_set_id_t id;
+    uint32_t op;
+    uint32_t seq;
+    sparse_set_field_t field;   // WRITE only
+    size_t payload;             // arena offset, or SIZE_MAX for none
+} sparse_set_command_t;
+
+typedef struct {
+    sparse_set_allocator_t *allocator;
+    sparse_set_command_t *commands;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t *arena;
+    size_t arena_size;
+    size_t arena_capacity;
+} sparse_set_commands_t;
+
+// A NULL allocator selects sparse_set_default_allocator.
+bool sparse_set_commands_init(sparse_set_commands_t *cmds, sparse_set_allocator_t *allocator);
+void sparse_set_commands_deinit(sparse_set_commands_t *cmds);
+void sparse_set_commands_clear(sparse_set_commands_t *cmds);
+// `row` (stride bytes) may be NULL: new ids get a zeroed row, existing ids
+// keep theirs.
+bool sparse_set_commands_insert(sparse_set_commands_t *cmds, sparse_set_t *set, sparse_set_id_t id, const void *row);
+bool sparse_set_commands_write(sparse_set_commands_t *cmds, sparse_set_t *set, sparse_set_id_t id,
+                               const sparse_set_field_t *field, const void *value);
+bool sparse_set_commands_remove(sparse_set_commands_t *cmds, sparse_set_t *set, sparse_set_id_t id);
+bool sparse_set_commands_destroy(sparse_set_commands_t *cmds, registry_t *reg, sparse_set_id_t id);
+// Applies and clears every command; returns how many took effect (inserts
+// of new ids or with a row, writes to present ids, successful removes,
+// destroys of valid ids).
+uint32_t sparse_set_commands_flush(sparse_set_commands_t *cmds);
+
 #endif
@@ -0,0 +1,302 @@
+// Benchmarks for the C core, built and run by `make bench`:
+//
+//   build/bench [n [rounds]]
+//
+// Each case runs `rounds` times over n operations, timed in batches of
+// BENCH_BATCH operations. One JSON object per case is printed on stdout:
+// ns_op is the mean over all rounds, p50/p90/p99/max are per-operation
+// times of single batches, mem is the live bytes of the default allocator
+// at the end of a round and rss_kb the peak resident set of the process so
+// far (getrusage). Setup and teardown of a round are not timed.
+
+#include "sparse-set.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define BENCH_BATCH 1024
+
+typedef enum { IDS_SEQ, IDS_RANDOM, IDS_HIGH, IDS_COUNT } bench_ids_t;
+
+static const char *bench_ids_names[IDS_COUNT] = { "seq", "random", "high" };
+
+typedef struct {
+    uint32_t n;
+    sparse_set_id_t *ids;
+    uint32_t stride;
+    sparse_set_t *set;
+    registry_t *reg;
+    sparse_set_id_t *live;
+    sparse_set_field_t field;
+    uint64_t rng;
+    volatile uint64_t sink;
+} bench_ctx_t;
+
+typedef struct {
+    const char *name;
+    bool (*setup)(bench_ctx_t *ctx);
+    void (*run)(bench_ctx_t *ctx, uint32_t first, uint32_t count);
+} bench_case_t;
+
+static uint64_t bench_next(uint64_t *state) {
+    // xorshift64*; deterministic so every run sees the same id sequence.
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static long bench_peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+    return usage.ru_maxrss;
+}
+
+// seq: indices 0..n-1 in order. random: the same indices shuffled, so the
+// set is equally dense but every access lands on a random page. high:
+// indices spread over the top of the 32-bit range (two-level directory).
+static void bench_fill_ids(sparse_set_id_t *ids, uint32_t n, bench_ids_t kind) {
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t index = kind == IDS_HIGH ? 0xF0000000u + i * 7 : i;
+        ids[i] = ID_MAKE(index, 1);
+    }
+    if (kind == IDS_RANDOM) {
+        for (uint32_t i = n - 1; i > 0; i--) {
+            uint32_t j = (uint32_t)(bench_next(&rng) % (i + 1));
+            sparse_set_id_t tmp = ids[i];
+            ids[i] = ids[j];
+            ids[j] = tmp;
+        }
+    }
+}
+
+static int bench_cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(const double *sorted, uint32_t count, double q) {
+    uint32_t i = (uint32_t)(q * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+static bool bench_new_set(bench_ctx_t *ctx) {
+    ctx->set = sparse_set_create();
+    if (!ctx->set) return false;
+    return ctx->stride == 0 || sparse_set_set_stride(ctx->set, ctx->stride);
+}
+
+static bool bench_filled_set(bench_ctx_t *ctx) {
+    if (!bench_new_set(ctx)) return false;
+    for (uint32_t i = 0; i < ctx->n; i++) {
+        uint32_t pos = sparse_set_insert(ctx->set, ctx->ids[i]);
+        if (pos == SPARSE_SET_INVALID_POS) return false;
+        if (ctx->stride) memset(sparse_set_get_data(ctx->set, pos), 0, ctx->stride);
+    }
+    return true;
+}
+
+static void bench_teardown(bench_ctx_t *ctx) {
+    sparse_set_destroy(ctx->set);
+    registry_destroy(ctx->reg);
+    free(ctx->live);
+    ctx->set = NULL;
+    ctx->reg = NULL;
+    ctx->live = NULL;
+}
+
+static void run_insert(bench_ctx_t *ctx, uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t pos = sparse_set_insert(ctx->set, ctx->ids[i]);
+        if (ctx->stride) memset(sparse_set_get_data(ctx->set, pos), (int)i, ctx->stride);
+    }
+}
+
+static void run_contains(bench_ctx_t *ctx, uint32_t first, uint32_t count) {
+    uint64_t hits = 0;
+    for (uint32_t i = first; i < first + count; i++) {
+        hits += sparse_set_contains(ctx->set, ctx->ids[i]);
+    }
+    ctx->sink += hits;
+}
+
+static void run_remove(bench_ctx_t *ctx, uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; i++) {
+        sparse_set_remove(ctx->set, ctx->ids[i]);
+    }
+}
+
+// Iteration visits positions [first, first + count) of the dense array and
+// reads the first word of each row (or the id for stride 0).
+static void run_iterate(bench_ctx_t *ctx, uint32_t first, uint32_t count) {
+    uint64_t sum = 0;
+    const sparse_set_t *set = ctx->set;
+    for (uint32_t pos = first; pos < first + count; pos++) {
+        if (ctx->stride) {
+            uint32_t word;
+            memcpy(&word, set->data + (size_t)pos * set->stride, sizeof(word));
+            sum += word;
+        } else {
+            sum += set->dense[pos];
+        }
+    }
+    ctx->sink += sum;
+}
+
+static bool setup_field(bench_ctx_t *ctx) {
+    return bench_filled_set(ctx) && sparse_set_field_at(ctx->set, 4, SPARSE_SET_TYPE_INT, &ctx->field);
+}
+
+static void run_get_field(bench_ctx_t *ctx, uint32_t first, uint32_t count) {
+    int64_t sum = 0;
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t pos = sparse_set_index_of(ctx->set, ctx->ids[i]);
+        int32_t value;
+        memcpy(&value, sparse_set_field_ptr(ctx->set, &ctx->field, pos), sizeof(value));
+        sum += value;
+    }
+    ctx->sink += (uint64_t)sum;
+}
+
+static void run_set_field(bench_ctx_t *ctx, uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t pos = sparse_set_index_of(ctx->set, ctx->ids[i]);
+        int32_t value = (int32_t)i;
+        memcpy(sparse_set_field_ptr(ctx->set, &ctx->field, pos), &value, sizeof(value));
+        sparse_set_mark_field(ctx->set, &ctx->field, pos, 1);
+    }
+}
+
+// Churn keeps n/2 entities alive; one operation destroys a random live one
+// (recycling its index) and creates a replacement.
+static bool setup_churn(bench_ctx_t *ctx) {
+    uint32_t live = ctx->n / 2 ? ctx->n / 2 : 1;
+    ctx->reg = registry_create();
+    ctx->live = (sparse_set_id_t*)malloc((size_t)live * sizeof(sparse_set_id_t));
+    if (!ctx->reg || !ctx->live || !bench_new_set(ctx)) return false;
+    for (uint32_t i = 0; i < live; i++) {
+        ctx->live[i] = registry_create_id(ctx->reg);
+        if (sparse_set_insert(ctx->set, ctx->live[i]) == SPARSE_SET_INVALID_POS) return false;
+    }
+    ctx->rng = 0xD1B54A32D192ED03ull;
+    return true;
+}
+
+static void run_churn(bench_ctx_t *ctx, uint32_t first, uint32_t count) {
+    uint32_t live = ctx->n / 2 ? ctx->n / 2 : 1;
+    (void)first;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = (uint32_t)(bench_next(&ctx->rng) % live);
+        sparse_set_remove(ctx->set, ctx->live[slot]);
+        registry_recycle(ctx->reg, ctx->live[slot]);
+        ctx->live[slot] = registry_create_id(ctx->reg);
+        sparse_set_insert(ctx->set, ctx->live[slot]);
+    }
+}
+
+static const bench_case_t bench_insert = { "insert", bench_new_set, run_insert };
+static const bench_case_t bench_contains = { "contains", bench_filled_set, run_contains };
+static const bench_case_t bench_remove = { "remove", bench_filled_set, run_remove };
+static const bench_case_t bench_iterate = { "iterate", bench_filled_set, run_iterate };
+static const bench_case_t bench_get_field = { "get_field", setup_field, run_get_field };
+static const bench_case_t bench_set_field = { "set_field", setup_field, run_set_field };
+static const bench_case_t bench_churn = { "churn", setup_churn, run_churn };
+
+static bool bench_run(const bench_case_t *c, bench_ctx_t *ctx, bench_ids_t ids, uint32_t rounds) {
+    uint32_t batches = (ctx->n + BENCH_BATCH - 1) / BENCH_BATCH;
+    double *samples = (double*)malloc((size_t)batches * rounds * sizeof(double));
+    if (!samples) return false;
+
+    uint64_t total_ns = 0;
+    size_t mem = 0;
+    uint32_t count = 0;
+    for (uint32_t r = 0; r < rounds; r++) {
+        if (!c->setup(ctx)) {
+            bench_teardown(ctx);
+            free(samples);
+            return false;
+        }
+        for (uint32_t first = 0; first < ctx->n; first += BENCH_BATCH) {
+            uint32_t len = ctx->n - first < BENCH_BATCH ? ctx->n - first : BENCH_BATCH;
+            uint64_t start = bench_now_ns();
+            c->run(ctx, first, len);
+            uint64_t elapsed = bench_now_ns() - start;
+            total_ns += elapsed;
+            samples[count++] = (double)elapsed / len;
+        }
+        mem = sparse_set_default_allocator.bytes;
+        bench_teardown(ctx);
+    }
+
+    qsort(samples, count, sizeof(double), bench_cmp_double);
+    printf("{\"suite\":\"c\",\"case\":\"%s\",\"ids\":\"%s\",\"stride\":%u,\"n\":%u,\"rounds\":%u,"
+           "\"ns_op\":%.2f,\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,\"max\":%.2f,"
+           "\"mem\":%zu,\"rss_kb\":%ld}\n",
+           c->name, bench_ids_names[ids], ctx->stride, ctx->n, rounds,
+           (double)total_ns / ((double)ctx->n * rounds),
+           bench_percentile(samples, count, 0.50), bench_percentile(samples, count, 0.90),
+           bench_percentile(samples, count, 0.99), samples[count - 1],
+           mem, bench_peak_rss_kb());
+    fflush(stdout);
+    free(samples);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 1000000;
+    uint32_t rounds = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 3;
+    if (n == 0 || rounds == 0) {
+        fprintf(stderr, "usage: %s [n [rounds]]\n", argv[0]);
+        return 1;
+    }
+
+    bench_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.n = n;
+    ctx.ids = (sparse_set_id_t*)malloc((size_t)n * sizeof(sparse_set_id_t));
+    if (!ctx.ids) return 1;
+
+    bool ok = true;
+    for (int kind = 0; kind < IDS_COUNT && ok; kind++) {
+        bench_fill_ids(ctx.ids, n, (bench_ids_t)kind);
+        ctx.stride = 0;
+        ok = bench_run(&bench_insert, &ctx, (bench_ids_t)kind, rounds) &&
+             bench_run(&bench_contains, &ctx, (bench_ids_t)kind, rounds) &&
+             bench_run(&bench_remove, &ctx, (bench_ids_t)kind, rounds);
+    }
+
+    static const uint32_t strides[] = { 4, 16, 64, 256 };
+    bench_fill_ids(ctx.ids, n, IDS_SEQ);
+    ctx.stride = 0;
+    ok = ok && bench_run(&bench_iterate, &ctx, IDS_SEQ, rounds);
+    for (size_t i = 0; i < sizeof(strides) / sizeof(strides[0]) && ok; i++) {
+        ctx.stride = strides[i];
+        ok = bench_run(&bench_insert, &ctx, IDS_SEQ, rounds) &&
+             bench_run(&bench_iterate, &ctx, IDS_SEQ, rounds);
+    }
+
+    bench_fill_ids(ctx.ids, n, IDS_RANDOM);
+    ctx.stride = 16;
+    ok = ok && bench_run(&bench_get_field, &ctx, IDS_RANDOM, rounds) &&
+         bench_run(&bench_set_field, &ctx, IDS_RANDOM, rounds);
+
+    ctx.stride = 0;
+    ok = ok && bench_run(&bench_churn, &ctx, IDS_RANDOM, rounds);
+
+    free(ctx.ids);
+    if (!ok) {
+        fprintf(stderr, "bench: allocation failed\n");
+        return 1;
+    }
+    return 0;
+}
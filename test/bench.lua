@@ -0,0 +1,266 @@
+-- Benchmarks for the Lua binding, run by `make bench`:
+--
+--   lua test/bench.lua [n [rounds]]
+--
+-- Mirrors test/bench.c case for case, so the difference between the two
+-- outputs is the cost of crossing the binding. Each case runs `rounds`
+-- times over n operations timed in batches of BATCH with os.clock, and
+-- prints one JSON object: ns_op is the mean, p50/p90/p99/max are
+-- per-operation times of single batches, mem the native bytes reported by
+-- sparseset.memory(), lua_kb the Lua heap and rss_kb the peak resident set
+-- (VmHWM, null where /proc is unavailable). Setup is not timed.
+package.cpath = package.cpath .. ";./build/?.so"
+local sparse_set = require("sparseset")
+
+local n = tonumber(arg and arg[1]) or 1000000
+local rounds = tonumber(arg and arg[2]) or 3
+local BATCH = 4096
+local VERSION = 4294967296 -- ID_MAKE(index, 1)
+
+local function peak_rss_kb()
+    local f = io.open("/proc/self/status", "r")
+    if not f then return "null" end
+    local text = f:read("*a")
+    f:close()
+    return text:match("VmHWM:%s*(%d+)") or "null"
+end
+
+-- Same id sets as the C harness: sequential, the same indices shuffled,
+-- and indices spread over the top of the 32-bit range.
+local function make_ids(kind)
+    local ids = {}
+    for i = 1, n do
+        local index = kind == "high" and 0xF0000000 + (i - 1) * 7 or i - 1
+        ids[i] = index + VERSION
+    end
+    if kind == "random" then
+        local seed = 12345
+        for i = n, 2, -1 do
+            seed = (seed * 1103515245 + 12345) % 2147483648
+            local j = seed % i + 1
+            ids[i], ids[j] = ids[j], ids[i]
+        end
+    end
+    return ids
+end
+
+local function percentile(sorted, q)
+    return sorted[math.floor(q * (#sorted - 1) + 0.5) + 1]
+end
+
+local sink = 0
+
+local function run_case(name, ids_kind, stride, ids, setup, run)
+    local samples = {}
+    local total = 0
+    local mem = 0
+    for _ = 1, rounds do
+        local ctx = setup(ids)
+        collectgarbage()
+        for first = 1, n, BATCH do
+            local last = math.min(first + BATCH - 1, n)
+            local start = os.clock()
+            run(ctx, first, last)
+            local elapsed = os.clock() - start
+            total = total + elapsed
+            samples[#samples + 1] = elapsed * 1e9 / (last - first + 1)
+        end
+        mem = sparse_set.memory()
+    end
+    table.sort(samples)
+    print(string.format(
+        '{"suite":"lua","case":"%s","ids":"%s","stride":%d,"n":%d,"rounds":%d,' ..
+        '"ns_op":%.2f,"p50":%.2f,"p90":%.2f,"p99":%.2f,"max":%.2f,' ..
+        '"mem":%d,"lua_kb":%d,"rss_kb":%s}',
+        name, ids_kind, stride, n, rounds, total * 1e9 / (n * rounds),
+        percentile(samples, 0.50), percentile(samples, 0.90), percentile(samples, 0.99),
+        samples[#samples], mem, math.floor(collectgarbage("count")), peak_rss_kb()))
+    io.stdout:flush()
+end
+
+local function new_set(stride)
+    if stride == 0 then return sparse_set.new_set() end
+    return sparse_set.new_set(stride)
+end
+
+local function filled_set(stride)
+    return function(ids)
+        local set = new_set(stride)
+        local value = stride == 0 and true or string.rep("\0", stride)
+        for i = 1, n do set:insert(ids[i], value) end
+        return { set = set, ids = ids }
+    end
+end
+
+local function run_insert(ctx, first, last)
+    local set, ids, value = ctx.set, ctx.ids, ctx.value
+    for i = first, last do set:insert(ids[i], value) end
+end
+
+local function run_contains(ctx, first, last)
+    local set, ids, hits = ctx.set, ctx.ids, 0
+    for i = first, last do
+        if set:contains(ids[i]) then hits = hits + 1 end
+    end
+    sink = sink + hits
+end
+
+local function run_remove(ctx, first, last)
+    local set, ids = ctx.set, ctx.ids
+    for i = first, last do set:remove(ids[i]) end
+end
+
+local function setup_iterate(stride)
+    local fill = filled_set(stride)
+    return function(ids)
+        local ctx = fill(ids)
+        ctx.f, ctx.s, ctx.k = ctx.set:iter()
+        return ctx
+    end
+end
+
+local function run_iterate(ctx, first, last)
+    local f, s, k = ctx.f, ctx.s, ctx.k
+    for _ = first, last do k = f(s, k) end
+    ctx.k = k
+end
+
+local function run_get_field(ctx, first, last)
+    local set, ids, sum = ctx.set, ctx.ids, 0
+    for i = first, last do sum = sum + set:get_field(ids[i], 4, sparse_set.TYPE_INT) end
+    sink = sink + sum
+end
+
+local function run_set_field(ctx, first, last)
+    local set, ids = ctx.set, ctx.ids
+    for i = first, last do set:set_field(ids[i], 4, sparse_set.TYPE_INT, i) end
+end
+
+local function run_get_field_at(ctx, first, last)
+    local set, sum = ctx.set, 0
+    for i = first, last do sum = sum + set:get_field_at(i, 4, sparse_set.TYPE_INT) end
+    sink = sink + sum
+end
+
+local function setup_layout(ids)
+    local ctx = filled_set(16)(ids)
+    ctx.layout = ctx.set:layout("iiii")
+    return ctx
+end
+
+local function run_get_fields(ctx, first, last)
+    local set, ids, layout, sum = ctx.set, ctx.ids, ctx.layout, 0
+    for i = first, last do
+        local a, b, c, d = set:get_fields(ids[i], layout)
+        sum = sum + a + b + c + d
+    end
+    sink = sink + sum
+end
+
+local function setup_accessor(ids)
+    local ctx = filled_set(16)(ids)
+    ctx.get, ctx.put = ctx.set:accessor(4, sparse_set.TYPE_INT)
+    return ctx
+end
+
+local function run_accessor_get(ctx, first, last)
+    local get, ids, sum = ctx.get, ctx.ids, 0
+    for i = first, last do sum = sum + get(ids[i]) end
+    sink = sink + sum
+end
+
+local function run_accessor_set(ctx, first, last)
+    local put, ids = ctx.put, ctx.ids
+    for i = first, last do put(ids[i], i) end
+end
+
+-- LuaJIT only: the same field read through a sparseset.ffi row pointer,
+-- walking positions instead of looking ids up.
+local function setup_ffi(ids)
+    local ctx = filled_set(16)(ids)
+    ctx.rows = sparse_set.ffi.data(ctx.set, "bench_row_t")
+    return ctx
+end
+
+local function run_ffi_iterate_field(ctx, first, last)
+    local rows, sum = ctx.rows, 0
+    for i = first - 1, last - 1 do sum = sum + rows[i].value end
+    sink = sink + sum
+end
+
+-- Churn keeps n/2 entities alive through a registry with the set attached;
+-- one operation destroys a random live entity and creates a replacement.
+local function setup_churn()
+    local reg, set = sparse_set.new_registry(), sparse_set.new_set()
+    reg:attach(set)
+    local live = {}
+    for i = 1, math.max(math.floor(n / 2), 1) do
+        live[i] = reg:create()
+        set:insert(live[i], true)
+    end
+    return { reg = reg, set = set, live = live, seed = 54321 }
+end
+
+local function run_churn(ctx, first, last)
+    local reg, set, live, seed = ctx.reg, ctx.set, ctx.live, ctx.seed
+    local count = #live
+    for _ = first, last do
+        seed = (seed * 1103515245 + 12345) % 2147483648
+        local slot = seed % count + 1
+        reg:destroy(live[slot])
+        local id = reg:create()
+        live[slot] = id
+        set:insert(id, true)
+    end
+    ctx.seed = seed
+end
+
+-- Plain Lua table doing the same keyed work, as a floor for the VM itself.
+local function setup_table(ids)
+    local t = {}
+    for i = 1, n do t[ids[i]] = true end
+    return { t = t, ids = ids }
+end
+
+local function run_table_contains(ctx, first, last)
+    local t, ids, hits = ctx.t, ctx.ids, 0
+    for i = first, last do
+        if t[ids[i]] then hits = hits + 1 end
+    end
+    sink = sink + hits
+end
+
+for _, kind in ipairs({ "seq", "random", "high" }) do
+    local ids = make_ids(kind)
+    run_case("insert", kind, 0, ids, function(ids)
+        return { set = new_set(0), ids = ids, value = true }
+    end, run_insert)
+    run_case("contains", kind, 0, ids, filled_set(0), run_contains)
+    run_case("remove", kind, 0, ids, filled_set(0), run_remove)
+    run_case("table_contains", kind, 0, ids, setup_table, run_table_contains)
+end
+
+local seq = make_ids("seq")
+run_case("iterate", "seq", 0, seq, setup_iterate(0), run_iterate)
+for _, stride in ipairs({ 4, 16, 64, 256 }) do
+    run_case("insert", "seq", stride, seq, function(ids)
+        return { set = new_set(stride), ids = ids, value = string.rep("\1", stride) }
+    end, run_insert)
+    run_case("iterate", "seq", stride, seq, setup_iterate(stride), run_iterate)
+end
+seq = nil
+
+local random = make_ids("random")
+run_case("get_field", "random", 16, random, filled_set(16), run_get_field)
+run_case("set_field", "random", 16, random, filled_set(16), run_set_field)
+run_case("get_field_at", "random", 16, random, filled_set(16), run_get_field_at)
+run_case("get_fields", "random", 16, random, setup_layout, run_get_fields)
+run_case("accessor_get", "random", 16, random, setup_accessor, run_accessor_get)
+run_case("accessor_set", "random", 16, random, setup_accessor, run_accessor_set)
+run_case("churn", "random", 0, random, setup_churn, run_churn)
+if sparse_set.ffi then
+    require("ffi").cdef("typedef struct { int32_t pad, value, rest[2]; } bench_row_t;")
+    run_case("ffi_iterate_field", "random", 16, random, setup_ffi, run_ffi_iterate_field)
+end
+
+if sink < 0 then print(sink) end
@@ -0,0 +1,192 @@
+// Native test module for the C API, built by `make test` as
+// build/capi_test.so. It reaches the core only through the function table
+// from lsparseset_getcapi, the way a third-party extension would, and
+// exposes thin wrappers for test/test.lua to check. closed_state runs code
+// in a second lua_State with a failing allocator, for the module's cleanup
+// at lua_close and its allocation failure paths.
+
+#include <lualib.h>
+#include <stdlib.h>
+#include "lua-sparse-set.h"
+
+static const sparse_set_capi_t *check_capi(lua_State *L) {
+    const sparse_set_capi_t *capi = lsparseset_getcapi(L, SPARSE_SET_API_VERSION);
+    if (!capi) luaL_error(L, "sparseset C API not available");
+    return capi;
+}
+
+static int l_version(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, SPARSE_SET_CAPI_KEY);
+    const sparse_set_capi_t *capi = (const sparse_set_capi_t *)lua_touserdata(L, -1);
+    if (!capi) return 0;
+    lua_pushinteger(L, capi->version);
+    lua_pushboolean(L, lsparseset_getcapi(L, capi->version + 1) == NULL);
+    return 2;
+}
+
+static int l_insert(lua_State *L) {
+    const sparse_set_capi_t *capi = check_capi(L);
+    sparse_set_t *set = lsparseset_checkset(L, 1);
+    uint32_t pos = capi->insert(set, (sparse_set_id_t)luaL_checkinteger(L, 2));
+    if (pos == SPARSE_SET_INVALID_POS) return 0;
+    lua_pushinteger(L, (lua_Integer)pos + 1);
+    return 1;
+}
+
+static int l_remove(lua_State *L) {
+    const sparse_set_capi_t *capi = check_capi(L);
+    sparse_set_t *set = lsparseset_checkset(L, 1);
+    lua_pushboolean(L, capi->remove(set, (sparse_set_id_t)luaL_checkinteger(L, 2)));
+    return 1;
+}
+
+// Ids through the dense span, the position lookups and the iterator; all
+// three must agree or this raises.
+static int l_dense(lua_State *L) {
+    const sparse_set_capi_t *capi = check_capi(L);
+    const sparse_set_t *set = lsparseset_checkset(L, 1);
+    uint32_t n = capi->size(set);
+    const sparse_set_id_t *dense = capi->dense(set);
+    sparse_set_iter_t it = capi->iter(set);
+    sparse_set_id_t id;
+    uint32_t seen = 0;
+    while (capi->iter_next(&it, &id)) {
+        if (seen >= n || dense[seen] != id) return luaL_error(L, "iterator disagrees with dense");
+        seen++;
+    }
+    if (seen != n) return luaL_error(L, "iterator stopped early");
+    lua_createtable(L, (int)n, 0);
+    for (uint32_t i = 0; i < n; i++) {
+        if (capi->get_id(set, i) != dense[i] || capi->index_of(set, dense[i]) != i ||
+            !capi->contains(set, dense[i])) {
+            return luaL_error(L, "position lookups disagree with dense");
+        }
+        lua_pushinteger(L, (lua_Integer)dense[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+// Packed records through the data span, checked against get_data.
+static int l_data(lua_State *L) {
+    const sparse_set_capi_t *capi = check_capi(L);
+    const sparse_set_t *set = lsparseset_checkset(L, 1);
+    uint32_t n = capi->size(set);
+    const char *data = (const char *)capi->data(set);
+    if (!data) return 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (capi->get_data(set, i) != data + (size_t)i * set->stride) {
+            return luaL_error(L, "get_data disagrees with data");
+        }
+    }
+    lua_pushlstring(L, data, (size_t)n * set->stride);
+    return 1;
+}
+
+static int l_column(lua_State *L) {
+    const sparse_set_capi_t *capi = check_capi(L);
+    const sparse_set_t *set = lsparseset_checkset(L, 1);
+    uint32_t column = (uint32_t)luaL_checkinteger(L, 2);
+    const char *data = (const char *)capi->column_data(set, column);
+    if (!data) return 0;
+    uint32_t n = capi->size(set);
+    uint32_t size = set->columns[column].size;
+    for (uint32_t i = 0; i < n; i++) {
+        if (capi->get_column(set, column, i) != data + (size_t)i * size) {
+            return luaL_error(L, "get_column disagrees with column_data");
+        }
+    }
+    lua_pushlstring(L, data, (size_t)n * size);
+    return 1;
+}
+
+static int l_registry(lua_State *L) {
+    const sparse_set_capi_t *capi = check_capi(L);
+    registry_t *reg = lsparseset_checkregistry(L, 1);
+    sparse_set_id_t id = capi->registry_create_id(reg);
+    bool fresh = capi->registry_valid(reg, id);
+    capi->registry_recycle(reg, id);
+    lua_pushinteger(L, (lua_Integer)id);
+    lua_pushboolean(L, fresh && !capi->registry_valid(reg, id));
+    return 2;
+}
+
+// Allocator of the states made below: once `limit` is set, allocations
+// that would take the state past it fail (shrinks and frees never do).
+typedef struct {
+    size_t used;
+    size_t limit;
+} limited_alloc_t;
+
+static void *limited_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    limited_alloc_t *state = (limited_alloc_t *)ud;
+    if (!ptr) osize = 0;
+    if (nsize == 0) {
+        free(ptr);
+        state->used -= osize;
+        return NULL;
+    }
+    if (nsize > osize && state->limit && state->used + (nsize - osize) > state->limit) return NULL;
+    void *out = realloc(ptr, nsize);
+    if (out) state->used += nsize - osize;
+    return out;
+}
+
+// limit(extra): fail allocations past `extra` more bytes; limit() lifts it.
+static int l_limit(lua_State *L) {
+    void *ud;
+    lua_getallocf(L, &ud);
+    limited_alloc_t *state = (limited_alloc_t *)ud;
+    state->limit = lua_isnoneornil(L, 1) ? 0 : state->used + (size_t)luaL_checkinteger(L, 1);
+    return 0;
+}
+
+// Runs `code` with `arg` in a fresh state that loads the module through
+// package.cpath `cpath` and has the global limit(), then closes the state;
+// returns the chunk's integer result.
+static int l_closed_state(lua_State *L) {
+    const char *cpath = luaL_checkstring(L, 1);
+    const char *code = luaL_checkstring(L, 2);
+    lua_Integer arg = luaL_optinteger(L, 3, 0);
+    limited_alloc_t state = { 0, 0 };
+    lua_State *other = lua_newstate(limited_alloc, &state);
+    if (!other) return luaL_error(L, "cannot create state");
+    luaL_openlibs(other);
+    lua_pushcfunction(other, l_limit);
+    lua_setglobal(other, "limit");
+    lua_getglobal(other, "package");
+    lua_pushstring(other, cpath);
+    lua_setfield(other, -2, "cpath");
+    lua_pop(other, 1);
+    int status = luaL_loadstring(other, code);
+    if (status == 0) {
+        lua_pushinteger(other, arg);
+        status = lua_pcall(other, 1, 1, 0);
+    }
+    if (status != 0) {
+        lua_pushstring(L, lua_tostring(other, -1));
+        lua_close(other);
+        return lua_error(L);
+    }
+    lua_Integer result = lua_tointeger(other, -1);
+    lua_close(other);
+    lua_pushinteger(L, result);
+    return 1;
+}
+
+int luaopen_capi_test(lua_State *L) {
+    static const luaL_Reg funcs[] = {
+        {"version", l_version},
+        {"insert", l_insert},
+        {"remove", l_remove},
+        {"dense", l_dense},
+        {"data", l_data},
+        {"column", l_column},
+        {"registry", l_registry},
+        {"closed_state", l_closed_state},
+        {NULL, NULL}
+    };
+    lua_newtable(L);
+    luaL_setfuncs(L, funcs, 0);
+    return 1;
+}
@@ -0,0 +1,222 @@
+-- Portable tests: runs unchanged on Lua 5.1 to 5.4 and LuaJIT, so it avoids
+-- integer operators and string.pack (test/test.lua needs 5.3+). Covers the
+-- paths the compatibility layer replaces and, on LuaJIT, sparseset.ffi.
+package.cpath = package.cpath .. ";./build/?.so;../build/?.so"
+
+local sparse_set = require("sparseset")
+
+local function assert_eq(a, b, msg)
+    if a ~= b then
+        error(string.format("%s: expected %s, got %s", msg or "Assertion failed", tostring(b), tostring(a)))
+    end
+end
+
+local function assert_true(a, msg)
+    if not a then
+        error(string.format("%s: expected true, got %s", msg or "Assertion failed", tostring(a)))
+    end
+end
+
+local function assert_error(fn, msg)
+    local ok = pcall(fn)
+    if ok then
+        error(string.format("%s: expected error, got success", msg or "Assertion failed"))
+    end
+end
+
+local VERSION = 4294967296
+
+local function id_version(id)
+    return math.floor(id / VERSION)
+end
+
+local function test_registry()
+    print("Testing registry...")
+    local reg = sparse_set.new_registry()
+    local set = sparse_set.new_set()
+    reg:attach(set)
+
+    local e = reg:create()
+    set:insert(e, { name = "a" })
+    assert_eq(set:get(e).name, "a", "Lua value stored")
+    reg:destroy(e)
+    assert_eq(set:size(), 0, "Attached set cleaned up")
+
+    local again = reg:create()
+    assert_eq(again % VERSION, e % VERSION, "Index reused")
+    assert_eq(id_version(again), 1, "Version bumped")
+    assert_true(reg:valid(again), "New id valid")
+    assert_true(not reg:valid(e), "Old id stale")
+
+    local block = reg:create_many(2000)
+    assert_eq(#block, 2000 * 8, "create_many packs 8 bytes per id")
+    print("Registry tests passed.")
+end
+
+-- Without an integer subtype ids are doubles, so versions wrap at 2^21 to
+-- keep every id exact.
+local function test_version_bits()
+    print("Testing version bits...")
+    local reg = sparse_set.new_registry()
+    local e = reg:create()
+    local limit = math.type and VERSION or 2097152
+    local last = e
+    if not math.type then
+        for _ = 1, limit - 1 do
+            reg:destroy(last)
+            last = reg:create()
+        end
+        assert_eq(id_version(last), limit - 1, "Highest version")
+        assert_true(reg:valid(last), "Highest version valid")
+        reg:destroy(last)
+        last = reg:create()
+        assert_eq(last, e, "Version wraps to 0")
+    else
+        reg:destroy(e)
+        assert_eq(id_version(reg:create()), 1, "Full 32-bit versions")
+    end
+    print("Version bits tests passed.")
+end
+
+local function test_binary()
+    print("Testing binary sets...")
+    local set = sparse_set.new_set(8)
+    for i = 1, 2000 do
+        set:insert(i, string.rep("\0", 8))
+        set:set_field(i, 4, sparse_set.TYPE_INT, i * 3)
+    end
+    assert_eq(set:get_field(1500, 4, sparse_set.TYPE_INT), 4500, "Field round trip")
+
+    local ids = {}
+    for i = 1, 2000 do ids[i] = i end
+    assert_eq(#set:get_many(ids), 2000 * 8, "Large get_many")
+    local small = set:get_many({ 1, 2, 9999 })
+    assert_eq(#small, 24, "Small get_many")
+    assert_eq(small:sub(17), string.rep("\0", 8), "Missing id reads as zeros")
+
+    local get, put = set:accessor(4, sparse_set.TYPE_INT)
+    put(7, 70)
+    assert_eq(get(7), 70, "Accessor")
+    print("Binary sets tests passed.")
+end
+
+local function test_schema()
+    print("Testing schema sets...")
+    local set = sparse_set.new_schema_set({
+        { "x", sparse_set.TYPE_FLOAT },
+        { "hp", sparse_set.TYPE_INT },
+    })
+    assert_eq(set:field("hp"), 2, "Field handle by name")
+    assert_eq(set:field("missing"), nil, "Unknown field")
+    assert_error(function()
+        sparse_set.new_schema_set({ { "x", sparse_set.TYPE_INT }, { "x", sparse_set.TYPE_INT } })
+    end, "Duplicate field rejected")
+
+    for i = 1, 10 do
+        set:insert(i, string.rep("\0", 8))
+        set:set_field(i, "hp", i)
+    end
+    set:field_add("hp", 5)
+    assert_eq(set:get_field(3, "hp"), 8, "Bulk field add")
+    print("Schema sets tests passed.")
+end
+
+local function test_queries()
+    print("Testing queries...")
+    local a, b = sparse_set.new_set(), sparse_set.new_set()
+    for i = 1, 10 do a:insert(i, i) end
+    for i = 2, 10, 2 do b:insert(i, -i) end
+    local sum = 0
+    for id, va, vb in sparse_set.new_query({ a, b }):iter() do
+        assert_eq(va, -vb, "Joined values")
+        sum = sum + id
+    end
+    assert_eq(sum, 30, "Query visits the intersection")
+
+    a:sort(function(x, y) return x > y end)
+    assert_eq(a:at(1), 10, "Sorted by comparator")
+
+    local index = sparse_set.new_index()
+    local c, d = sparse_set.new_set(4), sparse_set.new_set(4)
+    index:attach(c, d)
+    c:insert(5, "abcd")
+    d:insert(5, "efgh")
+    assert_eq(index:count(5), 2, "Shared index sees both sets")
+    print("Queries tests passed.")
+end
+
+local function test_snapshot()
+    print("Testing snapshots...")
+    local set = sparse_set.new_set(4)
+    for i = 1, 100 do set:insert(i * 2, "abcd") end
+    local restored = sparse_set.new_set(4)
+    assert_true(restored:restore(set:snapshot()), "Restore from string")
+    assert_eq(restored:size(), 100, "Restored size")
+    local ok, err = restored:restore_file("/nonexistent/dir/snapshot.bin")
+    assert_eq(ok, nil, "Missing file fails")
+    assert_true(type(err) == "string", "Error message returned")
+    print("Snapshots tests passed.")
+end
+
+local function test_ffi()
+    if not sparse_set.ffi then
+        print("Skipping FFI tests (not LuaJIT).")
+        return
+    end
+    print("Testing FFI views...")
+    local ffi = require("ffi")
+    ffi.cdef("typedef struct { float x, y; } compat_pos_t;")
+    local api = sparse_set.ffi
+
+    local pos = sparse_set.new_set(8)
+    for i = 1, 100 do pos:insert(i * 10, string.rep("\0", 8)) end
+    local view = api.view(pos)
+    assert_eq(view.size, 100, "View size")
+    assert_eq(view.stride, 8, "View stride")
+
+    local dense, n = api.dense(pos)
+    assert_eq(n, 100, "Dense count")
+    assert_eq(tonumber(dense[41]), pos:at(42), "Dense ids match")
+
+    local p = api.data(pos, "compat_pos_t")
+    for i = 0, n - 1 do
+        p[i].x = i
+        p[i].y = p[i].x * 2
+    end
+    assert_eq(pos:get_field(420, 4, sparse_set.TYPE_FLOAT), 82, "FFI writes visible to the binding")
+    pos:set_field(420, 0, sparse_set.TYPE_FLOAT, 5)
+    assert_eq(p[41].x, 5, "Binding writes visible to FFI")
+    assert_error(function() api.data(pos, "int32_t") end, "Size mismatch rejected")
+    assert_error(function() api.view({}) end, "Non-set rejected")
+
+    local movement = sparse_set.new_schema_set({ { "x", sparse_set.TYPE_FLOAT }, { "hp", sparse_set.TYPE_INT } })
+    for i = 1, 10 do movement:insert(i, string.rep("\0", 8)) end
+    local hp, count = api.column(movement, "hp")
+    for i = 0, count - 1 do hp[i] = i + 100 end
+    assert_eq(movement:get_field(4, "hp"), 103, "Column written through FFI")
+    assert_eq(api.column(movement, 1)[0], 0, "Column by handle")
+    assert_error(function() api.column(movement, "missing") end, "Unknown column rejected")
+    print("FFI views tests passed.")
+end
+
+local function run_tests()
+    print(_VERSION .. (jit and (" (" .. jit.version .. ")") or ""))
+    print("--------------------------------")
+    test_registry()
+    print("--------------------------------")
+    test_version_bits()
+    print("--------------------------------")
+    test_binary()
+    print("--------------------------------")
+    test_schema()
+    print("--------------------------------")
+    test_queries()
+    print("--------------------------------")
+    test_snapshot()
+    print("--------------------------------")
+    test_ffi()
+    print("--------------------------------")
+    print("ALL COMPAT TESTS PASSED")
+end
+
+run_tests()
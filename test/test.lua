@@ -139,10 +139,24 @@ local function test_lua_set()
     assert_true(set:contains(id2), "Should still contain id2")
     assert_eq(set:get(id1), nil, "Get removed ID should return nil")
 
-    local invalid_id = 0x100000
-    local inserted, err = set:insert(invalid_id, "bad")
-    assert_eq(inserted, nil, "Insert failure should return nil")
-    assert_eq(err, "oom", "Insert failure reason should be oom")
+    -- Indices beyond the flat sparse directory use the tiered one
+    local far_ids = {0x100000, 0x7FFFFFFF, 0xFFFFFFF0}
+    for i, far_id in ipairs(far_ids) do
+        assert_true(set:insert(far_id, "far" .. i), "High index insert should succeed")
+    end
+    for i, far_id in ipairs(far_ids) do
+        assert_true(set:contains(far_id), "Should contain high index")
+        assert_eq(set:get(far_id), "far" .. i, "High index value incorrect")
+    end
+    assert_false(set:contains(0xFFFFFFF1), "Neighbour of high index should be absent")
+    assert_eq(set:size(), 4, "Size after high index inserts incorrect")
+    assert_true(set:remove(0x7FFFFFFF), "High index remove should succeed")
+    assert_false(set:contains(0x7FFFFFFF), "Removed high index still present")
+    assert_true(set:contains(0xFFFFFFF0), "Swapped high index lost")
+    assert_eq(set:get(0xFFFFFFF0), "far3", "Swapped high index value incorrect")
+    set:remove(0x100000)
+    set:remove(0xFFFFFFF0)
+    assert_eq(set:size(), 1, "Size after high index removes incorrect")
     
     print("Lua Set tests passed.")
 end
@@ -253,13 +267,1547 @@ local function test_c_set()
     print("C Set tests passed.")
 end
 
+local function test_query()
+    print("Testing Query...")
+    local reg = sparse_set.new_registry()
+    local pos_set = sparse_set.new_set(8)
+    local vel_set = sparse_set.new_set()
+    local dead_set = sparse_set.new_set()
+
+    local ids = {}
+    for i = 1, 10 do
+        ids[i] = reg:create()
+        pos_set:insert(ids[i], string.pack("ii", i, i * 10))
+        if i % 2 == 0 then
+            vel_set:insert(ids[i], { v = i })
+        end
+    end
+    dead_set:insert(ids[4], true)
+
+    local q = sparse_set.new_query({ pos_set, vel_set })
+    assert_eq(q:count(), 5, "Query should match even ids")
+
+    local seen = 0
+    for id, pos, vel in q:iter() do
+        seen = seen + 1
+        local x = string.unpack("ii", pos)
+        assert_eq(vel.v, x, "Query values should belong to the same id")
+        assert_eq(pos_set:get(id), pos, "Query binary value mismatch")
+    end
+    assert_eq(seen, 5, "Query iter count incorrect")
+
+    local q_ex = sparse_set.new_query({ pos_set, vel_set }, { dead_set })
+    assert_eq(q_ex:count(), 4, "Excluded set should filter ids")
+    for id in q_ex:iter() do
+        assert_true(id ~= ids[4], "Excluded id should not be returned")
+    end
+
+    local empty = sparse_set.new_set()
+    assert_eq(sparse_set.new_query({ pos_set, empty }):count(), 0, "Query with empty set should match nothing")
+
+    assert_error(function() sparse_set.new_query({}) end, "Query requires an included set")
+    assert_error(function() sparse_set.new_query({ pos_set, {} }) end, "Query should reject non-set entries")
+
+    print("Query tests passed.")
+end
+
+local function test_batch()
+    print("Testing Batch APIs...")
+    local reg = sparse_set.new_registry()
+    local set = sparse_set.new_set()
+
+    local ids = {}
+    local values = {}
+    for i = 1, 100 do
+        ids[i] = reg:create()
+        values[i] = "v" .. i
+    end
+
+    assert_eq(set:insert_many(ids, values), 100, "insert_many should add all ids")
+    assert_eq(set:size(), 100, "Size after insert_many incorrect")
+    assert_eq(set:get(ids[42]), "v42", "insert_many value mismatch")
+    assert_eq(set:insert_many({ ids[1] }, { "again" }), 0, "insert_many on existing id should update only")
+    assert_eq(set:get(ids[1]), "again", "insert_many should update existing value")
+
+    local missing = reg:create()
+    local found = set:contains_many({ ids[1], missing, ids[100] })
+    assert_true(found[1], "contains_many first")
+    assert_false(found[2], "contains_many missing")
+    assert_true(found[3], "contains_many last")
+
+    local got, absent = set:get_many({ ids[2], missing, ids[3] })
+    assert_eq(absent, 1, "get_many missing count")
+    assert_eq(got[1], "v2", "get_many first")
+    assert_eq(got[2], nil, "get_many missing")
+    assert_eq(got[3], "v3", "get_many third")
+
+    local evens = {}
+    for i = 2, 100, 2 do
+        evens[#evens + 1] = ids[i]
+    end
+    assert_eq(set:remove_many(evens), 50, "remove_many count")
+    assert_eq(set:size(), 50, "Size after remove_many incorrect")
+    for i = 1, 100 do
+        if i % 2 == 0 then
+            assert_false(set:contains(ids[i]), "remove_many should remove even ids")
+        else
+            assert_eq(set:get(ids[i]), i == 1 and "again" or "v" .. i, "remove_many should keep values in sync")
+        end
+    end
+
+    -- Packed ids and packed stride records
+    local bin = sparse_set.new_set(8)
+    local packed_ids = string.pack("jjj", ids[1], ids[2], ids[3])
+    local blob = string.pack("iiiiii", 1, 2, 3, 4, 5, 6)
+    assert_eq(bin:insert_many(packed_ids, blob), 3, "insert_many packed")
+    assert_eq(bin:get_field(ids[2], 4, sparse_set.TYPE_INT), 4, "insert_many packed data")
+    local out, absent_bin = bin:get_many(string.pack("jj", ids[3], missing))
+    assert_eq(absent_bin, 1, "get_many packed missing count")
+    assert_eq(select(2, bin:get_many(packed_ids)), 0, "get_many nothing missing")
+    local a, b, c, d = string.unpack("iiii", out)
+    assert_eq(a, 5, "get_many packed first field")
+    assert_eq(b, 6, "get_many packed second field")
+    assert_eq(c, 0, "get_many packed missing should be zeroed")
+    assert_eq(d, 0, "get_many packed missing should be zeroed")
+    assert_eq(bin:remove_many(packed_ids), 3, "remove_many packed")
+    assert_eq(bin:size(), 0, "Size after packed remove_many")
+
+    assert_error(function() bin:insert_many(packed_ids, "short") end, "insert_many should reject bad blob size")
+    assert_error(function() bin:insert_many("1234567") end, "insert_many should reject bad id buffer")
+
+    print("Batch tests passed.")
+end
+
+local function test_schema_set()
+    print("Testing Schema Set (SoA)...")
+    local reg = sparse_set.new_registry()
+    local TYPE_FLOAT = sparse_set.TYPE_FLOAT
+    local TYPE_INT = sparse_set.TYPE_INT
+    local TYPE_BOOL = sparse_set.TYPE_BOOL
+    local set = sparse_set.new_schema_set({
+        { "x", TYPE_FLOAT },
+        { "y", TYPE_FLOAT },
+        { "hp", TYPE_INT },
+        { "alive", TYPE_BOOL },
+    })
+
+    local x = set:field("x")
+    local hp = set:field("hp")
+    assert_eq(x, 1, "First field handle")
+    assert_eq(hp, 3, "Third field handle")
+    assert_eq(set:field("missing"), nil, "Unknown field handle should be nil")
+
+    local ids = {}
+    for i = 1, 5 do
+        ids[i] = reg:create()
+        set:insert(ids[i], string.pack("ffiB", i, i * 2, i * 100, 1))
+    end
+
+    assert_eq(set:get_field(ids[3], "x"), 3.0, "get_field by name")
+    assert_eq(set:get_field(ids[3], hp), 300, "get_field by handle")
+    assert_true(set:get_field(ids[3], "alive"), "get_field bool column")
+    assert_true(set:set_field(ids[3], "y", 7.5), "set_field by name")
+    assert_eq(set:get_field(ids[3], "y"), 7.5, "set_field by name readback")
+
+    local raw = set:get(ids[3])
+    assert_eq(#raw, 13, "Schema row size")
+    local rx, ry, rhp = string.unpack("ffi", raw)
+    assert_eq(rx, 3.0, "Row gather x")
+    assert_eq(ry, 7.5, "Row gather y")
+    assert_eq(rhp, 300, "Row gather hp")
+
+    -- Swap-with-last on remove must move every column together
+    set:remove(ids[1])
+    assert_eq(set:get_field(ids[5], "x"), 5.0, "Column x after remove")
+    assert_eq(set:get_field(ids[5], "hp"), 500, "Column hp after remove")
+    set:swap(set:index_of(ids[2]), set:index_of(ids[5]))
+    assert_eq(set:get_field(ids[2], "y"), 4.0, "Column y after swap")
+    assert_eq(set:get_field(ids[5], "hp"), 500, "Column hp after swap")
+
+    local missing = reg:create()
+    assert_eq(set:get_field(missing, "x"), nil, "Schema get_field missing id")
+    assert_false(set:set_field(missing, "x", 1), "Schema set_field missing id")
+    assert_error(function() set:get_field(ids[2], "nope") end, "Unknown field name should error")
+    assert_error(function() set:get_field(ids[2], 9) end, "Unknown field handle should error")
+    assert_error(function() sparse_set.new_schema_set({}) end, "Empty schema should error")
+    assert_error(function() sparse_set.new_schema_set({ { "a", TYPE_INT }, { "a", TYPE_INT } }) end, "Duplicate field should error")
+
+    print("Schema Set tests passed.")
+end
+
+local function test_field_kernels()
+    print("Testing Field Kernels...")
+    local reg = sparse_set.new_registry()
+    local TYPE_INT = sparse_set.TYPE_INT
+    local TYPE_FLOAT = sparse_set.TYPE_FLOAT
+    local TYPE_DOUBLE = sparse_set.TYPE_DOUBLE
+    local TYPE_BYTE = sparse_set.TYPE_BYTE
+
+    -- Stride records: int at 0, float at 4, double at 8, byte at 16
+    local set = sparse_set.new_set(17)
+    local motion = sparse_set.new_schema_set({
+        { "x", TYPE_FLOAT },
+        { "vx", TYPE_FLOAT },
+        { "t", TYPE_DOUBLE },
+    })
+    local ids = {}
+    for i = 1, 37 do
+        ids[i] = reg:create()
+        set:insert(ids[i], string.pack("ifdB", i, i, i, i))
+        motion:insert(ids[i], string.pack("ffd", i, 2, i))
+    end
+
+    assert_eq(set:field_add(0, TYPE_INT, 5), 37, "field_add count")
+    assert_eq(set:get_field(ids[3], 0, TYPE_INT), 8, "field_add int")
+    set:field_mul(4, TYPE_FLOAT, 2)
+    assert_eq(set:get_field(ids[3], 4, TYPE_FLOAT), 6.0, "field_mul strided float")
+    set:field_fma(8, TYPE_DOUBLE, 2, 1)
+    assert_eq(set:get_field(ids[3], 8, TYPE_DOUBLE), 7.0, "field_fma strided double")
+    set:field_add(16, TYPE_BYTE, 250)
+    assert_eq(set:get_field(ids[3], 16, TYPE_BYTE), 253, "field_add byte")
+    assert_eq(set:get_field(ids[10], 16, TYPE_BYTE), 255, "field_add byte saturates")
+    set:field_clamp(0, TYPE_INT, 10, 20)
+    assert_eq(set:get_field(ids[1], 0, TYPE_INT), 10, "field_clamp low")
+    assert_eq(set:get_field(ids[30], 0, TYPE_INT), 20, "field_clamp high")
+    set:field_min(4, TYPE_FLOAT, 10)
+    assert_eq(set:get_field(ids[30], 4, TYPE_FLOAT), 10.0, "field_min")
+    set:field_max(4, TYPE_FLOAT, 4)
+    assert_eq(set:get_field(ids[1], 4, TYPE_FLOAT), 4.0, "field_max")
+
+    -- Contiguous columns take the vector path; 37 elements leaves a scalar tail
+    motion:field_axpy("x", motion, "vx", 0.5)
+    for i = 1, 37 do
+        assert_eq(motion:get_field(ids[i], "x"), i + 1.0, "field_axpy same set")
+    end
+    motion:field_fma("t", 3, -1)
+    assert_eq(motion:get_field(ids[37], "t"), 110.0, "field_fma column double")
+
+    -- Across sets, joined by id
+    local extra = sparse_set.new_set(4)
+    extra:insert(ids[5], string.pack("f", 100))
+    extra:insert(ids[6], string.pack("f", 200))
+    assert_eq(motion:field_axpy("x", extra, 0, TYPE_FLOAT, 1), 2, "field_axpy join count")
+    assert_eq(motion:get_field(ids[5], "x"), 106.0, "field_axpy joined value")
+    assert_eq(motion:get_field(ids[7], "x"), 8.0, "field_axpy leaves unmatched ids")
+    assert_eq(extra:field_copy(0, TYPE_FLOAT, motion, "vx"), 2, "field_copy join count")
+    assert_eq(extra:get_field(ids[6], 0, TYPE_FLOAT), 2.0, "field_copy joined value")
+    set:field_copy(0, TYPE_INT, set, 4, TYPE_FLOAT)
+    assert_eq(set:get_field(ids[3], 0, TYPE_INT), 6, "field_copy converts types")
+
+    local flags = sparse_set.new_set(1)
+    assert_error(function() flags:field_add(0, sparse_set.TYPE_BOOL, 1) end, "Kernels should reject bool fields")
+    assert_error(function() sparse_set.new_set():field_add(0, TYPE_INT, 1) end, "Kernels require stride")
+
+    print("Field Kernel tests passed.")
+end
+
+local function test_capi()
+    print("Testing C API...")
+    local capi = debug.getregistry()["sparseset.capi"]
+    assert_eq(type(capi), "userdata", "C API table should be published in the registry")
+
+    -- Built by `make test`; calls the core only through the function table
+    local native = require("capi_test")
+    local version, newer_refused = native.version()
+    assert_eq(version, 1, "C API version")
+    assert_true(newer_refused, "getcapi should refuse a newer min_version")
+
+    local values = sparse_set.new_set()
+    values:insert(1, "a")
+    assert_eq(native.insert(values, 2), nil, "Lua value sets refuse C inserts")
+    assert_false(native.remove(values, 1), "Lua value sets refuse C removes")
+    assert_eq(values:size(), 1, "Lua value set untouched")
+    assert_eq(native.dense(values)[1], 1, "Dense span of a Lua value set")
+    assert_eq(native.data(values), nil, "Lua value sets have no data span")
+
+    local set = sparse_set.new_set(8)
+    for i = 1, 5 do set:insert(i * 10, string.pack("ii", i, -i)) end
+    assert_eq(native.insert(set, 30), 3, "Existing id keeps its position")
+    assert_eq(native.insert(set, 60), 6, "C insert appends")
+    assert_true(set:contains(60), "C insert visible to Lua")
+    assert_eq(set:get(60), string.pack("ii", 0, 0), "C insert zeroes the row")
+    assert_true(native.remove(set, 10), "C remove")
+    assert_false(native.remove(set, 10), "C remove of a missing id")
+    assert_false(set:contains(10), "C remove visible to Lua")
+    local dense = native.dense(set)
+    assert_eq(#dense, set:size(), "Dense span length")
+    local records = native.data(set)
+    assert_eq(#records, set:size() * 8, "Data span length")
+    for i, id in ipairs(dense) do
+        assert_eq(set:at(i), id, "Dense span order")
+        assert_eq(records:sub(i * 8 - 7, i * 8), set:get(id), "Data span record")
+    end
+
+    local schema = sparse_set.new_schema_set({ { "x", sparse_set.TYPE_FLOAT }, { "hp", sparse_set.TYPE_INT } })
+    for i = 1, 3 do schema:insert(i, string.pack("fi", i, i * 100)) end
+    assert_eq(native.column(schema, 1), string.pack("iii", 100, 200, 300), "Column span")
+    assert_eq(native.column(schema, 2), nil, "Column out of range")
+
+    local reg = sparse_set.new_registry()
+    local id, cycled = native.registry(reg)
+    assert_eq(id, 0, "C registry create")
+    assert_true(cycled, "C registry valid/recycle")
+    assert_eq(reg:create(), 1 << 32, "C recycle visible to Lua")
+    print("C API tests passed.")
+end
+
+local function test_shrink()
+    print("Testing Shrink / Page Reclamation...")
+
+    -- Manual shrink_to_fit
+    local set = sparse_set.new_set(8)
+    local ids = {}
+    for i = 1, 10000 do ids[i] = i * 7 end
+    local row = string.rep("\0", 8)
+    set:insert_many(ids, row:rep(#ids))
+    local cap, pages = set:capacity()
+    assert_true(cap >= 10000, "Capacity should cover inserted ids")
+    assert_eq(pages, 18, "Page count after inserts incorrect")
+
+    local keep = 0
+    for i = 1, 10000 do
+        if i > 100 then set:remove(ids[i]) else keep = keep + 1 end
+    end
+    assert_eq(set:size(), keep, "Size after bulk remove incorrect")
+    local cap_before = set:capacity()
+    assert_eq(cap_before, cap, "Capacity should not shrink without auto_shrink")
+
+    set:shrink_to_fit()
+    cap, pages = set:capacity()
+    assert_eq(cap, 100, "Capacity after shrink_to_fit incorrect")
+    assert_eq(pages, 1, "Empty pages should be released")
+    for i = 1, 100 do
+        assert_true(set:contains(ids[i]), "Kept id lost after shrink")
+    end
+    assert_true(set:insert(ids[5000], row), "Insert after shrink should succeed")
+    assert_eq(select(2, set:capacity()), 2, "Page should be reallocated on demand")
+
+    -- Far pages in the tiered directory are released too
+    set:insert(0xF0000000, row)
+    assert_eq(select(2, set:capacity()), 3, "Far page not counted")
+    set:remove(0xF0000000)
+    set:shrink_to_fit()
+    assert_eq(select(2, set:capacity()), 2, "Far page not released")
+    assert_false(set:contains(0xF0000000), "Far id should be gone")
+
+    -- Automatic shrinking
+    local auto = sparse_set.new_set()
+    auto:auto_shrink(true)
+    for i = 1, 4096 do auto:insert(i, i) end
+    local peak = auto:capacity()
+    for i = 1, 4096 do auto:remove(i) end
+    cap, pages = auto:capacity()
+    assert_true(cap < peak, "Auto shrink should reduce capacity")
+    assert_eq(cap, 64, "Auto shrink should settle at default capacity")
+    assert_eq(pages, 0, "Auto shrink should release empty pages")
+    assert_true(auto:insert(5, "again"), "Insert after auto shrink should succeed")
+    assert_eq(auto:get(5), "again", "Value after auto shrink incorrect")
+
+    -- Registry recycle list
+    local reg = sparse_set.new_registry()
+    local rids = {}
+    for i = 1, 1000 do rids[i] = reg:create() end
+    for i = 1, 1000 do reg:destroy(rids[i]) end
+    reg:auto_shrink(true)
+    for i = 1, 1000 do
+        local id = reg:create()
+        assert_true(reg:valid(id), "Recycled id should be valid")
+    end
+    reg:shrink_to_fit()
+    assert_false(reg:valid(rids[1]), "Old id must stay invalid after shrink")
+
+    print("Shrink tests passed.")
+end
+
+local function test_group()
+    print("Testing Owning Groups...")
+    local TYPE_INT = sparse_set.TYPE_INT
+    local pos = sparse_set.new_set(4)
+    local vel = sparse_set.new_set(4)
+    local tag = sparse_set.new_schema_set({ { "v", TYPE_INT } })
+
+    local function check_aligned(group, sets)
+        for i, id in group:iter() do
+            for _, s in ipairs(sets) do
+                assert_eq(s:index_of(id), i, "Grouped id misaligned")
+            end
+        end
+    end
+
+    -- Pre-existing members are pulled to the front on creation
+    for i = 1, 20 do pos:insert(i, string.pack("i", i)) end
+    for i = 10, 30, 2 do vel:insert(i, string.pack("i", i * 10)) end
+    local group = sparse_set.new_group({ pos, vel })
+    assert_eq(group:size(), 6, "Initial group size incorrect")
+    check_aligned(group, { pos, vel })
+    assert_true(group:contains(12), "Group should contain 12")
+    assert_false(group:contains(11), "Group should not contain 11")
+    assert_eq(pos:get_field(12, 0, TYPE_INT), 12, "Row moved without data")
+    assert_eq(vel:get_field(12, 0, TYPE_INT), 120, "Row moved without data")
+
+    -- Insert/remove keep the invariant
+    vel:insert(11, string.pack("i", 110))
+    assert_eq(group:size(), 7, "Insert completing a member should grow group")
+    assert_eq(vel:get_field(11, 0, TYPE_INT), 110, "Inserted row written at wrong position")
+    pos:remove(14)
+    assert_eq(group:size(), 6, "Remove should shrink group")
+    assert_false(group:contains(14), "Removed id still grouped")
+    vel:insert_many({ 1, 2, 3, 99 }, string.pack("iiii", 1, 2, 3, 99))
+    assert_eq(group:size(), 9, "insert_many should enter group")
+    assert_eq(vel:get_field(2, 0, TYPE_INT), 2, "insert_many row misplaced")
+    assert_eq(vel:get_field(99, 0, TYPE_INT), 99, "insert_many row misplaced")
+    check_aligned(group, { pos, vel })
+
+    -- New version of a grouped id leaves the group
+    vel:insert((1 << 32) | 12, string.pack("i", 7))
+    assert_false(group:contains(12), "Stale version should leave group")
+    assert_eq(group:size(), 8, "Version change should shrink group")
+    check_aligned(group, { pos, vel })
+    vel:insert_many({ (1 << 32) | 2 }, string.pack("i", 7))
+    assert_false(group:contains(2), "Stale version should leave group in insert_many")
+    assert_eq(group:size(), 7, "insert_many version change should shrink group")
+    assert_eq(vel:get_field((1 << 32) | 2, 0, TYPE_INT), 7, "insert_many new version row")
+    check_aligned(group, { pos, vel })
+    vel:insert_many({ 2 }, string.pack("i", 2))
+    assert_eq(group:size(), 8, "Old version back in both sets rejoins group")
+    check_aligned(group, { pos, vel })
+
+    -- Grouped positions cannot be swapped by hand
+    assert_error(function() pos:swap(1, pos:size()) end, "Swap into group should fail")
+    pos:swap(pos:size() - 1, pos:size())
+
+    -- Kernels across grouped sets walk the prefix positionally
+    assert_eq(pos:field_axpy(0, TYPE_INT, vel, 0, TYPE_INT, 1), 8, "Group axpy count")
+    assert_eq(pos:get_field(11, 0, TYPE_INT), 121, "Group axpy value")
+    assert_eq(pos:get_field(19, 0, TYPE_INT), 19, "Ungrouped row touched by axpy")
+
+    -- With three owned sets the prefix is narrower than a pairwise join
+    local x, y, z = sparse_set.new_set(4), sparse_set.new_set(4), sparse_set.new_set(4)
+    local triple = sparse_set.new_group({ x, y, z })
+    for i = 1, 4 do
+        x:insert(i, string.pack("i", i))
+        y:insert(i, string.pack("i", 10))
+    end
+    z:insert(1, string.pack("i", 0))
+    assert_eq(triple:size(), 1, "Three-set group prefix")
+    assert_eq(x:field_axpy(0, TYPE_INT, y, 0, TYPE_INT, 1), 4, "Three-set group axpy joins by id")
+    for i = 1, 4 do
+        assert_eq(x:get_field(i, 0, TYPE_INT), i + 10, "Three-set group axpy value")
+    end
+
+    -- Errors
+    assert_error(function() sparse_set.new_group({ pos }) end, "Group needs two sets")
+    assert_error(function() sparse_set.new_group({ pos, tag }) end, "Set already grouped")
+    assert_error(function() sparse_set.new_group({ tag, sparse_set.new_set() }) end, "Lua value sets cannot be grouped")
+
+    -- Schema sets group too
+    local other = sparse_set.new_set(4)
+    for i = 1, 5 do
+        tag:insert(i, string.pack("i", i))
+        other:insert(6 - i, string.pack("i", i))
+    end
+    local g2 = sparse_set.new_group({ tag, other })
+    assert_eq(g2:size(), 5, "Schema group size incorrect")
+    check_aligned(g2, { tag, other })
+    other:remove_many({ 1, 2, 3, 4, 5 })
+    assert_eq(g2:size(), 0, "Removing all should empty group")
+    assert_eq(tag:size(), 5, "Other owned set should keep its ids")
+
+    print("Group tests passed.")
+end
+
+local function test_sort()
+    print("Testing Sorting...")
+    local TYPE_INT = sparse_set.TYPE_INT
+    local TYPE_FLOAT = sparse_set.TYPE_FLOAT
+
+    local function check_consistent(set)
+        for i, id in set:iter() do
+            assert_eq(set:index_of(id), i, "Sparse index out of sync after sort")
+        end
+    end
+
+    -- Lua value set by id, values follow their ids
+    local set = sparse_set.new_set()
+    local order = { 42, 7, 1000, 3, 99, 5000000, 8 }
+    for _, id in ipairs(order) do set:insert(id, "v" .. id) end
+    assert_true(set:sort(), "sort should succeed")
+    local prev = -1
+    for i, id, value in set:iter() do
+        assert_true(id > prev, "Ids not ascending after sort")
+        assert_eq(value, "v" .. id, "Value not moved with id")
+        prev = id
+    end
+    check_consistent(set)
+
+    -- Lua comparator on values
+    set:sort(function(a, b, va, vb) return #va > #vb or (#va == #vb and a < b) end)
+    local _, first = set:at(1)
+    assert_eq(first, "v5000000", "Comparator sort order incorrect")
+    check_consistent(set)
+
+    -- A failing comparator leaves the set untouched
+    local before = {}
+    for i, id in set:iter() do before[i] = id end
+    assert_error(function() set:sort(function() error("boom") end) end, "Comparator error should propagate")
+    for i, id, value in set:iter() do
+        assert_eq(id, before[i], "Set modified by failed sort")
+        assert_eq(value, "v" .. id, "Values modified by failed sort")
+    end
+
+    -- Radix sort on typed fields: int at 0, float at 4
+    local rec = sparse_set.new_set(8)
+    local ints = { 5, -3, 100, -100000, 0, 5, -3, 7 }
+    local floats = { 1.5, -2.25, 0.0, -1e10, 3.0, -0.5, 1e-3, 2.0 }
+    for i = 1, #ints do rec:insert(i, string.pack("if", ints[i], floats[i])) end
+    assert_true(rec:sort_by_field(0, TYPE_INT), "sort_by_field should succeed")
+    prev = -math.huge
+    local prev_id = 0
+    for _, id in rec:iter() do
+        local v = rec:get_field(id, 0, TYPE_INT)
+        assert_true(v >= prev, "Int field not ascending")
+        if v == prev then assert_true(id > prev_id, "Int sort not stable") end
+        prev, prev_id = v, id
+    end
+    rec:sort_by_field(4, TYPE_FLOAT, true)
+    prev = math.huge
+    for _, id in rec:iter() do
+        local v = rec:get_field(id, 4, TYPE_FLOAT)
+        assert_true(v <= prev, "Float field not descending")
+        prev = v
+    end
+    check_consistent(rec)
+
+    -- Schema set by field name, then another set follows its order
+    local schema = sparse_set.new_schema_set({ { "hp", TYPE_INT } })
+    for i = 1, 8 do schema:insert(i, string.pack("i", (i * 37) % 11)) end
+    schema:sort_by_field("hp")
+    rec:insert(50, string.pack("if", 0, 0))
+    assert_true(rec:sort_like(schema), "sort_like should succeed")
+    for i = 1, 8 do
+        assert_eq(rec:index_of(schema:at(i)), i, "sort_like order incorrect")
+    end
+    assert_eq(rec:index_of(50), 9, "Ids missing from other should go last")
+    check_consistent(rec)
+
+    -- Grouped sets stay aligned
+    local a = sparse_set.new_set(4)
+    local b = sparse_set.new_set(4)
+    for i = 1, 10 do a:insert(i, string.pack("i", 10 - i)) end
+    for i = 2, 10, 2 do b:insert(i, string.pack("i", i)) end
+    local group = sparse_set.new_group({ a, b })
+    a:sort_by_field(0, TYPE_INT)
+    for i, id in group:iter() do
+        assert_eq(a:index_of(id), i, "Group misaligned in sorted set")
+        assert_eq(b:index_of(id), i, "Group misaligned in other owned set")
+        assert_eq(b:get_field(id, 0, TYPE_INT), id, "Owned set data not moved")
+    end
+    local grouped_prev = -math.huge
+    for i = 1, group:size() do
+        local v = a:get_field(a:at(i), 0, TYPE_INT)
+        assert_true(v >= grouped_prev, "Group prefix not sorted")
+        grouped_prev = v
+    end
+    check_consistent(a)
+    check_consistent(b)
+
+    -- A comparator that changes the set (or its group) is stopped
+    local big = sparse_set.new_set()
+    for i = 1, 2000 do big:insert(i, i) end
+    big:auto_shrink(true)
+    local removed = false
+    local ok, err = pcall(big.sort, big, function(x, y)
+        if not removed then
+            removed = true
+            for i = 1, 1900 do big:remove(i) end
+            big:shrink_to_fit()
+        end
+        return x > y
+    end)
+    assert_false(ok, "Shrinking comparator should fail")
+    assert_true(err:find("modified during sort") ~= nil, "Modification error message")
+    assert_eq(big:size(), 100, "Removals by the comparator stay")
+    check_consistent(big)
+    assert_error(function()
+        big:sort(function(x, y) big:insert(big:size() + 5000, 0) return x < y end)
+    end, "Growing comparator should fail")
+    check_consistent(big)
+    assert_error(function()
+        a:sort(function(x, y) b:remove(b:at(1)) return x < y end)
+    end, "Comparator shrinking the group should fail")
+    check_consistent(a)
+    check_consistent(b)
+    for i, id in group:iter() do
+        assert_eq(b:index_of(id), i, "Group misaligned after failed sort")
+    end
+
+    print("Sort tests passed.")
+end
+
+local function test_snapshot()
+    print("Testing Snapshot / Restore...")
+    local TYPE_INT = sparse_set.TYPE_INT
+    local TYPE_DOUBLE = sparse_set.TYPE_DOUBLE
+
+    local reg = sparse_set.new_registry()
+    local set = sparse_set.new_set(12)
+    local schema = sparse_set.new_schema_set({ { "hp", TYPE_INT }, { "x", TYPE_DOUBLE } })
+    local ids = {}
+    for i = 1, 5000 do
+        ids[i] = reg:create()
+        set:insert(ids[i], string.pack("id", i, i * 0.5))
+        if i % 3 == 0 then schema:insert(ids[i], string.pack("id", -i, i * 2.0)) end
+    end
+    for i = 1, 5000, 7 do reg:destroy(ids[i]) end
+    set:insert(0xF0000001, string.pack("id", 1, 1))
+
+    -- Registry round trip keeps versions, free list and next index
+    local reg_data = reg:snapshot()
+    assert_eq(type(reg_data), "string", "Registry snapshot should be a string")
+    local reg2 = sparse_set.new_registry()
+    assert_true(reg2:restore(reg_data), "Registry restore should succeed")
+    for i = 1, 5000 do
+        assert_eq(reg2:valid(ids[i]), reg:valid(ids[i]), "Restored validity mismatch")
+    end
+    assert_eq(reg2:create(), reg:create(), "Restored registry should recycle identically")
+
+    -- Set round trip through a string
+    local set2 = sparse_set.new_set(12)
+    set2:insert(12345, string.pack("id", 0, 0))
+    assert_true(set2:restore(set:snapshot()), "Set restore should succeed")
+    assert_eq(set2:size(), set:size(), "Restored size mismatch")
+    assert_false(set2:contains(12345), "Restore should replace old contents")
+    for i, id, rec in set:iter() do
+        assert_eq(set2:index_of(id), i, "Restored order mismatch")
+        assert_eq(set2:get(id), rec, "Restored record mismatch")
+    end
+
+    -- Schema set round trip through a file
+    local path = os.tmpname()
+    assert_true(schema:snapshot(path), "Snapshot to file should succeed")
+    local schema2 = sparse_set.new_schema_set({ { "hp", TYPE_INT }, { "x", TYPE_DOUBLE } })
+    assert_true(schema2:restore_file(path), "Restore from file should succeed")
+    assert_eq(schema2:size(), schema:size(), "File restore size mismatch")
+    assert_eq(schema2:get_field(ids[9], "hp"), -9, "File restore column mismatch")
+    assert_eq(schema2:get_field(ids[9], "x"), 18.0, "File restore column mismatch")
+    assert_true(reg:snapshot(path), "Registry snapshot to file should succeed")
+    local reg3 = sparse_set.new_registry()
+    assert_true(reg3:restore_file(path), "Registry restore from file should succeed")
+    assert_true(reg3:valid(ids[2]), "File restored registry lost ids")
+    os.remove(path)
+
+    -- Layout and format checks
+    local ok, err = sparse_set.new_set(8):restore(set:snapshot())
+    assert_eq(ok, nil, "Stride mismatch should fail")
+    assert_eq(err, "invalid snapshot", "Stride mismatch error")
+    assert_eq(set2:restore(set:snapshot():sub(1, -2)), nil, "Truncated snapshot should fail")
+    assert_eq(set2:size(), set:size(), "Failed validation should keep contents")
+    local pair = sparse_set.new_set(4)
+    pair:insert(1, "aaaa")
+    pair:insert(2, "bbbb")
+    local pair_data = pair:snapshot()
+    local dup = pair_data:sub(1, 32) .. string.pack("=j", (1 << 32) | 1) .. pair_data:sub(41)
+    local single = sparse_set.new_set(4)
+    single:insert(9, "zzzz")
+    assert_eq(single:restore(dup), nil, "Repeated entity index should fail")
+    assert_eq(single:size(), 1, "Rejected snapshot should keep contents")
+    assert_eq(single:get(9), "zzzz", "Rejected snapshot should keep records")
+    assert_true(single:restore(pair_data), "Valid snapshot still restores")
+    assert_eq(reg2:restore(set:snapshot()), nil, "Set snapshot is not a registry snapshot")
+
+    -- A free list naming one index twice would hand out the same id twice
+    local small = sparse_set.new_registry()
+    small:destroy(small:create())
+    small:create()
+    small:destroy(small:create())
+    local good = small:snapshot()
+    assert_eq(#good, 32, "Registry snapshot layout")
+    assert_eq(string.unpack("=I4", good, 29), 1, "Free list entry")
+    local forged = good:sub(1, 16) .. string.pack("=I4", 2) .. good:sub(21) .. string.pack("=I4", 1)
+    assert_eq(reg2:restore(forged), nil, "Duplicate free index should fail")
+    assert_true(reg2:valid(ids[2]), "Failed registry restore should keep contents")
+    forged = good:sub(1, 28) .. string.pack("=I4", 2)
+    assert_eq(reg2:restore(forged), nil, "Out of range free index should fail")
+    assert_eq(select(1, set2:restore_file(path)), nil, "Missing file should fail")
+    assert_eq(select(1, set2:restore_file("/")), nil, "Directory should fail")
+    assert_error(function() sparse_set.new_set():snapshot() end, "Lua value sets cannot snapshot")
+
+    print("Snapshot tests passed.")
+end
+
+local function test_mapped()
+    print("Testing File-backed Sets...")
+    local TYPE_INT = sparse_set.TYPE_INT
+    local path = os.tmpname()
+    os.remove(path)
+
+    local set = sparse_set.new_set(8, { file = path })
+    for i = 1, 3000 do
+        assert_true(set:insert(i * 3, string.pack("ii", i, -i)), "Mapped insert failed")
+    end
+    assert_true(set:capacity() >= 3000, "Mapped set should grow")
+    for i = 1, 3000, 2 do set:remove(i * 3) end
+    set:set_field(6, 4, TYPE_INT, 77)
+    assert_true(set:sync(), "sync should succeed")
+    local expected = {}
+    for i, id, rec in set:iter() do expected[i] = { id, rec } end
+    set = nil
+    collectgarbage()
+    collectgarbage()
+
+    -- Reopen in place: same order, records and index
+    local reopened = sparse_set.new_set(8, { file = path })
+    assert_eq(reopened:size(), #expected, "Reopened size mismatch")
+    for i, pair in ipairs(expected) do
+        local id, rec = reopened:at(i)
+        assert_eq(id, pair[1], "Reopened id mismatch")
+        assert_eq(rec, pair[2], "Reopened record mismatch")
+        assert_eq(reopened:index_of(pair[1]), i, "Reopened index mismatch")
+    end
+    assert_eq(reopened:get_field(6, 4, TYPE_INT), 77, "Reopened field mismatch")
+
+    -- Shrinking keeps the data
+    reopened:auto_shrink(true)
+    for i = 2, 2900, 2 do reopened:remove(i * 3) end
+    assert_true(reopened:capacity() < 3000, "Mapped set should shrink")
+    assert_eq(reopened:get(6000), nil, "Removed id still present")
+    assert_eq(reopened:get(2902 * 3), string.pack("ii", 2902, -2902), "Record lost after shrink")
+    reopened = nil
+    collectgarbage()
+    collectgarbage()
+
+    assert_error(function() sparse_set.new_set(4, { file = path }) end, "Stride mismatch should fail")
+    assert_error(function() sparse_set.new_set(0, { file = path }) end, "File-backed set needs stride")
+    os.remove(path)
+
+    print("File-backed set tests passed.")
+end
+
+local function test_changes()
+    print("Testing Change Tracking...")
+    local TYPE_INT = sparse_set.TYPE_INT
+    local TYPE_FLOAT = sparse_set.TYPE_FLOAT
+    local reg = sparse_set.new_registry()
+    local set = sparse_set.new_set(8)
+    local row = string.pack("if", 0, 0)
+
+    local ids = {}
+    for i = 1, 6 do ids[i] = reg:create() end
+    for i = 1, 4 do set:insert(ids[i], row) end
+    assert_eq(set:change_count(), 0, "Untracked set should record nothing")
+
+    set:track_changes(true)
+    set:insert(ids[5], row)
+    set:set_field(ids[5], 0, TYPE_INT, 9)
+    set:set_field(ids[1], 4, TYPE_FLOAT, 1.5)
+    set:set_field(ids[1], 0, TYPE_INT, 3)
+    set:remove(ids[2])
+    set:insert(ids[6], row)
+    set:remove(ids[6])
+    assert_eq(set:change_count(), 3, "Folded change count")
+
+    local added, modified, removed, ranges = set:drain_changes()
+    assert_eq(#added, 1, "One added")
+    assert_eq(added[1], ids[5], "Added id")
+    assert_eq(#modified, 1, "One modified")
+    assert_eq(modified[1], ids[1], "Modified id")
+    assert_eq(ranges[1], 0, "Modified range start")
+    assert_eq(ranges[2], 8, "Modified range end")
+    assert_eq(#removed, 1, "One removed")
+    assert_eq(removed[1], ids[2], "Removed id")
+    assert_eq(set:change_count(), 0, "Drain empties the tracker")
+
+    -- Remove then re-add the same id is a whole-row modification
+    set:remove(ids[3])
+    set:insert(ids[3], row)
+    set:field_add(0, TYPE_INT, 1)
+    added, modified, removed, ranges = set:drain_changes()
+    assert_eq(#added, 0, "Nothing added")
+    assert_eq(#removed, 0, "Nothing removed")
+    assert_eq(#modified, set:size(), "Kernel marks every row")
+
+    -- A recycled index reports the new id added and the old id removed
+    reg:destroy(ids[4])
+    local reused = reg:create()
+    set:insert(reused, row)
+    added, modified, removed = set:drain_changes(true)
+    assert_eq(string.unpack("j", added), reused, "Recycled id added")
+    assert_eq(string.unpack("j", removed), ids[4], "Old version removed")
+    assert_eq(#modified, 0, "Packed modified is empty")
+
+    set:remove_many({ ids[1], ids[3] })
+    assert_eq(#select(3, set:drain_changes()), 2, "Bulk removal tracked")
+
+    set:track_changes(false)
+    set:remove(ids[5])
+    assert_eq(set:change_count(), 0, "Disabled tracking records nothing")
+
+    print("Change tracking tests passed.")
+end
+
+local function test_commands()
+    print("Testing Command Buffer...")
+    local TYPE_INT = sparse_set.TYPE_INT
+    local reg = sparse_set.new_registry()
+    local hp = sparse_set.new_set(4)
+    local pos = sparse_set.new_set(8)
+    local cmds = sparse_set.new_commands()
+
+    local ids = {}
+    for i = 1, 10 do
+        ids[i] = reg:create()
+        hp:insert(ids[i], string.pack("i", i))
+        pos:insert(ids[i], string.pack("ii", i, i))
+    end
+
+    -- Remove every even-hp entity while iterating; nothing is skipped
+    local seen = 0
+    for _, id in hp:iter() do
+        seen = seen + 1
+        if hp:get_field(id, 0, TYPE_INT) % 2 == 0 then
+            cmds:remove(hp, id)
+            cmds:remove(pos, id)
+            cmds:destroy(reg, id)
+        else
+            cmds:set_field(hp, id, 0, TYPE_INT, 100)
+        end
+    end
+    assert_eq(seen, 10, "Iteration visits every entity")
+    assert_eq(hp:size(), 10, "Nothing applied before flush")
+    assert_eq(cmds:size(), 20, "Recorded commands")
+
+    assert_eq(cmds:flush(), 20, "All commands applied")
+    assert_eq(cmds:size(), 0, "Flush empties the buffer")
+    assert_eq(hp:size(), 5, "Half removed from hp")
+    assert_eq(pos:size(), 5, "Half removed from pos")
+    for i = 1, 10 do
+        assert_eq(reg:valid(ids[i]), i % 2 == 1, "Destroy applied")
+        if i % 2 == 1 then
+            assert_eq(hp:get_field(ids[i], 0, TYPE_INT), 100, "Deferred field write")
+        end
+    end
+
+    -- Commands on one id keep their order
+    local e = reg:create()
+    cmds:insert(hp, e, string.pack("i", 5))
+    cmds:set_field(hp, e, 0, TYPE_INT, 6)
+    cmds:remove(hp, e)
+    cmds:insert(hp, e)
+    cmds:flush()
+    assert_true(hp:contains(e), "Re-inserted after remove")
+    assert_eq(hp:get_field(e, 0, TYPE_INT), 0, "Re-insert without data zeroes the row")
+
+    cmds:remove(hp, e)
+    cmds:clear()
+    assert_eq(cmds:flush(), 0, "Cleared commands are dropped")
+    assert_true(hp:contains(e), "Cleared remove not applied")
+
+    assert_error(function() cmds:remove(sparse_set.new_set(), e) end, "Lua value sets are rejected")
+    assert_error(function() cmds:insert(hp, e, "xx") end, "Row size is checked")
+
+    print("Command buffer tests passed.")
+end
+
+local function test_parallel()
+    print("Testing Parallel Kernels...")
+    local TYPE_FLOAT = sparse_set.TYPE_FLOAT
+    local TYPE_INT = sparse_set.TYPE_INT
+    assert_eq(sparse_set.threads(), 1, "Pool starts serial")
+    assert_error(function() sparse_set.set_threads(0) end, "Zero threads rejected")
+
+    local n = 100000
+    local pos = sparse_set.new_set(8)
+    local vel = sparse_set.new_set(4)
+    local ids = {}
+    for i = 1, n do ids[i] = i end
+    pos:insert_many(ids, string.rep(string.pack("fi", 1, 0), n))
+    local half = {}
+    for i = 1, n, 2 do half[#half + 1] = i end
+    vel:insert_many(half, string.rep(string.pack("f", 2), #half))
+
+    assert_true(sparse_set.set_threads(4), "Start workers")
+    assert_eq(sparse_set.threads(), 4, "Thread count")
+
+    assert_eq(pos:field_mul(0, TYPE_FLOAT, 3), n, "Parallel apply count")
+    assert_eq(pos:field_axpy(0, TYPE_FLOAT, vel, 0, TYPE_FLOAT, 0.5), #half, "Parallel join count")
+    pos:field_add(4, TYPE_INT, 7)
+    for _, i in ipairs({ 1, 2, 4999, 50001, n }) do
+        local expect = i % 2 == 1 and 4 or 3
+        assert_eq(pos:get_field(i, 0, TYPE_FLOAT), expect, "Parallel result " .. i)
+        assert_eq(pos:get_field(i, 4, TYPE_INT), 7, "Parallel int result " .. i)
+    end
+
+    local q = sparse_set.new_query({ pos, vel })
+    assert_eq(q:count(), #half, "Parallel query count")
+
+    -- Tracked sets still see every modification
+    vel:track_changes(true)
+    vel:field_copy(0, TYPE_FLOAT, pos, 0, TYPE_FLOAT)
+    assert_eq(vel:change_count(), #half, "Changes recorded under parallel kernels")
+    assert_eq(vel:get_field(1, 0, TYPE_FLOAT), 4, "Copied value")
+
+    assert_true(sparse_set.set_threads(1), "Stop workers")
+    assert_eq(sparse_set.threads(), 1, "Back to serial")
+    assert_eq(q:count(), #half, "Serial query count")
+
+    -- A closing state drops its hold on the process-wide pool; the last
+    -- hold stops the workers before the module can be unloaded.
+    local native = require("capi_test")
+    local start_workers = "local s = require('sparseset') s.set_threads(...) return s.threads()"
+    assert_eq(native.closed_state(package.cpath, start_workers, 3), 3, "Workers started in another state")
+    assert_eq(sparse_set.threads(), 1, "Closing the only holder stops the workers")
+    assert_true(sparse_set.set_threads(2), "Hold the pool here")
+    assert_eq(native.closed_state(package.cpath, start_workers, 4), 4, "Other state resizes the pool")
+    assert_eq(sparse_set.threads(), 4, "Workers held here survive another state closing")
+    assert_true(sparse_set.set_threads(1), "Release the pool")
+
+    print("Parallel kernel tests passed.")
+end
+
+local function test_attach()
+    print("Testing Attached Sets...")
+    local reg = sparse_set.new_registry()
+    local hp = sparse_set.new_set(4)
+    local tags = sparse_set.new_set()
+    local unattached = sparse_set.new_set(4)
+    reg:attach(hp, tags)
+
+    local block = reg:create_many(1000)
+    assert_eq(#block, 8000, "Packed ids")
+    local ids = {}
+    for i = 1, 1000 do ids[i] = string.unpack("j", block, (i - 1) * 8 + 1) end
+    assert_eq(ids[1], 0, "First fresh id")
+    assert_eq(ids[1000], 999, "Last fresh id")
+    assert_eq(hp:insert_many(block, string.rep(string.pack("i", 1), 1000)), 1000, "Bulk insert from create_many")
+    tags:insert_many(block)
+    unattached:insert_many(block, string.rep(string.pack("i", 1), 1000))
+
+    reg:destroy(ids[1])
+    assert_false(reg:valid(ids[1]), "Destroyed id invalid")
+    assert_false(hp:contains(ids[1]), "Cascade to stride set")
+    assert_false(tags:contains(ids[1]), "Cascade to Lua value set")
+    assert_true(unattached:contains(ids[1]), "Unattached set untouched")
+
+    local batch = {}
+    for i = 2, 500 do batch[#batch + 1] = ids[i] end
+    batch[#batch + 1] = ids[1]  -- already destroyed
+    assert_eq(reg:destroy_many(batch), 499, "destroy_many count")
+    assert_eq(hp:size(), 500, "destroy_many cascades")
+    assert_eq(tags:size(), 500, "destroy_many cascades to Lua set")
+    for _, id in tags:iter() do
+        assert_true(hp:contains(id), "Lua set values stay aligned")
+    end
+
+    -- Recycled indices come back first, with bumped versions
+    local again = reg:create_many(3)
+    local r1 = string.unpack("j", again)
+    assert_true(reg:valid(r1), "Recycled id valid")
+    assert_true(r1 >> 32 == 1, "Recycled id has new version")
+
+    reg:detach(tags)
+    reg:destroy(ids[600])
+    assert_false(hp:contains(ids[600]), "Still attached")
+    assert_true(tags:contains(ids[600]), "Detached set untouched")
+
+    -- Deferred destroys cascade on flush
+    local cmds = sparse_set.new_commands()
+    cmds:destroy(reg, ids[700])
+    assert_true(hp:contains(ids[700]), "Not before flush")
+    cmds:flush()
+    assert_false(hp:contains(ids[700]), "Cascade on flush")
+
+    assert_eq(reg:create_many(0), "", "Empty block")
+    print("Attached set tests passed.")
+end
+
+local function test_allocator()
+    print("Testing Allocator Accounting...")
+    collectgarbage()
+    collectgarbage()
+    local base = sparse_set.memory()
+
+    local set = sparse_set.new_set(16)
+    local ids = {}
+    for i = 1, 20000 do ids[i] = i * 7 end
+    set:insert_many(ids, string.rep(string.rep("x", 16), #ids))
+    local used, pooled = sparse_set.memory()
+    assert_true(used - base >= 20000 * (16 + 8), "Dense and data are accounted")
+
+    set = nil
+    collectgarbage()
+    collectgarbage()
+    local after, pooled_after = sparse_set.memory()
+    assert_true(pooled_after > pooled, "Released pages go to the pool")
+    assert_true(after - base <= pooled_after * 16388, "Everything else is returned")
+
+    -- New pages come from the pool first
+    local reg = sparse_set.new_registry()
+    reg:create_many(5000)
+    local _, pooled_reuse = sparse_set.memory()
+    assert_eq(pooled_reuse, pooled_after - 2, "Generation pages reuse pooled blocks")
+    for i = 1, 5000 do assert_true(reg:valid(i - 1), "Fresh ids valid after pooled page") end
+
+    -- A dense grow that fails part way must not leave the arrays at mixed
+    -- sizes: the allocator would be told wrong sizes from then on.
+    local failed_grow = [[
+        local s = require('sparseset')
+        local set = s.new_schema_set({ { "a", s.TYPE_DOUBLE }, { "b", s.TYPE_DOUBLE } })
+        local n = ...
+        limit(n * 8 * 2 + 1024)
+        local ok, grown = pcall(set.reserve, set, n)
+        limit()
+        if ok and grown then error("reserve should have failed") end
+        set:reserve(n)
+        set = nil
+        collectgarbage()
+        collectgarbage()
+        return (s.memory())
+    ]]
+    assert_eq(require("capi_test").closed_state(package.cpath, failed_grow, 40000), 0, "Failed grow keeps allocator sizes exact")
+
+    print("Allocator tests passed.")
+end
+
+local function test_shared_index()
+    print("Testing Shared Index...")
+    local reg = sparse_set.new_registry()
+    local index = sparse_set.new_index()
+    local pos = sparse_set.new_set(8)
+    local vel = sparse_set.new_set(8)
+    local tag = sparse_set.new_set()
+
+    -- Existing contents move onto the index
+    local e = {}
+    for i = 1, 100 do e[i] = reg:create() end
+    for i = 1, 100 do pos:insert(e[i], string.pack("d", i)) end
+    index:attach(pos, vel, tag)
+    assert_eq(index:count(), 3, "Three sets attached")
+    assert_eq(pos:size(), 100, "Contents kept")
+    local _, pages = pos:capacity()
+    assert_eq(pages, 0, "Private pages released")
+    assert_eq(string.unpack("d", pos:get(e[50])), 50, "Lookups go through the index")
+
+    for i = 1, 100, 2 do vel:insert(e[i], string.pack("d", -i)) end
+    for i = 1, 100, 3 do tag:insert(e[i], "t" .. i) end
+    assert_true(index:contains(e[1], pos, vel, tag), "Member of all three")
+    assert_false(index:contains(e[2], pos, vel), "Not in vel")
+    assert_true(index:contains(e[3], pos, vel), "In pos and vel")
+    assert_eq(tag:get(e[4]), "t4", "Lua value set on the index")
+
+    -- Slots spill past two members and shrink back
+    vel:remove(e[1])
+    assert_false(vel:contains(e[1]), "Removed from vel")
+    assert_true(pos:contains(e[1]) and tag:contains(e[1]), "Other members unaffected")
+    assert_eq(string.unpack("d", pos:get(e[1])), 1, "pos value intact")
+    assert_eq(string.unpack("d", vel:get(e[99])), -99, "Moved last element found")
+
+    -- Stale versions are not members
+    local old = e[7]
+    reg:destroy(old)
+    local fresh = reg:create()
+    assert_false(pos:contains(fresh), "New version not in pos")
+    assert_false(index:contains(fresh, pos), "Index checks versions")
+
+    -- Queries over shared sets match the slow path
+    local q = sparse_set.new_query({pos, vel}, {tag})
+    local expected = 0
+    for i = 1, 100, 2 do
+        if i ~= 1 and (i - 1) % 3 ~= 0 then expected = expected + 1 end
+    end
+    assert_eq(q:count(), expected, "Shared query count")
+    local seen = 0
+    for id, p, v in q:iter() do
+        assert_eq(string.unpack("d", v), -string.unpack("d", p), "Positions from the shared slot")
+        seen = seen + 1
+    end
+    assert_eq(seen, expected, "Shared query iteration")
+
+    -- Detach rebuilds a private index
+    index:detach(vel)
+    assert_eq(index:count(), 2, "Two left")
+    assert_eq(vel:size(), 49, "vel keeps its contents")
+    assert_true(vel:contains(e[3]), "Private lookup after detach")
+    assert_eq(q:count(), expected, "Query falls back after layout change")
+    assert_error(function() index:contains(e[3], vel) end, "Detached set rejected")
+    local other = sparse_set.new_index()
+    assert_error(function() other:attach(pos) end, "One index per set")
+
+    -- Sparse ids over many sets cost less than private pages
+    local function build(shared)
+        local sets = {}
+        local ids = {}
+        for i = 1, 2000 do ids[i] = i * 509 end
+        for s = 1, 8 do
+            sets[s] = sparse_set.new_set(4)
+            if shared then shared:attach(sets[s]) end
+            sets[s]:insert_many(ids, string.rep("\0\0\0\0", #ids))
+        end
+        return sets
+    end
+    collectgarbage()
+    local before = sparse_set.memory()
+    local private = build(nil)
+    local private_bytes = sparse_set.memory() - before
+    private = nil
+    collectgarbage()
+    before = sparse_set.memory()
+    local shared_index = sparse_set.new_index()
+    local shared = build(shared_index)
+    local shared_bytes = sparse_set.memory() - before
+    assert_true(shared_bytes < private_bytes, "Shared index uses less memory")
+    local ids = {}
+    for i = 1, 2000 do ids[i] = i * 509 end
+    for s = 1, 8 do assert_eq(shared[s]:remove_many(ids), 2000, "All removed") end
+    shared_index:shrink_to_fit()
+    assert_eq(shared_index:pages(), 0, "Empty pages released")
+
+    -- An index freed while short of memory keeps its sets' members: the
+    -- private index is built again once the shared pages are gone.
+    local close_index = [[
+        local s = require('sparseset')
+        local index = s.new_index()
+        local set = s.new_set()
+        local n = ...
+        index:attach(set)
+        for i = 1, n do set:insert(i * 4096, i) end
+        limit(0)
+        getmetatable(index).__gc(index)
+        limit()
+        local kept = 0
+        for i = 1, n do
+            if set:contains(i * 4096) and set:get(i * 4096) == i then kept = kept + 1 end
+        end
+        return kept
+    ]]
+    assert_eq(require("capi_test").closed_state(package.cpath, close_index, 8), 8, "Members kept when the index is freed")
+
+    print("Shared index tests passed.")
+end
+
+local function test_adaptive()
+    print("Testing Adaptive Index...")
+    local small = sparse_set.new_set(4, { adaptive = true })
+    local ids = {}
+    for i = 1, 50 do ids[i] = i * 100003 end
+    for i = 1, 50 do small:insert(ids[i], string.pack("i4", i)) end
+    local _, pages, slots = small:capacity()
+    assert_eq(pages, 0, "Spread ids stay off pages")
+    assert_eq(slots, 128, "Hash sized to twice the ids")
+    for i = 1, 50 do
+        assert_true(small:contains(ids[i]), "Hash lookup")
+        assert_eq(small:index_of(ids[i]), i, "Positions unchanged")
+    end
+    assert_false(small:contains(ids[1] + 1), "Neighbour not present")
+    assert_false(small:contains(ids[1] | (1 << 32)), "Other version not present")
+
+    -- Removal keeps probe chains intact
+    for i = 1, 50, 2 do assert_true(small:remove(ids[i]), "Remove from hash") end
+    for i = 2, 50, 2 do
+        assert_eq(string.unpack("i4", small:get(ids[i])), i, "Survivors found after removals")
+    end
+    assert_eq(small:size(), 25, "Size after removals")
+
+    -- Dense ids move to pages once pages are cheaper
+    local dense = sparse_set.new_set(0, { adaptive = true })
+    for i = 1, 3000 do dense:insert(i, i) end
+    _, pages, slots = dense:capacity()
+    assert_eq(slots, 0, "Left the hash")
+    assert_eq(pages, 1, "One page for contiguous ids")
+    assert_eq(dense:get(1234), 1234, "Lookups after switching")
+
+    -- And back after shrinking
+    local batch = {}
+    for i = 1, 2990 do batch[i] = i end
+    dense:remove_many(batch)
+    dense:shrink_to_fit()
+    _, pages, slots = dense:capacity()
+    assert_eq(pages, 0, "Pages released")
+    assert_eq(slots, 32, "Back on a small hash")
+    assert_eq(dense:get(3000), 3000, "Values kept")
+
+    -- Switching off moves to pages
+    small:adaptive(false)
+    _, pages, slots = small:capacity()
+    assert_eq(slots, 0, "Hash gone")
+    assert_true(pages > 0, "Paged again")
+    assert_true(small:contains(ids[2]), "Lookup after disabling")
+
+    print("Adaptive index tests passed.")
+end
+
+local function test_accessor()
+    print("Testing Field Accessors...")
+    local set = sparse_set.new_set(17)
+    set:insert(1, string.pack("i4fdB", 10, 1.5, 2.25, 7))
+    set:insert(2, string.pack("i4fdB", 20, 3.5, 4.25, 0))
+
+    local get_hp, set_hp = set:accessor(0, sparse_set.TYPE_INT)
+    local get_speed = set:accessor(4, sparse_set.TYPE_FLOAT)
+    local get_mass, set_mass = set:accessor(8, sparse_set.TYPE_DOUBLE)
+    local get_flag, set_flag = set:accessor(16, sparse_set.TYPE_BOOL)
+
+    assert_eq(get_hp(1), 10, "int read")
+    assert_eq(get_speed(2), 3.5, "float read")
+    assert_eq(get_mass(1), 2.25, "double read")
+    assert_eq(get_flag(1), true, "bool read")
+    assert_eq(get_hp(3), nil, "missing id reads nil")
+
+    assert_true(set_hp(1, 42), "int write")
+    assert_eq(set:get_field(1, 0, sparse_set.TYPE_INT), 42, "Visible through get_field")
+    assert_true(set_mass(2, -1.5), "double write")
+    assert_eq(get_mass(2), -1.5, "double round trip")
+    assert_true(set_flag(2, true), "bool write")
+    assert_eq(get_flag(2), true, "bool round trip")
+    assert_false(set_hp(3, 1), "missing id write")
+
+    -- Accessors follow the set through swaps and removals
+    set:remove(1)
+    assert_eq(get_hp(2), 20, "After swap-remove")
+
+    assert_error(function() set:accessor(10, sparse_set.TYPE_DOUBLE) end, "Bounds checked once")
+    assert_error(function() sparse_set.new_set():accessor(0, sparse_set.TYPE_INT) end, "Needs stride")
+    assert_error(function() set_hp(2, "x") end, "Value type checked")
+
+    -- Schema sets, with change tracking
+    local schema = sparse_set.new_schema_set({ { "x", sparse_set.TYPE_FLOAT }, { "hp", sparse_set.TYPE_INT } })
+    schema:insert(5, string.pack("fi", 1, 100))
+    schema:track_changes(true)
+    schema:drain_changes()
+    local get_x, set_x = schema:accessor("x")
+    local get_h = schema:accessor(schema:field("hp"))
+    assert_true(set_x(5, get_x(5) + 1), "schema write")
+    assert_eq(schema:get_field(5, "x"), 2, "schema round trip")
+    assert_eq(get_h(5), 100, "accessor by handle")
+    local _, modified = schema:drain_changes()
+    assert_eq(#modified, 1, "Accessor writes are tracked")
+
+    print("Field accessor tests passed.")
+end
+
+local function test_stats()
+    print("Testing Stats...")
+    local set = sparse_set.new_set()
+    local s = set:stats()
+    assert_eq(s.size, 0, "Empty size")
+    assert_eq(s.capacity, 64, "Default capacity")
+    assert_eq(s.pages, 0, "No pages yet")
+    assert_eq(s.value_bytes, 0, "No values yet")
+
+    for i = 0, 4999 do set:insert(i, i) end
+    s = set:stats()
+    assert_eq(s.size, 5000, "Size")
+    assert_eq(s.pages, 2, "Two pages")
+    assert_eq(s.live_pages, 2, "Both live")
+    assert_eq(s.page_allocs, 2, "Two page allocations")
+    assert_eq(s.grows, 7, "64 -> 8192 takes seven growths")
+    assert_eq(s.dense_bytes, s.capacity * 8, "Dense bytes")
+    assert_eq(s.data_bytes, 0, "No data for value sets")
+    assert_true(s.index_bytes >= 2 * 4096 * 4, "Index bytes cover the pages")
+    assert_true(s.value_bytes >= 5000 * 16, "Value table estimate")
+
+    for i = 4096, 4999 do set:remove(i) end
+    s = set:stats()
+    assert_eq(s.pages, 2, "Empty page kept without auto shrink")
+    assert_eq(s.live_pages, 1, "Only one page live")
+    set:shrink_to_fit()
+    s = set:stats()
+    assert_eq(s.pages, 1, "Empty page released")
+    assert_eq(s.shrinks, 1, "Dense shrunk once")
+
+    local data = sparse_set.new_set(12)
+    data:insert(1, string.rep("\0", 12))
+    s = data:stats()
+    assert_eq(s.data_bytes, s.capacity * 12, "Data bytes")
+    assert_eq(s.value_bytes, 0, "Stride sets have no value table")
+
+    local small = sparse_set.new_set(0, { adaptive = true })
+    for i = 1, 40 do small:insert(i * 100000, true) end
+    s = small:stats()
+    assert_eq(s.pages, 0, "Hash set has no pages")
+    assert_true(s.hash_capacity >= 80, "Hash slots")
+    assert_true(s.rehashes >= 2, "Hash rebuilt while growing")
+
+    local reg = sparse_set.new_registry()
+    local ids = {}
+    for i = 1, 10 do ids[i] = reg:create() end
+    for i = 1, 3 do reg:destroy(ids[i]) end
+    local r = reg:stats()
+    assert_eq(r.live, 7, "Live ids")
+    assert_eq(r.next_index, 10, "Indices handed out")
+    assert_eq(r.recycled, 3, "Recycle depth")
+    assert_eq(r.pages, 1, "One generation page")
+    assert_eq(r.page_allocs, 1, "One generation page allocated")
+    assert_true(r.bytes > 4096 * 4, "Registry bytes")
+
+    if sparse_set.STATS then
+        local counted = sparse_set.new_set()
+        counted:insert(1, true)
+        counted:insert(2, true)
+        counted:contains(1)
+        counted:contains(3)
+        counted:remove(2)
+        s = counted:stats()
+        assert_eq(s.inserts, 2, "Insert count")
+        assert_eq(s.removes, 1, "Remove count")
+        assert_true(s.lookups >= 2 and s.misses >= 1, "Lookup counts")
+        reg:valid(ids[1])
+        r = reg:stats()
+        assert_eq(r.inserts, 10, "Created ids")
+        assert_eq(r.removes, 3, "Destroyed ids")
+        assert_true(r.misses >= 1, "Invalid lookups")
+    else
+        assert_eq(set:stats().inserts, nil, "Call counters need SPARSE_SET_STATS")
+    end
+
+    print("Stats tests passed.")
+end
+
+local function test_reserve()
+    print("Testing Capacity Reservation...")
+    local set = sparse_set.new_set(16, 1000)
+    assert_eq(set:capacity(), 1000, "Preallocated capacity")
+    assert_eq(set:stats().grows, 1, "One growth to the requested capacity")
+    for i = 1, 1000 do set:insert(i, string.rep("x", 16)) end
+    assert_eq(set:stats().grows, 1, "No growth within capacity")
+    set:insert(1001, string.rep("y", 16))
+    assert_eq(set:stats().grows, 2, "Grows past it")
+
+    assert_true(set:reserve(5000), "reserve")
+    assert_eq(set:capacity(), 5000, "Reserved in one step")
+    assert_true(set:reserve(10), "Smaller reserve is a no-op")
+    assert_eq(set:capacity(), 5000, "Never shrinks")
+    assert_eq(set:get(1001), string.rep("y", 16), "Data kept")
+    assert_error(function() set:reserve(-1) end, "Negative capacity")
+
+    local values = sparse_set.new_set(0, 100)
+    for i = 1, 100 do values:insert(i, i * 2) end
+    assert_eq(values:get(50), 100, "Value set with capacity")
+    assert_eq(values:stats().grows, 1, "Value set grew once, up front")
+
+    -- Reserved address space: growth commits pages in place
+    local big = sparse_set.new_set(8, { reserve = 100000 })
+    assert_eq(big:stats().reserved, 100000, "Reservation recorded")
+    for i = 1, 70000 do big:insert(i, string.pack("ii", i, -i)) end
+    assert_eq(big:size(), 70000, "Filled")
+    assert_eq(big:get_field(1, 4, sparse_set.TYPE_INT), -1, "First record intact")
+    assert_eq(big:get_field(70000, 0, sparse_set.TYPE_INT), 70000, "Last record intact")
+    assert_true(big:stats().grows > 0, "Grew by committing")
+    assert_eq(select(2, big:reserve(200000)), "oom", "Cannot reserve past the reservation")
+
+    local ids = {}
+    for i = 1, 70000 do ids[i] = i end
+    big:remove_many(ids)
+    big:shrink_to_fit()
+    assert_eq(big:capacity(), 64, "Shrinks back")
+    big:insert(5, nil)
+    assert_eq(big:get(5), string.rep("\0", 8), "Recommitted rows read as zero")
+
+    local small = sparse_set.new_set(4, { reserve = 100 })
+    for i = 1, 100 do assert_true(small:insert(i, string.pack("i", i)), "Insert within reservation") end
+    local ok, err = small:insert(101, string.pack("i", 0))
+    assert_eq(ok, nil, "Insert past the reservation fails")
+    assert_eq(err, "oom", "Reported as oom")
+    assert_eq(small:size(), 100, "Set unchanged")
+
+    local schema = sparse_set.new_schema_set({ { "x", sparse_set.TYPE_FLOAT }, { "hp", sparse_set.TYPE_INT } },
+        { capacity = 1000, reserve = 10000 })
+    assert_eq(schema:capacity(), 1000, "Schema capacity")
+    for i = 1, 5000 do schema:insert(i, string.pack("fi", i, i)) end
+    assert_eq(schema:get_field(4321, "hp"), 4321, "Schema column grown in place")
+    assert_eq(sparse_set.new_schema_set({ { "x", sparse_set.TYPE_FLOAT } }, 300):capacity(), 300, "Schema capacity number")
+
+    assert_error(function() sparse_set.new_set(8, { reserve = 10, capacity = 20 }) end, "Capacity above reserve")
+    assert_error(function() sparse_set.new_set(0, -1) end, "Negative capacity")
+    assert_error(function() sparse_set.new_set(8, "x") end, "Bad option type")
+    assert_error(function() sparse_set.new_set(8, { file = "/tmp/x", reserve = 100 }) end, "File and reserve")
+
+    print("Capacity reservation tests passed.")
+end
+
+local function test_iteration()
+    print("Testing Allocation-Free Iteration...")
+    local INT, FLOAT = sparse_set.TYPE_INT, sparse_set.TYPE_FLOAT
+    local set = sparse_set.new_set(8)
+    for i = 1, 1000 do set:insert(i * 3, string.pack("if", i, i * 0.5)) end
+
+    local count, sum = 0, 0
+    for pos, id in set:iter_pos() do
+        assert_eq(set:at(pos), id, "Position matches at()")
+        sum = sum + set:get_field_at(pos, 0, INT)
+        count = count + 1
+    end
+    assert_eq(count, 1000, "iter_pos visits every element")
+    assert_eq(sum, 500500, "Fields read by position")
+    assert_eq(set:get_field_at(1001, 0, INT), nil, "Out of range reads nil")
+    assert_true(set:set_field_at(2, 4, FLOAT, 9), "Write by position")
+    assert_eq(set:get_field(6, 4, FLOAT), 9, "Visible by id")
+    assert_false(set:set_field_at(0, 4, FLOAT, 9), "Out of range write")
+
+    -- Iterating and reading fields allocates nothing per element
+    collectgarbage()
+    collectgarbage("stop")
+    local before = collectgarbage("count")
+    for _ = 1, 10 do
+        for pos in set:iter_pos() do sum = sum + set:get_field_at(pos, 4, FLOAT) end
+        set:each(function(_, hp, speed) sum = sum + hp + speed end, 0, INT, 4, FLOAT)
+    end
+    local grown = collectgarbage("count") - before
+    collectgarbage("restart")
+    assert_true(grown < 4, "GC-neutral loops allocated " .. grown .. " KB")
+
+    local seen = {}
+    set:each(function(id, hp, speed)
+        seen[id] = true
+        assert_eq(hp * 3, id, "each passes the int field")
+        if id ~= 6 then assert_eq(speed, hp * 0.5, "each passes the float field") end
+    end, 0, INT, 4, FLOAT)
+    local n = 0
+    for _ in pairs(seen) do n = n + 1 end
+    assert_eq(n, 1000, "each visits every element")
+
+    -- Removing the current element while walking is safe
+    set:each(function(id, hp)
+        if hp % 2 == 0 then set:remove(id) end
+    end, 0, INT)
+    assert_eq(set:size(), 500, "Even rows removed")
+    set:each(function(_, hp) assert_eq(hp % 2, 1, "Only odd rows left") end, 0, INT)
+
+    -- Schema sets take field names, value sets pass the stored value
+    local schema = sparse_set.new_schema_set({ { "x", FLOAT }, { "hp", INT } })
+    for i = 1, 10 do schema:insert(i, string.pack("fi", i, i * 10)) end
+    schema:track_changes(true)
+    schema:drain_changes()
+    local total = 0
+    schema:each(function(id, hp, x) total = total + hp + x end, "hp", "x")
+    assert_eq(total, 605, "Schema fields by name")
+    assert_true(schema:set_field_at(1, "hp", 7), "Schema write by position")
+    local _, modified = schema:drain_changes()
+    assert_eq(#modified, 1, "Position writes are tracked")
+
+    local values = sparse_set.new_set()
+    values:insert(1, "a")
+    values:insert(2, "b")
+    local joined = {}
+    values:each(function(id, v) joined[#joined + 1] = id .. v end)
+    assert_eq(table.concat(joined, ","), "2b,1a", "Value sets, last to first")
+    assert_error(function() values:each(function() end, 0, INT) end, "Fields need stride")
+    assert_error(function() set:each(nil) end, "Callback required")
+
+    print("Allocation-free iteration tests passed.")
+end
+
+local function test_layout()
+    print("Testing Layouts...")
+    local INT, FLOAT, DOUBLE, BOOL = sparse_set.TYPE_INT, sparse_set.TYPE_FLOAT, sparse_set.TYPE_DOUBLE, sparse_set.TYPE_BOOL
+    local set = sparse_set.new_set(24)
+    set:insert(1, string.pack("i4fdBxxxxxxx", 10, 1.5, 2.25, 7))
+    set:insert(2, string.pack("i4fdBxxxxxxx", 20, 3.5, 4.25, 0))
+
+    local all = set:layout("i4fdB")
+    assert_eq(all:size(), 4, "Four fields from the format")
+    local hp, speed, mass, flag = set:get_fields(1, all)
+    assert_eq(hp, 10, "int")
+    assert_eq(speed, 1.5, "float")
+    assert_eq(mass, 2.25, "double")
+    assert_eq(flag, 7, "byte")
+    assert_eq(select("#", set:get_fields(3, all)), 1, "Missing id returns a single nil")
+
+    assert_true(set:set_fields(2, all, 21, 3.25, -1, 9), "Write all fields")
+    assert_eq(set:get(2), string.pack("i4fdBxxxxxxx", 21, 3.25, -1, 9), "Record written in place")
+    assert_false(set:set_fields(3, all, 1, 1, 1, 1), "Missing id write")
+
+    local pairs_layout = set:layout(16, BOOL, 0, INT, 8, DOUBLE)
+    local f, h, m = set:get_fields(2, pairs_layout)
+    assert_eq(f, true, "bool from offset/type pairs")
+    assert_eq(h, 21, "Fields come back in layout order")
+    assert_eq(m, -1, "double from offset/type pairs")
+    local skipped = set:layout("x x x x f")
+    assert_eq(set:get_fields(1, skipped), 1.5, "Padding skips bytes")
+
+    assert_eq(select(2, set:get_fields_at(1, all)), 1.5, "Read by position")
+    assert_true(set:set_fields_at(1, set:layout(0, INT), 11), "Write by position")
+    assert_eq(set:get_field(1, 0, INT), 11, "Position write visible")
+    assert_eq(set:get_fields_at(9, all), nil, "Out of range position")
+
+    assert_error(function() set:layout("i4fdBd") end, "Format longer than stride")
+    assert_error(function() set:layout("j") end, "Unsupported format option")
+    assert_error(function() set:layout() end, "Empty layout")
+    local before = set:get(1)
+    assert_error(function() set:set_fields(1, all, 1, 2) end, "Missing values")
+    assert_error(function() set:set_fields(1, all, 1, 2, "x", 3) end, "Bad value type")
+    assert_eq(set:get(1), before, "Failed write leaves the row untouched")
+    assert_error(function() sparse_set.new_set(16):get_fields(1, all) end, "Layout of another stride")
+    assert_error(function() set:get_fields(1, "i4") end, "Needs a layout")
+
+    -- Schema sets name their fields; writes are change-tracked
+    local schema = sparse_set.new_schema_set({ { "x", FLOAT }, { "y", FLOAT }, { "hp", INT } })
+    schema:insert(5, string.pack("ffi", 1, 2, 3))
+    local xy = schema:layout("x", "y")
+    schema:track_changes(true)
+    schema:drain_changes()
+    local x, y = schema:get_fields(5, xy)
+    assert_true(schema:set_fields(5, xy, x + 10, y + 20), "Schema write")
+    assert_eq(schema:get(5), string.pack("ffi", 11, 22, 3), "Columns written")
+    local _, modified = schema:drain_changes()
+    assert_eq(#modified, 1, "Layout writes are tracked")
+    local other = sparse_set.new_schema_set({ { "x", INT }, { "y", FLOAT }, { "hp", INT } })
+    other:insert(5, string.pack("ifi", 1, 2, 3))
+    assert_error(function() other:get_fields(5, xy) end, "Column types must match")
+
+    print("Layout tests passed.")
+end
+
 local function run_tests()
     test_registry()
     print("--------------------------------")
     test_lua_set()
     print("--------------------------------")
-    test_c_set()
-    print("--------------------------------")
+    test_c_set()
+    print("--------------------------------")
+    test_query()
+    print("--------------------------------")
+    test_batch()
+    print("--------------------------------")
+    test_schema_set()
+    print("--------------------------------")
+    test_field_kernels()
+    print("--------------------------------")
+    test_capi()
+    print("--------------------------------")
+    test_shrink()
+    print("--------------------------------")
+    test_group()
+    print("--------------------------------")
+    test_sort()
+    print("--------------------------------")
+    test_snapshot()
+    print("--------------------------------")
+    test_mapped()
+    print("--------------------------------")
+    test_changes()
+    print("--------------------------------")
+    test_commands()
+    print("--------------------------------")
+    test_parallel()
+    print("--------------------------------")
+    test_attach()
+    print("--------------------------------")
+    test_allocator()
+    print("--------------------------------")
+    test_shared_index()
+    print("--------------------------------")
+    test_adaptive()
+    print("--------------------------------")
+    test_accessor()
+    print("--------------------------------")
+    test_stats()
+    print("--------------------------------")
+    test_reserve()
+    print("--------------------------------")
+    test_iteration()
+    print("--------------------------------")
+    test_layout()
+    print("--------------------------------")
     print("ALL TESTS PASSED")
 end
 